@@ -20,6 +20,7 @@
 
 #include <nvme/types.h>
 
+#include "ccan/compiler/compiler.h"
 #include "ccan/err/err.h"
 #include "ccan/likely/likely.h"
 #include "ccan/opt/opt.h"
@@ -52,6 +53,8 @@ static struct nvme_ctrl ctrl;
 static struct nvme_sq *sq;
 static struct nvme_cq *cq;
 
+static struct nvme_poll_group pg;
+
 static bool draining;
 static bool random_io;
 static unsigned int queued;
@@ -62,9 +65,11 @@ static struct {
 	uint64_t ttotal, tmin, tmax;
 } stats;
 
+static struct nvme_cmd_tmpl tmpl;
+
 struct iod {
 	uint64_t tsubmit;
-	union nvme_cmd cmd;
+	uint64_t iova;
 };
 
 static void io_issue(struct nvme_rq *rq)
@@ -78,16 +83,15 @@ static void io_issue(struct nvme_rq *rq)
 			slba = 0;
 	}
 
-	iod->cmd.rw.slba = cpu_to_le64(slba);
-
 	iod->tsubmit = get_ticks();
 
-	nvme_sq_post(rq->sq, &iod->cmd);
+	if (nvme_rq_read(rq, &tmpl, slba, 1, iod->iova))
+		err(1, "nvme_rq_read");
 
 	queued++;
 }
 
-static void io_complete(struct nvme_rq *rq)
+static void io_complete(struct nvme_rq *rq, struct nvme_cqe *cqe UNUSED)
 {
 	struct iod *iod = rq->opaque;
 	uint64_t diff;
@@ -130,27 +134,6 @@ out:
 	stats.completed_quantum = 0;
 }
 
-static int reap(void)
-{
-	struct nvme_cqe *cqe;
-	int reaped = 0;
-
-	do {
-		cqe = nvme_cq_get_cqe(cq);
-		if (!cqe)
-			break;
-
-		reaped++;
-
-		io_complete(__nvme_rq_from_cqe(sq, cqe));
-	} while (1);
-
-	if (reaped)
-		nvme_cq_update_head(cq);
-
-	return reaped;
-}
-
 static void run(void)
 {
 	uint64_t deadline, update_stats, now = get_ticks();
@@ -187,15 +170,12 @@ static void run(void)
 
 		iod = calloc(1, sizeof(*iod));
 
-		iod->cmd.rw.opcode = nvme_cmd_read;
-		iod->cmd.rw.nsid = cpu_to_le32(nsid);
-		iod->cmd.rw.dptr.prp1 = cpu_to_le64(iova);
-
-		nvme_rq_prep_cmd(rq, &iod->cmd);
+		iod->iova = iova;
 
 		iova += 0x1000;
 
 		rq->opaque = iod;
+		rq->cb = io_complete;
 
 		io_issue(rq);
 	} while (true && --to_submit > 0);
@@ -204,11 +184,9 @@ static void run(void)
 
 	do {
 
-		while (!reap())
+		while (!nvme_poll_group_poll(&pg))
 			;
 
-		nvme_sq_update_tail(sq);
-
 		now = get_ticks();
 
 		if (now > update_stats) {
@@ -247,16 +225,14 @@ static void run(void)
 	nvme_sq_update_tail(sq);
 
 	do {
-		reap();
+		nvme_poll_group_poll(&pg);
 	} while (queued);
 }
 
 int main(int argc, char **argv)
 {
-	void *vaddr;
-	ssize_t len;
-	struct nvme_id_ns *id_ns;
-	union nvme_cmd cmd;
+	const struct nvme_ns_info *info;
+	unsigned int lbads;
 
 	opt_register_table(opts, NULL);
 	opt_parse(&argc, argv, opt_log_stderr_exit);
@@ -284,22 +260,18 @@ int main(int argc, char **argv)
 	if (nvme_init(&ctrl, bdf, NULL))
 		err(1, "failed to init nvme controller");
 
-	len = pgmap(&vaddr, NVME_IDENTIFY_DATA_SIZE);
-	if (len < 0)
-		err(1, "could not allocate aligned memory");
-
-	cmd.identify = (struct nvme_cmd_identify) {
-		.opcode = nvme_admin_identify,
-		.nsid = cpu_to_le32(nsid),
-		.cns = NVME_IDENTIFY_CNS_NS,
-	};
+	info = nvme_ns_get_info(&ctrl, nsid);
+	if (!info)
+		err(1, "could not identify namespace");
 
-	if (nvme_admin(&ctrl, &cmd, vaddr, len, NULL))
-		err(1, "nvme_admin");
+	nsze = info->nsze;
+	lbads = info->lbads;
 
-	id_ns = (struct nvme_id_ns *)vaddr;
+	if (lbads > 12)
+		errx(1, "unsupported lba data size");
 
-	nsze = le64_to_cpu((__force leint64_t)(id_ns->nsze));
+	if (nvme_cmd_tmpl_init(&ctrl, &tmpl, nvme_cmd_read, nsid, lbads))
+		err(1, "nvme_cmd_tmpl_init");
 
 	if (io_qsize < 0)
 		io_qsize = ctrl.config.mqes + 1;
@@ -313,7 +285,12 @@ int main(int argc, char **argv)
 	sq = &ctrl.sq[1];
 	cq = &ctrl.cq[1];
 
+	if (nvme_poll_group_init(&pg, NULL) || nvme_poll_group_add(&pg, &ctrl, cq))
+		err(1, "nvme_poll_group");
+
 	run();
 
+	nvme_poll_group_fini(&pg);
+
 	return 0;
 }
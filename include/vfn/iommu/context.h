@@ -23,4 +23,78 @@
  */
 struct iommu_ctx *iommu_get_context(const char *name);
 
+/**
+ * enum iommu_ctx_backend - iommu context backends
+ * @IOMMU_CTX_BACKEND_VFIO: vfio container (type1 iommu)
+ * @IOMMU_CTX_BACKEND_IOMMUFD: iommufd I/O address space
+ */
+enum iommu_ctx_backend {
+	IOMMU_CTX_BACKEND_VFIO		= 1,
+	IOMMU_CTX_BACKEND_IOMMUFD	= 2,
+};
+
+#define IOMMU_CTX_STATE_MAX_FDS 2
+
+/**
+ * struct iommu_ctx_state - Exported iommu context state
+ * @backend: see &enum iommu_ctx_backend
+ * @nfds: number of file descriptors exported along with the state
+ * @id: backend object identifier (the I/O address space for iommufd)
+ * @next: next IOVA to allocate (vfio)
+ * @ephemerals: start of the IOVA range reserved for ephemeral mappings (vfio)
+ */
+struct iommu_ctx_state {
+	uint32_t backend;
+	uint32_t nfds;
+	uint32_t id;
+	uint64_t next;
+	uint64_t ephemerals;
+};
+
+/**
+ * iommu_export_context - Export an iommu context
+ * @ctx: &struct iommu_ctx to export
+ * @bdf: PCI device identifier of a device attached to @ctx
+ * @state: output parameter for the context state
+ * @fds: output array (of at least %IOMMU_CTX_STATE_MAX_FDS elements) for the
+ *       file descriptors backing the context
+ *
+ * Export the state needed to attach to @ctx (and the device) from another
+ * process with iommu_import_context(). The file descriptors remain owned by
+ * @ctx.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_export_context(struct iommu_ctx *ctx, const char *bdf, struct iommu_ctx_state *state,
+			 int *fds);
+
+/**
+ * iommu_import_context - Import an iommu context
+ * @state: context state from iommu_export_context()
+ * @bdf: PCI device identifier given to iommu_export_context()
+ * @fds: file descriptors from iommu_export_context()
+ *
+ * Create an iommu context attached to the same I/O address space as the
+ * exported context. No mappings are created or tracked; mappings made by the
+ * exporting process may be tracked with iommu_map_vaddr() and
+ * %IOMMU_MAP_ADOPT. The context takes ownership of @fds on success.
+ *
+ * Return: A new &struct iommu_ctx, or ``NULL`` on error and sets ``errno``.
+ */
+struct iommu_ctx *iommu_import_context(const struct iommu_ctx_state *state, const char *bdf,
+				       int *fds);
+
+/**
+ * iommu_release_context - Release an imported iommu context
+ * @ctx: &struct iommu_ctx from iommu_import_context()
+ *
+ * Tear down a context that was imported but will not be used, e.g. because
+ * the rest of a handover failed. The I/O address space and the mappings in it
+ * are left as they are (they belong to the exporting process); only the
+ * tracking state is freed and the file descriptors given to
+ * iommu_import_context() are closed. Does nothing for contexts that were not
+ * imported.
+ */
+void iommu_release_context(struct iommu_ctx *ctx);
+
 #endif /* LIBVFN_IOMMU_CONTEXT_H */
@@ -19,6 +19,9 @@
  * @IOMMU_MAP_EPHEMERAL: If set, the mapping is considered temporary
  * @IOMMU_MAP_NOWRITE: DMA is not allowed to write to this mapping
  * @IOMMU_MAP_NOREAD: DMA is not allowed to read from this mapping
+ * @IOMMU_MAP_ADOPT: The IOVA (given with IOMMU_MAP_FIXED_IOVA) is already mapped
+ *                   to the memory backing the virtual address (e.g., by another
+ *                   process sharing the context); only track the mapping
  *
  * IOMMU_MAP_EPHEMERAL may change how the iova is allocated. I.e., currently,
  * the vfio-based backend will allocate an IOVA from a reserved range of 64k.
@@ -29,6 +32,7 @@ enum iommu_map_flags {
 	IOMMU_MAP_EPHEMERAL	= 1 << 1,
 	IOMMU_MAP_NOWRITE	= 1 << 2,
 	IOMMU_MAP_NOREAD	= 1 << 3,
+	IOMMU_MAP_ADOPT		= 1 << 4,
 };
 
 /**
@@ -68,6 +72,27 @@ int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *io
  */
 int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len);
 
+/**
+ * iommu_share_mapping - Share a mapping with another context
+ * @dst: &struct iommu_ctx to share the mapping to
+ * @src: &struct iommu_ctx holding the mapping
+ * @vaddr: page aligned virtual memory address within a mapping in @src
+ * @len: page aligned number of bytes to share
+ *
+ * Map the range of an existing mapping in @src in @dst as well. If both
+ * contexts are backed by iommufd, the mapping is copied in the kernel
+ * (``IOMMU_IOAS_COPY``) and the pages already pinned by @src are reused.
+ * Otherwise, the range is mapped in @dst like iommu_map_vaddr() would.
+ *
+ * Use iommu_translate_vaddr() to get the iova of the shared mapping in @dst.
+ *
+ * The mapping in @src cannot be removed with iommu_unmap_vaddr() (fails with
+ * ``EBUSY``) until the mapping in @dst has been removed.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_share_mapping(struct iommu_ctx *dst, struct iommu_ctx *src, void *vaddr, size_t len);
+
 /**
  * iommu_unmap_all - Unmap all virtual memory address in the IOMMU
  * @ctx: &struct iommu_ctx
@@ -36,6 +36,8 @@
  * @vaddr: data buffer
  * @iova: mapped address
  * @len: length of @vaddr
+ * @memfd: memory file descriptor backing @vaddr if allocated with
+ *         IOMMU_DMABUF_SHARED, ``-1`` otherwise
  *
  * Convenience wrapper around a mapped data buffer.
  */
@@ -45,19 +47,57 @@ struct iommu_dmabuf {
 	void *vaddr;
 	uint64_t iova;
 	ssize_t len;
+
+	int memfd;
 };
 
+#define IOMMU_DMABUF_NODE_SHIFT 16
+#define IOMMU_DMABUF_NODE_MASK (0xffffUL << IOMMU_DMABUF_NODE_SHIFT)
+
+/**
+ * IOMMU_DMABUF_NODE - NUMA node affinity flag
+ * @node: NUMA node (negative for no preference)
+ *
+ * Flag for iommu_get_dmabuf() requesting that the buffer is allocated on
+ * @node. May be combined with &enum iommu_map_flags.
+ */
+#define IOMMU_DMABUF_NODE(node) \
+	((((unsigned long)((node) + 1)) << IOMMU_DMABUF_NODE_SHIFT) & IOMMU_DMABUF_NODE_MASK)
+
+/**
+ * IOMMU_DMABUF_SHARED - Shareable buffer flag
+ *
+ * Flag for iommu_get_dmabuf() requesting that the buffer is backed by a memory
+ * file (see pgmap_shared()), such that it can be mapped by another process.
+ * The file descriptor is available in &iommu_dmabuf.memfd and is closed by
+ * iommu_put_dmabuf().
+ */
+#define IOMMU_DMABUF_SHARED (1UL << 15)
+
+/**
+ * IOMMU_DMABUF_HUGEPAGE - Huge page backed buffer flag
+ *
+ * Flag for iommu_get_dmabuf() requesting that the buffer is backed by huge
+ * pages (see pgmap_hugepage()) if available. If not, the buffer is backed by
+ * regular pages. Ignored if combined with IOMMU_DMABUF_SHARED.
+ */
+#define IOMMU_DMABUF_HUGEPAGE (1UL << 14)
+
 /**
  * iommu_get_dmabuf - Allocate and map a DMA buffer
  * @ctx: &struct iommu_ctx
  * @buffer: uninitialized &struct iommu_dmabuf
  * @len: desired minimum length
- * @flags: combination of enum iommu_map_flags
+ * @flags: combination of enum iommu_map_flags, IOMMU_DMABUF_NODE(),
+ *         IOMMU_DMABUF_SHARED and IOMMU_DMABUF_HUGEPAGE
  *
  * Allocate at least @len bytes and map the buffer within the IOVA address space
  * described by @ctx. The actual allocated and mapped length may be larger than
  * requestes due to alignment requirements.
  *
+ * If @flags includes IOMMU_DMABUF_NODE(), the buffer is allocated on that NUMA
+ * node (see pgmap_node()).
+ *
  * Return: On success, returns ``0``; on error, returns ``-1`` and sets
  * ``errno``.
  */
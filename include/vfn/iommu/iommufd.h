@@ -21,6 +21,24 @@ struct iommufd_fault_queue {
 
 int iommufd_alloc_fault_queue(struct iommufd_fault_queue *fq);
 int iommufd_set_fault_queue(struct iommu_ctx *ctx, struct iommufd_fault_queue *fq, int devfd);
+
+struct iommu_iopf;
+struct iommu_iopf_opts;
+
+/**
+ * iommufd_iopf_init - Initialize an I/O page fault service on a fault queue
+ * @iopf: &struct iommu_iopf to initialize
+ * @ctx: &struct iommu_ctx that regions will be mapped in
+ * @fq: fault queue (see iommufd_alloc_fault_queue())
+ * @opts: service options (``NULL`` for defaults)
+ *
+ * Initialize an I/O page fault service (see iommu_iopf_init()) that reads
+ * faults from and writes responses to the fault queue file descriptor.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommufd_iopf_init(struct iommu_iopf *iopf, struct iommu_ctx *ctx,
+		      struct iommufd_fault_queue *fq, const struct iommu_iopf_opts *opts);
 #endif
 
 #endif /* LIBVFN_IOMMU_IOMMUFD_H */
@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_IOMMU_IOPF_H
+#define LIBVFN_IOMMU_IOPF_H
+
+/**
+ * DOC: I/O page fault service
+ *
+ * The I/O page fault (IOPF) service allows large, sparsely used buffers to be
+ * exposed to a device without pinning and mapping them up front. A virtual
+ * region is registered with the service, which reserves an IOVA range for it,
+ * but nothing is mapped. When the device faults on an IOVA within the region,
+ * the service maps the faulting page (and optionally a number of neighbouring
+ * pages) at the fixed IOVA and responds to the fault.
+ *
+ * Faults are read from a &struct iommu_iopf_source_ops fault source. On
+ * iommufd, see iommufd_iopf_init(). Tests may provide their own source.
+ *
+ * Required includes:
+ *   #include <pthread.h>
+ *   #include <vfn/iommu.h>
+ *   #include <vfn/iommu/iopf.h>
+ */
+
+/**
+ * enum iommu_iopf_fault_flags - Fault flags
+ * @IOMMU_IOPF_FAULT_LAST: Last fault in a fault group; the group must be
+ *                         responded to after handling this fault
+ */
+enum iommu_iopf_fault_flags {
+	IOMMU_IOPF_FAULT_LAST	= 1 << 0,
+};
+
+/**
+ * struct iommu_iopf_fault - I/O page fault
+ * @iova: faulting I/O virtual address
+ * @cookie: opaque cookie used to respond to the fault group
+ * @flags: combination of &enum iommu_iopf_fault_flags
+ */
+struct iommu_iopf_fault {
+	uint64_t iova;
+	uint32_t cookie;
+	uint32_t flags;
+};
+
+/**
+ * enum iommu_iopf_resp_code - Fault response code
+ * @IOMMU_IOPF_RESP_SUCCESS: fault was resolved
+ * @IOMMU_IOPF_RESP_INVALID: fault could not be resolved
+ */
+enum iommu_iopf_resp_code {
+	IOMMU_IOPF_RESP_SUCCESS	= 0,
+	IOMMU_IOPF_RESP_INVALID	= 1,
+};
+
+/**
+ * struct iommu_iopf_resp - I/O page fault group response
+ * @cookie: cookie of the fault group
+ * @code: see &enum iommu_iopf_resp_code
+ */
+struct iommu_iopf_resp {
+	uint32_t cookie;
+	uint32_t code;
+};
+
+/**
+ * struct iommu_iopf_source_ops - Fault source operations
+ * @read: wait for and read at most @n faults into @faults. Returns the number
+ *        of faults read, ``0`` if woken up by @kick and ``-1`` on error
+ * @respond: write @n fault group responses
+ * @kick: (optional) wake up a blocked @read
+ * @release: (optional) release resources associated with the source
+ */
+struct iommu_iopf_source_ops {
+	ssize_t (*read)(void *opaque, struct iommu_iopf_fault *faults, int n);
+	int (*respond)(void *opaque, struct iommu_iopf_resp *resps, int n);
+	void (*kick)(void *opaque);
+	void (*release)(void *opaque);
+};
+
+/**
+ * struct iommu_iopf_opts - I/O page fault service options
+ * @batch: maximum number of faults read and responded to in one go
+ * @prefetch: number of pages following the faulting page to map along with it
+ */
+struct iommu_iopf_opts {
+	int batch;
+	int prefetch;
+};
+
+static const struct iommu_iopf_opts iommu_iopf_opts_default = {
+	.batch = 32,
+	.prefetch = 0,
+};
+
+/**
+ * struct iommu_iopf - I/O page fault service
+ * @stats: fault handling statistics
+ */
+struct iommu_iopf {
+	/* private: */
+	struct iommu_ctx *ctx;
+
+	const struct iommu_iopf_source_ops *ops;
+	void *opaque;
+
+	struct iommu_iopf_opts opts;
+
+	pthread_rwlock_t lock;
+	struct iommu_iopf_region *regions;
+
+	uint64_t next_iova;
+
+	pthread_t thread;
+	bool running, stop;
+
+	struct iommu_iopf_fault *faults;
+	struct iommu_iopf_resp *resps;
+
+	/* public: */
+	struct {
+		unsigned long faults;
+		unsigned long invalid;
+		unsigned long mapped;
+	} stats;
+};
+
+/**
+ * iommu_iopf_init - Initialize an I/O page fault service
+ * @iopf: &struct iommu_iopf to initialize
+ * @ctx: &struct iommu_ctx that regions will be mapped in
+ * @ops: fault source operations
+ * @opaque: fault source private data passed to @ops
+ * @opts: service options (``NULL`` for &iommu_iopf_opts_default)
+ *
+ * Initialize the service. No thread is started; see iommu_iopf_start() or
+ * drive the service manually using iommu_iopf_process().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_iopf_init(struct iommu_iopf *iopf, struct iommu_ctx *ctx,
+		    const struct iommu_iopf_source_ops *ops, void *opaque,
+		    const struct iommu_iopf_opts *opts);
+
+/**
+ * iommu_iopf_fini - Tear down an I/O page fault service
+ * @iopf: &struct iommu_iopf
+ *
+ * Stop the service thread (if running), unmap all pages mapped on demand,
+ * unregister all regions and release the fault source.
+ */
+void iommu_iopf_fini(struct iommu_iopf *iopf);
+
+/**
+ * iommu_iopf_register - Register a virtual region for demand paging
+ * @iopf: &struct iommu_iopf
+ * @vaddr: page aligned virtual address
+ * @len: length of the region (rounded up to the page size)
+ * @iova: output parameter for the reserved I/O virtual address
+ *
+ * Reserve an IOVA range for the region, but do not map it. Faults on the range
+ * are resolved by mapping the corresponding part of the region.
+ *
+ * IOVAs are allocated downwards from the top of the highest usable IOVA range
+ * of the context to stay clear of IOVAs allocated by iommu_map_vaddr().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_iopf_register(struct iommu_iopf *iopf, void *vaddr, size_t len, uint64_t *iova);
+
+/**
+ * iommu_iopf_unregister - Unregister a virtual region
+ * @iopf: &struct iommu_iopf
+ * @vaddr: virtual address of a region registered with iommu_iopf_register()
+ *
+ * Unmap any pages of the region that were mapped on demand and unregister it.
+ * The reserved IOVA range is not reused.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_iopf_unregister(struct iommu_iopf *iopf, void *vaddr);
+
+/**
+ * iommu_iopf_process - Handle a batch of faults
+ * @iopf: &struct iommu_iopf
+ *
+ * Read up to &iommu_iopf_opts.batch faults from the fault source, resolve them
+ * and write the responses back in one go.
+ *
+ * Return: number of faults handled, ``0`` if the source was kicked and ``-1``
+ * on error and sets ``errno``.
+ */
+int iommu_iopf_process(struct iommu_iopf *iopf);
+
+/**
+ * iommu_iopf_start - Start the fault handling thread
+ * @iopf: &struct iommu_iopf
+ *
+ * Start a background thread that calls iommu_iopf_process() until
+ * iommu_iopf_stop() is called.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_iopf_start(struct iommu_iopf *iopf);
+
+/**
+ * iommu_iopf_stop - Stop the fault handling thread
+ * @iopf: &struct iommu_iopf
+ *
+ * Signal the background thread to stop, kick the fault source and wait for the
+ * thread to exit.
+ */
+void iommu_iopf_stop(struct iommu_iopf *iopf);
+
+#endif /* LIBVFN_IOMMU_IOPF_H */
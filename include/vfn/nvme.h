@@ -43,6 +43,18 @@ extern "C" {
 #include <vfn/nvme/ctrl.h>
 #include <vfn/nvme/util.h>
 #include <vfn/nvme/rq.h>
+#include <vfn/nvme/timeout.h>
+#include <vfn/nvme/admin.h>
+#include <vfn/nvme/ns.h>
+#include <vfn/nvme/bio.h>
+#include <vfn/nvme/blk.h>
+#include <vfn/nvme/poll.h>
+#include <vfn/nvme/task.h>
+#include <vfn/nvme/handover.h>
+#include <vfn/nvme/hmb.h>
+#include <vfn/nvme/zns.h>
+#include <vfn/nvme/trim.h>
+#include <vfn/nvme/pi.h>
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_ADMIN_H
+#define LIBVFN_NVME_ADMIN_H
+
+/**
+ * DOC: Asynchronous admin commands
+ *
+ * Admin commands may be submitted asynchronously with nvme_admin_submit(),
+ * which returns the request tracker of the command as a handle. Any number of
+ * admin commands (up to the admin queue depth) may be outstanding at the same
+ * time.
+ *
+ * Completions are reaped from the admin completion queue by
+ * nvme_admin_poll() and nvme_admin_wait() (and thus also nvme_admin()) and
+ * dispatched by command identifier. If a completion callback was given on
+ * submission, it is invoked; otherwise the completion is kept until collected
+ * with nvme_admin_wait() (i.e., the handle acts as a future).
+ *
+ * Completions of Asynchronous Event Requests (see nvme_aer()) are passed to
+ * the handler registered with nvme_set_aen_handler().
+ */
+
+/**
+ * typedef nvme_aen_handler - Asynchronous event notification handler
+ * @ctrl: &struct nvme_ctrl
+ * @cqe: completion queue entry of the Asynchronous Event Request
+ * @opaque: opaque data pointer given to nvme_aer()
+ */
+typedef void (*nvme_aen_handler)(struct nvme_ctrl *ctrl, struct nvme_cqe *cqe, void *opaque);
+
+/**
+ * nvme_admin_submit - Submit an admin command asynchronously
+ * @ctrl: See &struct nvme_ctrl
+ * @sqe: Submission queue entry
+ * @buf: Command payload
+ * @len: Command payload length
+ * @cb: Completion callback (or ``NULL``); see &typedef nvme_rq_cb
+ * @opaque: Opaque data pointer associated with the request tracker
+ *
+ * Submit an admin command without waiting for it to complete. If @buf is not
+ * already mapped, it is mapped for the duration of the command.
+ *
+ * If @cb is ``NULL``, the completion must be collected with nvme_admin_wait().
+ * Otherwise, the request tracker is released when @cb returns.
+ *
+ * Return: On success, returns the request tracker of the command. On error,
+ * returns ``NULL`` and sets ``errno``.
+ */
+struct nvme_rq *nvme_admin_submit(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf,
+				  size_t len, nvme_rq_cb cb, void *opaque);
+
+/**
+ * nvme_admin_poll - Reap and dispatch admin completions
+ * @ctrl: See &struct nvme_ctrl
+ *
+ * Reap any available admin completions without blocking, invoking completion
+ * callbacks and the asynchronous event handler as needed.
+ *
+ * Return: The number of completions reaped. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_admin_poll(struct nvme_ctrl *ctrl);
+
+/**
+ * nvme_admin_wait - Wait for an admin command to complete
+ * @ctrl: See &struct nvme_ctrl
+ * @rq: Request tracker returned by nvme_admin_submit() (without callback)
+ * @cqe_copy: Completion queue entry to fill
+ * @ts: Maximum time to wait for completion (or ``NULL`` to wait indefinitely)
+ *
+ * Wait for the command associated with @rq to complete, dispatching any other
+ * completions reaped in the meantime. The request tracker is released.
+ *
+ * If the command does not complete within @ts, set ``errno`` to ``ETIMEDOUT``
+ * and return ``-1``; the command is still outstanding and may be waited for
+ * again. If @rq was submitted with a completion callback (or is not an
+ * outstanding admin command), set ``errno`` to ``EINVAL`` and return ``-1``.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_admin_wait(struct nvme_ctrl *ctrl, struct nvme_rq *rq, struct nvme_cqe *cqe_copy,
+		    struct timespec *ts);
+
+/**
+ * nvme_set_aen_handler - Set the asynchronous event notification handler
+ * @ctrl: See &struct nvme_ctrl
+ * @handler: Handler to invoke for Asynchronous Event Request completions
+ *
+ * If no handler is set, asynchronous events reaped by the admin command engine
+ * are logged and dropped.
+ */
+void nvme_set_aen_handler(struct nvme_ctrl *ctrl, nvme_aen_handler handler);
+
+/**
+ * nvme_aer - Submit an Asynchronous Event Request command
+ * @ctrl: Controller reference
+ * @opaque: Opaque data pointer
+ *
+ * Issue an Asynchronous Event Request command and associate @opaque with the
+ * request tracker.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_aer(struct nvme_ctrl *ctrl, void *opaque);
+
+/**
+ * nvme_admin - Submit an Admin command and wait for completion
+ * @ctrl: See &struct nvme_ctrl
+ * @sqe: Submission queue entry
+ * @buf: Command payload
+ * @len: Command payload length
+ * @cqe_copy: Completion queue entry to fill
+ *
+ * Shortcut for nvme_admin_submit() followed by nvme_admin_wait(). Other admin
+ * commands may be outstanding at the same time.
+ *
+ * Return: On success, returns ``0``. On error, returnes ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
+	       struct nvme_cqe *cqe_copy);
+
+/**
+ * nvme_rq_abort - Abort a command
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq) of the command to abort
+ *
+ * Asynchronously submit an Abort admin command for the command associated with
+ * @rq. The abort is best effort; if it succeeds, the command is completed by
+ * the controller with a Command Abort Requested status. The completion of the
+ * Abort command itself is handled by the admin command engine (see
+ * nvme_admin_poll()).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_rq_abort(struct nvme_ctrl *ctrl, struct nvme_rq *rq);
+
+#endif /* LIBVFN_NVME_ADMIN_H */
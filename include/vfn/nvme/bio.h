@@ -0,0 +1,271 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_BIO_H
+#define LIBVFN_NVME_BIO_H
+
+/**
+ * DOC: Block I/O
+ *
+ * A block I/O request (&struct nvme_bio) reads or writes a byte range of a
+ * namespace from or to an iovec of any size. The request is split into child
+ * commands such that no command exceeds the Maximum Data Transfer Size or
+ * crosses an optimal I/O boundary of the namespace (see &struct nvme_ns_info),
+ * and such that the data of each command can be described by the PRP list or
+ * SGL segment of a request tracker.
+ *
+ * Children are posted on as many request trackers as are available on the
+ * submission queue and complete to the callback of the parent request. When a
+ * child completes, its tracker is reused for the next part of the request, so
+ * a request larger than the queue depth keeps the queue full until it has been
+ * submitted entirely. The parent request is completed once, when the last
+ * child has completed.
+ *
+ * Requests without a data buffer are initialized with nvme_bio_init_flush(),
+ * nvme_bio_init_trim(), nvme_bio_init_trimv() and nvme_bio_init_copy(). The
+ * ranges of a Dataset Management (deallocate) or Copy command are written to
+ * the PRP list page of the request tracker, so these need no buffer either.
+ *
+ * No memory is allocated; the parent is provided by the caller and children
+ * use the request trackers (and their PRP list pages) of the submission
+ * queue.
+ *
+ * Children are reaped like any other command with a completion callback
+ * (e.g., by a poll group; see &struct nvme_poll_group) or with
+ * nvme_bio_wait(). Posting is serialized with other threads submitting on the
+ * same queue, but the completions of a queue must be reaped by a single
+ * thread.
+ */
+
+/* maximum number of iovec entries described by a single child command */
+#define NVME_BIO_MAX_IOV 64
+
+struct nvme_bio;
+
+/**
+ * struct nvme_lba_range - Range of logical blocks
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks
+ */
+struct nvme_lba_range {
+	uint64_t slba;
+	uint64_t nlb;
+};
+
+/**
+ * typedef nvme_bio_cb - Block I/O completion callback
+ * @bio: Block I/O request (&struct nvme_bio)
+ *
+ * Called when all children of @bio have completed. &nvme_bio.err holds the
+ * result.
+ */
+typedef void (*nvme_bio_cb)(struct nvme_bio *bio);
+
+/**
+ * struct nvme_bio - Block I/O request
+ * @cmd: Command prototype; may be modified after nvme_bio_init() (e.g., to set
+ *       the Force Unit Access bit)
+ * @cb: Completion callback (or ``NULL``)
+ * @opaque: Opaque data pointer
+ * @err: ``0`` on success, otherwise an ``errno`` value describing the first
+ *       error (see nvme_set_errno_from_cqe())
+ * @cqe: Completion queue entry of the first child that failed or, if none
+ *       failed, of the last child to complete
+ */
+struct nvme_bio {
+	union nvme_cmd cmd;
+
+	nvme_bio_cb cb;
+	void *opaque;
+
+	int err;
+	struct nvme_cqe cqe;
+
+	/* private: */
+	struct nvme_ctrl *ctrl;
+	struct nvme_sq *sq;
+	const struct nvme_ns_info *info;
+
+	/*
+	 * next logical block to submit and number of blocks left to submit (a
+	 * flush request has a single "block")
+	 */
+	uint64_t slba, nlb;
+
+	/* cursor in the iovec */
+	struct iovec *iov;
+	int niov, iov_idx;
+	size_t iov_off;
+
+	/* cursor in the source ranges of a trim or copy request */
+	const struct nvme_lba_range *ranges;
+	int nranges, range_idx;
+
+	/* next destination logical block of a copy request */
+	uint64_t dlba;
+
+	int inflight;
+
+	/* called when the request has completed, before @cb */
+	void (*end_io)(struct nvme_bio *bio);
+	void *end_io_data;
+
+	/*
+	 * protection information (see &struct nvme_pi); separate metadata
+	 * buffer, first logical block of the request and the completion
+	 * callback of a request queued for verification
+	 */
+	bool pi;
+	void *mbuf;
+	uint64_t pi_slba;
+	nvme_bio_cb pi_cb;
+	struct nvme_bio *pi_next;
+};
+
+/**
+ * nvme_bio_init - Initialize a block I/O request
+ * @bio: &struct nvme_bio to initialize
+ * @ctrl: See &struct nvme_ctrl
+ * @opcode: Command opcode (e.g., ``0x2`` for Read or ``0x1`` for Write)
+ * @nsid: Namespace identifier
+ * @offset: Offset (in bytes) into the namespace
+ * @iov: Array of iovecs describing the data buffer
+ * @niov: Number of iovecs in @iov
+ *
+ * Initialize @bio to transfer the data described by @iov to or from the
+ * namespace at @offset. The geometry of the namespace is taken from the
+ * namespace table (see nvme_ns_get_info()). @offset and the total length of
+ * @iov must be multiples of the logical block size (including metadata for
+ * extended logical blocks). @iov must remain valid until the request has
+ * completed.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_bio_init(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint8_t opcode, uint32_t nsid,
+		  uint64_t offset, struct iovec *iov, int niov);
+
+/**
+ * nvme_bio_init_flush - Initialize a flush request
+ * @bio: &struct nvme_bio to initialize
+ * @ctrl: See &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ *
+ * Initialize @bio to flush the volatile write cache for the namespace.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_bio_init_flush(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint32_t nsid);
+
+/**
+ * nvme_bio_init_trim - Initialize a trim (deallocate) request
+ * @bio: &struct nvme_bio to initialize
+ * @ctrl: See &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ * @offset: Offset (in bytes) into the namespace
+ * @len: Number of bytes to deallocate
+ *
+ * Initialize @bio to deallocate the logical blocks in the given range using
+ * Dataset Management commands. @offset and @len must be multiples of the
+ * logical block size.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_bio_init_trim(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint32_t nsid,
+		       uint64_t offset, uint64_t len);
+
+/**
+ * nvme_bio_init_trimv - Initialize a trim (deallocate) request for many ranges
+ * @bio: &struct nvme_bio to initialize
+ * @ctrl: See &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ * @ranges: Array of logical block ranges (see &struct nvme_lba_range)
+ * @nranges: Number of ranges in @ranges
+ *
+ * Initialize @bio to deallocate the logical blocks in @ranges. Up to 256
+ * ranges are packed into each Dataset Management command (ranges of more than
+ * ``UINT32_MAX`` logical blocks take more than one). The ranges are not sorted
+ * or merged (see &struct nvme_trim). @ranges must remain valid until the
+ * request has completed.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_bio_init_trimv(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint32_t nsid,
+			const struct nvme_lba_range *ranges, int nranges);
+
+/**
+ * nvme_bio_init_copy - Initialize a copy request
+ * @bio: &struct nvme_bio to initialize
+ * @ctrl: See &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ * @ranges: Array of source logical block ranges (see &struct nvme_lba_range)
+ * @nranges: Number of ranges in @ranges
+ * @sdlba: Destination logical block address
+ *
+ * Initialize @bio to copy the logical blocks in @ranges, in order, to
+ * consecutive logical blocks starting at @sdlba using Copy commands. The
+ * source range entries are written to the PRP list page of the request
+ * tracker, and the request is split such that no command exceeds the copy
+ * limits of the namespace (&nvme_ns_info.msrc, &nvme_ns_info.mssrl and
+ * &nvme_ns_info.mcl). The source and destination ranges should not overlap.
+ * @ranges must remain valid until the request has completed.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``ENOTSUP`` if
+ * the namespace does not support the Copy command).
+ */
+int nvme_bio_init_copy(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint32_t nsid,
+		       const struct nvme_lba_range *ranges, int nranges, uint64_t sdlba);
+
+/**
+ * nvme_bio_submit - Submit a block I/O request
+ * @bio: Block I/O request (&struct nvme_bio)
+ * @sq: Submission queue (&struct nvme_sq)
+ *
+ * Post the children of @bio on the available request trackers of @sq and
+ * ring the doorbell. The rest of the request is submitted as children
+ * complete.
+ *
+ * If an error occurs after some children have been posted, the rest of the
+ * request is not submitted and the error is reported on completion.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``EBUSY`` if
+ * no request tracker is available). On error, the request is not submitted
+ * and the completion callback is not invoked.
+ */
+int nvme_bio_submit(struct nvme_bio *bio, struct nvme_sq *sq);
+
+/**
+ * nvme_bio_wait - Wait for a block I/O request to complete
+ * @bio: Block I/O request (&struct nvme_bio)
+ *
+ * Reap completions from the completion queue associated with the submission
+ * queue of @bio until @bio has completed, invoking the completion callbacks of
+ * the request trackers. Completions of commands without a callback are stashed
+ * for their waiters (see nvme_rq_wait()); conversely, completions of @bio that
+ * were stashed by a concurrent synchronous waiter are picked up from the stash.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` to
+ * &nvme_bio.err.
+ */
+int nvme_bio_wait(struct nvme_bio *bio);
+
+int __nvme_bio_prep(struct nvme_bio *bio, struct nvme_rq *rq, union nvme_cmd *cmd);
+
+/* initialize a request from namespace information the caller already holds */
+int __nvme_bio_init(struct nvme_bio *bio, struct nvme_ctrl *ctrl,
+		    const struct nvme_ns_info *info, uint8_t opcode, uint64_t offset,
+		    struct iovec *iov, int niov);
+void __nvme_bio_init_flush(struct nvme_bio *bio, struct nvme_ctrl *ctrl,
+			   const struct nvme_ns_info *info);
+int __nvme_bio_init_trim(struct nvme_bio *bio, struct nvme_ctrl *ctrl,
+			 const struct nvme_ns_info *info, uint64_t offset, uint64_t len);
+
+#endif /* LIBVFN_NVME_BIO_H */
@@ -0,0 +1,252 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_BLK_H
+#define LIBVFN_NVME_BLK_H
+
+/**
+ * DOC: Block devices
+ *
+ * A &struct nvme_ns provides block semantics on top of a namespace: read and
+ * write an iovec at a byte offset, flush, trim and copy. Request tracker
+ * acquisition, DMA address translation, PRP or SGL selection and splitting
+ * (see &struct nvme_bio) are handled internally.
+ *
+ * Each thread submits on its own I/O queue. Threads are assigned to the I/O
+ * queues that were created when the namespace was opened in a round-robin
+ * fashion, the first time they submit a request. If there are more threads
+ * than queues, queues are shared; posting is serialized by the submission
+ * queue lock.
+ *
+ * With weighted round robin arbitration, a thread may be restricted to the
+ * queues of a priority class with nvme_ns_set_thread_qprio(), such that, e.g.,
+ * latency critical requests are submitted on urgent priority class queues and
+ * background jobs on low priority class queues.
+ *
+ * The synchronous functions wait for completion on the calling thread and
+ * retry commands that fail with the Do Not Retry bit cleared a bounded number
+ * of times. A request that fits in a single command takes one tracker
+ * acquisition, one data pointer mapping and one post. Synchronous requests
+ * may be issued concurrently from any number of threads.
+ *
+ * The asynchronous functions submit a caller provided &struct nvme_bio and
+ * return immediately. Completions are reaped like any other &struct nvme_bio
+ * (e.g., by a poll group or nvme_bio_wait()), which requires that the queue
+ * of the calling thread is not used for synchronous requests by other threads
+ * at the same time.
+ */
+
+/**
+ * struct nvme_ns - Namespace block device
+ * @ctrl: See &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ * @info: Namespace geometry (see &struct nvme_ns_info)
+ */
+struct nvme_ns {
+	struct nvme_ctrl *ctrl;
+	uint32_t nsid;
+	const struct nvme_ns_info *info;
+
+	/* private: */
+
+	/* queue identifiers ordered by priority class */
+	int *qids;
+
+	/*
+	 * queues of each priority class; index 0 covers all queues, followed by
+	 * the urgent, high, medium and low priority classes
+	 */
+	struct {
+		int first, n;
+	} qprio[5];
+};
+
+/**
+ * nvme_ns_open - Open a namespace block device
+ * @ns: &struct nvme_ns to initialize
+ * @ctrl: See &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ *
+ * Initialize @ns for the namespace @nsid. The I/O queues of @ctrl must have
+ * been created; requests are submitted on the I/O queues that exist when the
+ * namespace is opened.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``ENODEV`` if
+ * no I/O queues have been created).
+ */
+int nvme_ns_open(struct nvme_ns *ns, struct nvme_ctrl *ctrl, uint32_t nsid);
+
+/**
+ * nvme_ns_close - Close a namespace block device
+ * @ns: &struct nvme_ns
+ *
+ * Release the resources held by @ns. No requests may be in flight.
+ */
+void nvme_ns_close(struct nvme_ns *ns);
+
+/**
+ * nvme_ns_get_sq - Get the submission queue of the calling thread
+ * @ns: &struct nvme_ns
+ *
+ * Return: The I/O submission queue that the calling thread submits requests
+ * for @ns on.
+ */
+struct nvme_sq *nvme_ns_get_sq(struct nvme_ns *ns);
+
+/**
+ * nvme_ns_set_thread_qprio - Set the queue priority class of the calling thread
+ * @qprio: Priority class (``NVME_SQ_QPRIO_*``) or ``-1`` for any
+ *
+ * Submit requests of the calling thread on the queues of the priority class
+ * @qprio. If a namespace has no queues of that class, any queue is used.
+ */
+void nvme_ns_set_thread_qprio(int qprio);
+
+/**
+ * nvme_ns_readv - Read from a namespace
+ * @ns: &struct nvme_ns
+ * @iov: Array of iovecs describing the data buffer
+ * @niov: Number of iovecs in @iov
+ * @offset: Offset (in bytes) into the namespace
+ *
+ * Read into the buffer described by @iov from @offset and wait for completion.
+ * @offset and the total length of @iov must be multiples of the logical block
+ * size.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_ns_readv(struct nvme_ns *ns, struct iovec *iov, int niov, uint64_t offset);
+
+/**
+ * nvme_ns_writev - Write to a namespace
+ * @ns: &struct nvme_ns
+ * @iov: Array of iovecs describing the data buffer
+ * @niov: Number of iovecs in @iov
+ * @offset: Offset (in bytes) into the namespace
+ *
+ * Write the buffer described by @iov to @offset and wait for completion.
+ * @offset and the total length of @iov must be multiples of the logical block
+ * size.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_ns_writev(struct nvme_ns *ns, struct iovec *iov, int niov, uint64_t offset);
+
+/**
+ * nvme_ns_flush - Flush the volatile write cache
+ * @ns: &struct nvme_ns
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_ns_flush(struct nvme_ns *ns);
+
+/**
+ * nvme_ns_trim - Deallocate a range of a namespace
+ * @ns: &struct nvme_ns
+ * @offset: Offset (in bytes) into the namespace
+ * @len: Number of bytes to deallocate
+ *
+ * @offset and @len must be multiples of the logical block size.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_ns_trim(struct nvme_ns *ns, uint64_t offset, uint64_t len);
+
+/**
+ * nvme_ns_copy - Copy logical blocks within a namespace
+ * @ns: &struct nvme_ns
+ * @ranges: Array of source logical block ranges (see &struct nvme_lba_range)
+ * @nranges: Number of ranges in @ranges
+ * @sdlba: Destination logical block address
+ *
+ * Copy the logical blocks in @ranges, in order, to consecutive logical blocks
+ * starting at @sdlba and wait for completion. The source and destination
+ * ranges should not overlap.
+ *
+ * If the namespace supports the Copy command, the copy is done by the
+ * controller (see nvme_bio_init_copy()). Otherwise, the data is read and
+ * written back through a bounce buffer of a few chunks, with reads and writes
+ * of different chunks in flight at once; completions are then reaped with
+ * nvme_bio_wait(), so the queue of the calling thread must not be used by
+ * other threads at the same time.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_ns_copy(struct nvme_ns *ns, const struct nvme_lba_range *ranges, int nranges,
+		 uint64_t sdlba);
+
+/**
+ * nvme_ns_readv_async - Submit a read from a namespace
+ * @ns: &struct nvme_ns
+ * @bio: &struct nvme_bio to initialize and submit
+ * @iov: Array of iovecs describing the data buffer
+ * @niov: Number of iovecs in @iov
+ * @offset: Offset (in bytes) into the namespace
+ * @cb: Completion callback (see &nvme_bio.cb)
+ * @opaque: Opaque data pointer (see &nvme_bio.opaque)
+ *
+ * Asynchronous version of nvme_ns_readv(); see nvme_bio_submit().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_ns_readv_async(struct nvme_ns *ns, struct nvme_bio *bio, struct iovec *iov, int niov,
+			uint64_t offset, nvme_bio_cb cb, void *opaque);
+
+/**
+ * nvme_ns_writev_async - Submit a write to a namespace
+ * @ns: &struct nvme_ns
+ * @bio: &struct nvme_bio to initialize and submit
+ * @iov: Array of iovecs describing the data buffer
+ * @niov: Number of iovecs in @iov
+ * @offset: Offset (in bytes) into the namespace
+ * @cb: Completion callback (see &nvme_bio.cb)
+ * @opaque: Opaque data pointer (see &nvme_bio.opaque)
+ *
+ * Asynchronous version of nvme_ns_writev(); see nvme_bio_submit().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_ns_writev_async(struct nvme_ns *ns, struct nvme_bio *bio, struct iovec *iov, int niov,
+			 uint64_t offset, nvme_bio_cb cb, void *opaque);
+
+/**
+ * nvme_ns_flush_async - Submit a flush of the volatile write cache
+ * @ns: &struct nvme_ns
+ * @bio: &struct nvme_bio to initialize and submit
+ * @cb: Completion callback (see &nvme_bio.cb)
+ * @opaque: Opaque data pointer (see &nvme_bio.opaque)
+ *
+ * Asynchronous version of nvme_ns_flush(); see nvme_bio_submit().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_ns_flush_async(struct nvme_ns *ns, struct nvme_bio *bio, nvme_bio_cb cb, void *opaque);
+
+/**
+ * nvme_ns_trim_async - Submit a deallocation of a range of a namespace
+ * @ns: &struct nvme_ns
+ * @bio: &struct nvme_bio to initialize and submit
+ * @offset: Offset (in bytes) into the namespace
+ * @len: Number of bytes to deallocate
+ * @cb: Completion callback (see &nvme_bio.cb)
+ * @opaque: Opaque data pointer (see &nvme_bio.opaque)
+ *
+ * Asynchronous version of nvme_ns_trim(); see nvme_bio_submit().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_ns_trim_async(struct nvme_ns *ns, struct nvme_bio *bio, uint64_t offset, uint64_t len,
+		       nvme_bio_cb cb, void *opaque);
+
+int __nvme_ns_sync(struct nvme_ns *ns, struct nvme_bio *bio);
+
+#endif /* LIBVFN_NVME_BLK_H */
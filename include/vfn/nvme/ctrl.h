@@ -15,11 +15,32 @@
 
 #define NVME_CTRL_MPS 0
 
+/**
+ * enum nvme_ctrl_opts_flags - NVMe controller option flags
+ * @NVME_CTRL_OPTS_F_HANDOVER: allocate queue memory and doorbell buffers such
+ *                             that the controller can be handed over to
+ *                             another process (see nvme_handover_send())
+ * @NVME_CTRL_OPTS_F_WRR: enable Weighted Round Robin with Urgent Priority Class
+ *                        arbitration if supported by the controller (see
+ *                        nvme_set_arbitration())
+ * @NVME_CTRL_OPTS_F_HMB: provide a host memory buffer if requested by the
+ *                        controller (see nvme_configure_hmb())
+ */
+enum nvme_ctrl_opts_flags {
+	NVME_CTRL_OPTS_F_HANDOVER		= 1 << 0,
+	NVME_CTRL_OPTS_F_WRR			= 1 << 1,
+	NVME_CTRL_OPTS_F_HMB			= 1 << 2,
+};
+
 /**
  * struct nvme_ctrl_opts - NVMe controller options
  * @nsqr: number of submission queues to request
  * @ncqr: number of completion queues to request
  * @quirks: quirks to apply
+ * @flags: see &enum nvme_ctrl_opts_flags
+ * @hmb_size: size (in bytes) of the host memory buffer provided with
+ *            %NVME_CTRL_OPTS_F_HMB; ``0`` for the size preferred by the
+ *            controller
  *
  * **Note**: @nsqr and @ncqr are zeroes based values.
  */
@@ -27,11 +48,15 @@ struct nvme_ctrl_opts {
 	int nsqr, ncqr;
 #define NVME_QUIRK_BROKEN_DBBUF (1 << 0)
 	unsigned int quirks;
+	unsigned long flags;
+	size_t hmb_size;
 };
 
 static const struct nvme_ctrl_opts nvme_ctrl_opts_default = {
 	.nsqr = 63, .ncqr = 63,
 	.quirks = 0x0,
+	.flags = 0x0,
+	.hmb_size = 0,
 };
 
 /*
@@ -39,11 +64,31 @@ static const struct nvme_ctrl_opts nvme_ctrl_opts_default = {
  * @NVME_CTRL_F_ADMINISTRATIVE: controller type is admin
  * @NVME_CTRL_F_SGLS_SUPPORTED: SGLs are supported
  * @NVME_CTRL_F_SGLS_DWORD_ALIGNMENT: SGL data blocks require dword alignment
+ * @NVME_CTRL_F_WRR: weighted round robin arbitration is enabled
  */
 enum nvme_ctrl_feature_flags {
 	NVME_CTRL_F_ADMINISTRATIVE		= 1 << 0,
 	NVME_CTRL_F_SGLS_SUPPORTED		= 1 << 1,
 	NVME_CTRL_F_SGLS_DWORD_ALIGNMENT	= 1 << 2,
+	NVME_CTRL_F_WRR				= 1 << 3,
+};
+
+/**
+ * enum nvme_create_iosq_flags - I/O Submission Queue creation flags
+ * @NVME_IOSQ_F_QPRIO: the priority class of the queue is the ``NVME_SQ_QPRIO_*``
+ *                     value (see &enum nvme_cmd_create_q_flags) given along
+ *                     with this flag, e.g. ``NVME_IOSQ_F_QPRIO |
+ *                     NVME_SQ_QPRIO_URGENT``; otherwise, the queue is in the
+ *                     medium priority class
+ *
+ * The priority class is only used by the controller if weighted round robin
+ * arbitration is enabled (see &enum nvme_ctrl_opts_flags). Commands in urgent
+ * priority class queues are processed before any others; the high, medium and
+ * low classes are serviced according to the weights set with
+ * nvme_set_arbitration().
+ */
+enum nvme_create_iosq_flags {
+	NVME_IOSQ_F_QPRIO			= 1 << 0,
 };
 
 /**
@@ -116,6 +161,83 @@ struct nvme_ctrl {
 		uint64_t iova;
 		size_t size;
 	} cmb;
+
+	/**
+	 * @numa_node: NUMA node of the device
+	 *
+	 * Initialized by nvme_ctrl_init() from sysfs. Queue memory, request
+	 * pages and doorbell buffers are allocated on this node. Set to ``-1``
+	 * before configuring queues to use the default allocation policy.
+	 */
+	int numa_node;
+
+	/**
+	 * @ioqmem: I/O queue memory allocated by nvme_create_ioqpairs()
+	 */
+	struct iommu_dmabuf ioqmem;
+
+	/**
+	 * @admin: asynchronous admin command engine state
+	 *
+	 * See nvme_admin_submit() and nvme_set_aen_handler().
+	 */
+	struct {
+		pthread_mutex_t lock;
+		struct nvme_admin_slot *slots;
+		void (*aen_handler)(struct nvme_ctrl *ctrl, struct nvme_cqe *cqe, void *opaque);
+	} admin;
+
+	/**
+	 * @ns: namespace table
+	 *
+	 * See nvme_ns_get_info().
+	 */
+	struct {
+		pthread_mutex_t lock;
+		struct nvme_ns_info **tbl;
+		int n;
+
+		/* entries replaced by a newer identification */
+		struct nvme_ns_info **retired;
+		int nretired;
+
+		bool loaded, stale;
+		size_t mdts;
+		uint32_t ctratt;
+		uint16_t oncs;
+	} ns;
+
+	/**
+	 * @arbitration: Arbitration feature value (valid if
+	 * @arbitration_set)
+	 *
+	 * Set by nvme_set_arbitration() and restored by
+	 * nvme_ctrl_reset_fast().
+	 */
+	uint32_t arbitration;
+
+	/**
+	 * @arbitration_set: @arbitration has been set
+	 */
+	bool arbitration_set;
+
+	/**
+	 * @hmb: host memory buffer
+	 *
+	 * The preferred and minimum sizes, the minimum descriptor size (all in
+	 * 4 KiB units) and the maximum number of descriptors are read from
+	 * Identify Controller during initialization. See nvme_configure_hmb().
+	 */
+	struct {
+		uint32_t hmpre, hmmin, hmminds;
+		uint16_t hmmaxd;
+
+		size_t size;
+		struct iommu_dmabuf descs;
+		struct iommu_dmabuf *chunks;
+		int nchunks;
+		bool enabled;
+	} hmb;
 };
 
 /**
@@ -164,6 +286,104 @@ int nvme_ctrl_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ct
  */
 int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_opts *opts);
 
+/**
+ * enum nvme_init_stage - Controller initialization stages
+ * @NVME_INIT_STAGE_RESET: waiting for the controller to reset (``CSTS.RDY`` to
+ *                         clear)
+ * @NVME_INIT_STAGE_ENABLE: waiting for the controller to become ready
+ * @NVME_INIT_STAGE_SET_FEATURES: setting the number of queues
+ * @NVME_INIT_STAGE_IDENTIFY: identifying the controller
+ * @NVME_INIT_STAGE_DBCONFIG: configuring doorbell buffers
+ * @NVME_INIT_STAGE_HMB: providing the host memory buffer
+ * @NVME_INIT_STAGE_DONE: initialization completed
+ * @NVME_INIT_NR_STAGES: number of stages
+ */
+enum nvme_init_stage {
+	NVME_INIT_STAGE_RESET,
+	NVME_INIT_STAGE_ENABLE,
+	NVME_INIT_STAGE_SET_FEATURES,
+	NVME_INIT_STAGE_IDENTIFY,
+	NVME_INIT_STAGE_DBCONFIG,
+	NVME_INIT_STAGE_HMB,
+	NVME_INIT_STAGE_DONE,
+
+	NVME_INIT_NR_STAGES = NVME_INIT_STAGE_DONE,
+};
+
+/**
+ * struct nvme_init_op - Asynchronous controller initialization
+ * @stage: current stage (see &enum nvme_init_stage)
+ * @err: ``errno`` of the failure if initialization failed
+ * @usecs: time spent in each stage (in microseconds)
+ */
+struct nvme_init_op {
+	/* private: */
+	struct nvme_ctrl *ctrl;
+
+	/* stage start and ready wait or admin command deadline (in ticks) */
+	uint64_t tstage, deadline;
+
+	/* status register polling backoff (in ticks) */
+	uint64_t next_poll, backoff;
+
+	/* outstanding admin command */
+	bool busy;
+	struct nvme_cqe cqe;
+
+	struct iommu_dmabuf buf;
+
+	/* public: */
+	int stage;
+	int err;
+	uint64_t usecs[NVME_INIT_NR_STAGES];
+};
+
+/**
+ * nvme_init_start - Start initializing a controller asynchronously
+ * @op: &struct nvme_init_op to track the initialization
+ * @ctrl: Controller to initialize
+ * @bdf: PCI device identifier ("bus:device:function")
+ * @opts: Controller configuration options
+ *
+ * Open the device (see nvme_ctrl_init()) and start resetting the controller.
+ * The initialization is carried out by calling nvme_init_poll(), which never
+ * blocks, so many controllers can be initialized concurrently from a single
+ * thread (see nvme_init_wait()).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_init_start(struct nvme_init_op *op, struct nvme_ctrl *ctrl, const char *bdf,
+		    const struct nvme_ctrl_opts *opts);
+
+/**
+ * nvme_init_poll - Make progress on an asynchronous controller initialization
+ * @op: &struct nvme_init_op
+ *
+ * Advance the initialization as far as possible without blocking. While
+ * waiting for the controller to change ready state, the status register is
+ * polled with exponential backoff, so calling this function more often than
+ * needed is cheap. Initialization fails with ``ETIMEDOUT`` if the controller
+ * does not change ready state within the time given by CAP.TO, or if an admin
+ * command does not complete within 60 seconds (the controller is disabled in
+ * that case).
+ *
+ * Return: ``1`` if the controller is initialized, ``0`` if initialization is
+ * still in progress or ``-1`` on error and sets ``errno``.
+ */
+int nvme_init_poll(struct nvme_init_op *op);
+
+/**
+ * nvme_init_wait - Wait for asynchronous controller initializations
+ * @ops: array of &struct nvme_init_op started with nvme_init_start()
+ * @n: number of elements in @ops
+ *
+ * Drive all initializations in @ops to completion, sleeping while all of them
+ * are waiting for the controller status to change.
+ *
+ * Return: The number of controllers that failed to initialize.
+ */
+int nvme_init_wait(struct nvme_init_op *ops, int n);
+
 /**
  * nvme_close - Close a controller
  * @ctrl: Controller to close
@@ -215,13 +435,37 @@ int nvme_del_ctrl(struct nvme_ctrl *ctrl);
  */
 int nvme_reset(struct nvme_ctrl *ctrl);
 
+/**
+ * nvme_ctrl_reset_fast - Reset controller, keeping queue memory
+ * @ctrl: Controller to reset
+ *
+ * Reset the controller and bring it back up with the same admin and I/O queues
+ * without releasing or remapping any queue memory or request tracker pages.
+ * The rings are cleared, the admin queue registers are programmed again, the
+ * number of queues and doorbell buffers (if used) are configured again and all
+ * I/O queues configured on @ctrl are recreated on the controller (batched, see
+ * nvme_create_ioqpairs()).
+ *
+ * Outstanding commands are completed with a Command Abort Requested status
+ * (with the Do Not Retry bit set), so threads waiting for them (or completion
+ * callbacks) see them fail and release their request trackers as usual.
+ * Outstanding Asynchronous Event Requests are dropped. Pending request
+ * timeouts are canceled, but timeouts remain enabled. Request trackers that
+ * are acquired but have no command outstanding must not be held across the
+ * reset, and no commands may be posted while it is in progress.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_ctrl_reset_fast(struct nvme_ctrl *ctrl);
+
 /**
  * nvme_configure_sq - Configure a submission queue instance
  * @ctrl: Controller to configure a submission queue instance
  * @qid: Queue identifier
  * @qsize: Queue size
  * @cq: Corresponding completion queue instance
- * @flags: Submission queue configuration flags
+ * @flags: Submission queue configuration flags (see &enum
+ *         nvme_create_iosq_flags)
  *
  * Create a submission queue instance for the given @qid.  This allocates
  * memory spaces for the submission queue and map it to IOMMU page table for
@@ -280,6 +524,25 @@ int nvme_configure_adminq(struct nvme_ctrl *ctrl, unsigned long sq_flags);
  */
 int nvme_enable(struct nvme_ctrl *ctrl);
 
+/**
+ * nvme_set_arbitration - Set the arbitration burst and weights
+ * @ctrl: See &struct nvme_ctrl
+ * @ab: Arbitration burst; the controller fetches at most ``2^ab`` commands
+ *      from a submission queue at a time (``7`` means no limit)
+ * @hpw: High priority weight (``1`` to ``256``)
+ * @mpw: Medium priority weight (``1`` to ``256``)
+ * @lpw: Low priority weight (``1`` to ``256``)
+ *
+ * Set the Arbitration feature. The weights determine the relative number of
+ * commands fetched from the high, medium and low priority class queues when
+ * weighted round robin arbitration is enabled (see &enum
+ * nvme_create_iosq_flags).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_set_arbitration(struct nvme_ctrl *ctrl, unsigned int ab, unsigned int hpw,
+			 unsigned int mpw, unsigned int lpw);
+
 /**
  * nvme_create_iocq - Create an I/O Completion Queue
  * @ctrl: Controller reference
@@ -366,6 +629,35 @@ int nvme_delete_iosq(struct nvme_ctrl *ctrl, int qid);
 int nvme_create_ioqpair(struct nvme_ctrl *ctrl, int qid, int qsize, int vector,
 			unsigned long flags);
 
+/**
+ * nvme_create_ioqpairs - Create a number of I/O Queue Pairs
+ * @ctrl: Controller reference
+ * @n: Number of queue pairs
+ * @qsize: Queue size
+ * @flags: See &enum nvme_create_iosq_flags
+ *
+ * Create @n I/O Completion/Submission Queue Pairs with queue identifiers ``1``
+ * through @n, all with queue size @qsize and without interrupts enabled.
+ *
+ * The rings and request tracker pages of all queues are allocated from a single
+ * region of queue memory, which is mapped once and released when the last queue
+ * carved from it is deleted (or by nvme_close()).
+ * Instead of waiting for each admin command in turn, the Create I/O Completion
+ * Queue commands are submitted back-to-back and reaped together, followed by
+ * the Create I/O Submission Queue commands.
+ *
+ * The queues may be deleted with nvme_delete_ioqpair() as usual. Fails with
+ * ``EBUSY`` if queue pairs created with this have not all been deleted, or if
+ * any of the queues ``1`` through @n is already configured.
+ *
+ * **Note** that one slot in the queue is reserved for the full queue condition.
+ * So, if a queue command depth of ``N`` is required, qsize should be ``N + 1``.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_create_ioqpairs(struct nvme_ctrl *ctrl, int n, int qsize, unsigned long flags);
+
 /**
  * nvme_delete_ioqpair - Delete an I/O Completion/Submission Queue Pair
  * @ctrl: See &struct nvme_ctrl
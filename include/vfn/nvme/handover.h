@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_HANDOVER_H
+#define LIBVFN_NVME_HANDOVER_H
+
+/**
+ * DOC: Controller handover
+ *
+ * An initialized controller may be handed over to another process (e.g., a
+ * new version of the same daemon) without resetting it or recreating any
+ * queues. The sending process serializes the controller state (cached
+ * configuration, queue geometry, I/O virtual addresses, head and tail
+ * pointers, phases, doorbell buffers and the controller memory buffer) and
+ * passes it over a Unix domain socket along with the file descriptors of the
+ * vfio device, the iommu context and the queue memory.
+ *
+ * The queue memory must be mappable by the receiving process, so the
+ * controller must have been initialized with %NVME_CTRL_OPTS_F_HANDOVER. The
+ * receiving process maps the same memory and tracks the existing DMA mappings
+ * without mapping anything again.
+ *
+ * When handing over, all I/O queues must be idle and no admin commands may be
+ * outstanding, except for Asynchronous Event Requests, which are carried over.
+ * Request timeouts and completion callbacks are not carried over; in
+ * particular, the timeout configuration of each submission queue (see
+ * nvme_sq_enable_timeouts()) is not serialized, so the receiving process must
+ * enable timeouts again on the queues that should have them.
+ */
+
+/**
+ * nvme_handover_send - Hand over a controller to another process
+ * @ctrl: See &struct nvme_ctrl
+ * @sock: connected Unix domain socket
+ *
+ * Send the state of @ctrl and the file descriptors needed to attach to it on
+ * @sock. The receiving process attaches with nvme_handover_recv().
+ *
+ * On success, the controller belongs to the receiving process. The sending
+ * process must not use @ctrl again and, in particular, must not call
+ * nvme_close() on it (which would unmap the queue memory from the device); it
+ * should simply exit.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_handover_send(struct nvme_ctrl *ctrl, int sock);
+
+/**
+ * nvme_handover_recv - Attach to a controller handed over by another process
+ * @ctrl: uninitialized &struct nvme_ctrl
+ * @sock: connected Unix domain socket
+ *
+ * Receive a controller sent with nvme_handover_send() and initialize @ctrl
+ * from it. The controller is not reset and no queues are created; the admin
+ * and I/O queues are ready for use when this returns.
+ *
+ * On error, the controller and its DMA mappings are left untouched, such that
+ * the sending process may continue to use it.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_handover_recv(struct nvme_ctrl *ctrl, int sock);
+
+#endif /* LIBVFN_NVME_HANDOVER_H */
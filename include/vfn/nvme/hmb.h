@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_HMB_H
+#define LIBVFN_NVME_HMB_H
+
+/**
+ * DOC: Host memory buffer
+ *
+ * Controllers without (enough) DRAM may request a host memory buffer (HMB)
+ * for their mapping tables. The buffer is provided as a list of chunks of
+ * host memory, described by a descriptor list, and is registered with the
+ * Host Memory Buffer feature.
+ *
+ * If initialized with %NVME_CTRL_OPTS_F_HMB, the controller is provided with
+ * a buffer as part of initialization. The chunks are backed by huge pages if
+ * any are available. Since the buffer is optional, initialization continues
+ * without it if it cannot be allocated or is rejected by the controller. The buffer is returned to the controller when it is
+ * reset with nvme_ctrl_reset_fast() and released by nvme_close().
+ *
+ * A host memory buffer cannot be provided to a controller that may be handed
+ * over to another process (see %NVME_CTRL_OPTS_F_HANDOVER).
+ */
+
+/**
+ * nvme_configure_hmb - Provide a host memory buffer to the controller
+ * @ctrl: See &struct nvme_ctrl
+ * @size: size of the buffer in bytes (``0`` for the preferred size)
+ *
+ * Allocate a host memory buffer of @size bytes, limited to the minimum and
+ * preferred sizes reported by the controller, and enable it. The controller
+ * must have been initialized with nvme_init() (or nvme_init_start()).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``ENOTSUP`` if
+ * the controller does not request a host memory buffer and ``EBUSY`` if a
+ * buffer has already been provided).
+ */
+int nvme_configure_hmb(struct nvme_ctrl *ctrl, size_t size);
+
+/**
+ * nvme_discard_hmb - Release the host memory buffer
+ * @ctrl: See &struct nvme_ctrl
+ *
+ * Disable the host memory buffer and release it.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``. If the buffer
+ * could not be disabled, it is not released.
+ */
+int nvme_discard_hmb(struct nvme_ctrl *ctrl);
+
+void __nvme_hmb_identified(struct nvme_ctrl *ctrl, void *id);
+int __nvme_hmb_alloc(struct nvme_ctrl *ctrl, size_t size);
+void __nvme_hmb_free(struct nvme_ctrl *ctrl);
+void __nvme_hmb_cmd(struct nvme_ctrl *ctrl, union nvme_cmd *cmd, uint32_t flags);
+
+#endif /* LIBVFN_NVME_HMB_H */
@@ -0,0 +1,183 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_NS_H
+#define LIBVFN_NVME_NS_H
+
+/**
+ * DOC: Namespace table
+ *
+ * Each controller keeps a table of its active namespaces and their geometry.
+ * The table is populated lazily; the active namespace list is fetched on the
+ * first lookup, and each namespace is identified the first time it is looked
+ * up with nvme_ns_get_info().
+ *
+ * The table is invalidated when a Namespace Attribute Changed asynchronous
+ * event is reaped by the admin command engine, when the controller is reset
+ * with nvme_ctrl_reset_fast() and by nvme_ns_invalidate(). The next lookup
+ * then refreshes the active namespace list and identifies the namespace again.
+ *
+ * Entries are never released before nvme_close(), so a &struct nvme_ns_info
+ * pointer may be kept and used on the I/O path. The geometry in an entry is not
+ * changed once returned (only the table flags are); identifying the namespace
+ * again publishes a new entry, which is returned by later lookups. Namespaces
+ * that are no longer active are not returned by lookups.
+ */
+
+/**
+ * enum nvme_ns_pif - Protection information format
+ * @NVME_NS_PIF_16B: 16b guard protection information (8 bytes; CRC16 guard)
+ * @NVME_NS_PIF_32B: 32b guard protection information (16 bytes; CRC32C guard)
+ * @NVME_NS_PIF_64B: 64b guard protection information (16 bytes; CRC64 guard)
+ *
+ * Formats other than 16b guard are reported by controllers that support
+ * extended LBA formats (``CTRATT.ELBAS``).
+ */
+enum nvme_ns_pif {
+	NVME_NS_PIF_16B		= 0x0,
+	NVME_NS_PIF_32B		= 0x1,
+	NVME_NS_PIF_64B		= 0x2,
+};
+
+/**
+ * struct nvme_ns_info - Cached namespace geometry
+ * @nsid: namespace identifier
+ * @csi: command set identifier (``0x0`` for the NVM command set)
+ * @nsze: namespace size in logical blocks
+ * @ncap: namespace capacity in logical blocks
+ * @lbaf: index of the formatted LBA format
+ * @lbads: log2 of the logical block data size
+ * @ms: metadata size (in bytes) per logical block
+ * @extended: metadata is transferred at the end of the logical block data
+ *            (extended logical blocks) instead of in a separate buffer
+ * @pi: protection information type (``0`` if disabled)
+ * @pi_first: protection information is in the first bytes of the metadata
+ * @pif: protection information format (see &enum nvme_ns_pif)
+ * @sts: storage tag size in bits
+ * @max_nlb: maximum number of logical blocks per command, derived from the
+ *           Maximum Data Transfer Size
+ * @noiob: namespace optimal I/O boundary in logical blocks (``0`` if not
+ *         reported)
+ * @npwg: namespace preferred write granularity in logical blocks
+ * @npwa: namespace preferred write alignment in logical blocks
+ * @npdg: namespace preferred deallocate granularity in logical blocks
+ * @npda: namespace preferred deallocate alignment in logical blocks
+ * @nows: namespace optimal write size in logical blocks
+ * @mssrl: maximum number of logical blocks in a source range of a Copy
+ *         command
+ * @mcl: maximum number of logical blocks copied by a Copy command
+ * @msrc: maximum number of source ranges in a Copy command (``0`` if the
+ *        Copy command is not supported)
+ *
+ * The preferred and optimal values are ``1`` if not reported by the
+ * namespace.
+ */
+struct nvme_ns_info {
+	uint32_t nsid;
+	uint8_t csi;
+
+	uint64_t nsze, ncap;
+
+	uint8_t lbaf;
+	unsigned int lbads;
+	uint16_t ms;
+	bool extended;
+
+	uint8_t pi;
+	bool pi_first;
+	uint8_t pif;
+	uint8_t sts;
+
+	uint32_t max_nlb;
+	uint32_t noiob;
+	uint32_t npwg, npwa;
+	uint32_t npdg, npda;
+	uint32_t nows;
+
+	uint16_t mssrl;
+	uint32_t mcl;
+	uint16_t msrc;
+
+	/* private: */
+	bool active;
+	bool identified;
+};
+
+/**
+ * nvme_ns_get_info - Look up a namespace in the namespace table
+ * @ctrl: See &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ *
+ * Look up @nsid in the namespace table of @ctrl, refreshing the table and
+ * identifying the namespace as needed. Admin commands are only issued if the
+ * namespace has not been identified since the table was last invalidated.
+ *
+ * Return: On success, returns a pointer to the cached namespace information,
+ * which remains valid until nvme_close(). On error, returns ``NULL`` and sets
+ * ``errno`` (``ENOENT`` if @nsid is not an active namespace).
+ */
+const struct nvme_ns_info *nvme_ns_get_info(struct nvme_ctrl *ctrl, uint32_t nsid);
+
+/**
+ * nvme_ns_invalidate - Invalidate the namespace table
+ * @ctrl: See &struct nvme_ctrl
+ *
+ * Mark the namespace table of @ctrl stale, such that the next lookup refreshes
+ * the active namespace list and identifies namespaces again. Use this after
+ * changing namespaces (e.g., formatting or attaching) through other means than
+ * the library. Safe to call from an asynchronous event handler.
+ */
+static inline void nvme_ns_invalidate(struct nvme_ctrl *ctrl)
+{
+	__atomic_store_n(&ctrl->ns.stale, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * nvme_ns_lba_size - Get the size of a logical block
+ * @info: See &struct nvme_ns_info
+ *
+ * Return: The number of bytes transferred in the data buffer per logical block
+ * (including metadata for extended logical blocks).
+ */
+static inline size_t nvme_ns_lba_size(const struct nvme_ns_info *info)
+{
+	return ((size_t)1 << info->lbads) + (info->extended ? info->ms : 0);
+}
+
+/**
+ * nvme_ns_max_nlb - Get the maximum number of logical blocks for a command
+ * @info: See &struct nvme_ns_info
+ * @slba: Starting logical block address
+ *
+ * Get the maximum number of logical blocks that a single command starting at
+ * @slba should transfer, such that it does not exceed the maximum data transfer
+ * size or cross an optimal I/O boundary.
+ *
+ * Return: The maximum number of logical blocks (``1`` or more).
+ */
+static inline uint32_t nvme_ns_max_nlb(const struct nvme_ns_info *info, uint64_t slba)
+{
+	uint32_t nlb = info->max_nlb;
+
+	if (info->noiob) {
+		uint32_t rem = (uint32_t)(info->noiob - slba % info->noiob);
+
+		if (rem < nlb)
+			nlb = rem;
+	}
+
+	return nlb;
+}
+
+void __nvme_ns_free(struct nvme_ctrl *ctrl);
+
+#endif /* LIBVFN_NVME_NS_H */
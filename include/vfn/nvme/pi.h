@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_PI_H
+#define LIBVFN_NVME_PI_H
+
+/**
+ * DOC: End-to-end data protection
+ *
+ * A protection information engine (&struct nvme_pi) generates and verifies
+ * the protection information of a namespace formatted with end-to-end data
+ * protection (see &nvme_ns_info.pi). The metadata is either interleaved with
+ * the data (extended logical blocks) or held in a separate buffer, which is
+ * described to the controller by the Metadata Pointer of each command.
+ *
+ * nvme_pi_attach() prepares a &struct nvme_bio for protection information. It
+ * sets the protection information action and check bits of the command and
+ * the expected application tag, and the reference tag and metadata pointer of
+ * each child command are set as the request is split. The protection
+ * information of a write is generated for the entire request in a single pass
+ * before submission. A read is verified when it completes; the guard is
+ * computed with the accelerated CRC implementations (see nvme_crc16() and
+ * nvme_crc64()).
+ *
+ * Verification is kept off the completion path by default
+ * (%NVME_PI_F_DEFER is set in &nvme_pi_opts_default): reads with a completion
+ * callback are queued when they complete, and the callback is only called once
+ * the request has been verified by nvme_pi_verify_pending() (e.g., when the
+ * application is otherwise idle, or from a thread that does not reap
+ * completions). **The application must call nvme_pi_verify_pending() for such
+ * reads to complete**; they are not verified by nvme_bio_wait(). Reads without
+ * a callback, and all reads if %NVME_PI_F_DEFER is cleared, are verified
+ * inline by the thread that reaps the completion.
+ *
+ * The 16b and 64b guard protection information formats are supported, without
+ * storage tags.
+ */
+
+/**
+ * enum nvme_pi_flags - Protection information engine flags
+ * @NVME_PI_F_CHECK_GUARD: the controller checks the guard
+ * @NVME_PI_F_CHECK_APPTAG: the controller checks the application tag
+ * @NVME_PI_F_CHECK_REFTAG: the controller checks the reference tag (ignored
+ *                          for type 3 protection information)
+ * @NVME_PI_F_PRACT: the controller inserts (on writes) and strips (on reads)
+ *                   the protection information (Protection Information Action)
+ * @NVME_PI_F_VERIFY: reads are verified by the host
+ * @NVME_PI_F_DEFER: reads are verified by nvme_pi_verify_pending() instead of
+ *                   on the completion path
+ */
+enum nvme_pi_flags {
+	NVME_PI_F_CHECK_GUARD	= 1 << 0,
+	NVME_PI_F_CHECK_APPTAG	= 1 << 1,
+	NVME_PI_F_CHECK_REFTAG	= 1 << 2,
+	NVME_PI_F_PRACT		= 1 << 3,
+	NVME_PI_F_VERIFY	= 1 << 4,
+	NVME_PI_F_DEFER		= 1 << 5,
+};
+
+/**
+ * struct nvme_pi_opts - Protection information engine options
+ * @flags: See &enum nvme_pi_flags
+ * @apptag: application tag written (and expected if checked)
+ * @appmask: application tag bits checked
+ */
+struct nvme_pi_opts {
+	unsigned int flags;
+	uint16_t apptag;
+	uint16_t appmask;
+};
+
+static const struct nvme_pi_opts nvme_pi_opts_default = {
+	.flags = NVME_PI_F_CHECK_GUARD | NVME_PI_F_CHECK_REFTAG | NVME_PI_F_VERIFY |
+		 NVME_PI_F_DEFER,
+	.apptag = 0x0,
+	.appmask = 0x0,
+};
+
+/**
+ * struct nvme_pi - Protection information engine
+ * @info: Namespace information (see &struct nvme_ns_info)
+ */
+struct nvme_pi {
+	const struct nvme_ns_info *info;
+
+	/* private: */
+	struct nvme_pi_opts opts;
+
+	/* logical block data size, protection information size and offset */
+	size_t bs, tuple, pioff;
+
+	pthread_mutex_t lock;
+
+	/* completed reads awaiting verification */
+	struct nvme_bio *pending, *pending_tail;
+};
+
+/**
+ * nvme_pi_init - Initialize a protection information engine
+ * @pi: &struct nvme_pi to initialize
+ * @info: Namespace information (see nvme_ns_get_info())
+ * @opts: protection information engine options (``NULL`` for
+ *        &nvme_pi_opts_default)
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``ENOTSUP`` if
+ * the namespace is not formatted with a supported protection information
+ * format).
+ */
+int nvme_pi_init(struct nvme_pi *pi, const struct nvme_ns_info *info,
+		 const struct nvme_pi_opts *opts);
+
+/**
+ * nvme_pi_fini - Tear down a protection information engine
+ * @pi: &struct nvme_pi
+ *
+ * No requests may be pending verification.
+ */
+void nvme_pi_fini(struct nvme_pi *pi);
+
+/**
+ * nvme_pi_generate - Generate protection information
+ * @pi: &struct nvme_pi
+ * @data: Logical block data (including metadata for extended logical blocks)
+ * @mbuf: Separate metadata buffer (``NULL`` for extended logical blocks)
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks
+ *
+ * Write the protection information of @nlb logical blocks, starting at @slba,
+ * to the metadata of the blocks.
+ */
+void nvme_pi_generate(struct nvme_pi *pi, void *data, void *mbuf, uint64_t slba, uint64_t nlb);
+
+/**
+ * nvme_pi_verify - Verify protection information
+ * @pi: &struct nvme_pi
+ * @data: Logical block data (including metadata for extended logical blocks)
+ * @mbuf: Separate metadata buffer (``NULL`` for extended logical blocks)
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks
+ * @lba: Set to the address of the first logical block that failed (or
+ *       ``NULL``)
+ *
+ * Check the protection information of @nlb logical blocks starting at @slba.
+ * The guard, application tag and reference tag are checked if the
+ * corresponding check flag is set (see &enum nvme_pi_flags). Blocks with the
+ * escape application tag (``0xffff``; and reference tag, for type 3 protection
+ * information) are not checked.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` to ``EILSEQ``.
+ */
+int nvme_pi_verify(struct nvme_pi *pi, void *data, void *mbuf, uint64_t slba, uint64_t nlb,
+		   uint64_t *lba);
+
+/**
+ * nvme_pi_attach - Attach protection information to a block I/O request
+ * @pi: &struct nvme_pi
+ * @bio: Read or write request (see nvme_bio_init())
+ * @mbuf: Separate metadata buffer of the request (``NULL`` for extended
+ *        logical blocks)
+ *
+ * Set the protection information bits of @bio and, unless
+ * %NVME_PI_F_PRACT is set, generate the protection information of a write or
+ * arrange for a read to be verified on completion if %NVME_PI_F_VERIFY is
+ * set. A read that fails verification completes with &nvme_bio.err set to
+ * ``EILSEQ``. @bio must not have been submitted and the length of each entry
+ * in its iovec must be a multiple of the logical block size. @mbuf must hold
+ * the metadata of all logical blocks of @bio, be mapped contiguously and
+ * remain valid until the request has completed.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_pi_attach(struct nvme_pi *pi, struct nvme_bio *bio, void *mbuf);
+
+/**
+ * nvme_pi_verify_pending - Verify completed reads
+ * @pi: &struct nvme_pi
+ * @budget: maximum number of requests to verify (``0`` for no limit)
+ *
+ * Verify reads queued by the completion path (see %NVME_PI_F_DEFER) and call
+ * their completion callbacks, in completion order. May be called from any
+ * thread.
+ *
+ * Return: The number of requests verified.
+ */
+int nvme_pi_verify_pending(struct nvme_pi *pi, int budget);
+
+#endif /* LIBVFN_NVME_PI_H */
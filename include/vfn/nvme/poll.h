@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_POLL_H
+#define LIBVFN_NVME_POLL_H
+
+/**
+ * DOC: Poll groups
+ *
+ * A poll group reaps a set of completion queues, possibly belonging to
+ * different controllers, and dispatches each completion to the completion
+ * callback (&struct nvme_rq.cb) of the associated request tracker.
+ *
+ * Callbacks may post new commands with nvme_rq_post(); the submission queue
+ * doorbell is rung once per batch. Work that should not run from within the
+ * reap loop (e.g., resubmitting a command that must wait for the completion
+ * queue head to be updated) may be deferred with nvme_poll_group_defer().
+ *
+ * Completions of commands without a callback are left for their synchronous
+ * waiters (see nvme_rq_wait()), so a poll group may share completion queues
+ * with waiters and with other poll groups.
+ *
+ * A poll group is not thread-safe; use one poll group per thread.
+ */
+
+/**
+ * struct nvme_poll_group_opts - Poll group options
+ * @batch: maximum number of completions reaped from one completion queue
+ *         before moving on to the next
+ * @budget: maximum number of completions reaped by one call to
+ *          nvme_poll_group_poll()
+ */
+struct nvme_poll_group_opts {
+	int batch;
+	int budget;
+};
+
+static const struct nvme_poll_group_opts nvme_poll_group_opts_default = {
+	.batch = 32,
+	.budget = 256,
+};
+
+/**
+ * struct nvme_poll_group - Poll group
+ */
+struct nvme_poll_group {
+	/* private: */
+	struct nvme_poll_group_opts opts;
+
+	struct nvme_poll_group_entry {
+		struct nvme_ctrl *ctrl;
+		struct nvme_cq *cq;
+
+		/* submission queues completing to cq (for timeout checks) */
+		struct nvme_sq **sqs;
+		int nsqs;
+	} *entries;
+
+	int nentries, nalloc;
+
+	/* index of the completion queue to start reaping from */
+	int next;
+
+	/* deferred request trackers (linked through rq_next) */
+	struct nvme_rq *deferred, **deferred_tail;
+};
+
+/**
+ * nvme_poll_group_init - Initialize a poll group
+ * @pg: &struct nvme_poll_group to initialize
+ * @opts: poll group options (``NULL`` for &nvme_poll_group_opts_default)
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_poll_group_init(struct nvme_poll_group *pg, const struct nvme_poll_group_opts *opts);
+
+/**
+ * nvme_poll_group_fini - Tear down a poll group
+ * @pg: &struct nvme_poll_group
+ *
+ * Remove all completion queues from the poll group. Pending deferred hooks are
+ * not run.
+ */
+void nvme_poll_group_fini(struct nvme_poll_group *pg);
+
+/**
+ * nvme_poll_group_add - Add a completion queue to a poll group
+ * @pg: &struct nvme_poll_group
+ * @ctrl: &struct nvme_ctrl that @cq belongs to
+ * @cq: &struct nvme_cq
+ *
+ * Request timeouts (see nvme_sq_enable_timeouts()) are checked for the
+ * submission queues completing to @cq when it is polled; those submission
+ * queues must be created before @cq is added.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_poll_group_add(struct nvme_poll_group *pg, struct nvme_ctrl *ctrl, struct nvme_cq *cq);
+
+/**
+ * nvme_poll_group_del - Remove a completion queue from a poll group
+ * @pg: &struct nvme_poll_group
+ * @cq: &struct nvme_cq
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_poll_group_del(struct nvme_poll_group *pg, struct nvme_cq *cq);
+
+/**
+ * nvme_poll_group_defer - Defer work on a request tracker
+ * @pg: &struct nvme_poll_group
+ * @rq: Request tracker (&struct nvme_rq)
+ * @fn: Hook to run
+ *
+ * Run @fn on @rq when the current (or next) call to nvme_poll_group_poll() has
+ * finished reaping and updated the completion queue heads. Hooks run in the
+ * order they were deferred. Commands posted by @fn to the submission queue of
+ * @rq are submitted when the hooks have run.
+ *
+ * @rq must not be on the request tracker free stack, since the same link is
+ * used for the deferred list. No memory is allocated.
+ */
+void nvme_poll_group_defer(struct nvme_poll_group *pg, struct nvme_rq *rq,
+			   void (*fn)(struct nvme_rq *rq));
+
+/**
+ * nvme_poll_group_poll - Reap and dispatch completions
+ * @pg: &struct nvme_poll_group
+ *
+ * Reap available completions from the completion queues of the poll group
+ * (at most &nvme_poll_group_opts.batch from each queue and at most
+ * &nvme_poll_group_opts.budget in total) and invoke the completion callback of
+ * the associated request trackers. Then run any deferred hooks.
+ *
+ * Queues are visited round-robin, starting where the previous call left off,
+ * so a busy queue cannot starve the others.
+ *
+ * Return: The number of completion callbacks invoked.
+ */
+int nvme_poll_group_poll(struct nvme_poll_group *pg);
+
+#endif /* LIBVFN_NVME_POLL_H */
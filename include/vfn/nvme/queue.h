@@ -41,6 +41,30 @@ struct nvme_cq {
 
 	int phase;
 	int vector;
+
+	/* ring memory is carved from &nvme_ctrl.ioqmem (see nvme_create_ioqpairs()) */
+	bool shared;
+
+	/* held while reaping entries (see nvme_rq_wait()) */
+	pthread_spinlock_t lock;
+
+	/*
+	 * Completion stash; completion queue entries reaped on behalf of other
+	 * waiters. Each submission queue associated with the completion queue
+	 * owns a range of slots indexed by command identifier. Protected by
+	 * @lock.
+	 */
+	struct {
+		struct nvme_cqe *cqes;
+		unsigned long *ready;
+		int nslots;
+
+		struct nvme_cq_stash_range {
+			uint16_t sqid;
+			int base, nslots;
+		} *ranges;
+		int nranges;
+	} stash;
 };
 
 /**
@@ -53,33 +77,120 @@ struct nvme_sq {
 	struct iommu_dmabuf mem;
 	struct iommu_dmabuf pages;
 
+	/* ring and pages are carved from &nvme_ctrl.ioqmem */
+	bool shared;
+
 	uint16_t tail, ptail;
 	int qsize;
 	int id;
 	size_t entry_size;
 
+	/* priority class (``NVME_SQ_QPRIO_*``; see &enum nvme_create_iosq_flags) */
+	int qprio;
+
 	/* memory-mapped register */
 	void *doorbell;
 
 	struct nvme_dbbuf dbbuf;
 
+	/* serializes posting from multiple threads (see nvme_sync()) */
+	pthread_spinlock_t lock;
+
 	/* rq stack */
 	struct nvme_rq *rqs;
 	struct nvme_rq *rq_top;
+
+	/* request timeouts (see nvme_sq_enable_timeouts()) */
+	struct {
+		/* protects the wheel; timeout handlers are called without it */
+		pthread_spinlock_t lock;
+
+		struct timer_wheel *wheel;
+		uint64_t timeout;
+
+		int (*fn)(struct nvme_rq *rq, int count, void *opaque);
+		void *opaque;
+	} timeouts;
 };
 
 /**
- * nvme_sq_post - Add a submission queue entry to a submission queue
+ * nvme_sq_reserve - Reserve the next submission queue entry
  * @sq: Submission queue
- * @sqe: Submission queue entry
  *
- * Add a submission queue entry to a submission queue, updating the queue tail
- * pointer in the process.
+ * Get a pointer to the submission queue entry at the queue tail, such that a
+ * command can be built directly in the queue, avoiding a copy. The entry holds
+ * whatever command was previously posted in the slot, so every field must be
+ * written. Nothing is posted until nvme_sq_commit() is called.
+ *
+ * **Note**: The queue does not track the head pointer. The caller must ensure
+ * that the queue has room (e.g., by only reserving an entry for an acquired
+ * request tracker).
+ *
+ * Return: Pointer to the submission queue entry.
  */
-static inline void nvme_sq_post(struct nvme_sq *sq, const union nvme_cmd *sqe)
+static inline union nvme_cmd *nvme_sq_reserve(struct nvme_sq *sq)
 {
-	memcpy(sq->mem.vaddr + (sq->tail << NVME_SQES), sqe, 1 << NVME_SQES);
+	return (union nvme_cmd *)(sq->mem.vaddr + (sq->tail << NVME_SQES));
+}
+
+/**
+ * nvme_sq_reserve_batch - Reserve a batch of submission queue entries
+ * @sq: Submission queue
+ * @n: Number of entries to reserve
+ * @sqes: Output array of @n submission queue entry pointers
+ *
+ * Like nvme_sq_reserve(), but reserve the next @n entries, wrapping around the
+ * end of the queue if needed (so the entries are not necessarily contiguous).
+ * Post them with nvme_sq_commit_batch() or, in order, one at a time with
+ * nvme_sq_commit() or nvme_rq_commit().
+ */
+static inline void nvme_sq_reserve_batch(struct nvme_sq *sq, int n, union nvme_cmd **sqes)
+{
+	int tail = sq->tail;
+
+	for (int i = 0; i < n; i++) {
+		sqes[i] = (union nvme_cmd *)(sq->mem.vaddr + (tail << NVME_SQES));
+
+		if (++tail == sq->qsize)
+			tail = 0;
+	}
+}
+
+/**
+ * nvme_sq_commit_batch - Post a batch of reserved submission queue entries
+ * @sq: Submission queue
+ * @n: Number of entries to post
+ *
+ * Post the next @n entries of the submission queue (see
+ * nvme_sq_reserve_batch()), updating the queue tail pointer in the process. The
+ * doorbell is not written.
+ *
+ * **Note**: Request timeouts (see nvme_sq_enable_timeouts()) are not armed; use
+ * nvme_rq_commit() on queues with timeouts enabled.
+ */
+static inline void nvme_sq_commit_batch(struct nvme_sq *sq, int n)
+{
+	int tail = sq->tail + n;
 
+	trace_guard(NVME_SQ_POST) {
+		trace_emit("sqid %d tail %d n %d\n", sq->id, sq->tail, n);
+	}
+
+	if (tail >= sq->qsize)
+		tail -= sq->qsize;
+
+	sq->tail = (uint16_t)tail;
+}
+
+/**
+ * nvme_sq_commit - Post a reserved submission queue entry
+ * @sq: Submission queue
+ *
+ * Post the submission queue entry returned by nvme_sq_reserve(), updating the
+ * queue tail pointer in the process. The doorbell is not written.
+ */
+static inline void nvme_sq_commit(struct nvme_sq *sq)
+{
 	trace_guard(NVME_SQ_POST) {
 		trace_emit("sqid %d tail %d\n", sq->id, sq->tail);
 	}
@@ -88,6 +199,21 @@ static inline void nvme_sq_post(struct nvme_sq *sq, const union nvme_cmd *sqe)
 		sq->tail = 0;
 }
 
+/**
+ * nvme_sq_post - Add a submission queue entry to a submission queue
+ * @sq: Submission queue
+ * @sqe: Submission queue entry
+ *
+ * Add a submission queue entry to a submission queue, updating the queue tail
+ * pointer in the process.
+ */
+static inline void nvme_sq_post(struct nvme_sq *sq, const union nvme_cmd *sqe)
+{
+	memcpy(nvme_sq_reserve(sq), sqe, 1 << NVME_SQES);
+
+	nvme_sq_commit(sq);
+}
+
 static inline bool __nvme_need_mmio(uint16_t eventidx, uint16_t val, uint16_t old)
 {
 	return (uint16_t)(val - eventidx) <= (uint16_t)(val - old);
@@ -255,6 +381,24 @@ static inline struct nvme_cqe *nvme_cq_get_cqe(struct nvme_cq *cq)
 	return cqe;
 }
 
+void __nvme_cq_grow_stash(struct nvme_cq *cq, uint16_t sqid, int nslots);
+void __nvme_cq_stash_put(struct nvme_cq *cq, struct nvme_cqe *cqe);
+
+/*
+ * Take up to @max stashed completions of commands on @sq that have a
+ * completion callback. Called with the completion queue lock held.
+ */
+int __nvme_cq_stash_take_cb(struct nvme_cq *cq, struct nvme_sq *sq, struct nvme_rq **rqs,
+			    struct nvme_cqe *cqes, int max);
+
+/*
+ * Stash a completion with status field @sfp for every command outstanding on
+ * @sq, i.e. for every request tracker that is neither on the free list nor has
+ * a completion stashed already, and stop tracking their timeouts. Called with
+ * the completion queue lock held.
+ */
+void __nvme_cq_stash_abort(struct nvme_cq *cq, struct nvme_sq *sq, uint16_t sfp);
+
 /**
  * nvme_cq_get_cqes - Get an exact number of cqes from a completion queue
  * @cq: Completion queue
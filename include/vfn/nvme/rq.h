@@ -13,12 +13,25 @@
 #ifndef LIBVFN_NVME_RQ_H
 #define LIBVFN_NVME_RQ_H
 
+struct nvme_rq;
+
+/**
+ * typedef nvme_rq_cb - Request completion callback
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cqe: Completion queue entry of the command associated with @rq
+ *
+ * The completion queue entry is only valid for the duration of the callback.
+ */
+typedef void (*nvme_rq_cb)(struct nvme_rq *rq, struct nvme_cqe *cqe);
+
 /**
  * struct nvme_rq - Request tracker
  * @opaque: Opaque data pointer
+ * @cb: Completion callback (see &struct nvme_poll_group)
  */
 struct nvme_rq {
 	void *opaque;
+	nvme_rq_cb cb;
 
 	/* private: */
 	struct nvme_sq *sq;
@@ -31,8 +44,36 @@ struct nvme_rq {
 	} page;
 
 	struct nvme_rq *rq_next;
+
+	/* deferred hook (see nvme_poll_group_defer()) */
+	void (*deferred)(struct nvme_rq *rq);
+
+	/* deadline (see nvme_sq_enable_timeouts()) */
+	struct timer_wheel_entry timer;
+	int ntimeouts;
+
+	/* list of expired requests (see nvme_sq_check_timeouts()) */
+	struct nvme_rq *expired_next;
 };
 
+void __nvme_rq_disarm(struct nvme_rq *rq);
+
+/**
+ * nvme_rq_disarm - Stop tracking the timeout of a request
+ * @rq: &struct nvme_rq
+ *
+ * Remove the deadline of the command associated with @rq (if any). Must be
+ * called when a completion is reaped outside of nvme_rq_wait(), poll groups or
+ * the admin command engine.
+ */
+static inline void nvme_rq_disarm(struct nvme_rq *rq)
+{
+	if (timer_wheel_pending(&rq->timer))
+		__nvme_rq_disarm(rq);
+
+	rq->ntimeouts = 0;
+}
+
 /**
  * nvme_rq_reset - Reset a request tracker for reuse
  * @rq: &struct nvme_rq
@@ -42,6 +83,9 @@ struct nvme_rq {
 static inline void nvme_rq_reset(struct nvme_rq *rq)
 {
 	rq->opaque = NULL;
+	rq->cb = NULL;
+
+	nvme_rq_disarm(rq);
 }
 
 /**
@@ -180,10 +224,60 @@ static inline void nvme_rq_prep_cmd(struct nvme_rq *rq, union nvme_cmd *cmd)
 	cmd->cid = rq->cid;
 }
 
+void __nvme_rq_arm(struct nvme_rq *rq);
+
+/**
+ * nvme_rq_post - Post the NVMe command on the submission queue associated with
+ *                the given request tracker
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ *
+ * Prepare @cmd and post it to a submission queue. If timeouts are enabled on
+ * the submission queue (see nvme_sq_enable_timeouts()), a deadline is set for
+ * the command. The doorbell is not written.
+ */
 static inline void nvme_rq_post(struct nvme_rq *rq, union nvme_cmd *cmd)
 {
 	nvme_rq_prep_cmd(rq, cmd);
 	nvme_sq_post(rq->sq, cmd);
+
+	if (rq->sq->timeouts.wheel)
+		__nvme_rq_arm(rq);
+}
+
+/**
+ * nvme_rq_reserve - Reserve a submission queue entry for a request tracker
+ * @rq: Request tracker (&struct nvme_rq)
+ *
+ * Reserve the next entry of the submission queue associated with @rq, such
+ * that the command can be built in place (see nvme_sq_reserve()). Post it with
+ * nvme_rq_commit().
+ *
+ * Return: Pointer to the submission queue entry.
+ */
+static inline union nvme_cmd *nvme_rq_reserve(struct nvme_rq *rq)
+{
+	return nvme_sq_reserve(rq->sq);
+}
+
+/**
+ * nvme_rq_commit - Post a command built in place
+ * @rq: Request tracker (&struct nvme_rq)
+ * @sqe: Submission queue entry returned by nvme_rq_reserve()
+ *
+ * Associate the command in @sqe with @rq (by setting the command identifier)
+ * and post it. Like nvme_rq_post(), a deadline is set for the command if
+ * timeouts are enabled on the submission queue and the doorbell is not
+ * written.
+ */
+static inline void nvme_rq_commit(struct nvme_rq *rq, union nvme_cmd *sqe)
+{
+	sqe->cid = rq->cid;
+
+	nvme_sq_commit(rq->sq);
+
+	if (rq->sq->timeouts.wheel)
+		__nvme_rq_arm(rq);
 }
 
 /**
@@ -200,6 +294,57 @@ static inline void nvme_rq_exec(struct nvme_rq *rq, union nvme_cmd *cmd)
 	nvme_sq_update_tail(rq->sq);
 }
 
+/**
+ * struct nvme_cmd_tmpl - Command template
+ * @cmd: Command prototype
+ *
+ * A command template holds the parts of a command that are constant for all
+ * commands of a given opcode to a given namespace (e.g., opcode, namespace
+ * identifier, flags and any constant command dwords, such as the FUA bit). The
+ * prototype may be modified after nvme_cmd_tmpl_init(). Templates are owned by
+ * the caller, which typically keeps one per namespace and opcode.
+ */
+struct nvme_cmd_tmpl {
+	union nvme_cmd cmd;
+
+	/* private: */
+	int lbads;
+	int pageshift;
+};
+
+/**
+ * nvme_cmd_tmpl_init - Initialize a command template
+ * @ctrl: &struct nvme_ctrl
+ * @tmpl: &struct nvme_cmd_tmpl to initialize
+ * @opcode: command opcode
+ * @nsid: namespace identifier
+ * @lbads: LBA data size of the namespace (as a power of two)
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_cmd_tmpl_init(struct nvme_ctrl *ctrl, struct nvme_cmd_tmpl *tmpl, uint8_t opcode,
+		       uint32_t nsid, unsigned int lbads);
+
+/**
+ * nvme_rq_rw - Post a read/write-style command from a template
+ * @rq: Request tracker (&struct nvme_rq)
+ * @tmpl: Command template (&struct nvme_cmd_tmpl)
+ * @slba: starting logical block address
+ * @nlb: number of logical blocks (``1`` to ``65536``)
+ * @iova: I/O virtual address of a buffer that is contiguous in iova mapped
+ *        memory
+ *
+ * Copy @tmpl directly into the next submission queue entry of the submission
+ * queue associated with @rq and fill in the command identifier, @slba, @nlb
+ * and the data pointer (using the PRP list page of @rq if needed). This avoids
+ * building the command on the stack and copying it into the queue. Like
+ * nvme_rq_post(), the doorbell is not written.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_rq_rw(struct nvme_rq *rq, const struct nvme_cmd_tmpl *tmpl, uint64_t slba,
+	       uint32_t nlb, uint64_t iova);
+
 /**
  * nvme_rq_map_prp - Set up the Physical Region Pages in the data pointer of the
  *                   command from a buffer that is contiguous in iova mapped
@@ -281,10 +426,19 @@ int nvme_rq_mapv(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd
  * @rq: Request tracker (&struct nvme_rq)
  * @cqe_copy: Output parameter to copy completion queue entry into
  *
- * Spin on the completion queue associated with @rq until a completion queue
- * entry is available and copy it into @cqe_copy (if not NULL). If the
- * completed command identifer is different from the one associated with @rq,
- * set ``errno`` to ``EAGAIN`` and return ``-1``.
+ * Spin on the completion queue associated with @rq until the completion queue
+ * entry for the command associated with @rq is available and copy it into
+ * @cqe_copy (if not NULL).
+ *
+ * Completion queue entries for other commands reaped while spinning are kept in
+ * a per completion queue stash (indexed by submission queue and command
+ * identifier), from which their own waiters pick them up. Thus, multiple
+ * threads may wait on request trackers of the same queue pair (or of submission
+ * queues sharing a completion queue) concurrently; only one of them reaps the
+ * completion queue at any time.
+ *
+ * **Note**: Completions of commands not waited for with nvme_rq_spin() or
+ * nvme_rq_wait() remain in the stash until the request tracker is waited on.
  *
  * Return: ``0`` on success, ``-1`` on error and set ``errno``.
  */
@@ -297,7 +451,8 @@ int nvme_rq_spin(struct nvme_rq *rq, struct nvme_cqe *cqe_copy);
  * @cqe_copy: Output parameter to copy completion queue entry into
  * @ts: Maximum time to wait for completion
  *
- * Like nvme_rq_spin(), but do not spin for more than @ts.
+ * Like nvme_rq_spin(), but do not spin for more than @ts. On timeout, set
+ * ``errno`` to ``ETIMEDOUT`` and return ``-1``.
  *
  * Return: ``0`` on success, ``-1`` on error and set ``errno``.
  */
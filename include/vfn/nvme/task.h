@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_TASK_H
+#define LIBVFN_NVME_TASK_H
+
+/**
+ * DOC: Tasks
+ *
+ * Tasks are stackless coroutines (in the style of protothreads) that may
+ * await the completion of commands associated with request trackers. A task
+ * is a function that is re-entered from the top every time it is resumed; the
+ * NVME_TASK_BEGIN() and NVME_TASK_END() macros jump to the point where it left
+ * off.
+ *
+ * .. code-block:: c
+ *
+ *   struct rmw {
+ *           struct nvme_task task;
+ *           struct nvme_rq *rq;
+ *           union nvme_cmd cmd;
+ *   };
+ *
+ *   static int rmw(struct nvme_task *task)
+ *   {
+ *           struct rmw *ctx = container_of(task, struct rmw, task);
+ *
+ *           NVME_TASK_BEGIN(task);
+ *
+ *           ctx->cmd.opcode = nvme_cmd_read;
+ *           nvme_rq_exec(ctx->rq, &ctx->cmd);
+ *
+ *           NVME_TASK_AWAIT(task, ctx->rq);
+ *
+ *           // modify
+ *
+ *           ctx->cmd.opcode = nvme_cmd_write;
+ *           nvme_rq_exec(ctx->rq, &ctx->cmd);
+ *
+ *           NVME_TASK_AWAIT(task, ctx->rq);
+ *
+ *           nvme_rq_release(ctx->rq);
+ *
+ *           NVME_TASK_END(task);
+ *   }
+ *
+ * A task is resumed from the completion callback (&struct nvme_rq.cb) of the
+ * awaited request trackers, i.e., by whoever reaps the completion queue (e.g.,
+ * nvme_poll_group_poll()). Awaiting does not allocate memory and a task only
+ * takes up the size of &struct nvme_task, so a thread may drive thousands of
+ * tasks.
+ *
+ * Since the task function returns when awaiting, local variables do not keep
+ * their values across NVME_TASK_AWAIT(). Keep state in a structure embedding
+ * the &struct nvme_task instead. Likewise, ``switch`` statements may not span
+ * an await.
+ */
+
+/**
+ * enum nvme_task_state - Task state
+ * @NVME_TASK_WAITING: task is waiting for completions
+ * @NVME_TASK_DONE: task has run to completion
+ */
+enum nvme_task_state {
+	NVME_TASK_WAITING	= 0,
+	NVME_TASK_DONE		= 1,
+};
+
+struct nvme_task;
+
+/**
+ * typedef nvme_task_fn - Task function
+ * @task: &struct nvme_task
+ *
+ * Return: &enum nvme_task_state; returned by the NVME_TASK_* macros.
+ */
+typedef int (*nvme_task_fn)(struct nvme_task *task);
+
+/**
+ * struct nvme_task - Task
+ * @opaque: Opaque data pointer
+ * @cqe: Completion queue entry of the last awaited command that completed
+ * @nerr: Number of awaited commands that completed with an error status
+ * @on_done: Called (if set) when the task has run to completion
+ */
+struct nvme_task {
+	/* private: */
+	nvme_task_fn fn;
+	unsigned int lc;
+	int pending;
+	int state;
+
+	/* public: */
+	void *opaque;
+	struct nvme_cqe cqe;
+	int nerr;
+
+	void (*on_done)(struct nvme_task *task);
+};
+
+/**
+ * NVME_TASK_BEGIN - Begin a task function body
+ * @task: &struct nvme_task
+ */
+#define NVME_TASK_BEGIN(task) \
+	switch ((task)->lc) { case 0:
+
+/**
+ * NVME_TASK_END - End a task function body
+ * @task: &struct nvme_task
+ *
+ * Mark the task as done and return from the task function.
+ */
+#define NVME_TASK_END(task) \
+	} (task)->lc = 0; return NVME_TASK_DONE
+
+/**
+ * NVME_TASK_WAIT - Wait for all commands awaited with nvme_task_await_rq()
+ * @task: &struct nvme_task
+ *
+ * Return from the task function until all awaited commands have completed.
+ */
+#define NVME_TASK_WAIT(task) \
+	do { \
+		(task)->lc = __LINE__; __attribute__((__fallthrough__)); case __LINE__: \
+		if ((task)->pending) \
+			return NVME_TASK_WAITING; \
+	} while (0)
+
+/**
+ * NVME_TASK_AWAIT - Await completion of a command
+ * @task: &struct nvme_task
+ * @rq: Request tracker (&struct nvme_rq)
+ *
+ * Await the completion of the command associated with @rq. The command must
+ * have been posted (and may already have completed, but not yet been reaped).
+ * On resumption, the completion queue entry is available in
+ * &nvme_task.cqe.
+ */
+#define NVME_TASK_AWAIT(task, rq) \
+	do { \
+		nvme_task_await_rq(task, rq); \
+		NVME_TASK_WAIT(task); \
+	} while (0)
+
+/**
+ * nvme_task_init - Initialize a task
+ * @task: &struct nvme_task
+ * @fn: task function
+ * @opaque: opaque data pointer
+ */
+void nvme_task_init(struct nvme_task *task, nvme_task_fn fn, void *opaque);
+
+/**
+ * nvme_task_await_rq - Add a command to the set of awaited commands
+ * @task: &struct nvme_task
+ * @rq: Request tracker (&struct nvme_rq)
+ *
+ * Take over the completion callback and opaque data pointer of @rq. Use
+ * NVME_TASK_WAIT() to wait for all awaited commands to complete.
+ */
+void nvme_task_await_rq(struct nvme_task *task, struct nvme_rq *rq);
+
+/**
+ * nvme_task_run - Run a task until it awaits a completion
+ * @task: &struct nvme_task
+ *
+ * Start (or explicitly resume) @task.
+ *
+ * Return: The &enum nvme_task_state of the task.
+ */
+int nvme_task_run(struct nvme_task *task);
+
+/**
+ * nvme_task_done - Check if a task has run to completion
+ * @task: &struct nvme_task
+ *
+ * Return: ``true`` if the task is done, ``false`` otherwise.
+ */
+static inline bool nvme_task_done(struct nvme_task *task)
+{
+	return task->state == NVME_TASK_DONE;
+}
+
+#endif /* LIBVFN_NVME_TASK_H */
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_TIMEOUT_H
+#define LIBVFN_NVME_TIMEOUT_H
+
+/**
+ * DOC: Request timeouts
+ *
+ * When timeouts are enabled on a submission queue, every command posted with
+ * nvme_rq_post() (or nvme_rq_exec()) is given a deadline and added to a timer
+ * wheel owned by the queue. The deadline is removed again when the completion
+ * is reaped by nvme_rq_wait(), a poll group or the admin command engine.
+ *
+ * The wheel is advanced by the reaper: nvme_rq_wait(), nvme_poll_group_poll(),
+ * nvme_admin_wait() and nvme_admin_poll() check the timeouts of the submission
+ * queues they reap completions for, and custom reap loops may call
+ * nvme_sq_check_timeouts() (after calling nvme_rq_disarm() on each reaped
+ * request). For every request that has timed out, the timeout handler decides
+ * what happens next; it may abort the command with nvme_rq_abort() and keep
+ * waiting, or give up and escalate (e.g., by resetting the controller).
+ *
+ * Timeouts are tracked with millisecond granularity. The timer wheel of a
+ * submission queue is protected by a lock, so commands may be posted and
+ * reaped, and timeouts checked, from multiple threads. Only one thread checks
+ * the timeouts of a queue at a time, and timeout handlers are called without
+ * the lock held (so they may post commands, e.g. with nvme_rq_abort()).
+ */
+
+/**
+ * enum nvme_rq_timeout_action - Timeout handler return values
+ * @NVME_RQ_TIMEOUT_REARM: keep tracking the request; the handler is called
+ *                         again if the request has not completed within
+ *                         another timeout period
+ * @NVME_RQ_TIMEOUT_DONE: stop tracking the request
+ */
+enum nvme_rq_timeout_action {
+	NVME_RQ_TIMEOUT_REARM,
+	NVME_RQ_TIMEOUT_DONE,
+};
+
+/**
+ * typedef nvme_rq_timeout_fn - Request timeout handler
+ * @rq: Request tracker (&struct nvme_rq) of the command that timed out
+ * @count: number of times the command has timed out (starting at ``1``)
+ * @opaque: opaque data pointer given to nvme_sq_enable_timeouts()
+ *
+ * Return: A &enum nvme_rq_timeout_action.
+ */
+typedef int (*nvme_rq_timeout_fn)(struct nvme_rq *rq, int count, void *opaque);
+
+/**
+ * nvme_sq_enable_timeouts - Enable request timeouts on a submission queue
+ * @sq: Submission queue (&struct nvme_sq)
+ * @timeout_ms: timeout in milliseconds
+ * @fn: timeout handler
+ * @opaque: opaque data pointer passed to @fn
+ *
+ * Enable timeout tracking for commands posted to @sq from now on. If timeouts
+ * are already enabled, the timeout and handler are updated.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_sq_enable_timeouts(struct nvme_sq *sq, unsigned int timeout_ms,
+			    nvme_rq_timeout_fn fn, void *opaque);
+
+/**
+ * nvme_sq_disable_timeouts - Disable request timeouts on a submission queue
+ * @sq: Submission queue (&struct nvme_sq)
+ *
+ * Stop tracking all outstanding commands on @sq and release the timer wheel.
+ */
+void nvme_sq_disable_timeouts(struct nvme_sq *sq);
+
+/**
+ * nvme_sq_check_timeouts - Check for timed out requests
+ * @sq: Submission queue (&struct nvme_sq)
+ *
+ * Advance the timer wheel of @sq to the current time and call the timeout
+ * handler for each request that has timed out. Does nothing if timeouts are
+ * not enabled on @sq.
+ *
+ * Return: The number of requests that timed out.
+ */
+int nvme_sq_check_timeouts(struct nvme_sq *sq);
+
+#endif /* LIBVFN_NVME_TIMEOUT_H */
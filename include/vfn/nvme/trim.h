@@ -0,0 +1,171 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_TRIM_H
+#define LIBVFN_NVME_TRIM_H
+
+/**
+ * DOC: Batched deallocation
+ *
+ * A trim engine (&struct nvme_trim) collects a stream of deallocations for a
+ * namespace and issues them in batches. Before a batch is issued, the pending
+ * ranges are sorted and adjacent or overlapping ranges are merged, and up to
+ * 256 ranges are packed into each Dataset Management command. The range lists
+ * are written to the PRP list pages of the request trackers (see &struct
+ * nvme_bio), so no memory is allocated per batch.
+ *
+ * To limit the impact on other I/O, at most &nvme_trim_opts.max_inflight
+ * batches are in flight at once. Batches are issued when enough ranges are
+ * pending and as earlier batches complete, or, with %NVME_TRIM_F_DEFER, only
+ * when the application asks for it with nvme_trim_kick() (e.g., when it is
+ * otherwise idle) or nvme_trim_flush().
+ *
+ * Batches are submitted on the queue of the calling thread (see
+ * nvme_ns_get_sq()) and completions are reaped like any other &struct nvme_bio
+ * (e.g., by a poll group or nvme_bio_wait()). Ranges may be added from any
+ * thread.
+ */
+
+/**
+ * enum nvme_trim_opts_flags - Trim engine flags
+ * @NVME_TRIM_F_DEFER: only issue batches from nvme_trim_kick() and
+ *                     nvme_trim_flush()
+ */
+enum nvme_trim_opts_flags {
+	NVME_TRIM_F_DEFER	= 1 << 0,
+};
+
+/**
+ * struct nvme_trim_opts - Trim engine options
+ * @capacity: maximum number of pending ranges
+ * @batch: number of pending ranges at which a batch is issued (at most 256)
+ * @max_inflight: maximum number of batches in flight
+ * @flags: See &enum nvme_trim_opts_flags
+ */
+struct nvme_trim_opts {
+	int capacity;
+	int batch;
+	int max_inflight;
+	unsigned int flags;
+};
+
+static const struct nvme_trim_opts nvme_trim_opts_default = {
+	.capacity = 4096,
+	.batch = 256,
+	.max_inflight = 1,
+	.flags = 0x0,
+};
+
+/**
+ * struct nvme_trim - Trim engine
+ * @ns: Namespace block device (see &struct nvme_ns)
+ */
+struct nvme_trim {
+	struct nvme_ns *ns;
+
+	/* private: */
+	struct nvme_trim_opts opts;
+
+	pthread_mutex_t lock;
+
+	/* pending ranges */
+	struct nvme_lba_range *pending;
+	int npending;
+
+	struct nvme_trim_batch {
+		struct nvme_trim *trim;
+		struct nvme_bio bio;
+		struct nvme_lba_range *ranges;
+		bool busy;
+	} *batches;
+
+	/* batches not in flight */
+	struct nvme_trim_batch **idle;
+	int nidle;
+
+	/* first error reported by a batch */
+	int err;
+};
+
+/**
+ * nvme_trim_init - Initialize a trim engine
+ * @trim: &struct nvme_trim to initialize
+ * @ns: Namespace block device (see nvme_ns_open())
+ * @opts: trim engine options (``NULL`` for &nvme_trim_opts_default)
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_trim_init(struct nvme_trim *trim, struct nvme_ns *ns, const struct nvme_trim_opts *opts);
+
+/**
+ * nvme_trim_fini - Tear down a trim engine
+ * @trim: &struct nvme_trim
+ *
+ * Pending ranges are discarded; use nvme_trim_flush() first to issue them. No
+ * batches may be in flight.
+ */
+void nvme_trim_fini(struct nvme_trim *trim);
+
+/**
+ * nvme_trim_add - Queue a deallocation
+ * @trim: &struct nvme_trim
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks
+ *
+ * Queue the deallocation of @nlb logical blocks starting at @slba. Unless
+ * %NVME_TRIM_F_DEFER is set, a batch is issued if &nvme_trim_opts.batch
+ * ranges are pending and fewer than &nvme_trim_opts.max_inflight batches are
+ * in flight.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``EAGAIN`` if
+ * the pending ranges cannot be merged to make room and no batch can be
+ * issued).
+ */
+int nvme_trim_add(struct nvme_trim *trim, uint64_t slba, uint64_t nlb);
+
+/**
+ * nvme_trim_kick - Issue pending deallocations
+ * @trim: &struct nvme_trim
+ *
+ * Issue batches of pending ranges, regardless of &nvme_trim_opts.batch, until
+ * no ranges are pending or &nvme_trim_opts.max_inflight batches are in
+ * flight.
+ *
+ * Return: The number of batches issued, or ``-1`` on error and sets ``errno``.
+ */
+int nvme_trim_kick(struct nvme_trim *trim);
+
+/**
+ * nvme_trim_flush - Issue all pending deallocations and wait for completion
+ * @trim: &struct nvme_trim
+ *
+ * Issue batches until no ranges are pending and wait for all batches to
+ * complete, reaping completions on the queues the batches were submitted on.
+ * This must not be called while another thread reaps those queues.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` to the first
+ * error reported by a batch since the last call.
+ */
+int nvme_trim_flush(struct nvme_trim *trim);
+
+/**
+ * nvme_trim_pending - Get the number of pending ranges
+ * @trim: &struct nvme_trim
+ *
+ * Return: The number of ranges that have not been issued.
+ */
+static inline int nvme_trim_pending(struct nvme_trim *trim)
+{
+	return __atomic_load_n(&trim->npending, __ATOMIC_ACQUIRE);
+}
+
+#endif /* LIBVFN_NVME_TRIM_H */
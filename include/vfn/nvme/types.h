@@ -75,6 +75,8 @@ enum nvme_cmd_create_q_flags {
 	NVME_SQ_QPRIO_URGENT	= 0 << 1,
 };
 
+#define NVME_SQ_QPRIO_MASK (3 << 1)
+
 struct nvme_cmd_create_cq {
 	uint8_t   opcode;
 	uint8_t   flags;
@@ -282,6 +284,13 @@ __static_assert(sizeof(struct nvme_cqe) == 16);
 
 typedef void (*cqe_handler)(struct nvme_cqe *cqe);
 
+struct nvme_crc16_pi_tuple {
+	beint16_t guard;
+	beint16_t apptag;
+	beint32_t reftag;
+};
+__static_assert(sizeof(struct nvme_crc16_pi_tuple) == 8);
+
 struct nvme_crc64_pi_tuple {
 	beint64_t guard;
 	beint16_t apptag;
@@ -27,10 +27,28 @@
  * @buffer: buffer to calculate CRC for
  * @len: length of buffer
  *
+ * The implementation (carry-less multiplication on x86_64 and arm64 if
+ * supported by the processor, slicing-by-8 otherwise) is selected when the
+ * library is loaded.
+ *
  * Return: the NVMe CRC64 calculated over buffer
  */
 uint64_t nvme_crc64(uint64_t crc, const unsigned char *buffer, size_t len);
 
+/**
+ * nvme_crc16 - Calculate T10-DIF CRC16
+ * @crc: starting value (``0`` for a new guard, or the result of a previous
+ *       call to continue the calculation)
+ * @buffer: buffer to calculate CRC for
+ * @len: length of buffer
+ *
+ * Calculate the CRC16 used as the guard of 16b Guard protection information.
+ * The implementation is selected as for nvme_crc64().
+ *
+ * Return: the T10-DIF CRC16 calculated over buffer
+ */
+uint16_t nvme_crc16(uint16_t crc, const unsigned char *buffer, size_t len);
+
 /**
  * nvme_cqe_ok - Check the status field of CQE
  * @cqe: Completion queue entry
@@ -57,19 +75,6 @@ static inline bool nvme_cqe_ok(struct nvme_cqe *cqe)
  */
 int nvme_set_errno_from_cqe(struct nvme_cqe *cqe);
 
-/**
- * nvme_aer - Submit an Asynchronous Event Request command
- * @ctrl: Controller reference
- * @opaque: Opaque data pointer
- *
- * Issue an Asynchronous Event Request command and associate @opaque with the
- * request tracker.
- *
- * Return: On success, returns ``0``. On error, returns ``-1`` and sets
- * ``errno``.
- */
-int nvme_aer(struct nvme_ctrl *ctrl, void *opaque);
-
 /**
  * nvme_sync - Submit a command and wait for completion
  * @ctrl: Controller reference
@@ -79,14 +84,13 @@ int nvme_aer(struct nvme_ctrl *ctrl, void *opaque);
  * @len: Command payload length
  * @cqe_copy: Completion queue entry to fill
  *
- * Submit a command and wait for completion in a synchronous manner. If a
- * spurious completion queue entry is posted (i.e., the command identifier is
- * different from the one set in @sqe), the CQE is ignored and an error message
- * is logged.
+ * Submit a command and wait for completion in a synchronous manner (see
+ * nvme_rq_spin()). Completions of other commands reaped while waiting are
+ * stashed for their waiters, so multiple threads may use nvme_sync() on the
+ * same queue pair concurrently.
  *
- * **Note**: This function should only be used for synchronous commands where no
- * spurious CQEs are expected to be posted on the completion queue. Any spurious
- * CQEs will be logged and dropped.
+ * **Note**: Completion queue entries with a command identifier that does not
+ * correspond to a request tracker of the queue are logged and dropped.
  *
  * Return: On success, returns ``0``. On error, returns ``-1`` and sets
  * ``errno``.
@@ -94,22 +98,6 @@ int nvme_aer(struct nvme_ctrl *ctrl, void *opaque);
 int nvme_sync(struct nvme_ctrl *ctrl, struct nvme_sq *sq, union nvme_cmd *sqe, void *buf,
 	      size_t len, struct nvme_cqe *cqe_copy);
 
-/**
- * nvme_admin - Submit an Admin command and wait for completion
- * @ctrl: See &struct nvme_ctrl
- * @sqe: Submission queue entry
- * @buf: Command payload
- * @len: Command payload length
- * @cqe_copy: Completion queue entry to fill
- *
- * Shortcut for nvme_sync(), submitting to the admin submission queue.
- *
- * Return: On success, returns ``0``. On error, returnes ``-1`` and sets
- * ``errno``.
- */
-int nvme_admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
-	       struct nvme_cqe *cqe_copy);
-
 /**
  * nvme_map_prp - Set up the Physical Region Pages in the data pointer of the
  *                command from a buffer that is contiguous in iova mapped
@@ -127,6 +115,13 @@ int nvme_admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t le
 int nvme_map_prp(struct nvme_ctrl *ctrl, leint64_t *prplist, union nvme_cmd *cmd,
 		 uint64_t iova, size_t len);
 
+/*
+ * Like nvme_map_prp(), but with the iova of the PRP list page already known
+ * (e.g., that of a request tracker page) and the memory page size given.
+ */
+int __nvme_map_prp(union nvme_dptr *dptr, leint64_t *prplist, uint64_t prplist_iova,
+		   uint64_t iova, size_t len, int pageshift);
+
 /**
  * nvme_mapv_prp - Set up the Physical Region Pages in the data pointer of
  *                 the command from an iovec.
@@ -0,0 +1,279 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_ZNS_H
+#define LIBVFN_NVME_ZNS_H
+
+/**
+ * DOC: Zoned namespaces
+ *
+ * A &struct nvme_zns keeps a table of the zones of a Zoned Namespace (see
+ * &struct nvme_zone), populated from Zone Management Receive (Report Zones)
+ * when it is opened. The table may be refreshed for any range of zones with
+ * nvme_zns_refresh(); zones changed with nvme_zns_zone_action() are refreshed
+ * automatically.
+ *
+ * Data is written to a zone with Zone Append, where the controller picks the
+ * location and returns it in the completion queue entry. Zone Append requests
+ * must fit in a single command; they are submitted and reaped like any other
+ * &struct nvme_bio (on the queue of the calling thread, see nvme_ns_get_sq()).
+ *
+ * Any number of threads may append to the same zone. Each request reserves its
+ * logical blocks against the zone capacity when submitted, so a request that
+ * would not fit in the zone fails up front with ``ENOSPC`` instead of in the
+ * controller, and the cached write pointer is advanced as requests complete.
+ */
+
+/**
+ * enum nvme_zone_state - Zone states
+ * @NVME_ZONE_STATE_EMPTY: empty
+ * @NVME_ZONE_STATE_IMPLICITLY_OPEN: implicitly opened
+ * @NVME_ZONE_STATE_EXPLICITLY_OPEN: explicitly opened
+ * @NVME_ZONE_STATE_CLOSED: closed
+ * @NVME_ZONE_STATE_READ_ONLY: read only
+ * @NVME_ZONE_STATE_FULL: full
+ * @NVME_ZONE_STATE_OFFLINE: offline
+ */
+enum nvme_zone_state {
+	NVME_ZONE_STATE_EMPTY			= 0x1,
+	NVME_ZONE_STATE_IMPLICITLY_OPEN		= 0x2,
+	NVME_ZONE_STATE_EXPLICITLY_OPEN		= 0x3,
+	NVME_ZONE_STATE_CLOSED			= 0x4,
+	NVME_ZONE_STATE_READ_ONLY		= 0xd,
+	NVME_ZONE_STATE_FULL			= 0xe,
+	NVME_ZONE_STATE_OFFLINE			= 0xf,
+};
+
+/**
+ * enum nvme_zone_action - Zone Management Send actions
+ * @NVME_ZONE_ACTION_CLOSE: close zone
+ * @NVME_ZONE_ACTION_FINISH: finish zone
+ * @NVME_ZONE_ACTION_OPEN: open zone
+ * @NVME_ZONE_ACTION_RESET: reset zone
+ * @NVME_ZONE_ACTION_OFFLINE: offline zone
+ */
+enum nvme_zone_action {
+	NVME_ZONE_ACTION_CLOSE			= 0x1,
+	NVME_ZONE_ACTION_FINISH			= 0x2,
+	NVME_ZONE_ACTION_OPEN			= 0x3,
+	NVME_ZONE_ACTION_RESET			= 0x4,
+	NVME_ZONE_ACTION_OFFLINE		= 0x5,
+};
+
+/**
+ * enum nvme_zone_report_filter - Zone Receive Action Specific Field values
+ * @NVME_ZONE_REPORT_ALL: all zones
+ * @NVME_ZONE_REPORT_EMPTY: empty zones
+ * @NVME_ZONE_REPORT_IMPLICITLY_OPEN: implicitly opened zones
+ * @NVME_ZONE_REPORT_EXPLICITLY_OPEN: explicitly opened zones
+ * @NVME_ZONE_REPORT_CLOSED: closed zones
+ * @NVME_ZONE_REPORT_FULL: full zones
+ * @NVME_ZONE_REPORT_READ_ONLY: read only zones
+ * @NVME_ZONE_REPORT_OFFLINE: offline zones
+ */
+enum nvme_zone_report_filter {
+	NVME_ZONE_REPORT_ALL			= 0x0,
+	NVME_ZONE_REPORT_EMPTY			= 0x1,
+	NVME_ZONE_REPORT_IMPLICITLY_OPEN	= 0x2,
+	NVME_ZONE_REPORT_EXPLICITLY_OPEN	= 0x3,
+	NVME_ZONE_REPORT_CLOSED			= 0x4,
+	NVME_ZONE_REPORT_FULL			= 0x5,
+	NVME_ZONE_REPORT_READ_ONLY		= 0x6,
+	NVME_ZONE_REPORT_OFFLINE		= 0x7,
+};
+
+/**
+ * struct nvme_zone - Cached zone descriptor
+ * @zslba: zone start logical block address
+ * @zcap: zone capacity in logical blocks
+ * @wp: write pointer; advanced as Zone Append requests complete
+ * @zt: zone type
+ * @zs: zone state (see &enum nvme_zone_state)
+ * @za: zone attributes
+ */
+struct nvme_zone {
+	uint64_t zslba;
+	uint64_t zcap;
+	uint64_t wp;
+
+	uint8_t zt, zs, za;
+
+	/* private: */
+
+	/* logical blocks written or reserved by inflight zone append requests */
+	uint64_t reserved;
+};
+
+/**
+ * struct nvme_zns - Zoned namespace
+ * @ns: Namespace block device (see &struct nvme_ns)
+ * @zsze: zone size in logical blocks
+ * @nr_zones: number of zones
+ * @max_append: maximum number of logical blocks in a Zone Append command
+ * @zones: zone table (see &struct nvme_zone)
+ */
+struct nvme_zns {
+	struct nvme_ns *ns;
+
+	uint64_t zsze;
+	uint32_t nr_zones;
+	uint32_t max_append;
+
+	struct nvme_zone *zones;
+
+	/* private: */
+
+	/* serializes use of the report buffer */
+	pthread_mutex_t lock;
+	struct iommu_dmabuf report;
+};
+
+/**
+ * nvme_zns_mgmt_send - Submit a Zone Management Send command
+ * @ns: See &struct nvme_ns
+ * @slba: Starting logical block address of the zone
+ * @zsa: Zone send action (see &enum nvme_zone_action)
+ * @all: Select all zones (@slba is ignored)
+ *
+ * Submit a Zone Management Send command and wait for completion. The zone
+ * table of a &struct nvme_zns is not updated (see nvme_zns_zone_action()).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_zns_mgmt_send(struct nvme_ns *ns, uint64_t slba, uint8_t zsa, bool all);
+
+/**
+ * nvme_zns_mgmt_recv - Submit a Zone Management Receive (Report Zones) command
+ * @ns: See &struct nvme_ns
+ * @slba: Logical block address of the first zone to report
+ * @zrasf: Report filter (see &enum nvme_zone_report_filter)
+ * @partial: Report the number of zones returned rather than matched
+ * @buf: Report buffer
+ * @len: Length of @buf (a multiple of 4 bytes)
+ *
+ * Submit a Zone Management Receive command with the Report Zones action and
+ * wait for completion.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_zns_mgmt_recv(struct nvme_ns *ns, uint64_t slba, uint8_t zrasf, bool partial,
+		       void *buf, size_t len);
+
+/**
+ * nvme_zns_open - Open a zoned namespace
+ * @zns: &struct nvme_zns to initialize
+ * @ns: Namespace block device (see nvme_ns_open())
+ *
+ * Identify the zoned namespace of @ns and populate the zone table.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``ENOTSUP`` if
+ * the namespace does not use the Zoned Namespace command set).
+ */
+int nvme_zns_open(struct nvme_zns *zns, struct nvme_ns *ns);
+
+/**
+ * nvme_zns_close - Close a zoned namespace
+ * @zns: &struct nvme_zns
+ *
+ * Release the resources held by @zns. No requests may be in flight.
+ */
+void nvme_zns_close(struct nvme_zns *zns);
+
+/**
+ * nvme_zns_refresh - Refresh a range of the zone table
+ * @zns: &struct nvme_zns
+ * @zone: Index of the first zone
+ * @n: Number of zones
+ *
+ * Refresh the cached descriptors of @n zones starting at @zone from Report
+ * Zones. Only the requested zones are reported. Write pointers reported by the
+ * controller never move the cached write pointer of a zone backwards.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_zns_refresh(struct nvme_zns *zns, uint32_t zone, uint32_t n);
+
+/**
+ * nvme_zns_zone_action - Open, close, finish, reset or offline a zone
+ * @zns: &struct nvme_zns
+ * @zone: Zone index
+ * @zsa: Zone send action (see &enum nvme_zone_action)
+ *
+ * Submit a Zone Management Send command for @zone and refresh its cached
+ * descriptor. No Zone Append requests may be in flight to a zone that is reset
+ * or taken offline.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_zns_zone_action(struct nvme_zns *zns, uint32_t zone, uint8_t zsa);
+
+/**
+ * nvme_zns_zone_avail - Get the unreserved capacity of a zone
+ * @zone: See &struct nvme_zone
+ *
+ * Return: The number of logical blocks that may still be appended to @zone.
+ */
+static inline uint64_t nvme_zns_zone_avail(struct nvme_zone *zone)
+{
+	return zone->zcap - __atomic_load_n(&zone->reserved, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * nvme_zns_append - Append to a zone
+ * @zns: &struct nvme_zns
+ * @zone: Zone index
+ * @iov: Array of iovecs describing the data buffer
+ * @niov: Number of iovecs in @iov
+ * @alba: Output parameter for the logical block address of the data (or
+ *        ``NULL``)
+ *
+ * Append the buffer described by @iov to @zone and wait for completion. The
+ * data must fit in a single command (at most &nvme_zns.max_append logical
+ * blocks).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno`` (``ENOSPC`` if
+ * the data does not fit in the remaining capacity of the zone).
+ */
+int nvme_zns_append(struct nvme_zns *zns, uint32_t zone, struct iovec *iov, int niov,
+		    uint64_t *alba);
+
+/**
+ * nvme_zns_append_async - Submit an append to a zone
+ * @zns: &struct nvme_zns
+ * @bio: &struct nvme_bio to initialize and submit
+ * @zone: Zone index
+ * @iov: Array of iovecs describing the data buffer
+ * @niov: Number of iovecs in @iov
+ * @cb: Completion callback (see &nvme_bio.cb)
+ * @opaque: Opaque data pointer (see &nvme_bio.opaque)
+ *
+ * Asynchronous version of nvme_zns_append(); see nvme_bio_submit(). On
+ * successful completion, the location of the data is returned by
+ * nvme_zns_append_lba().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int nvme_zns_append_async(struct nvme_zns *zns, struct nvme_bio *bio, uint32_t zone,
+			  struct iovec *iov, int niov, nvme_bio_cb cb, void *opaque);
+
+/**
+ * nvme_zns_append_lba - Get the location of appended data
+ * @bio: Completed Zone Append request (see nvme_zns_append_async())
+ *
+ * Return: The logical block address assigned by the controller.
+ */
+static inline uint64_t nvme_zns_append_lba(struct nvme_bio *bio)
+{
+	return le64_to_cpu(bio->cqe.qw0);
+}
+
+#endif /* LIBVFN_NVME_ZNS_H */
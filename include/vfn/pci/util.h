@@ -75,6 +75,17 @@ int pci_driver_remove_id(const char *driver, uint16_t vid, uint16_t did);
  */
 int pci_device_info_get_ull(const char *bdf, const char *prop, unsigned long long *v);
 
+/**
+ * pci_device_get_numa_node - Get the NUMA node of a device
+ * @bdf: pci device identifier ("bus:device:function")
+ *
+ * Read the NUMA node that the device is attached to from sysfs.
+ *
+ * Return: On success, returns the NUMA node. If the device has no NUMA
+ * affinity, returns ``-1``. On error, returns ``-1`` and sets ``errno``.
+ */
+int pci_device_get_numa_node(const char *bdf);
+
 /**
  * pci_get_driver - Get the name of the driver that the device is currently
  *                  bound to
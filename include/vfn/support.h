@@ -45,6 +45,7 @@ extern "C" {
 #include <vfn/support/rwlock.h>
 #include <vfn/support/timer.h>
 #include <vfn/support/ticks.h>
+#include <vfn/support/timerwheel.h>
 
 #ifdef __cplusplus
 }
@@ -92,6 +92,28 @@
 #define atomic_dec(ptr) \
 	((void) __atomic_fetch_sub(ptr, 1, __ATOMIC_SEQ_CST))
 
+/**
+ * atomic_or - Syntactic suger for __atomic_fetch_or
+ * @ptr: Pointer to value
+ * @val: Value
+ *
+ * Atomically bitwise-or @val into the value at @ptr with sequential consistency
+ * semantics.
+ */
+#define atomic_or(ptr, val) \
+	((void) __atomic_fetch_or(ptr, val, __ATOMIC_SEQ_CST))
+
+/**
+ * atomic_and - Syntactic suger for __atomic_fetch_and
+ * @ptr: Pointer to value
+ * @val: Value
+ *
+ * Atomically bitwise-and @val into the value at @ptr with sequential
+ * consistency semantics.
+ */
+#define atomic_and(ptr, val) \
+	((void) __atomic_fetch_and(ptr, val, __ATOMIC_SEQ_CST))
+
 /**
  * atomic_cmpxchg - Syntactic suger for __atomic_compare_exchange_n
  * @ptr: Pointer to value to compare
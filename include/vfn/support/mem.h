@@ -118,6 +118,50 @@ static inline void *reallocn(void *mem, unsigned int n, size_t sz)
 ssize_t pgmap(void **mem, size_t sz);
 ssize_t pgmapn(void **mem, unsigned int n, size_t sz);
 
+/**
+ * pgmap_node - Allocate page aligned memory on a NUMA node
+ * @mem: output parameter for the allocated memory
+ * @sz: number of bytes to allocate (rounded up to the page size)
+ * @node: preferred NUMA node (negative for no preference)
+ *
+ * Like pgmap(), but prefer allocating the backing pages on @node. Binding the
+ * memory is best effort; if it fails, the default allocation policy is used.
+ *
+ * Return: the number of bytes allocated, or ``-1`` on error and sets ``errno``.
+ */
+ssize_t pgmap_node(void **mem, size_t sz, int node);
+
+/**
+ * pgmap_shared - Allocate page aligned, shareable memory
+ * @mem: output parameter for the allocated memory
+ * @sz: number of bytes to allocate (rounded up to the page size)
+ * @node: preferred NUMA node (negative for no preference)
+ * @fd: output parameter for the memory file descriptor
+ *
+ * Like pgmap_node(), but back the memory by an anonymous memory file
+ * (memfd_create(2)), such that it may be mapped by another process (e.g.,
+ * after passing @fd over a Unix domain socket). The caller owns @fd.
+ *
+ * Return: the number of bytes allocated, or ``-1`` on error and sets ``errno``.
+ */
+ssize_t pgmap_shared(void **mem, size_t sz, int node, int *fd);
+
+/* size of the huge pages allocated by pgmap_hugepage() */
+#define __VFN_HUGEPAGESIZE (2UL << 20)
+
+/**
+ * pgmap_hugepage - Allocate memory backed by huge pages
+ * @mem: output parameter for the allocated memory
+ * @sz: number of bytes to allocate (rounded up to the huge page size)
+ * @node: preferred NUMA node (negative for no preference)
+ *
+ * Like pgmap_node(), but back the memory by 2 MiB pages from the hugetlb pool.
+ * Fails if not enough huge pages are available.
+ *
+ * Return: the number of bytes allocated, or ``-1`` on error and sets ``errno``.
+ */
+ssize_t pgmap_hugepage(void **mem, size_t sz, int node);
+
 static inline void pgunmap(void *mem, size_t len)
 {
 	if (munmap(mem, len))
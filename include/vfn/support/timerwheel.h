@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_SUPPORT_TIMERWHEEL_H
+#define LIBVFN_SUPPORT_TIMERWHEEL_H
+
+/**
+ * DOC: Hierarchical timer wheel
+ *
+ * A timer wheel keeps timers in buckets by expiration time, so adding and
+ * removing a timer is O(1) and advancing the wheel only touches the timers
+ * that expire (and, rarely, cascades a bucket of far-out timers to a lower
+ * level). Time is measured in abstract units (e.g., milliseconds); timers
+ * expire when the wheel is advanced past their expiration time.
+ *
+ * The wheel has %TIMER_WHEEL_LEVELS levels of %TIMER_WHEEL_SIZE slots each.
+ * Timers further out than the wheel can represent are clamped to the largest
+ * representable expiration time.
+ */
+
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS	4
+
+/**
+ * struct timer_wheel_entry - Timer (to be embedded in another structure)
+ * @expires: expiration time
+ */
+struct timer_wheel_entry {
+	/* private: */
+	struct timer_wheel_entry *next, **pprev;
+
+	/* public: */
+	uint64_t expires;
+};
+
+/**
+ * struct timer_wheel - Hierarchical timer wheel
+ */
+struct timer_wheel {
+	/* private: */
+
+	/* next unit of time to be processed */
+	uint64_t next;
+
+	struct timer_wheel_entry *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+};
+
+/**
+ * timer_wheel_init - Initialize a timer wheel
+ * @tw: &struct timer_wheel
+ * @now: current time
+ */
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now);
+
+/**
+ * timer_wheel_add - Add a timer
+ * @tw: &struct timer_wheel
+ * @t: &struct timer_wheel_entry (must not be pending)
+ * @expires: expiration time
+ *
+ * Timers that have already expired fire on the next call to
+ * timer_wheel_advance().
+ */
+void timer_wheel_add(struct timer_wheel *tw, struct timer_wheel_entry *t, uint64_t expires);
+
+/**
+ * timer_wheel_pending - Check if a timer is pending
+ * @t: &struct timer_wheel_entry
+ *
+ * Return: ``true`` if @t is in a timer wheel, ``false`` otherwise.
+ */
+static inline bool timer_wheel_pending(struct timer_wheel_entry *t)
+{
+	return t->pprev != NULL;
+}
+
+/**
+ * timer_wheel_del - Remove a timer
+ * @t: &struct timer_wheel_entry
+ *
+ * Remove @t from the timer wheel it was added to (if any).
+ */
+static inline void timer_wheel_del(struct timer_wheel_entry *t)
+{
+	if (!t->pprev)
+		return;
+
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/**
+ * timer_wheel_advance - Advance the timer wheel
+ * @tw: &struct timer_wheel
+ * @now: current time
+ * @fn: called for each expired timer (which is no longer pending)
+ * @opaque: opaque data pointer passed to @fn
+ *
+ * Expire all timers with an expiration time before or at @now. @fn may add
+ * timers (including the expired one) back to the wheel; a timer added with an
+ * expiration time that has already passed fires when the wheel reaches the
+ * next unit of time.
+ *
+ * Return: The number of expired timers.
+ */
+int timer_wheel_advance(struct timer_wheel *tw, uint64_t now,
+			void (*fn)(struct timer_wheel_entry *t, void *opaque), void *opaque);
+
+#endif /* LIBVFN_SUPPORT_TIMERWHEEL_H */
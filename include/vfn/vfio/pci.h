@@ -52,6 +52,22 @@ struct vfio_pci_device {
  */
 int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf);
 
+/**
+ * vfio_pci_adopt - initialize pci device from an open device file descriptor
+ * @pci: &struct vfio_pci_device to initialize
+ * @bdf: pci device identifier ("bus:device:function")
+ * @fd: vfio device file descriptor (e.g., received from another process)
+ *
+ * Like vfio_pci_open(), but use the already opened device @fd instead of
+ * getting one from the iommu context. The iommu context (``pci->dev.ctx``) must
+ * be set and already attached to the device (see iommu_import_context()). The
+ * device is not reset. On success, @pci takes ownership of @fd.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int vfio_pci_adopt(struct vfio_pci_device *pci, const char *bdf, int fd);
+
 /**
  * vfio_pci_close - close vfio device file descriptor
  * @pci: &struct vfio_pci_device whose fd is to close
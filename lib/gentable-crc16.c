@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "ccan/compiler/compiler.h"
+
+/* T10-DIF (x^16 + x^15 + x^11 + x^9 + x^8 + x^7 + x^5 + x^4 + x^2 + x + 1) */
+#define CRC16_T10DIF_POLY 0x8BB7
+
+/* tables for slicing-by-8; the first is the byte-wise table */
+static uint16_t crc16_t10dif_table[8][256] = { 0 };
+
+/* constants for folding 128 bit blocks with carry-less multiplication */
+static uint64_t crc16_t10dif_fold[16][2] = { 0 };
+
+/* x^n mod P */
+static uint64_t xnmod(int n)
+{
+	uint16_t r = 1;
+
+	for (int i = 0; i < n; i++)
+		r = (r & 0x8000) ? (uint16_t)(r << 1) ^ CRC16_T10DIF_POLY : (uint16_t)(r << 1);
+
+	return r;
+}
+
+static void generate(void)
+{
+	uint16_t crc;
+
+	for (int i = 0; i < 256; i++) {
+		crc = (uint16_t)(i << 8);
+
+		for (int j = 0; j < 8; j++) {
+			if (crc & 0x8000)
+				crc = (uint16_t)(crc << 1) ^ CRC16_T10DIF_POLY;
+			else
+				crc = (uint16_t)(crc << 1);
+		}
+
+		crc16_t10dif_table[0][i] = crc;
+	}
+
+	for (int k = 1; k < 8; k++) {
+		for (int i = 0; i < 256; i++) {
+			crc = crc16_t10dif_table[k - 1][i];
+			crc16_t10dif_table[k][i] = (uint16_t)(crc << 8) ^
+				crc16_t10dif_table[0][crc >> 8];
+		}
+	}
+
+	/*
+	 * Folding a block over d bits multiplies the low half by x^d and the
+	 * high half by x^(d+64).
+	 */
+	for (int i = 0; i < 16; i++) {
+		int d = 128 * (i + 1);
+
+		crc16_t10dif_fold[i][0] = xnmod(d);
+		crc16_t10dif_fold[i][1] = xnmod(d + 64);
+	}
+}
+
+static void print(void)
+{
+	printf("/* GENERATED FILE; DO NOT EDIT! */\n");
+	printf("\n");
+	printf("static const uint16_t crc16_t10dif_table[8][256] = {\n");
+
+	for (int k = 0; k < 8; k++) {
+		printf("\t{\n");
+
+		for (int i = 0; i < 256; i++) {
+			if (i % 8 == 0)
+				printf("\t\t");
+
+			printf("0x%04" PRIx16, crc16_t10dif_table[k][i]);
+
+			if (i % 8 == 7)
+				printf(",\n");
+			else
+				printf(", ");
+		}
+
+		printf("\t},\n");
+	}
+
+	printf("};\n");
+	printf("\n");
+	printf("static const uint64_t crc16_t10dif_fold[16][2] = {\n");
+
+	for (int i = 0; i < 16; i++)
+		printf("\t{ 0x%04" PRIx64 ", 0x%04" PRIx64 " },\n",
+		       crc16_t10dif_fold[i][0], crc16_t10dif_fold[i][1]);
+
+	printf("};\n");
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	generate();
+	print();
+
+	return 0;
+}
@@ -30,7 +30,33 @@ static UNNEEDED int COEFFS[] = {
 
 #define CRC64_NVME_POLY 0x9A6C9329AC4BC9B5ULL
 
-static uint64_t crc64_nvme_table[256] = { 0 };
+/* tables for slicing-by-8; the first is the byte-wise table */
+static uint64_t crc64_nvme_table[8][256] = { 0 };
+
+/* constants for folding 128 bit blocks with carry-less multiplication */
+static uint64_t crc64_nvme_fold[16][2] = { 0 };
+
+static uint64_t reflect(uint64_t v)
+{
+	uint64_t r = 0;
+
+	for (int i = 0; i < 64; i++)
+		if (v & (1ULL << i))
+			r |= 1ULL << (63 - i);
+
+	return r;
+}
+
+/* x^n mod P (not reflected) */
+static uint64_t xnmod(int n)
+{
+	uint64_t poly = reflect(CRC64_NVME_POLY), r = 1;
+
+	for (int i = 0; i < n; i++)
+		r = (r & (1ULL << 63)) ? (r << 1) ^ poly : r << 1;
+
+	return r;
+}
 
 static void generate(void)
 {
@@ -48,7 +74,26 @@ static void generate(void)
 				crc = crc >> 1;
 		}
 
-		crc64_nvme_table[i] = crc;
+		crc64_nvme_table[0][i] = crc;
+	}
+
+	for (int k = 1; k < 8; k++) {
+		for (int i = 0; i < 256; i++) {
+			crc = crc64_nvme_table[k - 1][i];
+			crc64_nvme_table[k][i] = (crc >> 8) ^ crc64_nvme_table[0][crc & 0xff];
+		}
+	}
+
+	/*
+	 * Folding a block over d bits multiplies the low (higher degree) half
+	 * by x^(d+64) and the high half by x^d. The reflected carry-less
+	 * product carries an extra factor of x, so the exponents are one less.
+	 */
+	for (int i = 0; i < 16; i++) {
+		int d = 128 * (i + 1);
+
+		crc64_nvme_fold[i][0] = reflect(xnmod(d + 63));
+		crc64_nvme_fold[i][1] = reflect(xnmod(d - 1));
 	}
 }
 
@@ -56,20 +101,34 @@ static void print(void)
 {
 	printf("/* GENERATED FILE; DO NOT EDIT! */\n");
 	printf("\n");
-	printf("static const uint64_t crc64_nvme_table[256] = {\n");
+	printf("static const uint64_t crc64_nvme_table[8][256] = {\n");
 
-	for (int i = 0; i < 256; i++) {
-		if (i % 2 == 0)
-			printf("\t");
+	for (int k = 0; k < 8; k++) {
+		printf("\t{\n");
+
+		for (int i = 0; i < 256; i++) {
+			if (i % 2 == 0)
+				printf("\t\t");
 
-		printf("0x%016" PRIx64 "ULL", crc64_nvme_table[i]);
+			printf("0x%016" PRIx64 "ULL", crc64_nvme_table[k][i]);
 
-		if (i % 2 == 1)
-			printf(",\n");
-		else
-			printf(", ");
+			if (i % 2 == 1)
+				printf(",\n");
+			else
+				printf(", ");
+		}
+
+		printf("\t},\n");
 	}
 
+	printf("};\n");
+	printf("\n");
+	printf("static const uint64_t crc64_nvme_fold[16][2] = {\n");
+
+	for (int i = 0; i < 16; i++)
+		printf("\t{ 0x%016" PRIx64 "ULL, 0x%016" PRIx64 "ULL },\n",
+		       crc64_nvme_fold[i][0], crc64_nvme_fold[i][1]);
+
 	printf("};\n");
 }
 
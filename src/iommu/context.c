@@ -12,8 +12,10 @@
 
 #define log_fmt(fmt) "iommu/context: " fmt
 
+#include <errno.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <pthread.h>
 
 #include <sys/stat.h>
@@ -69,6 +71,42 @@ fallback:
 	return vfio_get_iommu_context(name);
 }
 
+int iommu_export_context(struct iommu_ctx *ctx, const char *bdf, struct iommu_ctx_state *state,
+			 int *fds)
+{
+	if (!ctx->ops.export_state) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	memset(state, 0x0, sizeof(*state));
+
+	return ctx->ops.export_state(ctx, bdf, state, fds);
+}
+
+struct iommu_ctx *iommu_import_context(const struct iommu_ctx_state *state, const char *bdf,
+				       int *fds)
+{
+	switch (state->backend) {
+	case IOMMU_CTX_BACKEND_VFIO:
+		return vfio_import_iommu_context(state, bdf, fds);
+
+#ifdef HAVE_VFIO_DEVICE_BIND_IOMMUFD
+	case IOMMU_CTX_BACKEND_IOMMUFD:
+		return iommufd_import_iommu_context(state, fds);
+#endif
+	}
+
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+void iommu_release_context(struct iommu_ctx *ctx)
+{
+	if (ctx->ops.release)
+		ctx->ops.release(ctx);
+}
+
 void iommu_ctx_init(struct iommu_ctx *ctx)
 {
 	ctx->nranges = 1;
@@ -84,3 +122,13 @@ void iommu_ctx_init(struct iommu_ctx *ctx)
 	skiplist_init(&ctx->map.list);
 	pthread_rwlock_init(&ctx->map.lock, NULL);
 }
+
+void iommu_ctx_fini(struct iommu_ctx *ctx)
+{
+	iova_map_fini(&ctx->map);
+	pthread_rwlock_destroy(&ctx->map.lock);
+
+	free(ctx->iova_ranges);
+	ctx->iova_ranges = NULL;
+	ctx->nranges = 0;
+}
@@ -23,10 +23,19 @@ struct iommu_ctx_ops {
 		       unsigned long flags);
 	int (*dma_unmap)(struct iommu_ctx *ctx, uint64_t iova, size_t len);
 	int (*dma_unmap_all)(struct iommu_ctx *ctx);
+	int (*dma_copy)(struct iommu_ctx *ctx, struct iommu_ctx *src, uint64_t src_iova,
+			size_t len, uint64_t *iova, unsigned long flags);
 
 	/* device ops */
 	int (*get_device_fd)(struct iommu_ctx *ctx, const char *bdf);
 	int (*put_device_fd)(struct iommu_ctx *ctx, const char *bdf);
+
+	/* handover (see iommu_export_context()) */
+	int (*export_state)(struct iommu_ctx *ctx, const char *bdf,
+			    struct iommu_ctx_state *state, int *fds);
+
+	/* tear down an imported context (see iommu_release_context()) */
+	void (*release)(struct iommu_ctx *ctx);
 };
 
 struct iova_mapping {
@@ -36,12 +45,36 @@ struct iova_mapping {
 
 	unsigned long flags;
 
+	/* identifies the mapping within its map; never reused */
+	uint64_t id;
+
+	/*
+	 * context and mapping (by id) that this mapping is shared from (see
+	 * iommu_share_mapping)
+	 */
+	struct iommu_ctx *src;
+	uint64_t src_id;
+
+	/* number of contexts this mapping is shared to */
+	unsigned int nshares;
+
 	struct skiplist_node list;
+
+	/* free list linkage */
+	struct iova_mapping *next;
 };
 
+struct iova_map_chunk;
+
 struct iova_map {
 	pthread_rwlock_t lock;
 	struct skiplist list;
+
+	/* recycled mappings; allocated in chunks, freed by iova_map_fini() */
+	struct iova_mapping *free;
+	struct iova_map_chunk *chunks;
+
+	uint64_t next_id;
 };
 
 struct iommu_ctx {
@@ -56,11 +89,16 @@ struct iommu_ctx *iommu_get_default_context(void);
 
 struct iommu_ctx *vfio_get_default_iommu_context(void);
 struct iommu_ctx *vfio_get_iommu_context(const char *name);
+struct iommu_ctx *vfio_import_iommu_context(const struct iommu_ctx_state *state,
+					    const char *bdf, int *fds);
 
 #ifdef HAVE_VFIO_DEVICE_BIND_IOMMUFD
 struct iommu_ctx *iommufd_get_default_iommu_context(void);
 struct iommu_ctx *iommufd_get_iommu_context(const char *name);
+struct iommu_ctx *iommufd_import_iommu_context(const struct iommu_ctx_state *state, int *fds);
 #endif
 
 void iommu_ctx_init(struct iommu_ctx *ctx);
+void iommu_ctx_fini(struct iommu_ctx *ctx);
+void iova_map_fini(struct iova_map *map);
 int iommu_iova_range_to_string(struct iommu_iova_range *range, char **str);
@@ -16,6 +16,7 @@
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <pthread.h>
 
 #include "ccan/compiler/compiler.h"
@@ -38,8 +39,91 @@ static int iova_cmp(const void *vaddr, const struct skiplist_node *n)
 	return 0;
 }
 
+#define IOVA_MAP_CHUNK 64
+
+struct iova_map_chunk {
+	struct iova_map_chunk *next;
+	struct iova_mapping mappings[IOVA_MAP_CHUNK];
+};
+
+/* must be called with the map write lock held */
+static struct iova_mapping *__iova_map_get(struct iova_map *map)
+{
+	struct iova_mapping *m;
+
+	if (!map->free) {
+		struct iova_map_chunk *chunk = znew_t(struct iova_map_chunk, 1);
+
+		m = chunk->mappings;
+
+		for (int i = 0; i < IOVA_MAP_CHUNK - 1; i++)
+			m[i].next = &m[i + 1];
+
+		chunk->next = map->chunks;
+		map->chunks = chunk;
+
+		map->free = m;
+	}
+
+	m = map->free;
+	map->free = m->next;
+
+	memset(m, 0x0, sizeof(*m));
+
+	return m;
+}
+
+/* must be called with the map write lock held */
+static void __iova_map_put(struct iova_map *map, struct iova_mapping *m)
+{
+	m->next = map->free;
+	map->free = m;
+}
+
+/* forget all mappings and free the mapping chunks; the map is not used again */
+void iova_map_fini(struct iova_map *map)
+{
+	struct iova_map_chunk *chunk, *next;
+
+	for (chunk = map->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	map->chunks = NULL;
+	map->free = NULL;
+
+	skiplist_init(&map->list);
+}
+
+/*
+ * Check if any mapping intersects [vaddr; vaddr + len). If @update is given, it
+ * receives the search path for vaddr. Must be called with the map lock held.
+ */
+static bool __iova_map_overlaps(struct iova_map *map, void *vaddr, size_t len,
+				struct skiplist_node **update)
+{
+	struct skiplist_node *path[SKIPLIST_LEVELS] = {}, *next;
+	struct iova_mapping *m;
+
+	if (!update)
+		update = path;
+
+	if (skiplist_find(&map->list, vaddr, iova_cmp, update))
+		return true;
+
+	/* the mapping following vaddr must start beyond the range */
+	next = skiplist_next(&map->list, update[0], 0);
+	if (!next)
+		return false;
+
+	m = container_of_var(next, m, list);
+
+	return m->vaddr < vaddr + len;
+}
+
 static int iova_map_add(struct iova_map *map, void *vaddr, size_t len, uint64_t iova,
-			unsigned long flags)
+			unsigned long flags, struct iommu_ctx *src, uint64_t src_id)
 {
 	__autowrlock(&map->lock);
 
@@ -51,34 +135,80 @@ static int iova_map_add(struct iova_map *map, void *vaddr, size_t len, uint64_t
 		return -1;
 	}
 
-	if (skiplist_find(&map->list, vaddr, iova_cmp, update)) {
+	if (__iova_map_overlaps(map, vaddr, len, update)) {
 		errno = EEXIST;
 		return -1;
 	}
 
-	m = znew_t(struct iova_mapping, 1);
+	m = __iova_map_get(map);
 
 	m->vaddr = vaddr;
 	m->len = len;
 	m->iova = iova;
 	m->flags = flags;
+	m->id = map->next_id++;
+	m->src = src;
+	m->src_id = src_id;
 
 	skiplist_link(&map->list, &m->list, update);
 
 	return 0;
 }
 
-static void iova_map_remove(struct iova_map *map, void *vaddr)
+/*
+ * Unlink the mapping of vaddr, unless it is shared with other contexts. The
+ * caller either returns it with iova_map_release() or puts it back with
+ * iova_map_relink().
+ */
+static struct iova_mapping *iova_map_unlink(struct iova_map *map, void *vaddr)
 {
 	__autowrlock(&map->lock);
 
 	struct skiplist_node *n, *update[SKIPLIST_LEVELS] = {};
+	struct iova_mapping *m;
 
 	n = skiplist_find(&map->list, vaddr, iova_cmp, update);
-	if (!n)
-		return;
+	if (!n) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	m = container_of_var(n, m, list);
+
+	/* shares are taken with the lock held, so this cannot race */
+	if (atomic_load_acquire(&m->nshares)) {
+		log_debug("mapping is shared with other contexts\n");
+		errno = EBUSY;
+		return NULL;
+	}
 
 	skiplist_erase(&map->list, n, update);
+
+	return m;
+}
+
+static void iova_map_relink(struct iova_map *map, struct iova_mapping *m)
+{
+	__autowrlock(&map->lock);
+
+	struct skiplist_node *update[SKIPLIST_LEVELS] = {};
+
+	/* the address may have been mapped again in the meantime */
+	if (__iova_map_overlaps(map, m->vaddr, m->len, update)) {
+		log_error("could not restore mapping of %p\n", m->vaddr);
+
+		__iova_map_put(map, m);
+		return;
+	}
+
+	skiplist_link(&map->list, &m->list, update);
+}
+
+static void iova_map_release(struct iova_map *map, struct iova_mapping *m)
+{
+	__autowrlock(&map->lock);
+
+	__iova_map_put(map, m);
 }
 
 static struct iova_mapping *iova_map_find(struct iova_map *map, void *vaddr)
@@ -89,16 +219,61 @@ static struct iova_mapping *iova_map_find(struct iova_map *map, void *vaddr)
 				    struct iova_mapping, list);
 }
 
-static void iova_map_clear_with(struct iova_map *map, skiplist_iter_fn fn, void *opaque)
+static bool iova_map_overlaps(struct iova_map *map, void *vaddr, size_t len)
 {
-	__autowrlock(&map->lock);
+	__autordlock(&map->lock);
 
-	skiplist_clear_with(&map->list, fn, opaque);
+	return __iova_map_overlaps(map, vaddr, len, NULL);
 }
 
-static void UNUSED iova_map_clear(struct iova_map *map)
+/*
+ * Take a share of the mapping covering all of [vaddr; vaddr + len). The
+ * mapping may be torn down (by iommu_unmap_all()) once the lock is dropped,
+ * so return a copy of it.
+ */
+static int iova_map_get_share(struct iova_map *map, void *vaddr, size_t len,
+			      struct iova_mapping *copy)
 {
-	iova_map_clear_with(map, NULL, NULL);
+	__autordlock(&map->lock);
+
+	struct iova_mapping *m;
+
+	m = container_of_or_null(skiplist_find(&map->list, vaddr, iova_cmp, NULL),
+				 struct iova_mapping, list);
+	if (!m || vaddr + len > m->vaddr + m->len) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	atomic_inc(&m->nshares);
+
+	*copy = *m;
+
+	return 0;
+}
+
+static void iova_map_put_share(struct iova_map *map, void *vaddr, uint64_t id)
+{
+	__autordlock(&map->lock);
+
+	struct iova_mapping *m;
+
+	m = container_of_or_null(skiplist_find(&map->list, vaddr, iova_cmp, NULL),
+				 struct iova_mapping, list);
+
+	/*
+	 * The mapping may already be gone if torn down with iommu_unmap_all(),
+	 * and the address may have been mapped again since.
+	 */
+	if (m && m->id == id)
+		atomic_dec(&m->nshares);
+}
+
+static void iova_map_clear_with(struct iova_map *map, skiplist_iter_fn fn, void *opaque)
+{
+	__autowrlock(&map->lock);
+
+	skiplist_clear_with(&map->list, fn, opaque);
 }
 
 bool iommu_translate_vaddr(struct iommu_ctx *ctx, void *vaddr, uint64_t *iova)
@@ -121,6 +296,11 @@ int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *io
 	if (iommu_translate_vaddr(ctx, vaddr, &_iova))
 		goto out;
 
+	if ((flags & IOMMU_MAP_ADOPT) && !(flags & IOMMU_MAP_FIXED_IOVA)) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	if (flags & IOMMU_MAP_FIXED_IOVA) {
 		_iova = *iova;
 	} else if (ctx->ops.iova_reserve && ctx->ops.iova_reserve(ctx, len, &_iova, flags)) {
@@ -128,12 +308,12 @@ int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *io
 		return -1;
 	}
 
-	if (ctx->ops.dma_map(ctx, vaddr, len, &_iova, flags)) {
+	if (!(flags & IOMMU_MAP_ADOPT) && ctx->ops.dma_map(ctx, vaddr, len, &_iova, flags)) {
 		log_debug("failed to map dma\n");
 		return -1;
 	}
 
-	if (iova_map_add(&ctx->map, vaddr, len, _iova, flags)) {
+	if (iova_map_add(&ctx->map, vaddr, len, _iova, flags, NULL, 0)) {
 		log_debug("failed to add mapping\n");
 		return -1;
 	}
@@ -145,30 +325,97 @@ out:
 	return 0;
 }
 
-int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len)
+int iommu_share_mapping(struct iommu_ctx *dst, struct iommu_ctx *src, void *vaddr, size_t len)
 {
-	struct iova_mapping *m;
+	struct iova_mapping m;
+	unsigned long flags;
+	uint64_t iova;
 
-	m = iova_map_find(&ctx->map, vaddr);
-	if (!m) {
-		errno = ENOENT;
+	if (dst == src || !ALIGNED((uintptr_t)vaddr, __VFN_PAGESIZE) ||
+	    !ALIGNED(len, __VFN_PAGESIZE)) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	if (len)
-		*len = m->len;
+	if (iova_map_overlaps(&dst->map, vaddr, len)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	/* pin the source mapping before handing its iova to the kernel */
+	if (iova_map_get_share(&src->map, vaddr, len, &m))
+		return -1;
+
+	flags = m.flags & (IOMMU_MAP_NOWRITE | IOMMU_MAP_NOREAD);
+
+	/*
+	 * If both contexts support it, copy the mapping in the kernel. This
+	 * reuses the pages already pinned by the source context.
+	 */
+	if (dst->ops.dma_copy && dst->ops.dma_copy == src->ops.dma_copy) {
+		if (dst->ops.dma_copy(dst, src, m.iova + (vaddr - m.vaddr), len, &iova, flags)) {
+			log_debug("failed to copy dma mapping\n");
+			goto put_share;
+		}
+	} else {
+		if (dst->ops.iova_reserve && dst->ops.iova_reserve(dst, len, &iova, flags)) {
+			log_debug("failed to allocate iova\n");
+			goto put_share;
+		}
+
+		if (dst->ops.dma_map(dst, vaddr, len, &iova, flags)) {
+			log_debug("failed to map dma\n");
+			goto put_share;
+		}
+	}
+
+	if (iova_map_add(&dst->map, vaddr, len, iova, flags, src, m.id)) {
+		log_debug("failed to add mapping\n");
+
+		log_fatal_if(dst->ops.dma_unmap(dst, iova, len), "failed to unmap dma\n");
+
+		goto put_share;
+	}
+
+	return 0;
+
+put_share:
+	iova_map_put_share(&src->map, vaddr, m.id);
+
+	return -1;
+}
+
+static void __unshare_mapping(struct iova_mapping *m)
+{
+	iova_map_put_share(&m->src->map, m->vaddr, m->src_id);
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len)
+{
+	struct iova_mapping *m;
+
+	m = iova_map_unlink(&ctx->map, vaddr);
+	if (!m)
+		return -1;
 
 	if (ctx->ops.dma_unmap(ctx, m->iova, m->len)) {
 		log_debug("failed to unmap dma\n");
+
+		iova_map_relink(&ctx->map, m);
+
 		return -1;
 	}
 
+	if (len)
+		*len = m->len;
+
 	if (m->flags & IOMMU_MAP_EPHEMERAL && ctx->ops.iova_put_ephemeral)
 		ctx->ops.iova_put_ephemeral(ctx);
 
-	iova_map_remove(&ctx->map, m->vaddr);
+	if (m->src)
+		__unshare_mapping(m);
 
-	free(m);
+	iova_map_release(&ctx->map, m);
 
 	return 0;
 }
@@ -178,10 +425,24 @@ static void __unmap_mapping(void *opaque, struct skiplist_node *n)
 	struct iommu_ctx *ctx = opaque;
 	struct iova_mapping *m = container_of_var(n, m, list);
 
-	log_fatal_if(ctx->ops.dma_unmap(ctx, m->len, m->iova),
+	log_fatal_if(ctx->ops.dma_unmap(ctx, m->iova, m->len),
 		     "failed to unmap dma (iova 0x%" PRIx64 " len %zu)\n", m->iova, m->len);
 
-	free(m);
+	if (m->src)
+		__unshare_mapping(m);
+
+	__iova_map_put(&ctx->map, m);
+}
+
+static void __put_mapping(void *opaque, struct skiplist_node *n)
+{
+	struct iommu_ctx *ctx = opaque;
+	struct iova_mapping *m = container_of_var(n, m, list);
+
+	if (m->src)
+		__unshare_mapping(m);
+
+	__iova_map_put(&ctx->map, m);
 }
 
 int iommu_unmap_all(struct iommu_ctx *ctx)
@@ -192,7 +453,7 @@ int iommu_unmap_all(struct iommu_ctx *ctx)
 			return -1;
 		}
 
-		iova_map_clear(&ctx->map);
+		iova_map_clear_with(&ctx->map, __put_mapping, ctx);
 
 		return 0;
 	}
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "dma.c"
+
+static bool fail_dma_map;
+
+static int fake_dma_map(struct iommu_ctx *ctx UNUSED, void *vaddr, size_t len UNUSED,
+			uint64_t *iova, unsigned long flags UNUSED)
+{
+	if (fail_dma_map) {
+		errno = EIO;
+		return -1;
+	}
+
+	*iova = (uint64_t)vaddr;
+
+	return 0;
+}
+
+static int fake_dma_unmap(struct iommu_ctx *ctx UNUSED, uint64_t iova UNUSED, size_t len UNUSED)
+{
+	return 0;
+}
+
+static void ctx_init(struct iommu_ctx *ctx)
+{
+	memset(ctx, 0x0, sizeof(*ctx));
+
+	ctx->ops.dma_map = fake_dma_map;
+	ctx->ops.dma_unmap = fake_dma_unmap;
+
+	skiplist_init(&ctx->map.list);
+	pthread_rwlock_init(&ctx->map.lock, NULL);
+}
+
+int main(void)
+{
+	struct iommu_ctx a, b;
+	void *buf;
+
+	plan_tests(9);
+
+	ctx_init(&a);
+	ctx_init(&b);
+
+	assert(pgmap(&buf, 2 * __VFN_PAGESIZE) > 0);
+
+	assert(iommu_map_vaddr(&a, buf, __VFN_PAGESIZE, NULL, 0x0) == 0);
+
+	/* the source mapping is pinned while shared */
+	ok1(iommu_share_mapping(&b, &a, buf, __VFN_PAGESIZE) == 0);
+	ok1(iommu_unmap_vaddr(&a, buf, NULL) == -1 && errno == EBUSY);
+
+	ok1(iommu_unmap_vaddr(&b, buf, NULL) == 0 && iommu_unmap_vaddr(&a, buf, NULL) == 0);
+
+	/* tearing down the source leaves the shared mapping behind */
+	assert(iommu_map_vaddr(&a, buf, __VFN_PAGESIZE, NULL, 0x0) == 0);
+	assert(iommu_share_mapping(&b, &a, buf, __VFN_PAGESIZE) == 0);
+
+	ok1(iommu_unmap_all(&a) == 0);
+
+	/* a new mapping of the same address is not the one that was shared */
+	assert(iommu_map_vaddr(&a, buf, __VFN_PAGESIZE, NULL, 0x0) == 0);
+
+	ok1(iommu_unmap_vaddr(&b, buf, NULL) == 0 && iova_map_find(&a.map, buf)->nshares == 0);
+	ok1(iommu_unmap_vaddr(&a, buf, NULL) == 0);
+
+	/* a range partially overlapping a mapping in the destination is rejected */
+	assert(iommu_map_vaddr(&a, buf, 2 * __VFN_PAGESIZE, NULL, 0x0) == 0);
+	assert(iommu_map_vaddr(&b, buf + __VFN_PAGESIZE, __VFN_PAGESIZE, NULL, 0x0) == 0);
+
+	ok1(iommu_share_mapping(&b, &a, buf, 2 * __VFN_PAGESIZE) == -1 && errno == EEXIST);
+
+	assert(iommu_unmap_vaddr(&b, buf + __VFN_PAGESIZE, NULL) == 0);
+
+	/* a failed share does not pin the source mapping */
+	fail_dma_map = true;
+	ok1(iommu_share_mapping(&b, &a, buf, 2 * __VFN_PAGESIZE) == -1 && errno == EIO);
+	fail_dma_map = false;
+
+	ok1(iommu_unmap_vaddr(&a, buf, NULL) == 0);
+
+	iova_map_fini(&a.map);
+	iova_map_fini(&b.map);
+
+	pgunmap(buf, 2 * __VFN_PAGESIZE);
+
+	return exit_status();
+}
@@ -10,7 +10,9 @@
  * COPYING and LICENSE files for more information.
  */
 
+#include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <sys/types.h>
 
@@ -24,14 +26,34 @@
 int iommu_get_dmabuf(struct iommu_ctx *ctx, struct iommu_dmabuf *buffer, size_t len,
 		     unsigned long flags)
 {
+	int node = (int)((flags & IOMMU_DMABUF_NODE_MASK) >> IOMMU_DMABUF_NODE_SHIFT) - 1;
+	bool shared = flags & IOMMU_DMABUF_SHARED;
+	bool hugepage = flags & IOMMU_DMABUF_HUGEPAGE;
+
+	flags &= ~(IOMMU_DMABUF_NODE_MASK | IOMMU_DMABUF_SHARED | IOMMU_DMABUF_HUGEPAGE);
+
 	buffer->ctx = ctx;
+	buffer->memfd = -1;
+	buffer->len = -1;
+
+	if (shared)
+		buffer->len = pgmap_shared(&buffer->vaddr, len, node, &buffer->memfd);
+	else if (hugepage)
+		buffer->len = pgmap_hugepage(&buffer->vaddr, len, node);
+
+	/* fall back to regular pages if no huge pages are available */
+	if (buffer->len < 0 && !shared)
+		buffer->len = pgmap_node(&buffer->vaddr, len, node);
 
-	buffer->len = pgmap(&buffer->vaddr, len);
 	if (buffer->len < 0)
 		return -1;
 
 	if (iommu_map_vaddr(ctx, buffer->vaddr, buffer->len, &buffer->iova, flags)) {
 		pgunmap(buffer->vaddr, buffer->len);
+
+		if (buffer->memfd >= 0)
+			log_fatal_if(close(buffer->memfd), "close\n");
+
 		return -1;
 	}
 
@@ -47,5 +69,8 @@ void iommu_put_dmabuf(struct iommu_dmabuf *buffer)
 
 	pgunmap(buffer->vaddr, buffer->len);
 
+	if (buffer->memfd >= 0)
+		log_fatal_if(close(buffer->memfd), "close\n");
+
 	memset(buffer, 0x0, sizeof(*buffer));
 }
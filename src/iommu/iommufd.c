@@ -24,6 +24,9 @@
 #include <pthread.h>
 #include <limits.h>
 
+#include <poll.h>
+
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
@@ -36,9 +39,11 @@
 #include "vfn/pci.h"
 #include "vfn/iommu.h"
 #include "vfn/iommu/iommufd.h"
+#include "vfn/iommu/iopf.h"
 
 #include "ccan/list/list.h"
 #include "ccan/compiler/compiler.h"
+#include "ccan/minmax/minmax.h"
 
 #include "context.h"
 #include "trace.h"
@@ -292,13 +297,71 @@ static int iommu_ioas_do_dma_unmap_all(struct iommu_ctx *ctx)
 	return iommu_ioas_do_dma_unmap(ctx, 0, UINT64_MAX);
 }
 
+static int iommu_ioas_do_dma_copy(struct iommu_ctx *ctx, struct iommu_ctx *src, uint64_t src_iova,
+				  size_t len, uint64_t *iova, unsigned long flags)
+{
+	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
+	struct iommu_ioas *src_ioas = container_of_var(src, src_ioas, ctx);
+
+	struct iommu_ioas_copy copy = {
+		.size = sizeof(copy),
+		.flags = IOMMU_IOAS_MAP_READABLE | IOMMU_IOAS_MAP_WRITEABLE,
+		.dst_ioas_id = ioas->id,
+		.src_ioas_id = src_ioas->id,
+		.length = len,
+		.src_iova = src_iova,
+	};
+
+	if (flags & IOMMU_MAP_NOWRITE)
+		copy.flags &= ~IOMMU_IOAS_MAP_WRITEABLE;
+
+	if (flags & IOMMU_MAP_NOREAD)
+		copy.flags &= ~IOMMU_IOAS_MAP_READABLE;
+
+	trace_guard(IOMMUFD_IOAS_COPY_DMA) {
+		trace_emit("src ioas %" PRIu32 " iova 0x%" PRIx64 " len %zu\n",
+			   src_ioas->id, src_iova, len);
+	}
+
+	if (ioctl(__iommufd, IOMMU_IOAS_COPY, &copy)) {
+		log_debug("failed to copy\n");
+		return -1;
+	}
+
+	*iova = copy.dst_iova;
+
+	trace_guard(IOMMUFD_IOAS_COPY_DMA) {
+		trace_emit("allocated iova 0x%" PRIx64 "\n", *iova);
+	}
+
+	return 0;
+}
+
+static int iommufd_export_state(struct iommu_ctx *ctx, const char *bdf UNUSED,
+				struct iommu_ctx_state *state, int *fds)
+{
+	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
+
+	*state = (struct iommu_ctx_state) {
+		.backend = IOMMU_CTX_BACKEND_IOMMUFD,
+		.nfds = 1,
+		.id = ioas->id,
+	};
+
+	fds[0] = __iommufd;
+
+	return 0;
+}
+
 static const struct iommu_ctx_ops iommufd_ops = {
 	.get_device_fd = iommufd_get_device_fd,
 	.put_device_fd = iommufd_put_device_fd,
+	.export_state = iommufd_export_state,
 
 	.dma_map = iommu_ioas_do_dma_map,
 	.dma_unmap = iommu_ioas_do_dma_unmap,
 	.dma_unmap_all = iommu_ioas_do_dma_unmap_all,
+	.dma_copy = iommu_ioas_do_dma_copy,
 };
 
 static int iommu_ioas_init(struct iommu_ioas *ioas)
@@ -387,6 +450,137 @@ int iommufd_set_fault_queue(struct iommu_ctx *ctx, struct iommufd_fault_queue *f
 
 	return 0;
 }
+
+struct iommufd_iopf_source {
+	int fault_fd;
+	int kick_fd;
+
+	struct iommu_hwpt_pgfault *records;
+	struct iommu_hwpt_page_response *resps;
+	int batch;
+};
+
+static ssize_t iommufd_iopf_read(void *opaque, struct iommu_iopf_fault *faults, int n)
+{
+	struct iommufd_iopf_source *src = opaque;
+	struct pollfd fds[] = {
+		{ .fd = src->fault_fd, .events = POLLIN },
+		{ .fd = src->kick_fd, .events = POLLIN },
+	};
+	ssize_t ret;
+
+	if (poll(fds, 2, -1) < 0)
+		return -1;
+
+	if (fds[1].revents & POLLIN) {
+		uint64_t val;
+
+		if (read(src->kick_fd, &val, sizeof(val)) < 0)
+			return -1;
+
+		return 0;
+	}
+
+	n = min_t(int, n, src->batch);
+
+	ret = read(src->fault_fd, src->records, n * sizeof(*src->records));
+	if (ret < 0)
+		return -1;
+
+	n = (int)(ret / sizeof(*src->records));
+
+	for (int i = 0; i < n; i++) {
+		struct iommu_hwpt_pgfault *rec = &src->records[i];
+
+		faults[i] = (struct iommu_iopf_fault) {
+			.iova = rec->addr,
+			.cookie = rec->cookie,
+		};
+
+		if (rec->flags & IOMMU_PGFAULT_FLAGS_LAST_PAGE)
+			faults[i].flags |= IOMMU_IOPF_FAULT_LAST;
+	}
+
+	return n;
+}
+
+static int iommufd_iopf_respond(void *opaque, struct iommu_iopf_resp *resps, int n)
+{
+	struct iommufd_iopf_source *src = opaque;
+
+	for (int i = 0; i < n; i++) {
+		src->resps[i] = (struct iommu_hwpt_page_response) {
+			.cookie = resps[i].cookie,
+			.code = resps[i].code == IOMMU_IOPF_RESP_SUCCESS ?
+				IOMMUFD_PAGE_RESP_SUCCESS : IOMMUFD_PAGE_RESP_INVALID,
+		};
+	}
+
+	if (writeallfd(src->fault_fd, src->resps, n * sizeof(*src->resps)) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void iommufd_iopf_kick(void *opaque)
+{
+	struct iommufd_iopf_source *src = opaque;
+	uint64_t val = 1;
+
+	log_fatal_if(write(src->kick_fd, &val, sizeof(val)) < 0, "write eventfd\n");
+}
+
+static void iommufd_iopf_release(void *opaque)
+{
+	struct iommufd_iopf_source *src = opaque;
+
+	close(src->kick_fd);
+
+	free(src->records);
+	free(src->resps);
+	free(src);
+}
+
+static const struct iommu_iopf_source_ops iommufd_iopf_source_ops = {
+	.read = iommufd_iopf_read,
+	.respond = iommufd_iopf_respond,
+	.kick = iommufd_iopf_kick,
+	.release = iommufd_iopf_release,
+};
+
+int iommufd_iopf_init(struct iommu_iopf *iopf, struct iommu_ctx *ctx,
+		      struct iommufd_fault_queue *fq, const struct iommu_iopf_opts *opts)
+{
+	struct iommufd_iopf_source *src;
+	int batch = opts ? opts->batch : iommu_iopf_opts_default.batch;
+
+	if (batch < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	src = znew_t(struct iommufd_iopf_source, 1);
+
+	src->fault_fd = fq->fault_fd;
+	src->batch = batch;
+
+	src->kick_fd = eventfd(0, EFD_CLOEXEC);
+	if (src->kick_fd < 0) {
+		log_debug("could not create eventfd\n");
+		free(src);
+		return -1;
+	}
+
+	src->records = znew_t(struct iommu_hwpt_pgfault, batch);
+	src->resps = znew_t(struct iommu_hwpt_page_response, batch);
+
+	if (iommu_iopf_init(iopf, ctx, &iommufd_iopf_source_ops, src, opts)) {
+		iommufd_iopf_release(src);
+		return -1;
+	}
+
+	return 0;
+}
 #endif
 
 struct iommu_ctx *iommufd_get_iommu_context(const char *name)
@@ -408,6 +602,57 @@ struct iommu_ctx *iommufd_get_iommu_context(const char *name)
 	return &ioas->ctx;
 }
 
+static void iommufd_release_imported(struct iommu_ctx *ctx)
+{
+	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
+
+	/* the imported ioas owns the iommufd (see iommufd_import_iommu_context()) */
+	close(__iommufd);
+	__iommufd = -1;
+
+	free(ioas->name);
+
+	iommu_ctx_fini(&ioas->ctx);
+
+	free(ioas);
+}
+
+struct iommu_ctx *iommufd_import_iommu_context(const struct iommu_ctx_state *state, int *fds)
+{
+	struct iommu_ioas *ioas;
+
+	/* object identifiers are local to the iommufd they were allocated on */
+	if (__iommufd != -1) {
+		log_debug("iommufd already open\n");
+		errno = EBUSY;
+		return NULL;
+	}
+
+	ioas = znew_t(struct iommu_ioas, 1);
+
+	iommu_ctx_init(&ioas->ctx);
+
+	memcpy(&ioas->ctx.ops, &iommufd_ops, sizeof(ioas->ctx.ops));
+	ioas->ctx.ops.release = iommufd_release_imported;
+
+	__iommufd = fds[0];
+	ioas->id = state->id;
+
+	if (iommu_ioas_update_iova_ranges(ioas)) {
+		log_debug("could not update iova ranges\n");
+
+		__iommufd = -1;
+		free(ioas->ctx.iova_ranges);
+		free(ioas);
+
+		return NULL;
+	}
+
+	ioas->name = strdup("handover");
+
+	return &ioas->ctx;
+}
+
 struct iommu_ctx *iommufd_get_default_iommu_context(void)
 {
 	if (__iommufd == -1) {
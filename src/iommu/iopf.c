@@ -0,0 +1,385 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "iommu/iopf: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "vfn/iommu.h"
+#include "vfn/iommu/iopf.h"
+#include "vfn/support.h"
+
+struct iommu_iopf_region {
+	void *vaddr;
+	uint64_t iova;
+	size_t len;
+
+	/* bitmap of pages mapped on demand */
+	unsigned long *mapped;
+
+	struct iommu_iopf_region *next;
+};
+
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+
+static inline bool __test_bit(unsigned long *map, size_t nr)
+{
+	return map[nr / BITS_PER_LONG] & (1UL << (nr % BITS_PER_LONG));
+}
+
+static inline void __set_bit(unsigned long *map, size_t nr)
+{
+	map[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline size_t __region_npages(struct iommu_iopf_region *r)
+{
+	return r->len >> __VFN_PAGESHIFT;
+}
+
+int iommu_iopf_init(struct iommu_iopf *iopf, struct iommu_ctx *ctx,
+		    const struct iommu_iopf_source_ops *ops, void *opaque,
+		    const struct iommu_iopf_opts *opts)
+{
+	struct iommu_iova_range *ranges;
+	int nranges;
+
+	if (!ops || !ops->read || !ops->respond) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*iopf = (struct iommu_iopf) {
+		.ctx = ctx,
+		.ops = ops,
+		.opaque = opaque,
+		.opts = opts ? *opts : iommu_iopf_opts_default,
+	};
+
+	if (iopf->opts.batch < 1 || iopf->opts.prefetch < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nranges = iommu_get_iova_ranges(ctx, &ranges);
+	if (nranges < 1) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* allocate downwards from the top of the last range */
+	iopf->next_iova = ALIGN_DOWN(ranges[nranges - 1].last + 1, __VFN_PAGESIZE);
+
+	iopf->faults = znew_t(struct iommu_iopf_fault, iopf->opts.batch);
+	iopf->resps = znew_t(struct iommu_iopf_resp, iopf->opts.batch);
+
+	pthread_rwlock_init(&iopf->lock, NULL);
+
+	return 0;
+}
+
+static int __iopf_reserve_iova(struct iommu_iopf *iopf, size_t len, uint64_t *iova)
+{
+	struct iommu_iova_range *ranges;
+	int nranges;
+
+	nranges = iommu_get_iova_ranges(iopf->ctx, &ranges);
+
+	for (int i = nranges - 1; i >= 0; i--) {
+		struct iommu_iova_range *r = &ranges[i];
+		uint64_t top = min_t(uint64_t, iopf->next_iova, r->last + 1);
+
+		if (top <= r->start || top - r->start < len)
+			continue;
+
+		*iova = ALIGN_DOWN(top - len, __VFN_PAGESIZE);
+		iopf->next_iova = *iova;
+
+		return 0;
+	}
+
+	errno = ENOMEM;
+	return -1;
+}
+
+int iommu_iopf_register(struct iommu_iopf *iopf, void *vaddr, size_t len, uint64_t *iova)
+{
+	__autowrlock(&iopf->lock);
+
+	struct iommu_iopf_region *r;
+	size_t nwords;
+
+	if (!len || !ALIGNED((uintptr_t)vaddr, __VFN_PAGESIZE)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = ALIGN_UP(len, __VFN_PAGESIZE);
+
+	for (r = iopf->regions; r; r = r->next) {
+		if (vaddr < r->vaddr + r->len && r->vaddr < vaddr + len) {
+			errno = EEXIST;
+			return -1;
+		}
+	}
+
+	r = znew_t(struct iommu_iopf_region, 1);
+
+	if (__iopf_reserve_iova(iopf, len, &r->iova)) {
+		free(r);
+		return -1;
+	}
+
+	nwords = ROUND_UP(len >> __VFN_PAGESHIFT, BITS_PER_LONG) / BITS_PER_LONG;
+
+	r->vaddr = vaddr;
+	r->len = len;
+	r->mapped = znew_t(unsigned long, (unsigned int)nwords);
+
+	r->next = iopf->regions;
+	iopf->regions = r;
+
+	if (iova)
+		*iova = r->iova;
+
+	log_debug("registered region vaddr %p len %zu iova 0x%" PRIx64 "\n", vaddr, len, r->iova);
+
+	return 0;
+}
+
+static void __iopf_unmap_region(struct iommu_iopf *iopf, struct iommu_iopf_region *r)
+{
+	size_t npages = __region_npages(r);
+	size_t len;
+
+	for (size_t pg = 0; pg < npages; pg++) {
+		if (!__test_bit(r->mapped, pg))
+			continue;
+
+		/* a mapping may cover a run of pages; skip past it */
+		log_fatal_if(iommu_unmap_vaddr(iopf->ctx, r->vaddr + (pg << __VFN_PAGESHIFT), &len),
+			     "iommu_unmap_vaddr\n");
+
+		pg += (len >> __VFN_PAGESHIFT) - 1;
+	}
+}
+
+int iommu_iopf_unregister(struct iommu_iopf *iopf, void *vaddr)
+{
+	__autowrlock(&iopf->lock);
+
+	struct iommu_iopf_region **p, *r;
+
+	for (p = &iopf->regions; (r = *p); p = &r->next) {
+		if (r->vaddr != vaddr)
+			continue;
+
+		__iopf_unmap_region(iopf, r);
+
+		*p = r->next;
+
+		free(r->mapped);
+		free(r);
+
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+static struct iommu_iopf_region *__iopf_find_region(struct iommu_iopf *iopf, uint64_t iova)
+{
+	for (struct iommu_iopf_region *r = iopf->regions; r; r = r->next) {
+		if (iova >= r->iova && iova - r->iova < r->len)
+			return r;
+	}
+
+	return NULL;
+}
+
+/*
+ * Map the faulting page and up to opts.prefetch following pages. Pages that
+ * are already mapped are skipped, and each contiguous run of unmapped pages is
+ * mapped with a single call.
+ */
+static int __iopf_resolve(struct iommu_iopf *iopf, struct iommu_iopf_region *r, uint64_t iova)
+{
+	size_t first = (iova - r->iova) >> __VFN_PAGESHIFT;
+	size_t last = min_t(size_t, first + iopf->opts.prefetch, __region_npages(r) - 1);
+	size_t pg = first;
+
+	while (pg <= last) {
+		size_t start, len;
+		uint64_t _iova;
+
+		if (__test_bit(r->mapped, pg)) {
+			pg++;
+			continue;
+		}
+
+		for (start = pg; pg <= last && !__test_bit(r->mapped, pg); pg++)
+			;
+
+		len = (pg - start) << __VFN_PAGESHIFT;
+		_iova = r->iova + (start << __VFN_PAGESHIFT);
+
+		if (iommu_map_vaddr(iopf->ctx, r->vaddr + (start << __VFN_PAGESHIFT), len, &_iova,
+				    IOMMU_MAP_FIXED_IOVA)) {
+			/* only the faulting page is mandatory */
+			if (start == first)
+				return -1;
+
+			break;
+		}
+
+		for (size_t i = start; i < pg; i++)
+			__set_bit(r->mapped, i);
+
+		iopf->stats.mapped += pg - start;
+	}
+
+	return 0;
+}
+
+int iommu_iopf_process(struct iommu_iopf *iopf)
+{
+	struct iommu_iopf_fault *faults = iopf->faults;
+	struct iommu_iopf_resp *resps = iopf->resps;
+	uint32_t code = IOMMU_IOPF_RESP_SUCCESS;
+	int nresps = 0;
+	ssize_t n;
+
+	n = iopf->ops->read(iopf->opaque, faults, iopf->opts.batch);
+	if (n <= 0)
+		return (int)n;
+
+	{
+		__autowrlock(&iopf->lock);
+
+		for (int i = 0; i < n; i++) {
+			struct iommu_iopf_fault *f = &faults[i];
+			struct iommu_iopf_region *r = __iopf_find_region(iopf, f->iova);
+
+			iopf->stats.faults++;
+
+			if (!r || __iopf_resolve(iopf, r, f->iova)) {
+				log_debug("could not resolve fault on iova 0x%" PRIx64 "\n", f->iova);
+
+				iopf->stats.invalid++;
+				code = IOMMU_IOPF_RESP_INVALID;
+			}
+
+			if (!(f->flags & IOMMU_IOPF_FAULT_LAST))
+				continue;
+
+			/* a group fails if any of its faults could not be resolved */
+			resps[nresps++] = (struct iommu_iopf_resp) {
+				.cookie = f->cookie,
+				.code = code,
+			};
+
+			code = IOMMU_IOPF_RESP_SUCCESS;
+		}
+	}
+
+	if (nresps && iopf->ops->respond(iopf->opaque, resps, nresps)) {
+		log_debug("failed to respond to faults\n");
+		return -1;
+	}
+
+	return (int)n;
+}
+
+static void *__iopf_thread(void *opaque)
+{
+	struct iommu_iopf *iopf = opaque;
+
+	while (!atomic_load_acquire(&iopf->stop)) {
+		if (iommu_iopf_process(iopf) < 0 && errno != EINTR && errno != EAGAIN) {
+			log_error("fault processing failed: %s\n", strerror(errno));
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+int iommu_iopf_start(struct iommu_iopf *iopf)
+{
+	int err;
+
+	if (iopf->running) {
+		errno = EALREADY;
+		return -1;
+	}
+
+	iopf->stop = false;
+
+	err = pthread_create(&iopf->thread, NULL, __iopf_thread, iopf);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	iopf->running = true;
+
+	return 0;
+}
+
+void iommu_iopf_stop(struct iommu_iopf *iopf)
+{
+	if (!iopf->running)
+		return;
+
+	atomic_store_release(&iopf->stop, true);
+
+	if (iopf->ops->kick)
+		iopf->ops->kick(iopf->opaque);
+
+	pthread_join(iopf->thread, NULL);
+
+	iopf->running = false;
+}
+
+void iommu_iopf_fini(struct iommu_iopf *iopf)
+{
+	struct iommu_iopf_region *r, *next;
+
+	iommu_iopf_stop(iopf);
+
+	for (r = iopf->regions; r; r = next) {
+		next = r->next;
+
+		__iopf_unmap_region(iopf, r);
+
+		free(r->mapped);
+		free(r);
+	}
+
+	if (iopf->ops->release)
+		iopf->ops->release(iopf->opaque);
+
+	free(iopf->faults);
+	free(iopf->resps);
+
+	pthread_rwlock_destroy(&iopf->lock);
+
+	memset(iopf, 0x0, sizeof(*iopf));
+}
@@ -0,0 +1,281 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <assert.h>
+
+#include <sys/mman.h>
+
+#include "ccan/tap/tap.h"
+
+#include "iopf.c"
+
+#define NPAGES 16
+
+static struct iommu_iova_range __ranges[] = {
+	{ .start = 0x10000, .last = 0xffffffff },
+};
+
+/* fake iommu; records which pages are mapped at what iova */
+static struct {
+	int nmaps, nunmaps;
+
+	struct {
+		void *vaddr;
+		size_t len;
+		uint64_t iova;
+	} maps[NPAGES];
+} __iommu;
+
+int iommu_get_iova_ranges(struct iommu_ctx *ctx UNUSED, struct iommu_iova_range **ranges)
+{
+	*ranges = __ranges;
+
+	return 1;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, size_t len, uint64_t *iova,
+		    unsigned long flags)
+{
+	assert(flags & IOMMU_MAP_FIXED_IOVA);
+
+	for (int i = 0; i < NPAGES; i++) {
+		if (__iommu.maps[i].vaddr)
+			continue;
+
+		__iommu.maps[i].vaddr = vaddr;
+		__iommu.maps[i].len = len;
+		__iommu.maps[i].iova = *iova;
+
+		__iommu.nmaps++;
+
+		return 0;
+	}
+
+	errno = ENOMEM;
+	return -1;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, size_t *len)
+{
+	for (int i = 0; i < NPAGES; i++) {
+		if (__iommu.maps[i].vaddr != vaddr)
+			continue;
+
+		if (len)
+			*len = __iommu.maps[i].len;
+
+		__iommu.maps[i].vaddr = NULL;
+		__iommu.nunmaps++;
+
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+/* fake fault source */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct iommu_iopf_fault faults[NPAGES];
+	int nfaults;
+
+	struct iommu_iopf_resp resps[NPAGES];
+	int nresps, nresponds;
+
+	bool kicked, released;
+} __src = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static ssize_t __read(void *opaque UNUSED, struct iommu_iopf_fault *faults, int n)
+{
+	ssize_t ret;
+
+	pthread_mutex_lock(&__src.lock);
+
+	while (!__src.nfaults && !__src.kicked)
+		pthread_cond_wait(&__src.cond, &__src.lock);
+
+	__src.kicked = false;
+
+	ret = min_t(int, n, __src.nfaults);
+	memcpy(faults, __src.faults, ret * sizeof(*faults));
+
+	__src.nfaults -= (int)ret;
+	memmove(__src.faults, &__src.faults[ret], __src.nfaults * sizeof(*faults));
+
+	pthread_mutex_unlock(&__src.lock);
+
+	return ret;
+}
+
+static int __respond(void *opaque UNUSED, struct iommu_iopf_resp *resps, int n)
+{
+	pthread_mutex_lock(&__src.lock);
+
+	memcpy(&__src.resps[__src.nresps], resps, n * sizeof(*resps));
+	__src.nresps += n;
+	__src.nresponds++;
+
+	pthread_cond_broadcast(&__src.cond);
+	pthread_mutex_unlock(&__src.lock);
+
+	return 0;
+}
+
+static void __kick(void *opaque UNUSED)
+{
+	pthread_mutex_lock(&__src.lock);
+
+	__src.kicked = true;
+
+	pthread_cond_broadcast(&__src.cond);
+	pthread_mutex_unlock(&__src.lock);
+}
+
+static void __release(void *opaque UNUSED)
+{
+	__src.released = true;
+}
+
+static const struct iommu_iopf_source_ops __ops = {
+	.read = __read,
+	.respond = __respond,
+	.kick = __kick,
+	.release = __release,
+};
+
+static void fault(uint64_t iova, uint32_t cookie, uint32_t flags)
+{
+	pthread_mutex_lock(&__src.lock);
+
+	__src.faults[__src.nfaults++] = (struct iommu_iopf_fault) {
+		.iova = iova,
+		.cookie = cookie,
+		.flags = flags,
+	};
+
+	pthread_cond_broadcast(&__src.cond);
+	pthread_mutex_unlock(&__src.lock);
+}
+
+static void reset(void)
+{
+	__src.nresps = __src.nresponds = 0;
+	__iommu.nmaps = __iommu.nunmaps = 0;
+}
+
+int main(void)
+{
+	struct iommu_iopf_opts opts = { .batch = 4, .prefetch = 2 };
+	struct iommu_iopf iopf;
+	uint64_t iova, iova2;
+	void *vaddr;
+
+	plan_tests(32);
+
+	vaddr = mmap(NULL, NPAGES << __VFN_PAGESHIFT, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(vaddr != MAP_FAILED);
+
+	ok1(iommu_iopf_init(&iopf, NULL, &__ops, NULL, &opts) == 0);
+
+	/* registration reserves iovas top-down */
+	ok1(iommu_iopf_register(&iopf, vaddr, 8 << __VFN_PAGESHIFT, &iova) == 0);
+	ok1(iova == 0x100000000 - (8UL << __VFN_PAGESHIFT));
+
+	ok1(iommu_iopf_register(&iopf, vaddr, __VFN_PAGESIZE, NULL) == -1 && errno == EEXIST);
+
+	ok1(iommu_iopf_register(&iopf, vaddr + (8 << __VFN_PAGESHIFT), 1, &iova2) == 0);
+	ok1(iova2 == iova - __VFN_PAGESIZE);
+
+	/* fault on page 1; pages 1-3 are mapped in one go */
+	fault(iova + __VFN_PAGESIZE + 0x10, 1, IOMMU_IOPF_FAULT_LAST);
+	ok1(iommu_iopf_process(&iopf) == 1);
+	ok1(__iommu.nmaps == 1);
+	ok1(__iommu.maps[0].vaddr == vaddr + __VFN_PAGESIZE);
+	ok1(__iommu.maps[0].len == 3UL << __VFN_PAGESHIFT);
+	ok1(__iommu.maps[0].iova == iova + __VFN_PAGESIZE);
+	ok1(__src.nresps == 1 && __src.resps[0].cookie == 1);
+	ok1(__src.resps[0].code == IOMMU_IOPF_RESP_SUCCESS);
+
+	reset();
+
+	/* fault on page 0; pages 1-2 are already mapped */
+	fault(iova, 2, IOMMU_IOPF_FAULT_LAST);
+	ok1(iommu_iopf_process(&iopf) == 1);
+	ok1(__iommu.nmaps == 1 && __iommu.maps[1].len == __VFN_PAGESIZE);
+
+	reset();
+
+	/* prefetch is clamped to the end of the region */
+	fault(iova + (7 << __VFN_PAGESHIFT), 3, IOMMU_IOPF_FAULT_LAST);
+	ok1(iommu_iopf_process(&iopf) == 1);
+	ok1(__iommu.nmaps == 1 && __iommu.maps[2].len == __VFN_PAGESIZE);
+
+	reset();
+
+	/* a group is only responded to on the last fault; unknown iovas are invalid */
+	fault(iova + (4 << __VFN_PAGESHIFT), 4, 0);
+	fault(0x20000, 4, IOMMU_IOPF_FAULT_LAST);
+	fault(iova2, 5, IOMMU_IOPF_FAULT_LAST);
+	ok1(iommu_iopf_process(&iopf) == 3);
+	ok1(__src.nresponds == 1 && __src.nresps == 2);
+	ok1(__src.resps[0].cookie == 4 && __src.resps[0].code == IOMMU_IOPF_RESP_INVALID);
+	ok1(__src.resps[1].cookie == 5 && __src.resps[1].code == IOMMU_IOPF_RESP_SUCCESS);
+	ok1(iopf.stats.faults == 6 && iopf.stats.invalid == 1);
+
+	reset();
+
+	/* unregistering unmaps everything mapped on demand */
+	ok1(iommu_iopf_unregister(&iopf, vaddr) == 0);
+	ok1(__iommu.nunmaps == 4);
+	ok1(iommu_iopf_unregister(&iopf, vaddr) == -1 && errno == ENOENT);
+
+	reset();
+
+	/* background thread */
+	ok1(iommu_iopf_start(&iopf) == 0);
+	ok1(iommu_iopf_start(&iopf) == -1 && errno == EALREADY);
+
+	fault(iova2, 6, IOMMU_IOPF_FAULT_LAST);
+
+	pthread_mutex_lock(&__src.lock);
+	while (!__src.nresps)
+		pthread_cond_wait(&__src.cond, &__src.lock);
+	pthread_mutex_unlock(&__src.lock);
+
+	ok1(__src.resps[0].cookie == 6 && __src.resps[0].code == IOMMU_IOPF_RESP_SUCCESS);
+
+	/* stopping kicks the blocked reader */
+	iommu_iopf_stop(&iopf);
+	ok1(!iopf.running);
+
+	iommu_iopf_fini(&iopf);
+	ok1(__src.released);
+	ok1(__iommu.nunmaps == 1);
+	ok1(iopf.regions == NULL);
+
+	munmap(vaddr, NPAGES << __VFN_PAGESHIFT);
+
+	return exit_status();
+}
@@ -595,9 +595,36 @@ static int vfio_iommu_type1_do_dma_unmap_all(struct iommu_ctx *ctx)
 }
 #endif
 
+static int vfio_export_state(struct iommu_ctx *ctx, const char *bdf,
+			     struct iommu_ctx_state *state, int *fds)
+{
+	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
+	struct vfio_group *group;
+
+	group = vfio_get_group(vfio, bdf);
+	if (!group || group->fd < 0) {
+		log_debug("no open iommu group for device %s\n", bdf);
+		errno = ENODEV;
+		return -1;
+	}
+
+	*state = (struct iommu_ctx_state) {
+		.backend = IOMMU_CTX_BACKEND_VFIO,
+		.nfds = 2,
+		.next = vfio->next,
+		.ephemerals = vfio->ephemerals.start,
+	};
+
+	fds[0] = vfio->fd;
+	fds[1] = group->fd;
+
+	return 0;
+}
+
 static const struct iommu_ctx_ops vfio_ops = {
 	.get_device_fd = vfio_get_device_fd,
 	.put_device_fd = vfio_put_device_fd,
+	.export_state = vfio_export_state,
 
 	.iova_reserve = vfio_iommu_type1_iova_reserve,
 	.iova_put_ephemeral = vfio_iommu_type1_iova_put_ephemeral,
@@ -648,6 +675,81 @@ struct iommu_ctx *vfio_get_iommu_context(const char *name)
 	return &vfio->ctx;
 }
 
+static void vfio_release_imported(struct iommu_ctx *ctx)
+{
+	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
+
+	for (int i = 0; i < VFN_MAX_VFIO_GROUPS; i++) {
+		struct vfio_group *group = &vfio->groups[i];
+
+		if (!group->path)
+			continue;
+
+		if (group->fd >= 0)
+			close(group->fd);
+
+		free(group->path);
+	}
+
+	close(vfio->fd);
+
+	free(vfio->name);
+
+	iommu_ctx_fini(&vfio->ctx);
+
+	free(vfio);
+}
+
+struct iommu_ctx *vfio_import_iommu_context(const struct iommu_ctx_state *state,
+					    const char *bdf, int *fds)
+{
+	struct vfio_container *vfio = znew_t(struct vfio_container, 1);
+	struct vfio_group *group;
+
+	iommu_ctx_init(&vfio->ctx);
+
+	memcpy(&vfio->ctx.ops, &vfio_ops, sizeof(vfio->ctx.ops));
+	vfio->ctx.ops.release = vfio_release_imported;
+
+	group = vfio_get_or_create_group(vfio, bdf);
+	if (!group) {
+		log_debug("could not determine iommu group for device %s\n", bdf);
+		goto err;
+	}
+
+	/* the container is already set up and the exported device is open */
+	vfio->fd = fds[0];
+	vfio->iommu_set = true;
+
+	group->fd = fds[1];
+	group->nr_devs = 1;
+	vfio->nr_groups = 1;
+
+#ifdef VFIO_IOMMU_INFO_CAPS
+	if (vfio_iommu_type1_get_capabilities(vfio)) {
+		log_debug("failed to get iommu capabilities\n");
+		goto err;
+	}
+#endif
+
+	vfio->next = state->next;
+
+	vfio->ephemerals.start = state->ephemerals;
+	vfio->ephemerals.last = state->ephemerals + VFIO_IOMMU_TYPE1_IOVA_RESERVED - 1;
+	vfio->next_ephemeral = vfio->ephemerals.start;
+
+	vfio->name = strdup("handover");
+
+	return &vfio->ctx;
+
+err:
+	free(group ? group->path : NULL);
+	free(vfio->ctx.iova_ranges);
+	free(vfio);
+
+	return NULL;
+}
+
 struct iommu_ctx *vfio_get_default_iommu_context(void)
 {
 	if (vfio_default_container.fd == -1) {
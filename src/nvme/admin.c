@@ -0,0 +1,482 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/admin: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/nvme.h>
+
+#include "ccan/array_size/array_size.h"
+#include "ccan/compiler/compiler.h"
+#include "ccan/time/time.h"
+
+#include "types.h"
+#include "admin.h"
+
+struct nvme_admin_slot {
+	void *buf;
+	bool unmap;
+
+	bool active, done, aer;
+	struct nvme_cqe cqe;
+};
+
+struct nvme_admin_completion {
+	struct nvme_rq *rq;
+	struct nvme_cqe cqe;
+};
+
+#define NVME_ADMIN_REAP_MAX 8
+
+/*
+ * Slots are allocated on first use since the admin queue may be configured
+ * after nvme_ctrl_init() by other means than nvme_configure_adminq().
+ */
+static int __admin_get_slots(struct nvme_ctrl *ctrl)
+{
+	__autolock(&ctrl->admin.lock);
+
+	if (!ctrl->adminq.sq) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!ctrl->admin.slots)
+		ctrl->admin.slots = znew_t(struct nvme_admin_slot,
+					   (unsigned int)ctrl->adminq.sq->qsize - 1);
+
+	return 0;
+}
+
+void nvme_set_aen_handler(struct nvme_ctrl *ctrl, nvme_aen_handler handler)
+{
+	ctrl->admin.aen_handler = handler;
+}
+
+/*
+ * Reap at most @max completions. Completions of commands without a callback are
+ * stored in the slot for nvme_admin_wait() to pick up; others are returned in
+ * @comps for dispatch without the lock held.
+ *
+ * Must be called with the admin lock held.
+ */
+static int __admin_reap(struct nvme_ctrl *ctrl, struct nvme_admin_completion *comps, int max,
+			int *nreaped)
+{
+	struct nvme_sq *sq = ctrl->adminq.sq;
+	struct nvme_cq *cq = ctrl->adminq.cq;
+	struct nvme_cqe *cqe;
+	int n = 0, reaped = 0;
+
+	while (n < max && (cqe = nvme_cq_get_cqe(cq))) {
+		uint16_t cid = cqe->cid & ~NVME_CID_AER;
+		struct nvme_admin_slot *slot;
+
+		reaped++;
+
+		if (cid >= sq->qsize - 1) {
+			log_error("SPURIOUS CQE (cq %d cid %" PRIu16 ")\n", cq->id, cqe->cid);
+			continue;
+		}
+
+		slot = &ctrl->admin.slots[cid];
+
+		if (!slot->active) {
+			log_error("SPURIOUS CQE (cq %d cid %" PRIu16 ")\n", cq->id, cqe->cid);
+			continue;
+		}
+
+		nvme_rq_disarm(&sq->rqs[cid]);
+
+		if (!sq->rqs[cid].cb && !(cqe->cid & NVME_CID_AER)) {
+			memcpy(&slot->cqe, cqe, sizeof(*cqe));
+			slot->done = true;
+
+			continue;
+		}
+
+		comps[n].rq = &sq->rqs[cid];
+		memcpy(&comps[n++].cqe, cqe, sizeof(*cqe));
+	}
+
+	if (reaped)
+		nvme_cq_update_head(cq);
+
+	*nreaped = reaped;
+
+	return n;
+}
+
+static void __admin_put_slot(struct nvme_ctrl *ctrl, struct nvme_rq *rq)
+{
+	struct nvme_admin_slot *slot = &ctrl->admin.slots[rq->cid];
+
+	if (slot->unmap)
+		log_fatal_if(iommu_unmap_vaddr(__iommu_ctx(ctrl), slot->buf, NULL),
+			     "iommu_unmap_vaddr\n");
+
+	memset(slot, 0x0, sizeof(*slot));
+
+	nvme_rq_release_atomic(rq);
+}
+
+/*
+ * Get the command identifiers of outstanding Asynchronous Event Requests. Fails
+ * with EBUSY if any other admin command is outstanding.
+ */
+int __nvme_admin_export_aers(struct nvme_ctrl *ctrl, uint16_t *cids)
+{
+	int n = 0;
+
+	__autolock(&ctrl->admin.lock);
+
+	if (!ctrl->admin.slots)
+		return 0;
+
+	for (int i = 0; i < ctrl->adminq.sq->qsize - 1; i++) {
+		struct nvme_admin_slot *slot = &ctrl->admin.slots[i];
+
+		if (!slot->active)
+			continue;
+
+		if (!slot->aer || slot->done) {
+			errno = EBUSY;
+			return -1;
+		}
+
+		cids[n++] = (uint16_t)i;
+	}
+
+	return n;
+}
+
+/*
+ * Mark Asynchronous Event Requests submitted by another process as outstanding.
+ * The request trackers must not be on the free stack.
+ */
+int __nvme_admin_import_aers(struct nvme_ctrl *ctrl, uint16_t *cids, int n)
+{
+	if (!ctrl->admin.slots && __admin_get_slots(ctrl))
+		return -1;
+
+	for (int i = 0; i < n; i++)
+		ctrl->admin.slots[cids[i]] = (struct nvme_admin_slot) {
+			.active = true, .aer = true,
+		};
+
+	return 0;
+}
+
+static void __admin_dispatch(struct nvme_ctrl *ctrl, struct nvme_admin_completion *comps, int n)
+{
+	for (int i = 0; i < n; i++) {
+		struct nvme_rq *rq = comps[i].rq;
+		struct nvme_cqe *cqe = &comps[i].cqe;
+
+		if (cqe->cid & NVME_CID_AER) {
+			uint32_t dw0 = le32_to_cpu(cqe->dw0);
+
+			if (NVME_FIELD_GET(dw0, AEN_TYPE) == NVME_AEN_TYPE_NOTICE &&
+			    NVME_FIELD_GET(dw0, AEN_INFO) == NVME_AEN_NOTICE_NS_CHANGED)
+				nvme_ns_invalidate(ctrl);
+
+			if (ctrl->admin.aen_handler)
+				ctrl->admin.aen_handler(ctrl, cqe, rq->opaque);
+			else
+				log_info("unhandled aen (dw0 0x%" PRIx32 ")\n", dw0);
+		} else {
+			rq->cb(rq, cqe);
+		}
+
+		__admin_put_slot(ctrl, rq);
+	}
+}
+
+/*
+ * Complete all outstanding admin commands with a Command Abort Requested
+ * status (the controller has been reset). Futures are completed for their
+ * waiters and completion callbacks are invoked; Asynchronous Event Requests
+ * are dropped.
+ */
+void __nvme_admin_reset(struct nvme_ctrl *ctrl)
+{
+	struct nvme_sq *sq = ctrl->adminq.sq;
+	struct nvme_admin_completion *comps;
+	int n = 0;
+
+	pthread_mutex_lock(&ctrl->admin.lock);
+
+	if (!ctrl->admin.slots) {
+		pthread_mutex_unlock(&ctrl->admin.lock);
+		return;
+	}
+
+	comps = znew_t(struct nvme_admin_completion, sq->qsize - 1);
+
+	for (uint16_t cid = 0; cid < sq->qsize - 1; cid++) {
+		struct nvme_admin_slot *slot = &ctrl->admin.slots[cid];
+		struct nvme_rq *rq = &sq->rqs[cid];
+		struct nvme_cqe cqe = {
+			.cid = cid,
+			.sfp = cpu_to_le16(NVME_CQE_SFP_DNR | NVME_CQE_SFP_SC_ABORT_REQ),
+		};
+
+		if (!slot->active || slot->done)
+			continue;
+
+		nvme_rq_disarm(rq);
+
+		if (slot->aer) {
+			__admin_put_slot(ctrl, rq);
+			continue;
+		}
+
+		if (!rq->cb) {
+			memcpy(&slot->cqe, &cqe, sizeof(cqe));
+			slot->done = true;
+
+			continue;
+		}
+
+		comps[n].rq = rq;
+		memcpy(&comps[n++].cqe, &cqe, sizeof(cqe));
+	}
+
+	pthread_mutex_unlock(&ctrl->admin.lock);
+
+	__admin_dispatch(ctrl, comps, n);
+
+	free(comps);
+}
+
+int nvme_admin_poll(struct nvme_ctrl *ctrl)
+{
+	struct nvme_admin_completion comps[NVME_ADMIN_REAP_MAX];
+	int n, reaped, total = 0;
+
+	if (!ctrl->admin.slots && __admin_get_slots(ctrl))
+		return -1;
+
+	do {
+		pthread_mutex_lock(&ctrl->admin.lock);
+		n = __admin_reap(ctrl, comps, ARRAY_SIZE(comps), &reaped);
+		pthread_mutex_unlock(&ctrl->admin.lock);
+
+		__admin_dispatch(ctrl, comps, n);
+
+		total += reaped;
+	} while (reaped);
+
+	nvme_sq_check_timeouts(ctrl->adminq.sq);
+
+	return total;
+}
+
+struct nvme_rq *nvme_admin_submit(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf,
+				  size_t len, nvme_rq_cb cb, void *opaque)
+{
+	struct nvme_admin_slot *slot;
+	struct nvme_rq *rq;
+	uint64_t iova;
+	bool do_unmap = false;
+
+	if (!ctrl->admin.slots && __admin_get_slots(ctrl))
+		return NULL;
+
+	if (buf) {
+		struct iommu_ctx *ctx = __iommu_ctx(ctrl);
+
+		if (!iommu_translate_vaddr(ctx, buf, &iova)) {
+			do_unmap = true;
+
+			if (iommu_map_vaddr(ctx, buf, len, &iova, IOMMU_MAP_EPHEMERAL)) {
+				log_debug("failed to map vaddr\n");
+				return NULL;
+			}
+		}
+	}
+
+	rq = nvme_rq_acquire_atomic(ctrl->adminq.sq);
+	if (!rq)
+		goto unmap;
+
+	if (buf && nvme_rq_map_prp(ctrl, rq, sqe, iova, len))
+		goto release_rq;
+
+	slot = &ctrl->admin.slots[rq->cid];
+
+	*slot = (struct nvme_admin_slot) {
+		.buf = buf,
+		.unmap = do_unmap,
+		.active = true,
+	};
+
+	rq->opaque = opaque;
+	rq->cb = cb;
+
+	pthread_mutex_lock(&ctrl->admin.lock);
+	nvme_rq_exec(rq, sqe);
+	pthread_mutex_unlock(&ctrl->admin.lock);
+
+	return rq;
+
+release_rq:
+	nvme_rq_release_atomic(rq);
+unmap:
+	if (do_unmap)
+		log_fatal_if(iommu_unmap_vaddr(__iommu_ctx(ctrl), buf, NULL),
+			     "iommu_unmap_vaddr\n");
+
+	return NULL;
+}
+
+int nvme_admin_wait(struct nvme_ctrl *ctrl, struct nvme_rq *rq, struct nvme_cqe *cqe_copy,
+		    struct timespec *ts)
+{
+	struct nvme_admin_completion comps[NVME_ADMIN_REAP_MAX];
+	struct nvme_admin_slot *slot;
+	struct nvme_cqe cqe;
+	uint64_t timeout = 0;
+	int n, reaped;
+
+	/* completions of commands with a callback are never kept in the slot */
+	if (!ctrl->admin.slots || rq->cb || !ctrl->admin.slots[rq->cid].active ||
+	    ctrl->admin.slots[rq->cid].aer) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	slot = &ctrl->admin.slots[rq->cid];
+
+	if (ts) {
+		struct timerel rel = { .ts = *ts };
+
+		timeout = get_ticks() + time_to_usec(rel) * (__vfn_ticks_freq / 1000000ULL);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&ctrl->admin.lock);
+
+		if (slot->done) {
+			memcpy(&cqe, &slot->cqe, sizeof(cqe));
+			pthread_mutex_unlock(&ctrl->admin.lock);
+
+			break;
+		}
+
+		n = __admin_reap(ctrl, comps, ARRAY_SIZE(comps), &reaped);
+
+		pthread_mutex_unlock(&ctrl->admin.lock);
+
+		__admin_dispatch(ctrl, comps, n);
+
+		nvme_sq_check_timeouts(ctrl->adminq.sq);
+
+		if (ts && get_ticks() >= timeout) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+
+	__admin_put_slot(ctrl, rq);
+
+	if (cqe_copy)
+		memcpy(cqe_copy, &cqe, sizeof(*cqe_copy));
+
+	if (!nvme_cqe_ok(&cqe)) {
+		if (logv(LOG_DEBUG)) {
+			uint16_t status = le16_to_cpu(cqe.sfp) >> 1;
+
+			log_debug("cqe status 0x%" PRIx16 "\n", status & 0x7ff);
+		}
+
+		return nvme_set_errno_from_cqe(&cqe);
+	}
+
+	return 0;
+}
+
+int nvme_admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
+	       struct nvme_cqe *cqe_copy)
+{
+	struct nvme_rq *rq;
+
+	rq = nvme_admin_submit(ctrl, sqe, buf, len, NULL, NULL);
+	if (!rq)
+		return -1;
+
+	return nvme_admin_wait(ctrl, rq, cqe_copy, NULL);
+}
+
+int nvme_aer(struct nvme_ctrl *ctrl, void *opaque)
+{
+	struct nvme_rq *rq;
+	union nvme_cmd cmd = { .opcode = NVME_ADMIN_ASYNC_EVENT };
+
+	if (!ctrl->admin.slots && __admin_get_slots(ctrl))
+		return -1;
+
+	rq = nvme_rq_acquire_atomic(ctrl->adminq.sq);
+	if (!rq) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	cmd.cid = rq->cid | NVME_CID_AER;
+	rq->opaque = opaque;
+
+	ctrl->admin.slots[rq->cid] = (struct nvme_admin_slot) { .active = true, .aer = true };
+
+	/* rq_exec overwrites the command identifier, so use sq_exec */
+	pthread_mutex_lock(&ctrl->admin.lock);
+	nvme_sq_exec(ctrl->adminq.sq, &cmd);
+	pthread_mutex_unlock(&ctrl->admin.lock);
+
+	return 0;
+}
+
+static void __abort_cb(struct nvme_rq UNUSED *rq, struct nvme_cqe *cqe)
+{
+	if (!nvme_cqe_ok(cqe))
+		log_debug("abort failed (status 0x%" PRIx16 ")\n",
+			  (uint16_t)((le16_to_cpu(cqe->sfp) >> 1) & 0x7ff));
+	else if (le32_to_cpu(cqe->dw0) & 0x1)
+		log_debug("command was not aborted\n");
+}
+
+int nvme_rq_abort(struct nvme_ctrl *ctrl, struct nvme_rq *rq)
+{
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_ABORT,
+		.cdw10 = cpu_to_le32((uint32_t)rq->sq->id | (uint32_t)rq->cid << 16),
+	};
+
+	if (!nvme_admin_submit(ctrl, &cmd, NULL, 0x0, __abort_cb, NULL))
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * Admin command engine internals used by controller initialization (reset)
+ * and handover (see src/nvme/admin.c).
+ */
+void __nvme_admin_reset(struct nvme_ctrl *ctrl);
+int __nvme_admin_export_aers(struct nvme_ctrl *ctrl, uint16_t *cids);
+int __nvme_admin_import_aers(struct nvme_ctrl *ctrl, uint16_t *cids, int n);
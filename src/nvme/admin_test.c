@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "admin.c"
+#include "fakedev.h"
+
+#define QSIZE 8
+
+static struct nvme_sq sq;
+static struct nvme_cq cq;
+static struct nvme_rq rqs[QSIZE - 1];
+static struct fakedev fdev;
+
+static int nfree(void)
+{
+	int n = 0;
+
+	for (struct nvme_rq *rq = sq.rq_top; rq; rq = rq->rq_next)
+		n++;
+
+	return n;
+}
+
+static struct nvme_rq *cb_rq;
+static uint32_t cb_dw0;
+static int cb_calls;
+
+static void cb(struct nvme_rq *rq, struct nvme_cqe *cqe)
+{
+	cb_rq = rq;
+	cb_dw0 = le32_to_cpu(cqe->dw0);
+	cb_calls++;
+}
+
+static void *aen_opaque;
+static uint32_t aen_dw0;
+static int aen_calls;
+
+static void aen_handler(struct nvme_ctrl *ctrl UNUSED, struct nvme_cqe *cqe, void *opaque)
+{
+	aen_opaque = opaque;
+	aen_dw0 = le32_to_cpu(cqe->dw0);
+	aen_calls++;
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = {};
+	union nvme_cmd cmd = { .opcode = NVME_ADMIN_IDENTIFY };
+	struct nvme_rq *a, *b, *c;
+	struct timespec ts = { .tv_nsec = 1000000 };
+	struct nvme_cqe cqe;
+	int opaque;
+
+	plan_tests(36);
+
+	pthread_mutex_init(&ctrl.admin.lock, NULL);
+
+	fakedev_init(&fdev, 0, &sq, QSIZE, &cq, QSIZE, rqs);
+
+	ctrl.adminq.sq = &sq;
+	ctrl.adminq.cq = &cq;
+
+	/* futures completed out of order */
+	a = nvme_admin_submit(&ctrl, &cmd, NULL, 0, NULL, NULL);
+	b = nvme_admin_submit(&ctrl, &cmd, NULL, 0, NULL, NULL);
+	c = nvme_admin_submit(&ctrl, &cmd, NULL, 0, NULL, NULL);
+	ok1(a && b && c);
+	ok1(fdev.sqdb == 3);
+
+	fakedev_complete(&fdev, c->cid, 0, 0xc);
+	fakedev_complete(&fdev, a->cid, 0, 0xa);
+	fakedev_complete(&fdev, b->cid, 0, 0xb);
+
+	ok1(nvme_admin_wait(&ctrl, a, &cqe, NULL) == 0);
+	ok1(le32_to_cpu(cqe.dw0) == 0xa);
+	ok1(fdev.cqdb == 3);
+
+	ok1(nvme_admin_wait(&ctrl, c, &cqe, NULL) == 0);
+	ok1(le32_to_cpu(cqe.dw0) == 0xc);
+	ok1(nvme_admin_wait(&ctrl, b, &cqe, NULL) == 0);
+	ok1(le32_to_cpu(cqe.dw0) == 0xb);
+	ok1(nfree() == QSIZE - 1);
+
+	/* error status */
+	a = nvme_admin_submit(&ctrl, &cmd, NULL, 0, NULL, NULL);
+	fakedev_complete(&fdev, a->cid, 0x2, 0);
+	ok1(nvme_admin_wait(&ctrl, a, NULL, NULL) == -1 && errno == EIO);
+
+	/* timeouts leave the command outstanding */
+	a = nvme_admin_submit(&ctrl, &cmd, NULL, 0, NULL, NULL);
+	ok1(nvme_admin_wait(&ctrl, a, &cqe, &ts) == -1 && errno == ETIMEDOUT);
+
+	fakedev_complete(&fdev, a->cid, 0, 0x41);
+	ok1(nvme_admin_wait(&ctrl, a, &cqe, &ts) == 0 && le32_to_cpu(cqe.dw0) == 0x41);
+
+	/* callbacks */
+	a = nvme_admin_submit(&ctrl, &cmd, NULL, 0, cb, &opaque);
+	ok1(a && a->opaque == &opaque);
+	ok1(nvme_admin_poll(&ctrl) == 0);
+	ok1(nvme_admin_wait(&ctrl, a, &cqe, &ts) == -1 && errno == EINVAL);
+
+	fakedev_complete(&fdev, a->cid, 0, 0x42);
+	ok1(nvme_admin_poll(&ctrl) == 1);
+	ok1(cb_calls == 1 && cb_rq == a && cb_dw0 == 0x42);
+	ok1(nfree() == QSIZE - 1);
+
+	/* callbacks are dispatched while waiting on a future */
+	a = nvme_admin_submit(&ctrl, &cmd, NULL, 0, NULL, NULL);
+	b = nvme_admin_submit(&ctrl, &cmd, NULL, 0, cb, NULL);
+
+	fakedev_complete(&fdev, b->cid, 0, 0x43);
+	fakedev_complete(&fdev, a->cid, 0, 0x44);
+
+	ok1(nvme_admin_wait(&ctrl, a, &cqe, NULL) == 0);
+	ok1(cb_calls == 2 && cb_rq == b && cb_dw0 == 0x43);
+
+	/* asynchronous event notifications */
+	c = sq.rq_top;
+	ok1(nvme_aer(&ctrl, &opaque) == 0);
+	ok1(nfree() == QSIZE - 2);
+	ok1(nvme_admin_wait(&ctrl, c, &cqe, NULL) == -1 && errno == EINVAL);
+
+	fakedev_complete(&fdev, c->cid | NVME_CID_AER, 0, 0x10002);
+	ok1(nvme_admin_poll(&ctrl) == 1);
+	ok1(aen_calls == 0);
+
+	/* namespace attribute changed notices invalidate the namespace table */
+	ok1(ctrl.ns.stale);
+
+	nvme_set_aen_handler(&ctrl, aen_handler);
+	c = sq.rq_top;
+	ok1(nvme_aer(&ctrl, &opaque) == 0);
+	fakedev_complete(&fdev, c->cid | NVME_CID_AER, 0, 0x10002);
+	ok1(nvme_admin_poll(&ctrl) == 1);
+	ok1(aen_calls == 1 && aen_opaque == &opaque && aen_dw0 == 0x10002);
+
+	/* spurious completions are dropped */
+	fakedev_complete(&fdev, 3 | NVME_CID_AER, 0, 0);
+	fakedev_complete(&fdev, 3, 0, 0);
+	fakedev_complete(&fdev, QSIZE + 1, 0, 0);
+	ok1(nvme_admin_poll(&ctrl) == 3 && cb_calls == 2 && aen_calls == 1 && nfree() == QSIZE - 1);
+
+	/* a reset aborts outstanding commands and drops event requests */
+	a = nvme_admin_submit(&ctrl, &cmd, NULL, 0, NULL, NULL);
+	b = nvme_admin_submit(&ctrl, &cmd, NULL, 0, cb, NULL);
+	ok1(nvme_aer(&ctrl, &opaque) == 0);
+
+	__nvme_admin_reset(&ctrl);
+	ok1(cb_calls == 3 && cb_rq == b && aen_calls == 1 && nfree() == QSIZE - 2);
+
+	ok1(nvme_admin_wait(&ctrl, a, &cqe, NULL) == -1 && errno == EIO);
+	ok1(le16_to_cpu(cqe.sfp) == (NVME_CQE_SFP_DNR | NVME_CQE_SFP_SC_ABORT_REQ));
+	ok1(nfree() == QSIZE - 1);
+
+	return exit_status();
+}
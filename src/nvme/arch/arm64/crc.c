@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/auxv.h>
+
+#include <asm/hwcap.h>
+
+#include <arm_neon.h>
+
+#include "nvme/crc.h"
+
+/* shorter buffers are not worth folding */
+#define NVME_CRC_FOLD_MIN 256
+
+#if defined(__clang__)
+# define __target_pmull __attribute__((target("aes")))
+#else
+# define __target_pmull __attribute__((target("+crypto")))
+#endif
+
+/*
+ * The CRC64 is reflected, so blocks are used as loaded. The CRC16 is not, so
+ * the bytes of each block are reversed to put the first bit of the block in
+ * the most significant bit.
+ */
+static inline __target_pmull uint64x2_t __load(const unsigned char *p, bool swap)
+{
+	uint8x16_t v = vld1q_u8(p);
+
+	if (swap) {
+		v = vrev64q_u8(v);
+		v = vextq_u8(v, v, 8);
+	}
+
+	return vreinterpretq_u64_u8(v);
+}
+
+static inline __target_pmull void __store(unsigned char *p, uint64x2_t x, bool swap)
+{
+	uint8x16_t v = vreinterpretq_u8_u64(x);
+
+	if (swap) {
+		v = vrev64q_u8(v);
+		v = vextq_u8(v, v, 8);
+	}
+
+	vst1q_u8(p, v);
+}
+
+static inline __target_pmull uint64x2_t __k(const uint64_t k[2])
+{
+	return vcombine_u64(vcreate_u64(k[0]), vcreate_u64(k[1]));
+}
+
+static inline __target_pmull uint64x2_t __fold(uint64x2_t x, uint64x2_t k)
+{
+	poly128_t lo = vmull_p64((poly64_t)vgetq_lane_u64(x, 0), (poly64_t)vgetq_lane_u64(k, 0));
+	poly128_t hi = vmull_high_p64(vreinterpretq_p64_u64(x), vreinterpretq_p64_u64(k));
+
+	return veorq_u64(vreinterpretq_u64_p128(lo), vreinterpretq_u64_p128(hi));
+}
+
+/*
+ * Fold eight lanes of 128 bits over the buffer, then fold the lanes into the
+ * last one and the remaining whole blocks into that. Returns the number of
+ * bytes consumed.
+ */
+static inline __target_pmull size_t __fold_pmull(const unsigned char *buffer, size_t len,
+						 uint64x2_t init, const uint64_t (*fold)[2],
+						 bool swap, unsigned char block[16])
+{
+	uint64x2_t x[8], k = __k(fold[7]);
+	size_t off;
+
+	for (int i = 0; i < 8; i++)
+		x[i] = __load(buffer + 16 * i, swap);
+
+	x[0] = veorq_u64(x[0], init);
+
+	for (off = 128; len - off >= 128; off += 128) {
+		for (int i = 0; i < 8; i++)
+			x[i] = veorq_u64(__fold(x[i], k), __load(buffer + off + 16 * i, swap));
+	}
+
+	for (int i = 0; i < 7; i++)
+		x[7] = veorq_u64(x[7], __fold(x[i], __k(fold[6 - i])));
+
+	k = __k(fold[0]);
+
+	for (; len - off >= 16; off += 16)
+		x[7] = veorq_u64(__fold(x[7], k), __load(buffer + off, swap));
+
+	__store(block, x[7], swap);
+
+	return off;
+}
+
+static __target_pmull uint64_t __crc64_pmull(uint64_t crc, const unsigned char *buffer,
+					     size_t len)
+{
+	unsigned char block[16];
+	size_t off;
+
+	if (len < NVME_CRC_FOLD_MIN)
+		return __nvme_crc64_slice8(crc, buffer, len);
+
+	off = __fold_pmull(buffer, len, vcombine_u64(vcreate_u64(crc), vcreate_u64(0)),
+			   __nvme_crc64_fold, false, block);
+
+	crc = __nvme_crc64_slice8(0, block, 16);
+
+	return __nvme_crc64_slice8(crc, buffer + off, len - off);
+}
+
+static __target_pmull uint16_t __crc16_pmull(uint16_t crc, const unsigned char *buffer,
+					     size_t len)
+{
+	unsigned char block[16];
+	size_t off;
+
+	if (len < NVME_CRC_FOLD_MIN)
+		return __nvme_crc16_slice8(crc, buffer, len);
+
+	off = __fold_pmull(buffer, len,
+			   vcombine_u64(vcreate_u64(0), vcreate_u64((uint64_t)crc << 48)),
+			   __nvme_crc16_fold, true, block);
+
+	crc = __nvme_crc16_slice8(0, block, 16);
+
+	return __nvme_crc16_slice8(crc, buffer + off, len - off);
+}
+
+static bool __pmull_supported(void)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return getauxval(AT_HWCAP) & HWCAP_PMULL;
+#else
+	return false;
+#endif
+}
+
+const struct nvme_crc_impl __nvme_crc_pmull = {
+	.name = "pmull",
+	.supported = __pmull_supported,
+	.crc64 = __crc64_pmull,
+	.crc16 = __crc16_pmull,
+};
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <immintrin.h>
+
+#include "nvme/crc.h"
+
+/* shorter buffers are not worth folding */
+#define NVME_CRC_FOLD_MIN 256
+
+#define __target_pclmul __attribute__((target("pclmul,ssse3")))
+#define __target_vpclmul __attribute__((target("vpclmulqdq,avx2,pclmul,ssse3")))
+
+/*
+ * The CRC64 is reflected, so blocks are used as loaded. The CRC16 is not, so
+ * the bytes of each block are reversed to put the first bit of the block in
+ * the most significant bit.
+ */
+static inline __target_pclmul __m128i __bswap_mask(void)
+{
+	return _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+}
+
+static inline __target_pclmul __m128i __load(const unsigned char *p, bool swap)
+{
+	__m128i x = _mm_loadu_si128((const __m128i *)p);
+
+	return swap ? _mm_shuffle_epi8(x, __bswap_mask()) : x;
+}
+
+static inline __target_pclmul void __store(unsigned char *p, __m128i x, bool swap)
+{
+	_mm_storeu_si128((__m128i *)p, swap ? _mm_shuffle_epi8(x, __bswap_mask()) : x);
+}
+
+static inline __target_pclmul __m128i __k(const uint64_t k[2])
+{
+	return _mm_set_epi64x((long long)k[1], (long long)k[0]);
+}
+
+static inline __target_pclmul __m128i __fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+/*
+ * Fold eight lanes into the last one and then fold the remaining whole blocks
+ * into it. Returns the number of bytes consumed.
+ */
+static inline __target_pclmul size_t __reduce(__m128i x[8], const unsigned char *buffer,
+					      size_t off, size_t len, const uint64_t (*fold)[2],
+					      bool swap, unsigned char block[16])
+{
+	__m128i k = __k(fold[0]);
+
+	for (int i = 0; i < 7; i++)
+		x[7] = _mm_xor_si128(x[7], __fold(x[i], __k(fold[6 - i])));
+
+	for (; len - off >= 16; off += 16)
+		x[7] = _mm_xor_si128(__fold(x[7], k), __load(buffer + off, swap));
+
+	__store(block, x[7], swap);
+
+	return off;
+}
+
+static inline __target_pclmul size_t __fold_pclmul(const unsigned char *buffer, size_t len,
+						   __m128i init, const uint64_t (*fold)[2],
+						   bool swap, unsigned char block[16])
+{
+	__m128i x[8], k = __k(fold[7]);
+	size_t off;
+
+	for (int i = 0; i < 8; i++)
+		x[i] = __load(buffer + 16 * i, swap);
+
+	x[0] = _mm_xor_si128(x[0], init);
+
+	for (off = 128; len - off >= 128; off += 128) {
+		for (int i = 0; i < 8; i++)
+			x[i] = _mm_xor_si128(__fold(x[i], k), __load(buffer + off + 16 * i, swap));
+	}
+
+	return __reduce(x, buffer, off, len, fold, swap, block);
+}
+
+static __target_pclmul uint64_t __crc64_pclmul(uint64_t crc, const unsigned char *buffer,
+					       size_t len)
+{
+	unsigned char block[16];
+	size_t off;
+
+	if (len < NVME_CRC_FOLD_MIN)
+		return __nvme_crc64_slice8(crc, buffer, len);
+
+	off = __fold_pclmul(buffer, len, _mm_set_epi64x(0, (long long)crc), __nvme_crc64_fold,
+			    false, block);
+
+	crc = __nvme_crc64_slice8(0, block, 16);
+
+	return __nvme_crc64_slice8(crc, buffer + off, len - off);
+}
+
+static __target_pclmul uint16_t __crc16_pclmul(uint16_t crc, const unsigned char *buffer,
+					       size_t len)
+{
+	unsigned char block[16];
+	size_t off;
+
+	if (len < NVME_CRC_FOLD_MIN)
+		return __nvme_crc16_slice8(crc, buffer, len);
+
+	off = __fold_pclmul(buffer, len, _mm_set_epi64x((long long)crc << 48, 0),
+			    __nvme_crc16_fold, true, block);
+
+	crc = __nvme_crc16_slice8(0, block, 16);
+
+	return __nvme_crc16_slice8(crc, buffer + off, len - off);
+}
+
+static bool __pclmul_supported(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+const struct nvme_crc_impl __nvme_crc_pclmul = {
+	.name = "pclmul",
+	.supported = __pclmul_supported,
+	.crc64 = __crc64_pclmul,
+	.crc16 = __crc16_pclmul,
+};
+
+static inline __target_vpclmul __m256i __load256(const unsigned char *p, bool swap)
+{
+	__m256i y = _mm256_loadu_si256((const __m256i *)p);
+
+	return swap ? _mm256_shuffle_epi8(y, _mm256_broadcastsi128_si256(__bswap_mask())) : y;
+}
+
+static inline __target_vpclmul __m256i __fold256(__m256i y, __m256i k)
+{
+	return _mm256_xor_si256(_mm256_clmulepi64_epi128(y, k, 0x00),
+				_mm256_clmulepi64_epi128(y, k, 0x11));
+}
+
+/*
+ * As __fold_pclmul, but with sixteen lanes in 256 bit registers that are
+ * folded to eight lanes before the final reduction.
+ */
+static inline __target_vpclmul size_t __fold_vpclmul(const unsigned char *buffer, size_t len,
+						     __m128i init, const uint64_t (*fold)[2],
+						     bool swap, unsigned char block[16])
+{
+	__m256i y[8], k = _mm256_broadcastsi128_si256(__k(fold[15]));
+	__m128i x[8];
+	size_t off;
+
+	for (int i = 0; i < 8; i++)
+		y[i] = __load256(buffer + 32 * i, swap);
+
+	y[0] = _mm256_xor_si256(y[0], _mm256_set_m128i(_mm_setzero_si128(), init));
+
+	for (off = 256; len - off >= 256; off += 256) {
+		for (int i = 0; i < 8; i++)
+			y[i] = _mm256_xor_si256(__fold256(y[i], k),
+						__load256(buffer + off + 32 * i, swap));
+	}
+
+	k = _mm256_broadcastsi128_si256(__k(fold[7]));
+
+	for (int i = 0; i < 4; i++) {
+		__m256i v = _mm256_xor_si256(y[i + 4], __fold256(y[i], k));
+
+		x[2 * i] = _mm256_castsi256_si128(v);
+		x[2 * i + 1] = _mm256_extracti128_si256(v, 1);
+	}
+
+	return __reduce(x, buffer, off, len, fold, swap, block);
+}
+
+static __target_vpclmul uint64_t __crc64_vpclmul(uint64_t crc, const unsigned char *buffer,
+						 size_t len)
+{
+	unsigned char block[16];
+	size_t off;
+
+	if (len < NVME_CRC_FOLD_MIN)
+		return __nvme_crc64_slice8(crc, buffer, len);
+
+	off = __fold_vpclmul(buffer, len, _mm_set_epi64x(0, (long long)crc), __nvme_crc64_fold,
+			     false, block);
+
+	crc = __nvme_crc64_slice8(0, block, 16);
+
+	return __nvme_crc64_slice8(crc, buffer + off, len - off);
+}
+
+static __target_vpclmul uint16_t __crc16_vpclmul(uint16_t crc, const unsigned char *buffer,
+						 size_t len)
+{
+	unsigned char block[16];
+	size_t off;
+
+	if (len < NVME_CRC_FOLD_MIN)
+		return __nvme_crc16_slice8(crc, buffer, len);
+
+	off = __fold_vpclmul(buffer, len, _mm_set_epi64x((long long)crc << 48, 0),
+			     __nvme_crc16_fold, true, block);
+
+	crc = __nvme_crc16_slice8(0, block, 16);
+
+	return __nvme_crc16_slice8(crc, buffer + off, len - off);
+}
+
+static bool __vpclmul_supported(void)
+{
+	__builtin_cpu_init();
+
+	return __pclmul_supported() && __builtin_cpu_supports("avx2") &&
+		__builtin_cpu_supports("vpclmulqdq");
+}
+
+const struct nvme_crc_impl __nvme_crc_vpclmul = {
+	.name = "vpclmulqdq",
+	.supported = __vpclmul_supported,
+	.crc64 = __crc64_vpclmul,
+	.crc16 = __crc16_vpclmul,
+};
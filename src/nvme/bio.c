@@ -0,0 +1,684 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/bio: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+/* maximum number of completions reaped by nvme_bio_wait() before dispatching */
+#define NVME_BIO_REAP_MAX 32
+
+struct nvme_bio_child {
+	struct iovec iov[NVME_BIO_MAX_IOV];
+	int niov;
+
+	uint32_t nlb;
+
+	/* cursor after the child */
+	int iov_idx;
+	size_t iov_off;
+};
+
+static void __bio_rq_cb(struct nvme_rq *rq, struct nvme_cqe *cqe);
+
+int __nvme_bio_init(struct nvme_bio *bio, struct nvme_ctrl *ctrl,
+		    const struct nvme_ns_info *info, uint8_t opcode, uint64_t offset,
+		    struct iovec *iov, int niov)
+{
+	size_t lbsize, len = 0;
+
+	lbsize = nvme_ns_lba_size(info);
+
+	for (int i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+
+	if (!len || len % lbsize || offset % lbsize) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(bio, 0x0, sizeof(*bio));
+
+	bio->cmd.opcode = opcode;
+	bio->cmd.nsid = cpu_to_le32(info->nsid);
+
+	bio->ctrl = ctrl;
+	bio->info = info;
+
+	bio->slba = offset / lbsize;
+	bio->nlb = len / lbsize;
+
+	bio->iov = iov;
+	bio->niov = niov;
+
+	return 0;
+}
+
+int nvme_bio_init(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint8_t opcode, uint32_t nsid,
+		  uint64_t offset, struct iovec *iov, int niov)
+{
+	const struct nvme_ns_info *info;
+
+	info = nvme_ns_get_info(ctrl, nsid);
+	if (!info)
+		return -1;
+
+	return __nvme_bio_init(bio, ctrl, info, opcode, offset, iov, niov);
+}
+
+void __nvme_bio_init_flush(struct nvme_bio *bio, struct nvme_ctrl *ctrl,
+			   const struct nvme_ns_info *info)
+{
+	memset(bio, 0x0, sizeof(*bio));
+
+	bio->cmd.opcode = NVME_CMD_FLUSH;
+	bio->cmd.nsid = cpu_to_le32(info->nsid);
+
+	bio->ctrl = ctrl;
+	bio->info = info;
+
+	/* a single command */
+	bio->nlb = 1;
+}
+
+int nvme_bio_init_flush(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint32_t nsid)
+{
+	const struct nvme_ns_info *info;
+
+	info = nvme_ns_get_info(ctrl, nsid);
+	if (!info)
+		return -1;
+
+	__nvme_bio_init_flush(bio, ctrl, info);
+
+	return 0;
+}
+
+int __nvme_bio_init_trim(struct nvme_bio *bio, struct nvme_ctrl *ctrl,
+			 const struct nvme_ns_info *info, uint64_t offset, uint64_t len)
+{
+	size_t lbsize = nvme_ns_lba_size(info);
+
+	if (!len || len % lbsize || offset % lbsize) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(bio, 0x0, sizeof(*bio));
+
+	bio->cmd.opcode = NVME_CMD_DSM;
+	bio->cmd.nsid = cpu_to_le32(info->nsid);
+
+	bio->ctrl = ctrl;
+	bio->info = info;
+
+	bio->slba = offset / lbsize;
+	bio->nlb = len / lbsize;
+
+	return 0;
+}
+
+int nvme_bio_init_trim(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint32_t nsid,
+		       uint64_t offset, uint64_t len)
+{
+	const struct nvme_ns_info *info;
+
+	info = nvme_ns_get_info(ctrl, nsid);
+	if (!info)
+		return -1;
+
+	return __nvme_bio_init_trim(bio, ctrl, info, offset, len);
+}
+
+int nvme_bio_init_trimv(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint32_t nsid,
+			const struct nvme_lba_range *ranges, int nranges)
+{
+	const struct nvme_ns_info *info;
+	uint64_t nlb = 0;
+
+	info = nvme_ns_get_info(ctrl, nsid);
+	if (!info)
+		return -1;
+
+	if (nranges <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int i = 0; i < nranges; i++) {
+		if (!ranges[i].nlb) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		nlb += ranges[i].nlb;
+	}
+
+	memset(bio, 0x0, sizeof(*bio));
+
+	bio->cmd.opcode = NVME_CMD_DSM;
+	bio->cmd.nsid = cpu_to_le32(nsid);
+
+	bio->ctrl = ctrl;
+	bio->info = info;
+
+	bio->ranges = ranges;
+	bio->nranges = nranges;
+
+	bio->slba = ranges[0].slba;
+	bio->nlb = nlb;
+
+	return 0;
+}
+
+int nvme_bio_init_copy(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint32_t nsid,
+		       const struct nvme_lba_range *ranges, int nranges, uint64_t sdlba)
+{
+	const struct nvme_ns_info *info;
+	uint64_t nlb = 0;
+
+	info = nvme_ns_get_info(ctrl, nsid);
+	if (!info)
+		return -1;
+
+	if (!info->msrc) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (nranges <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int i = 0; i < nranges; i++) {
+		if (!ranges[i].nlb || ranges[i].slba >= info->nsze ||
+		    ranges[i].nlb > info->nsze - ranges[i].slba) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		nlb += ranges[i].nlb;
+	}
+
+	if (sdlba >= info->nsze || nlb > info->nsze - sdlba) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(bio, 0x0, sizeof(*bio));
+
+	bio->cmd.opcode = NVME_CMD_COPY;
+	bio->cmd.nsid = cpu_to_le32(nsid);
+
+	bio->ctrl = ctrl;
+	bio->info = info;
+
+	bio->ranges = ranges;
+	bio->nranges = nranges;
+
+	bio->slba = ranges[0].slba;
+	bio->nlb = nlb;
+	bio->dlba = sdlba;
+
+	return 0;
+}
+
+/*
+ * Carve the next child out of @bio, starting at the iovec cursor. The child is
+ * limited by the namespace (MDTS and optimal I/O boundary) and by what the
+ * data pointer of a single command can describe: a bounded number of SGL data
+ * block descriptors or a single page of PRP entries, where every PRP entry but
+ * the first must be page aligned.
+ */
+static int __bio_next(struct nvme_bio *bio, bool sgl, struct nvme_bio_child *child)
+{
+	int pageshift = __mps_to_pageshift(bio->ctrl->config.mps);
+	size_t pagesize = 1 << pageshift;
+	int max_prps = 1 << (pageshift - 3);
+	int max_iov = sgl ? min_t(int, NVME_BIO_MAX_IOV, 1 << (pageshift - 4)) : NVME_BIO_MAX_IOV;
+	size_t lbsize = nvme_ns_lba_size(bio->info);
+	size_t max, len = 0, trim;
+	int idx = bio->iov_idx, prps = 0, n = 0;
+	size_t off = bio->iov_off;
+
+	max = (size_t)min_t(uint64_t, bio->nlb, nvme_ns_max_nlb(bio->info, bio->slba)) * lbsize;
+
+	while (len < max && idx < bio->niov && n < max_iov) {
+		void *base = bio->iov[idx].iov_base + off;
+		size_t take = min_t(size_t, bio->iov[idx].iov_len - off, max - len);
+
+		if (!take) {
+			idx++;
+			off = 0;
+
+			continue;
+		}
+
+		if (!sgl) {
+			uintptr_t addr = (uintptr_t)base;
+			int pages;
+
+			/* split where the buffer cannot continue the prp list */
+			if (n && (!ALIGNED(addr, pagesize) ||
+				  !ALIGNED((uintptr_t)child->iov[n - 1].iov_base +
+					   child->iov[n - 1].iov_len, pagesize)))
+				break;
+
+			pages = (int)((ALIGN_UP(addr + take, pagesize) -
+				       ALIGN_DOWN(addr, pagesize)) >> pageshift);
+
+			if (prps + pages > max_prps) {
+				pages = max_prps - prps;
+				take = ALIGN_DOWN(addr, pagesize) + ((size_t)pages << pageshift) - addr;
+			}
+
+			prps += pages;
+		}
+
+		child->iov[n++] = (struct iovec) { .iov_base = base, .iov_len = take };
+
+		len += take;
+		off += take;
+
+		if (off == bio->iov[idx].iov_len) {
+			idx++;
+			off = 0;
+		}
+
+		if (!sgl && prps == max_prps)
+			break;
+	}
+
+	/* only transfer whole logical blocks */
+	trim = len % lbsize;
+	if (trim == len) {
+		log_debug("logical block cannot be described by a single command\n");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	len -= trim;
+
+	while (trim) {
+		struct iovec *last = &child->iov[n - 1];
+		size_t cut = min_t(size_t, trim, last->iov_len);
+
+		last->iov_len -= cut;
+		trim -= cut;
+
+		/* move the cursor back (over any zero length entries) */
+		while (!off) {
+			idx--;
+			off = bio->iov[idx].iov_len;
+		}
+
+		off -= cut;
+
+		if (!last->iov_len)
+			n--;
+	}
+
+	child->niov = n;
+	child->nlb = (uint32_t)(len / lbsize);
+	child->iov_idx = idx;
+	child->iov_off = off;
+
+	return 0;
+}
+
+/* the ranges are written to the prp list page of the request tracker */
+static void __bio_prep_dsm(struct nvme_bio *bio, struct nvme_rq *rq, union nvme_cmd *cmd)
+{
+	struct nvme_dsm_range *ranges = rq->page.vaddr;
+	unsigned int n = 0;
+
+	while (bio->nlb && n < NVME_DSM_MAX_RANGES) {
+		uint64_t left = bio->nlb;
+		uint32_t nlb;
+
+		if (bio->ranges) {
+			const struct nvme_lba_range *r = &bio->ranges[bio->range_idx];
+
+			left = r->slba + r->nlb - bio->slba;
+		}
+
+		nlb = (uint32_t)min_t(uint64_t, left, UINT32_MAX);
+
+		ranges[n++] = (struct nvme_dsm_range) {
+			.nlb = cpu_to_le32(nlb),
+			.slba = cpu_to_le64(bio->slba),
+		};
+
+		bio->slba += nlb;
+		bio->nlb -= nlb;
+
+		/* move on to the next range */
+		if (bio->nlb && nlb == left)
+			bio->slba = bio->ranges[++bio->range_idx].slba;
+	}
+
+	cmd->cdw10 = cpu_to_le32(n - 1);
+	cmd->cdw11 = cpu_to_le32(NVME_DSM_ATTR_AD);
+	cmd->dptr.prp1 = cpu_to_le64(rq->page.iova);
+}
+
+/*
+ * The source ranges are written to the prp list page of the request tracker.
+ * A command is limited by the number of source ranges (and the number of
+ * entries that fit in the page), the length of a single source range and the
+ * total copy length.
+ */
+static void __bio_prep_copy(struct nvme_bio *bio, struct nvme_rq *rq, union nvme_cmd *cmd)
+{
+	const struct nvme_ns_info *info = bio->info;
+	size_t pagesize = __mps_to_pagesize(bio->ctrl->config.mps);
+	struct nvme_copy_range *ranges = rq->page.vaddr;
+	unsigned int n = 0, max;
+	uint64_t len = 0;
+
+	max = (unsigned int)min_t(size_t, info->msrc, pagesize / sizeof(*ranges));
+
+	while (bio->nlb && n < max && len < info->mcl) {
+		const struct nvme_lba_range *r = &bio->ranges[bio->range_idx];
+		uint64_t left = r->slba + r->nlb - bio->slba;
+		uint64_t nlb;
+
+		nlb = min_t(uint64_t, left, min_t(uint64_t, info->mssrl, info->mcl - len));
+
+		ranges[n++] = (struct nvme_copy_range) {
+			.slba = cpu_to_le64(bio->slba),
+			.nlb = cpu_to_le16((uint16_t)(nlb - 1)),
+		};
+
+		bio->slba += nlb;
+		bio->nlb -= nlb;
+		len += nlb;
+
+		/* move on to the next range */
+		if (bio->nlb && nlb == left)
+			bio->slba = bio->ranges[++bio->range_idx].slba;
+	}
+
+	cmd->rw.slba = cpu_to_le64(bio->dlba);
+	cmd->cdw12 = cpu_to_le32(NVME_FIELD_SET(n - 1, COPY_NR));
+	cmd->dptr.prp1 = cpu_to_le64(rq->page.iova);
+
+	bio->dlba += len;
+}
+
+/* set the initial reference tag and metadata pointer of a child */
+static int __bio_prep_pi(struct nvme_bio *bio, union nvme_cmd *cmd)
+{
+	const struct nvme_ns_info *info = bio->info;
+	uint64_t iova;
+
+	cmd->rw.reftag = cpu_to_le32((uint32_t)bio->slba);
+
+	/* the upper bits of the 48 bit reference tag */
+	if (info->pif == NVME_NS_PIF_64B)
+		cmd->rw.cdw3 = cpu_to_le32((uint32_t)(bio->slba >> 32) & 0xffff);
+
+	if (!bio->mbuf)
+		return 0;
+
+	if (!iommu_translate_vaddr(__iommu_ctx(bio->ctrl),
+				   bio->mbuf + (bio->slba - bio->pi_slba) * info->ms, &iova)) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	cmd->rw.mptr = cpu_to_le64(iova);
+
+	return 0;
+}
+
+int __nvme_bio_prep(struct nvme_bio *bio, struct nvme_rq *rq, union nvme_cmd *cmd)
+{
+	struct nvme_ctrl *ctrl = bio->ctrl;
+	struct nvme_bio_child child;
+	bool sgl;
+
+	memcpy(cmd, &bio->cmd, sizeof(*cmd));
+
+	switch (bio->cmd.opcode) {
+	case NVME_CMD_FLUSH:
+		bio->nlb = 0;
+
+		return 0;
+
+	case NVME_CMD_DSM:
+		__bio_prep_dsm(bio, rq, cmd);
+
+		return 0;
+
+	case NVME_CMD_COPY:
+		__bio_prep_copy(bio, rq, cmd);
+
+		return 0;
+
+	default:
+		break;
+	}
+
+	sgl = (ctrl->flags & NVME_CTRL_F_SGLS_SUPPORTED) && rq->sq->id;
+
+	if (__bio_next(bio, sgl, &child))
+		return -1;
+
+	/* the controller picks the location of the data */
+	if (bio->cmd.opcode == NVME_CMD_ZONE_APPEND && child.nlb != bio->nlb) {
+		log_debug("zone append cannot be described by a single command\n");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (nvme_rq_mapv(ctrl, rq, cmd, child.iov, child.niov))
+		return -1;
+
+	cmd->rw.slba = cpu_to_le64(bio->slba);
+	cmd->rw.nlb = cpu_to_le16((uint16_t)(child.nlb - 1));
+
+	if (bio->pi && __bio_prep_pi(bio, cmd))
+		return -1;
+
+	bio->slba += child.nlb;
+	bio->nlb -= child.nlb;
+
+	bio->iov_idx = child.iov_idx;
+	bio->iov_off = child.iov_off;
+
+	return 0;
+}
+
+static int __bio_post(struct nvme_bio *bio, struct nvme_rq *rq)
+{
+	union nvme_cmd cmd;
+
+	if (__nvme_bio_prep(bio, rq, &cmd))
+		return -1;
+
+	rq->opaque = bio;
+	rq->cb = __bio_rq_cb;
+
+	pthread_spin_lock(&bio->sq->lock);
+	nvme_rq_post(rq, &cmd);
+	pthread_spin_unlock(&bio->sq->lock);
+
+	bio->inflight++;
+
+	return 0;
+}
+
+static void __bio_fail(struct nvme_bio *bio, int err)
+{
+	if (!bio->err)
+		bio->err = err;
+
+	/* do not submit the rest of the request */
+	bio->nlb = 0;
+}
+
+static void __bio_rq_cb(struct nvme_rq *rq, struct nvme_cqe *cqe)
+{
+	struct nvme_bio *bio = rq->opaque;
+
+	bio->inflight--;
+
+	if (!bio->err)
+		memcpy(&bio->cqe, cqe, sizeof(*cqe));
+
+	if (!nvme_cqe_ok(cqe)) {
+		nvme_set_errno_from_cqe(cqe);
+		__bio_fail(bio, errno);
+	}
+
+	/* keep the request tracker busy with the next child */
+	if (bio->nlb) {
+		if (!__bio_post(bio, rq))
+			return;
+
+		__bio_fail(bio, errno);
+	}
+
+	nvme_rq_release_atomic(rq);
+
+	if (bio->inflight)
+		return;
+
+	if (bio->end_io)
+		bio->end_io(bio);
+
+	if (bio->cb)
+		bio->cb(bio);
+}
+
+int nvme_bio_submit(struct nvme_bio *bio, struct nvme_sq *sq)
+{
+	struct nvme_rq *rq;
+
+	if (bio->inflight) {
+		errno = EALREADY;
+		return -1;
+	}
+
+	bio->sq = sq;
+
+	while (bio->nlb && (rq = nvme_rq_acquire_atomic(sq))) {
+		if (__bio_post(bio, rq)) {
+			int err = errno;
+
+			nvme_rq_release_atomic(rq);
+
+			if (!bio->inflight) {
+				errno = err;
+				return -1;
+			}
+
+			__bio_fail(bio, err);
+		}
+	}
+
+	if (!bio->inflight) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	pthread_spin_lock(&sq->lock);
+	nvme_sq_update_tail(sq);
+	pthread_spin_unlock(&sq->lock);
+
+	return 0;
+}
+
+int nvme_bio_wait(struct nvme_bio *bio)
+{
+	struct nvme_sq *sq = bio->sq;
+	struct nvme_cq *cq = sq->cq;
+
+	while (bio->inflight) {
+		struct nvme_cqe cqes[NVME_BIO_REAP_MAX], *cqe;
+		struct nvme_rq *rqs[NVME_BIO_REAP_MAX];
+		int n;
+
+		if (pthread_spin_trylock(&cq->lock))
+			continue;
+
+		/* completions reaped and stashed by synchronous waiters */
+		n = __nvme_cq_stash_take_cb(cq, sq, rqs, cqes, NVME_BIO_REAP_MAX);
+
+		while (n < NVME_BIO_REAP_MAX && (cqe = nvme_cq_get_cqe(cq))) {
+			struct nvme_rq *rq = nvme_rq_from_cqe(bio->ctrl, cqe);
+
+			if (!rq) {
+				log_error("SPURIOUS CQE (cq %d cid %" PRIu16 ")\n", cq->id, cqe->cid);
+				continue;
+			}
+
+			/* completions for waiters */
+			if (!rq->cb) {
+				__nvme_cq_stash_put(cq, cqe);
+				continue;
+			}
+
+			rqs[n] = rq;
+			memcpy(&cqes[n++], cqe, sizeof(*cqe));
+		}
+
+		nvme_cq_update_head(cq);
+
+		pthread_spin_unlock(&cq->lock);
+
+		for (int i = 0; i < n; i++) {
+			nvme_rq_disarm(rqs[i]);
+			rqs[i]->cb(rqs[i], &cqes[i]);
+		}
+
+		if (n) {
+			pthread_spin_lock(&sq->lock);
+			nvme_sq_update_tail(sq);
+			pthread_spin_unlock(&sq->lock);
+		}
+
+		nvme_sq_check_timeouts(sq);
+	}
+
+	if (bio->err) {
+		errno = bio->err;
+		return -1;
+	}
+
+	return 0;
+}
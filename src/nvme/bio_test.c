@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+
+#include "ccan/tap/tap.h"
+
+#include "bio.c"
+#include "fakedev.h"
+
+#define SQSIZE 4
+#define CQSIZE 8
+#define MAX_LOG 32
+
+static struct nvme_ns_info info = {
+	.nsid = 1,
+	.lbads = 9,
+	.max_nlb = 16,
+	.noiob = 32,
+};
+
+const struct nvme_ns_info *nvme_ns_get_info(struct nvme_ctrl *ctrl UNUSED, uint32_t nsid)
+{
+	if (nsid != info.nsid) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	return &info;
+}
+
+static struct nvme_sq sqs[2];
+static struct nvme_cq cqs[2];
+static struct nvme_rq rqs[SQSIZE - 1];
+static struct fakedev fdev;
+
+/* commands seen by the fake device */
+static struct {
+	/* fail the command with this starting lba */
+	uint64_t fail_slba;
+
+	int n;
+	struct {
+		uint64_t slba;
+		uint16_t nlb;
+		uint64_t prp1;
+		uint64_t mptr;
+		uint32_t reftag;
+	} log[MAX_LOG];
+} dev = { .fail_slba = UINT64_MAX };
+
+static uint16_t dev_exec(struct fakedev *fdev UNUSED, union nvme_cmd *sqe, uint32_t *dw0 UNUSED)
+{
+	uint64_t slba = le64_to_cpu(sqe->rw.slba);
+
+	if (dev.n < MAX_LOG) {
+		dev.log[dev.n].slba = slba;
+		dev.log[dev.n].nlb = le16_to_cpu(sqe->rw.nlb);
+		dev.log[dev.n].prp1 = le64_to_cpu(sqe->dptr.prp1);
+		dev.log[dev.n].mptr = le64_to_cpu(sqe->rw.mptr);
+		dev.log[dev.n].reftag = le32_to_cpu(sqe->rw.reftag);
+	}
+
+	dev.n++;
+
+	return slba == dev.fail_slba ? 0x2 : 0x0;
+}
+
+static int ncb, nend;
+
+static void bio_cb(struct nvme_bio *bio UNUSED)
+{
+	ncb++;
+}
+
+static void bio_end_io(struct nvme_bio *bio UNUSED)
+{
+	/* called before the completion callback */
+	nend = ncb + 1;
+}
+
+static void reset(void)
+{
+	dev.n = 0;
+	ncb = nend = 0;
+}
+
+static void setup(struct nvme_ctrl *ctrl)
+{
+	fakedev_init(&fdev, 1, &sqs[1], SQSIZE, &cqs[1], CQSIZE, rqs);
+	fdev.exec = dev_exec;
+
+	ctrl->sq = sqs;
+	ctrl->cq = cqs;
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = {};
+	struct nvme_bio_child child;
+	struct nvme_bio bio;
+	struct iovec iov[3];
+	struct nvme_rq *held[SQSIZE - 1];
+	void *buf;
+	bool ok;
+
+	plan_tests(35);
+
+	setup(&ctrl);
+
+	assert(pgmap(&buf, 0x10000) > 0);
+
+	fakedev_start(&fdev);
+
+	/* invalid requests */
+	iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 0x300 };
+	ok1(nvme_bio_init(&bio, &ctrl, 0x2, 1, 0x0, iov, 1) == -1 && errno == EINVAL);
+
+	iov[0].iov_len = 0x200;
+	ok1(nvme_bio_init(&bio, &ctrl, 0x2, 1, 0x100, iov, 1) == -1 && errno == EINVAL);
+	ok1(nvme_bio_init(&bio, &ctrl, 0x2, 2, 0x0, iov, 1) == -1 && errno == ENOENT);
+
+	/* split at the maximum transfer size; more children than trackers */
+	reset();
+	iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 0xc000 };
+	ok1(nvme_bio_init(&bio, &ctrl, 0x2, 1, 0x0, iov, 1) == 0);
+
+	bio.cb = bio_cb;
+	bio.end_io = bio_end_io;
+
+	ok1(nvme_bio_submit(&bio, &sqs[1]) == 0);
+	ok1(nvme_bio_wait(&bio) == 0 && bio.err == 0);
+	ok1(ncb == 1 && nend == 1 && dev.n == 6);
+
+	ok = true;
+	for (int i = 0; i < 6; i++) {
+		if (dev.log[i].slba != (uint64_t)i * 16 || dev.log[i].nlb != 15 ||
+		    dev.log[i].prp1 != (uint64_t)buf + i * 0x2000)
+			ok = false;
+	}
+	ok1(ok);
+
+	/* all trackers are released */
+	ok1(sqs[1].rq_top != NULL && cqs[1].stash.ready[0] == 0x0);
+
+	/* split at the optimal i/o boundary */
+	reset();
+	iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 0x4000 };
+	ok1(nvme_bio_init(&bio, &ctrl, 0x1, 1, 24 << 9, iov, 1) == 0);
+	ok1(nvme_bio_submit(&bio, &sqs[1]) == 0 && nvme_bio_wait(&bio) == 0);
+	ok1(dev.n == 3);
+	ok1(dev.log[0].slba == 24 && dev.log[0].nlb == 7 && dev.log[1].slba == 32 &&
+	    dev.log[1].nlb == 15 && dev.log[2].slba == 48 && dev.log[2].nlb == 7);
+
+	/* zone append must fit in a single command */
+	reset();
+	iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 0xc000 };
+	ok1(nvme_bio_init(&bio, &ctrl, NVME_CMD_ZONE_APPEND, 1, 0x0, iov, 1) == 0);
+	ok1(nvme_bio_submit(&bio, &sqs[1]) == -1 && errno == EINVAL && dev.n == 0);
+
+	/* split where the prp list cannot continue */
+	reset();
+	iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 0x800 };
+	iov[1] = (struct iovec) { .iov_base = buf + 0x1000, .iov_len = 0x1000 };
+	ok1(nvme_bio_init(&bio, &ctrl, 0x2, 1, 0x0, iov, 2) == 0);
+	ok1(nvme_bio_submit(&bio, &sqs[1]) == 0 && nvme_bio_wait(&bio) == 0);
+	ok1(dev.n == 2 && dev.log[0].nlb == 3 && dev.log[1].slba == 4 && dev.log[1].nlb == 7 &&
+	    dev.log[1].prp1 == (uint64_t)buf + 0x1000);
+
+	/* zero length entries */
+	reset();
+	iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 0x200 };
+	iov[1] = (struct iovec) { .iov_base = buf + 0x200, .iov_len = 0x0 };
+	iov[2] = (struct iovec) { .iov_base = buf + 0x200, .iov_len = 0x200 };
+	ok1(nvme_bio_init(&bio, &ctrl, 0x2, 1, 0x0, iov, 3) == 0);
+	ok1(nvme_bio_submit(&bio, &sqs[1]) == 0 && nvme_bio_wait(&bio) == 0);
+	ok1(dev.n == 2 && dev.log[0].nlb == 0 && dev.log[1].slba == 1 &&
+	    dev.log[1].prp1 == (uint64_t)buf + 0x200);
+
+	/* the cursor moves back over zero length entries when trimming a child */
+	reset();
+	iov[0] = (struct iovec) { .iov_base = buf + 0xd00, .iov_len = 0x300 };
+	iov[1] = (struct iovec) { .iov_base = buf + 0x2000, .iov_len = 0x0 };
+	iov[2] = (struct iovec) { .iov_base = buf + 0x2100, .iov_len = 0x100 };
+	ok1(nvme_bio_init(&bio, &ctrl, 0x2, 1, 0x0, iov, 3) == 0);
+	ok1(__bio_next(&bio, false, &child) == 0 && child.nlb == 1 && child.niov == 1 &&
+	    child.iov_idx == 0 && child.iov_off == 0x200);
+
+	/* metadata pointer and initial reference tag of each child */
+	reset();
+	info.ms = 8;
+	info.pi = 1;
+	iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 0x6000 };
+	ok1(nvme_bio_init(&bio, &ctrl, 0x2, 1, 8 << 9, iov, 1) == 0);
+
+	bio.pi = true;
+	bio.mbuf = buf + 0x8000;
+	bio.pi_slba = bio.slba;
+
+	ok1(nvme_bio_submit(&bio, &sqs[1]) == 0 && nvme_bio_wait(&bio) == 0 && dev.n == 4);
+
+	ok = true;
+	for (int i = 0; i < 4; i++) {
+		uint64_t slba = (uint64_t[]) { 8, 24, 32, 48 }[i];
+
+		if (dev.log[i].slba != slba || dev.log[i].reftag != slba ||
+		    dev.log[i].mptr != (uint64_t)buf + 0x8000 + (slba - 8) * 8)
+			ok = false;
+	}
+	ok1(ok);
+
+	info.ms = 0;
+	info.pi = 0;
+
+	/* errors stop submission and are reported once */
+	reset();
+	dev.fail_slba = 16;
+	iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 0xc000 };
+	ok1(nvme_bio_init(&bio, &ctrl, 0x2, 1, 0x0, iov, 1) == 0);
+
+	bio.cb = bio_cb;
+
+	ok1(nvme_bio_submit(&bio, &sqs[1]) == 0);
+	ok1(nvme_bio_wait(&bio) == -1 && errno == EIO && bio.err == EIO && ncb == 1 &&
+	    dev.n < 6 && le16_to_cpu(bio.cqe.sfp) >> 1 == 0x2);
+
+	dev.fail_slba = UINT64_MAX;
+
+	/* completions stashed by a synchronous waiter */
+	reset();
+	iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 0x200 };
+	ok1(nvme_bio_init(&bio, &ctrl, 0x2, 1, 0x0, iov, 1) == 0);
+
+	bio.cb = bio_cb;
+
+	ok1(nvme_bio_submit(&bio, &sqs[1]) == 0);
+
+	held[0] = nvme_rq_acquire(&sqs[1]);
+	nvme_rq_exec(held[0], &(union nvme_cmd) { .opcode = 0x2 });
+
+	ok1(nvme_rq_wait(held[0], NULL, NULL) == 0 && cqs[1].stash.ready[0] != 0x0 && ncb == 0);
+	ok1(nvme_bio_wait(&bio) == 0 && ncb == 1 && cqs[1].stash.ready[0] == 0x0);
+
+	nvme_rq_release(held[0]);
+
+	/* no trackers available */
+	for (int i = 0; i < SQSIZE - 1; i++)
+		held[i] = nvme_rq_acquire(&sqs[1]);
+
+	ok1(nvme_bio_init(&bio, &ctrl, 0x2, 1, 0x0, iov, 1) == 0);
+	ok1(nvme_bio_submit(&bio, &sqs[1]) == -1 && errno == EBUSY);
+
+	for (int i = 0; i < SQSIZE - 1; i++)
+		nvme_rq_release(held[i]);
+
+	fakedev_stop(&fdev);
+
+	return exit_status();
+}
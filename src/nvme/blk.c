@@ -0,0 +1,553 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/blk: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/nvme.h>
+
+#include "ccan/array_size/array_size.h"
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+/* maximum number of commands in flight for a synchronous request */
+#define NVME_NS_SYNC_QD 8
+
+/* maximum number of times a failed command is retried */
+#define NVME_NS_RETRIES 3
+
+/* copies without the copy command are bounced in this many chunks at once */
+#define NVME_NS_COPY_DEPTH 4
+
+/* preferred size of a bounced chunk */
+#define NVME_NS_COPY_CHUNK (256 << 10)
+
+struct nvme_ns_slot {
+	struct nvme_rq *rq;
+	union nvme_cmd cmd;
+	int retries;
+};
+
+/* threads are assigned to queues in the order they first submit */
+static unsigned int __nthreads;
+static __thread int __thread_idx = -1;
+static __thread int __thread_qprio;
+
+/* index of a priority class in &nvme_ns.qprio */
+#define __qprio_idx(qprio) ((((qprio) & NVME_SQ_QPRIO_MASK) >> 1) + 1)
+
+int nvme_ns_open(struct nvme_ns *ns, struct nvme_ctrl *ctrl, uint32_t nsid)
+{
+	const struct nvme_ns_info *info;
+	int n = 0;
+
+	info = nvme_ns_get_info(ctrl, nsid);
+	if (!info)
+		return -1;
+
+	for (int qid = 1; qid <= ctrl->opts.nsqr + 1; qid++) {
+		if (ctrl->sq[qid].mem.vaddr)
+			n++;
+	}
+
+	if (!n) {
+		log_debug("no i/o queues\n");
+
+		errno = ENODEV;
+		return -1;
+	}
+
+	*ns = (struct nvme_ns) {
+		.ctrl = ctrl,
+		.nsid = nsid,
+		.info = info,
+		.qids = znew_t(int, n),
+	};
+
+	ns->qprio[0].n = n;
+
+	n = 0;
+
+	for (int qprio = 1; qprio < (int)ARRAY_SIZE(ns->qprio); qprio++) {
+		ns->qprio[qprio].first = n;
+
+		for (int qid = 1; qid <= ctrl->opts.nsqr + 1; qid++) {
+			struct nvme_sq *sq = &ctrl->sq[qid];
+
+			if (!sq->mem.vaddr)
+				continue;
+
+			if (__qprio_idx(sq->qprio) == qprio)
+				ns->qids[n++] = qid;
+		}
+
+		ns->qprio[qprio].n = n - ns->qprio[qprio].first;
+	}
+
+	return 0;
+}
+
+void nvme_ns_close(struct nvme_ns *ns)
+{
+	free(ns->qids);
+
+	memset(ns, 0x0, sizeof(*ns));
+}
+
+void nvme_ns_set_thread_qprio(int qprio)
+{
+	__thread_qprio = qprio < 0 ? 0 : __qprio_idx(qprio);
+}
+
+struct nvme_sq *nvme_ns_get_sq(struct nvme_ns *ns)
+{
+	int qprio = ns->qprio[__thread_qprio].n ? __thread_qprio : 0;
+
+	if (__thread_idx < 0)
+		__thread_idx = (int)((atomic_inc_fetch(&__nthreads) - 1) & INT32_MAX);
+
+	return &ns->ctrl->sq[ns->qids[ns->qprio[qprio].first +
+				      __thread_idx % ns->qprio[qprio].n]];
+}
+
+static inline void __post(struct nvme_sq *sq, struct nvme_rq *rq, union nvme_cmd *cmd)
+{
+	pthread_spin_lock(&sq->lock);
+	nvme_rq_exec(rq, cmd);
+	pthread_spin_unlock(&sq->lock);
+}
+
+static inline bool __retry(struct nvme_cqe *cqe, struct nvme_ns_slot *slot)
+{
+	if (le16_to_cpu(cqe->sfp) & NVME_CQE_SFP_DNR)
+		return false;
+
+	return slot->retries++ < NVME_NS_RETRIES;
+}
+
+/*
+ * Keep up to NVME_NS_SYNC_QD children of @bio in flight and wait for them in
+ * submission order. Completions are reaped with nvme_rq_wait(), so other
+ * threads may submit and wait on the same queue.
+ */
+int __nvme_ns_sync(struct nvme_ns *ns, struct nvme_bio *bio)
+{
+	struct nvme_sq *sq = nvme_ns_get_sq(ns);
+	struct nvme_ns_slot slots[NVME_NS_SYNC_QD];
+	int head = 0, n = 0;
+
+	bio->sq = sq;
+
+	while (bio->nlb || n) {
+		struct nvme_ns_slot *slot;
+		struct nvme_cqe cqe;
+
+		while (bio->nlb && n < NVME_NS_SYNC_QD) {
+			struct nvme_rq *rq = nvme_rq_acquire_atomic(sq);
+
+			/* wait for a tracker to complete */
+			if (!rq) {
+				if (n)
+					break;
+
+				continue;
+			}
+
+			slot = &slots[(head + n) % NVME_NS_SYNC_QD];
+
+			if (__nvme_bio_prep(bio, rq, &slot->cmd)) {
+				nvme_rq_release_atomic(rq);
+
+				if (!bio->err)
+					bio->err = errno;
+
+				bio->nlb = 0;
+
+				break;
+			}
+
+			slot->rq = rq;
+			slot->retries = 0;
+
+			__post(sq, rq, &slot->cmd);
+
+			n++;
+		}
+
+		if (!n)
+			break;
+
+		slot = &slots[head];
+
+		if (!nvme_rq_spin(slot->rq, &cqe)) {
+			if (!bio->err)
+				memcpy(&bio->cqe, &cqe, sizeof(cqe));
+		} else {
+			if (!bio->err && __retry(&cqe, slot)) {
+				log_debug("retrying command (cid %" PRIu16 ")\n", slot->rq->cid);
+
+				__post(sq, slot->rq, &slot->cmd);
+
+				continue;
+			}
+
+			if (!bio->err) {
+				memcpy(&bio->cqe, &cqe, sizeof(cqe));
+				bio->err = errno;
+			}
+
+			/* do not submit the rest of the request */
+			bio->nlb = 0;
+		}
+
+		nvme_rq_release_atomic(slot->rq);
+
+		head = (head + 1) % NVME_NS_SYNC_QD;
+		n--;
+	}
+
+	if (bio->end_io)
+		bio->end_io(bio);
+
+	if (bio->err) {
+		errno = bio->err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nvme_ns_readv(struct nvme_ns *ns, struct iovec *iov, int niov, uint64_t offset)
+{
+	struct nvme_bio bio;
+
+	if (__nvme_bio_init(&bio, ns->ctrl, ns->info, NVME_CMD_READ, offset, iov, niov))
+		return -1;
+
+	return __nvme_ns_sync(ns, &bio);
+}
+
+int nvme_ns_writev(struct nvme_ns *ns, struct iovec *iov, int niov, uint64_t offset)
+{
+	struct nvme_bio bio;
+
+	if (__nvme_bio_init(&bio, ns->ctrl, ns->info, NVME_CMD_WRITE, offset, iov, niov))
+		return -1;
+
+	return __nvme_ns_sync(ns, &bio);
+}
+
+int nvme_ns_flush(struct nvme_ns *ns)
+{
+	struct nvme_bio bio;
+
+	__nvme_bio_init_flush(&bio, ns->ctrl, ns->info);
+
+	return __nvme_ns_sync(ns, &bio);
+}
+
+int nvme_ns_trim(struct nvme_ns *ns, uint64_t offset, uint64_t len)
+{
+	struct nvme_bio bio;
+
+	if (__nvme_bio_init_trim(&bio, ns->ctrl, ns->info, offset, len))
+		return -1;
+
+	return __nvme_ns_sync(ns, &bio);
+}
+
+struct nvme_ns_copy {
+	struct nvme_ns *ns;
+
+	/* cursor in the source ranges */
+	const struct nvme_lba_range *ranges;
+	int nranges, idx;
+	uint64_t slba, dlba;
+
+	uint64_t chunk_nlb;
+	int err;
+
+	struct nvme_ns_copy_slot {
+		struct nvme_ns_copy *copy;
+		struct nvme_bio bio;
+		struct iovec iov;
+		uint64_t dlba;
+		bool busy, parked;
+	} slots[NVME_NS_COPY_DEPTH];
+};
+
+static void __copy_next(struct nvme_ns_copy_slot *slot);
+
+static void __copy_fail(struct nvme_ns_copy_slot *slot, int err)
+{
+	if (!slot->copy->err)
+		slot->copy->err = err;
+
+	slot->busy = false;
+}
+
+/* submit the bio of @slot; it is parked if no request tracker is available */
+static void __copy_submit(struct nvme_ns_copy_slot *slot)
+{
+	slot->parked = false;
+
+	if (nvme_bio_submit(&slot->bio, nvme_ns_get_sq(slot->copy->ns))) {
+		if (errno == EBUSY) {
+			slot->parked = true;
+			return;
+		}
+
+		__copy_fail(slot, errno);
+	}
+}
+
+static void __copy_write_cb(struct nvme_bio *bio)
+{
+	struct nvme_ns_copy_slot *slot = bio->opaque;
+
+	if (bio->err) {
+		__copy_fail(slot, bio->err);
+		return;
+	}
+
+	__copy_next(slot);
+}
+
+static void __copy_read_cb(struct nvme_bio *bio)
+{
+	struct nvme_ns_copy_slot *slot = bio->opaque;
+	struct nvme_ns *ns = slot->copy->ns;
+	size_t lbsize = nvme_ns_lba_size(ns->info);
+
+	if (bio->err) {
+		__copy_fail(slot, bio->err);
+		return;
+	}
+
+	if (__nvme_bio_init(&slot->bio, ns->ctrl, ns->info, NVME_CMD_WRITE, slot->dlba * lbsize,
+			    &slot->iov, 1))
+		goto err;
+
+	slot->bio.cb = __copy_write_cb;
+	slot->bio.opaque = slot;
+
+	__copy_submit(slot);
+
+	return;
+
+err:
+	__copy_fail(slot, errno);
+}
+
+/* read the next chunk of the source ranges into the buffer of @slot */
+static void __copy_next(struct nvme_ns_copy_slot *slot)
+{
+	struct nvme_ns_copy *copy = slot->copy;
+	struct nvme_ns *ns = copy->ns;
+	size_t lbsize = nvme_ns_lba_size(ns->info);
+	const struct nvme_lba_range *r;
+	uint64_t slba, nlb, left;
+
+	if (copy->err || copy->idx == copy->nranges) {
+		slot->busy = false;
+		return;
+	}
+
+	r = &copy->ranges[copy->idx];
+	left = r->slba + r->nlb - copy->slba;
+	nlb = min_t(uint64_t, left, copy->chunk_nlb);
+	slba = copy->slba;
+
+	slot->iov.iov_len = nlb * lbsize;
+	slot->dlba = copy->dlba;
+
+	copy->slba += nlb;
+	copy->dlba += nlb;
+
+	if (nlb == left && ++copy->idx < copy->nranges)
+		copy->slba = copy->ranges[copy->idx].slba;
+
+	if (__nvme_bio_init(&slot->bio, ns->ctrl, ns->info, NVME_CMD_READ, slba * lbsize,
+			    &slot->iov, 1))
+		goto err;
+
+	slot->bio.cb = __copy_read_cb;
+	slot->bio.opaque = slot;
+	slot->busy = true;
+
+	__copy_submit(slot);
+
+	return;
+
+err:
+	__copy_fail(slot, errno);
+}
+
+/*
+ * Copy through a bounce buffer of NVME_NS_COPY_DEPTH chunks. Each chunk is
+ * read and then written back from the completion callback of the read, so
+ * reads and writes of different chunks overlap. Slots that cannot get a
+ * request tracker are parked and resubmitted as others complete.
+ */
+static int __copy_bounce(struct nvme_ns *ns, const struct nvme_lba_range *ranges, int nranges,
+			 uint64_t sdlba)
+{
+	__autovar_s(iommu_dmabuf) buf = {};
+	size_t lbsize = nvme_ns_lba_size(ns->info);
+	struct nvme_ns_copy copy = {
+		.ns = ns,
+		.ranges = ranges,
+		.nranges = nranges,
+		.slba = ranges[0].slba,
+		.dlba = sdlba,
+	};
+
+	copy.chunk_nlb = clamp_t(uint64_t, NVME_NS_COPY_CHUNK / lbsize, 1, ns->info->max_nlb);
+
+	if (iommu_get_dmabuf(__iommu_ctx(ns->ctrl), &buf,
+			     NVME_NS_COPY_DEPTH * copy.chunk_nlb * lbsize, 0x0))
+		return -1;
+
+	for (int i = 0; i < NVME_NS_COPY_DEPTH; i++) {
+		struct nvme_ns_copy_slot *slot = &copy.slots[i];
+
+		slot->copy = &copy;
+		slot->iov.iov_base = buf.vaddr + i * copy.chunk_nlb * lbsize;
+
+		__copy_next(slot);
+	}
+
+	while (true) {
+		struct nvme_ns_copy_slot *inflight = NULL;
+		bool parked = false;
+
+		for (int i = 0; i < NVME_NS_COPY_DEPTH; i++) {
+			struct nvme_ns_copy_slot *slot = &copy.slots[i];
+
+			if (slot->parked)
+				__copy_submit(slot);
+
+			if (slot->parked)
+				parked = true;
+			else if (slot->busy)
+				inflight = slot;
+		}
+
+		if (inflight)
+			nvme_bio_wait(&inflight->bio);
+		else if (!parked)
+			break;
+	}
+
+	if (copy.err) {
+		errno = copy.err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nvme_ns_copy(struct nvme_ns *ns, const struct nvme_lba_range *ranges, int nranges,
+		 uint64_t sdlba)
+{
+	const struct nvme_ns_info *info = ns->info;
+	struct nvme_bio bio;
+	uint64_t nlb = 0;
+
+	if (info->msrc) {
+		if (nvme_bio_init_copy(&bio, ns->ctrl, ns->nsid, ranges, nranges, sdlba))
+			return -1;
+
+		return __nvme_ns_sync(ns, &bio);
+	}
+
+	if (nranges <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int i = 0; i < nranges; i++) {
+		if (!ranges[i].nlb || ranges[i].slba >= info->nsze ||
+		    ranges[i].nlb > info->nsze - ranges[i].slba) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		nlb += ranges[i].nlb;
+	}
+
+	if (sdlba >= info->nsze || nlb > info->nsze - sdlba) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return __copy_bounce(ns, ranges, nranges, sdlba);
+}
+
+static int __submit(struct nvme_ns *ns, struct nvme_bio *bio, nvme_bio_cb cb, void *opaque)
+{
+	bio->cb = cb;
+	bio->opaque = opaque;
+
+	return nvme_bio_submit(bio, nvme_ns_get_sq(ns));
+}
+
+int nvme_ns_readv_async(struct nvme_ns *ns, struct nvme_bio *bio, struct iovec *iov, int niov,
+			uint64_t offset, nvme_bio_cb cb, void *opaque)
+{
+	if (__nvme_bio_init(bio, ns->ctrl, ns->info, NVME_CMD_READ, offset, iov, niov))
+		return -1;
+
+	return __submit(ns, bio, cb, opaque);
+}
+
+int nvme_ns_writev_async(struct nvme_ns *ns, struct nvme_bio *bio, struct iovec *iov, int niov,
+			 uint64_t offset, nvme_bio_cb cb, void *opaque)
+{
+	if (__nvme_bio_init(bio, ns->ctrl, ns->info, NVME_CMD_WRITE, offset, iov, niov))
+		return -1;
+
+	return __submit(ns, bio, cb, opaque);
+}
+
+int nvme_ns_flush_async(struct nvme_ns *ns, struct nvme_bio *bio, nvme_bio_cb cb, void *opaque)
+{
+	__nvme_bio_init_flush(bio, ns->ctrl, ns->info);
+
+	return __submit(ns, bio, cb, opaque);
+}
+
+int nvme_ns_trim_async(struct nvme_ns *ns, struct nvme_bio *bio, uint64_t offset, uint64_t len,
+		       nvme_bio_cb cb, void *opaque)
+{
+	if (__nvme_bio_init_trim(bio, ns->ctrl, ns->info, offset, len))
+		return -1;
+
+	return __submit(ns, bio, cb, opaque);
+}
@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <pthread.h>
+
+#include "ccan/tap/tap.h"
+
+#include "blk.c"
+#include "fakedev.h"
+
+#define NSQR 3
+#define SQSIZE 4
+#define CQSIZE 8
+#define MAX_LOG 32
+
+static struct nvme_ns_info info = {
+	.nsid = 1,
+	.nsze = 0x10000,
+	.lbads = 9,
+	.max_nlb = 16,
+};
+
+const struct nvme_ns_info *nvme_ns_get_info(struct nvme_ctrl *ctrl UNUSED, uint32_t nsid)
+{
+	if (nsid != info.nsid) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	return &info;
+}
+
+static struct nvme_sq sqs[NSQR + 2];
+static struct nvme_cq cqs[NSQR + 2];
+static struct nvme_rq rqs[SQSIZE - 1];
+static struct fakedev fdev;
+
+/* commands seen by the fake device serving queue pair 1 */
+static struct {
+	/* fail commands with this starting lba */
+	uint64_t fail_slba;
+	int fail_count;
+	bool fail_dnr;
+
+	int n;
+	struct {
+		uint8_t opcode;
+		uint64_t slba;
+		uint16_t nlb;
+		uint32_t cdw10, cdw11, cdw12;
+		struct nvme_dsm_range ranges[2];
+		struct nvme_copy_range copy[2];
+	} log[MAX_LOG];
+} dev = { .fail_slba = UINT64_MAX };
+
+static uint16_t dev_exec(struct fakedev *fdev UNUSED, union nvme_cmd *sqe, uint32_t *dw0 UNUSED)
+{
+	uint64_t slba = le64_to_cpu(sqe->rw.slba);
+	uint16_t status = 0x0;
+
+	if (sqe->opcode != NVME_CMD_FLUSH && slba == dev.fail_slba && dev.fail_count) {
+		dev.fail_count--;
+		status = dev.fail_dnr ? 0x4002 : 0x2;
+	}
+
+	if (dev.n < MAX_LOG) {
+		dev.log[dev.n].opcode = sqe->opcode;
+		dev.log[dev.n].slba = slba;
+		dev.log[dev.n].nlb = le16_to_cpu(sqe->rw.nlb);
+		dev.log[dev.n].cdw10 = le32_to_cpu(sqe->cdw10);
+		dev.log[dev.n].cdw11 = le32_to_cpu(sqe->cdw11);
+		dev.log[dev.n].cdw12 = le32_to_cpu(sqe->cdw12);
+
+		if (sqe->opcode == NVME_CMD_DSM)
+			memcpy(dev.log[dev.n].ranges, (void *)le64_to_cpu(sqe->dptr.prp1),
+			       sizeof(dev.log[dev.n].ranges));
+
+		if (sqe->opcode == NVME_CMD_COPY)
+			memcpy(dev.log[dev.n].copy, (void *)le64_to_cpu(sqe->dptr.prp1),
+			       sizeof(dev.log[dev.n].copy));
+	}
+
+	dev.n++;
+
+	return status;
+}
+
+static int ncb;
+
+static void bio_cb(struct nvme_bio *bio UNUSED)
+{
+	ncb++;
+}
+
+static void *other_thread(void *opaque)
+{
+	return nvme_ns_get_sq(opaque);
+}
+
+static void setup(struct nvme_ctrl *ctrl)
+{
+	fakedev_init(&fdev, 1, &sqs[1], SQSIZE, &cqs[1], CQSIZE, rqs);
+	fdev.exec = dev_exec;
+
+	sqs[1].qprio = NVME_SQ_QPRIO_URGENT;
+
+	/* only used for queue selection */
+	sqs[3].id = 3;
+	sqs[3].mem.vaddr = (void *)0x1000;
+	sqs[3].qprio = NVME_SQ_QPRIO_LOW;
+
+	ctrl->sq = sqs;
+	ctrl->cq = cqs;
+	ctrl->opts.nsqr = NSQR;
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = {};
+	struct nvme_ns ns;
+	struct nvme_bio bio;
+	struct nvme_lba_range ranges[258];
+	struct iovec iov;
+	pthread_t thread;
+	void *buf, *sq;
+	bool ok;
+
+	plan_tests(38);
+
+	ctrl.sq = sqs;
+	ctrl.opts.nsqr = NSQR;
+
+	ok1(nvme_ns_open(&ns, &ctrl, 1) == -1 && errno == ENODEV);
+
+	setup(&ctrl);
+
+	ok1(nvme_ns_open(&ns, &ctrl, 2) == -1 && errno == ENOENT);
+	ok1(nvme_ns_open(&ns, &ctrl, 1) == 0);
+	ok1(ns.qprio[0].n == 2 && ns.qids[0] == 1 && ns.qids[1] == 3 && ns.info == &info);
+	ok1(ns.qprio[__qprio_idx(NVME_SQ_QPRIO_URGENT)].n == 1 &&
+	    ns.qprio[__qprio_idx(NVME_SQ_QPRIO_LOW)].n == 1 &&
+	    ns.qprio[__qprio_idx(NVME_SQ_QPRIO_LOW)].first == 1);
+
+	/* threads are spread over the queues */
+	ok1(nvme_ns_get_sq(&ns) == &sqs[1] && nvme_ns_get_sq(&ns) == &sqs[1]);
+
+	/* routed by priority class */
+	nvme_ns_set_thread_qprio(NVME_SQ_QPRIO_LOW);
+	ok1(nvme_ns_get_sq(&ns) == &sqs[3]);
+
+	/* no high priority queues */
+	nvme_ns_set_thread_qprio(NVME_SQ_QPRIO_HIGH);
+	ok1(nvme_ns_get_sq(&ns) == &sqs[1]);
+
+	nvme_ns_set_thread_qprio(NVME_SQ_QPRIO_URGENT);
+	ok1(nvme_ns_get_sq(&ns) == &sqs[1]);
+
+	pthread_create(&thread, NULL, other_thread, &ns);
+	pthread_join(thread, &sq);
+	ok1(sq == &sqs[3]);
+
+	assert(pgmap(&buf, 0x10000) > 0);
+
+	fakedev_start(&fdev);
+
+	/* single command */
+	iov = (struct iovec) { .iov_base = buf, .iov_len = 0x1000 };
+	ok1(nvme_ns_readv(&ns, &iov, 1, 0x2000) == 0);
+	ok1(dev.n == 1 && dev.log[0].opcode == NVME_CMD_READ && dev.log[0].slba == 16 &&
+	    dev.log[0].nlb == 7);
+
+	/* split over more commands than trackers */
+	dev.n = 0;
+	iov.iov_len = 0xc000;
+	ok1(nvme_ns_writev(&ns, &iov, 1, 0x0) == 0);
+	ok1(dev.n == 6);
+
+	ok = true;
+	for (int i = 0; i < 6; i++) {
+		if (dev.log[i].opcode != NVME_CMD_WRITE || dev.log[i].slba != (uint64_t)i * 16 ||
+		    dev.log[i].nlb != 15)
+			ok = false;
+	}
+	ok1(ok);
+
+	ok1(sqs[1].rq_top != NULL && cqs[1].stash.ready[0] == 0x0);
+
+	/* retried */
+	dev.n = 0;
+	dev.fail_slba = 16;
+	dev.fail_count = 1;
+	iov.iov_len = 0x1000;
+	ok1(nvme_ns_readv(&ns, &iov, 1, 0x2000) == 0);
+	ok1(dev.n == 2 && dev.log[1].slba == 16);
+
+	/* not retried if do not retry is set */
+	dev.n = 0;
+	dev.fail_count = 1;
+	dev.fail_dnr = true;
+	ok1(nvme_ns_readv(&ns, &iov, 1, 0x2000) == -1 && errno == EIO);
+	ok1(dev.n == 1);
+
+	/* retries are bounded */
+	dev.n = 0;
+	dev.fail_count = 10;
+	dev.fail_dnr = false;
+	ok1(nvme_ns_readv(&ns, &iov, 1, 0x2000) == -1 && errno == EIO);
+	ok1(dev.n == NVME_NS_RETRIES + 1);
+
+	dev.fail_count = 0;
+
+	ok1(nvme_ns_readv(&ns, &iov, 1, 0x100) == -1 && errno == EINVAL);
+
+	/* flush */
+	dev.n = 0;
+	ok1(nvme_ns_flush(&ns) == 0);
+	ok1(dev.n == 1 && dev.log[0].opcode == NVME_CMD_FLUSH);
+
+	/* trim; ranges are limited to 32 bits */
+	dev.n = 0;
+	ok1(nvme_ns_trim(&ns, 0x200, ((uint64_t)UINT32_MAX + 2) << 9) == 0);
+	ok1(dev.n == 1 && dev.log[0].opcode == NVME_CMD_DSM && dev.log[0].cdw10 == 1 &&
+	    dev.log[0].cdw11 == NVME_DSM_ATTR_AD);
+	ok1(le64_to_cpu(dev.log[0].ranges[0].slba) == 1 &&
+	    le32_to_cpu(dev.log[0].ranges[0].nlb) == UINT32_MAX &&
+	    le64_to_cpu(dev.log[0].ranges[1].slba) == (uint64_t)UINT32_MAX + 1 &&
+	    le32_to_cpu(dev.log[0].ranges[1].nlb) == 2);
+
+	/* many ranges; up to 256 per command */
+	for (int i = 0; i < 258; i++)
+		ranges[i] = (struct nvme_lba_range) { .slba = (uint64_t)i * 4, .nlb = 2 };
+
+	dev.n = 0;
+	ok1(nvme_bio_init_trimv(&bio, &ctrl, 1, ranges, 258) == 0 &&
+	    nvme_bio_submit(&bio, nvme_ns_get_sq(&ns)) == 0 && nvme_bio_wait(&bio) == 0);
+	ok1(dev.n == 2 && dev.log[0].cdw10 == 255 && dev.log[1].cdw10 == 1 &&
+	    le64_to_cpu(dev.log[0].ranges[1].slba) == 4 &&
+	    le64_to_cpu(dev.log[1].ranges[0].slba) == 256 * 4 &&
+	    le64_to_cpu(dev.log[1].ranges[1].slba) == 257 * 4 &&
+	    le32_to_cpu(dev.log[1].ranges[1].nlb) == 2);
+
+	/* copy offload, split by the copy limits */
+	info.msrc = 2;
+	info.mssrl = 8;
+	info.mcl = 12;
+
+	dev.n = 0;
+	ok1(nvme_ns_copy(&ns, (struct nvme_lba_range[]) { { 0, 10 }, { 20, 4 } }, 2, 100) == 0);
+	ok1(dev.n == 2 && dev.log[0].opcode == NVME_CMD_COPY && dev.log[0].slba == 100 &&
+	    (dev.log[0].cdw12 & 0xff) == 1 && dev.log[1].slba == 110 &&
+	    (dev.log[1].cdw12 & 0xff) == 0);
+	ok1(le64_to_cpu(dev.log[0].copy[0].slba) == 0 && le16_to_cpu(dev.log[0].copy[0].nlb) == 7 &&
+	    le64_to_cpu(dev.log[0].copy[1].slba) == 8 && le16_to_cpu(dev.log[0].copy[1].nlb) == 1 &&
+	    le64_to_cpu(dev.log[1].copy[0].slba) == 20 &&
+	    le16_to_cpu(dev.log[1].copy[0].nlb) == 3);
+
+	/* read/write fallback */
+	info.msrc = 0;
+
+	dev.n = 0;
+	ok1(nvme_ns_copy(&ns, (struct nvme_lba_range[]) { { 0, 40 }, { 100, 8 } }, 2, 1000) == 0);
+
+	ok = dev.n == 8;
+	for (int i = 0; i < dev.n && ok; i++) {
+		static const uint64_t src[] = { 0, 16, 32, 100 }, dst[] = { 1000, 1016, 1032, 1040 };
+		const uint64_t *lbas = dev.log[i].opcode == NVME_CMD_READ ? src : dst;
+		bool found = false;
+
+		for (int j = 0; j < 4; j++)
+			found |= dev.log[i].slba == lbas[j] && dev.log[i].nlb == (j < 2 ? 15 : 7);
+
+		ok = found;
+	}
+	ok1(ok);
+
+	ok1(nvme_ns_copy(&ns, (struct nvme_lba_range[]) { { 0x10000 - 4, 8 } }, 1, 0) == -1 &&
+	    errno == EINVAL);
+
+	/* asynchronous */
+	dev.n = 0;
+	iov.iov_len = 0x4000;
+	ok1(nvme_ns_readv_async(&ns, &bio, &iov, 1, 0x0, bio_cb, NULL) == 0);
+	ok1(nvme_bio_wait(&bio) == 0 && ncb == 1 && dev.n == 2);
+
+	fakedev_stop(&fdev);
+
+	nvme_ns_close(&ns);
+
+	return exit_status();
+}
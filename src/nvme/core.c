@@ -42,12 +42,20 @@
 #include "ccan/list/list.h"
 
 #include "types.h"
+#include "admin.h"
 
-#define cqhdbl(doorbells, qid, dstrd) \
-	(doorbells + (2 * qid + 1) * (4 << dstrd))
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
 
-#define sqtdbl(doorbells, qid, dstrd) \
-	(doorbells + (2 * qid) * (4 << dstrd))
+static inline unsigned long __dmabuf_flags(struct nvme_ctrl *ctrl)
+{
+	unsigned long flags = IOMMU_DMABUF_NODE(ctrl->numa_node);
+
+	/* must be mappable by the process taking over (see nvme_handover_send()) */
+	if (ctrl->opts.flags & NVME_CTRL_OPTS_F_HANDOVER)
+		flags |= IOMMU_DMABUF_SHARED;
+
+	return flags;
+}
 
 struct nvme_ctrl_handle {
 	struct nvme_ctrl *ctrl;
@@ -109,7 +117,8 @@ int nvme_del_ctrl(struct nvme_ctrl *ctrl)
 	return 0;
 }
 
-int nvme_configure_cq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
+static int __configure_cq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector,
+			  struct iommu_dmabuf *mem)
 {
 	struct nvme_cq *cq = &ctrl->cq[qid];
 	uint64_t cap;
@@ -142,35 +151,104 @@ int nvme_configure_cq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
 		.vector = vector,
 	};
 
+	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+
 	if (ctrl->dbbuf.doorbells.vaddr) {
 		cq->dbbuf.doorbell = cqhdbl(ctrl->dbbuf.doorbells.vaddr, qid, dstrd);
 		cq->dbbuf.eventidx = cqhdbl(ctrl->dbbuf.eventidxs.vaddr, qid, dstrd);
 	}
 
-	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &cq->mem, qsize << NVME_CQES, 0x0))
+	if (mem) {
+		cq->mem = *mem;
+		cq->shared = true;
+
+		return 0;
+	}
+
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &cq->mem, qsize << NVME_CQES,
+			     __dmabuf_flags(ctrl)))
 		return -1;
 
 	return 0;
 }
 
+int nvme_configure_cq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
+{
+	return __configure_cq(ctrl, qid, qsize, vector, NULL);
+}
+
+/*
+ * Release the I/O queue memory (see nvme_create_ioqpairs()) once no queue is
+ * carved from it anymore.
+ */
+static void __put_ioqmem(struct nvme_ctrl *ctrl)
+{
+	for (int i = 1; i < ctrl->opts.nsqr + 2; i++) {
+		if (ctrl->sq[i].shared)
+			return;
+	}
+
+	for (int i = 1; i < ctrl->opts.ncqr + 2; i++) {
+		if (ctrl->cq[i].shared)
+			return;
+	}
+
+	iommu_put_dmabuf(&ctrl->ioqmem);
+}
+
 void nvme_discard_cq(struct nvme_ctrl *ctrl, struct nvme_cq *cq)
 {
+	bool shared = cq->shared;
+
 	if (!cq->mem.vaddr)
 		return;
 
-	iommu_put_dmabuf(&cq->mem);
+	if (!cq->shared)
+		iommu_put_dmabuf(&cq->mem);
 
 	if (ctrl->dbbuf.doorbells.vaddr) {
 		__STORE_PTR(uint32_t *, cq->dbbuf.doorbell, 0);
 		__STORE_PTR(uint32_t *, cq->dbbuf.eventidx, 0);
 	}
 
+	free(cq->stash.cqes);
+	free(cq->stash.ready);
+	free(cq->stash.ranges);
+
+	pthread_spin_destroy(&cq->lock);
+
 	memset(cq, 0x0, sizeof(*cq));
+
+	if (shared)
+		__put_ioqmem(ctrl);
 }
 
-int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
-		      struct nvme_cq *cq, unsigned long UNUSED flags)
+/*
+ * (Re)initialize the request trackers and push them all on the free stack.
+ */
+static void __sq_init_rqs(struct nvme_ctrl *ctrl, struct nvme_sq *sq)
+{
+	sq->rq_top = &sq->rqs[sq->qsize - 2];
+
+	for (int i = 0; i < sq->qsize - 1; i++) {
+		struct nvme_rq *rq = &sq->rqs[i];
+
+		nvme_rq_reset(rq);
+
+		rq->sq = sq;
+		rq->cid = (uint16_t)i;
+
+		rq->page.vaddr = sq->pages.vaddr + (i << __mps_to_pageshift(ctrl->config.mps));
+		rq->page.iova = sq->pages.iova + (i << __mps_to_pageshift(ctrl->config.mps));
+
+		rq->rq_next = i > 0 ? &sq->rqs[i - 1] : NULL;
+	}
+}
+
+static int __configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize, struct nvme_cq *cq,
+			  unsigned long flags, struct iommu_dmabuf *mem, struct iommu_dmabuf *pages)
 {
+	int qprio = NVME_SQ_QPRIO_MEDIUM;
 	struct nvme_sq *sq = &ctrl->sq[qid];
 	uint64_t cap;
 	uint8_t dstrd;
@@ -198,42 +276,50 @@ int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 		log_debug("qsize %d invalid; max qsize is %d\n", qsize, ctrl->config.mqes + 1);
 	}
 
+	if (flags & NVME_IOSQ_F_QPRIO)
+		qprio = (int)(flags & NVME_SQ_QPRIO_MASK);
+
 	*sq = (struct nvme_sq) {
 		.id = qid,
 		.qsize = qsize,
+		.qprio = qprio,
 		.doorbell = sqtdbl(ctrl->doorbells, qid, dstrd),
 		.cq = cq,
 	};
 
+	pthread_spin_init(&sq->lock, PTHREAD_PROCESS_PRIVATE);
+
 	if (ctrl->dbbuf.doorbells.vaddr) {
 		sq->dbbuf.doorbell = sqtdbl(ctrl->dbbuf.doorbells.vaddr, qid, dstrd);
 		sq->dbbuf.eventidx = sqtdbl(ctrl->dbbuf.eventidxs.vaddr, qid, dstrd);
 	}
 
+	if (mem) {
+		sq->mem = *mem;
+		sq->pages = *pages;
+		sq->shared = true;
+	}
+
 	/*
 	 * Use ctrl->config.mps instead of host page size, as we have the
 	 * opportunity to pack the allocations.
 	 */
-	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &sq->pages, __abort_on_overflow(qsize, pagesize), 0x0))
+	else if (iommu_get_dmabuf(__iommu_ctx(ctrl), &sq->pages,
+				  __abort_on_overflow(qsize, pagesize),
+				  __dmabuf_flags(ctrl)))
 		return -1;
 
 	sq->rqs = znew_t(struct nvme_rq, qsize - 1);
-	sq->rq_top = &sq->rqs[qsize - 2];
 
-	for (int i = 0; i < qsize - 1; i++) {
-		struct nvme_rq *rq = &sq->rqs[i];
-
-		rq->sq = sq;
-		rq->cid = (uint16_t)i;
+	__sq_init_rqs(ctrl, sq);
 
-		rq->page.vaddr = sq->pages.vaddr + (i << __mps_to_pageshift(ctrl->config.mps));
-		rq->page.iova = sq->pages.iova + (i << __mps_to_pageshift(ctrl->config.mps));
+	__nvme_cq_grow_stash(cq, (uint16_t)sq->id, qsize - 1);
 
-		if (i > 0)
-			rq->rq_next = &sq->rqs[i - 1];
-	}
+	if (sq->shared)
+		return 0;
 
-	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &sq->mem, qsize << NVME_SQES, 0x0)) {
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &sq->mem, qsize << NVME_SQES,
+			     __dmabuf_flags(ctrl))) {
 		free(sq->rqs);
 		iommu_put_dmabuf(&sq->pages);
 
@@ -243,29 +329,55 @@ int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 	return 0;
 }
 
+int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
+		      struct nvme_cq *cq, unsigned long flags)
+{
+	return __configure_sq(ctrl, qid, qsize, cq, flags, NULL, NULL);
+}
+
 void nvme_discard_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq)
 {
+	bool shared = sq->shared;
+
 	if (!sq->mem.vaddr)
 		return;
 
-	iommu_put_dmabuf(&sq->mem);
-
 	free(sq->rqs);
 
-	iommu_put_dmabuf(&sq->pages);
+	if (!sq->shared) {
+		iommu_put_dmabuf(&sq->mem);
+		iommu_put_dmabuf(&sq->pages);
+	}
 
 	if (ctrl->dbbuf.doorbells.vaddr) {
 		__STORE_PTR(uint32_t *, sq->dbbuf.doorbell, 0);
 		__STORE_PTR(uint32_t *, sq->dbbuf.eventidx, 0);
 	}
 
+	nvme_sq_disable_timeouts(sq);
+
+	pthread_spin_destroy(&sq->lock);
+
 	memset(sq, 0x0, sizeof(*sq));
+
+	if (shared)
+		__put_ioqmem(ctrl);
 }
 
-int nvme_configure_adminq(struct nvme_ctrl *ctrl, unsigned long sq_flags)
+static void __program_adminq(struct nvme_ctrl *ctrl)
 {
 	int aqa;
 
+	aqa = ctrl->adminq.sq->qsize - 1;
+	aqa |= aqa << 16;
+
+	mmio_write32(ctrl->regs + NVME_REG_AQA, cpu_to_le32(aqa));
+	mmio_hl_write64(ctrl->regs + NVME_REG_ASQ, cpu_to_le64(ctrl->adminq.sq->mem.iova));
+	mmio_hl_write64(ctrl->regs + NVME_REG_ACQ, cpu_to_le64(ctrl->adminq.cq->mem.iova));
+}
+
+int nvme_configure_adminq(struct nvme_ctrl *ctrl, unsigned long sq_flags)
+{
 	struct nvme_cq *cq = &ctrl->cq[NVME_AQ];
 	struct nvme_sq *sq = &ctrl->sq[NVME_AQ];
 
@@ -282,12 +394,7 @@ int nvme_configure_adminq(struct nvme_ctrl *ctrl, unsigned long sq_flags)
 	ctrl->adminq.cq = cq;
 	ctrl->adminq.sq = sq;
 
-	aqa = NVME_AQ_QSIZE - 1;
-	aqa |= aqa << 16;
-
-	mmio_write32(ctrl->regs + NVME_REG_AQA, cpu_to_le32(aqa));
-	mmio_hl_write64(ctrl->regs + NVME_REG_ASQ, cpu_to_le64(sq->mem.iova));
-	mmio_hl_write64(ctrl->regs + NVME_REG_ACQ, cpu_to_le64(cq->mem.iova));
+	__program_adminq(ctrl);
 
 	return 0;
 
@@ -298,35 +405,86 @@ discard_cq:
 
 static int __admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe)
 {
-	return nvme_sync(ctrl, ctrl->adminq.sq, sqe, NULL, 0, NULL);
+	return nvme_admin(ctrl, sqe, NULL, 0, NULL);
 }
 
-int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
+static void __create_cq_cmd(struct nvme_cq *cq, union nvme_cmd *cmd)
 {
-	struct nvme_cq *cq = &ctrl->cq[qid];
-	union nvme_cmd cmd;
-
 	uint16_t qflags = NVME_Q_PC;
 	uint16_t iv = 0;
 
-	if (nvme_configure_cq(ctrl, qid, qsize, vector)) {
-		log_debug("could not configure io completion queue\n");
-		return -1;
-	}
-
-	if (vector != -1) {
+	if (cq->vector != -1) {
 		qflags |= NVME_CQ_IEN;
-		iv = (uint16_t)vector;
+		iv = (uint16_t)cq->vector;
 	}
 
-	cmd.create_cq = (struct nvme_cmd_create_cq) {
+	cmd->create_cq = (struct nvme_cmd_create_cq) {
 		.opcode = NVME_ADMIN_CREATE_CQ,
 		.prp1   = cpu_to_le64(cq->mem.iova),
-		.qid    = cpu_to_le16((uint16_t)qid),
-		.qsize  = cpu_to_le16((uint16_t)(qsize - 1)),
+		.qid    = cpu_to_le16((uint16_t)cq->id),
+		.qsize  = cpu_to_le16((uint16_t)(cq->qsize - 1)),
 		.qflags = cpu_to_le16(qflags),
 		.iv     = cpu_to_le16(iv),
 	};
+}
+
+static void __create_sq_cmd(struct nvme_sq *sq, union nvme_cmd *cmd)
+{
+	uint16_t qflags = (uint16_t)(NVME_Q_PC | sq->qprio);
+
+	cmd->create_sq = (struct nvme_cmd_create_sq) {
+		.opcode = NVME_ADMIN_CREATE_SQ,
+		.prp1   = cpu_to_le64(sq->mem.iova),
+		.qid    = cpu_to_le16((uint16_t)sq->id),
+		.qsize  = cpu_to_le16((uint16_t)(sq->qsize - 1)),
+		.qflags = cpu_to_le16(qflags),
+		.cqid   = cpu_to_le16((uint16_t)sq->cq->id),
+	};
+}
+
+int nvme_set_arbitration(struct nvme_ctrl *ctrl, unsigned int ab, unsigned int hpw,
+			 unsigned int mpw, unsigned int lpw)
+{
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_SET_FEATURES,
+	};
+	uint32_t arb;
+
+	if (ab > NVME_FEAT_ARB_AB_MASK || !hpw || hpw > 256 || !mpw || mpw > 256 ||
+	    !lpw || lpw > 256) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* weights are zeroes based values */
+	arb =
+		NVME_FIELD_SET(ab,	 FEAT_ARB_AB) |
+		NVME_FIELD_SET(lpw - 1, FEAT_ARB_LPW) |
+		NVME_FIELD_SET(mpw - 1, FEAT_ARB_MPW) |
+		NVME_FIELD_SET(hpw - 1, FEAT_ARB_HPW);
+
+	cmd.features.fid = NVME_FEAT_FID_ARBITRATION;
+	cmd.features.cdw11 = cpu_to_le32(arb);
+
+	if (__admin(ctrl, &cmd))
+		return -1;
+
+	ctrl->arbitration = arb;
+	ctrl->arbitration_set = true;
+
+	return 0;
+}
+
+int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
+{
+	union nvme_cmd cmd;
+
+	if (nvme_configure_cq(ctrl, qid, qsize, vector)) {
+		log_debug("could not configure io completion queue\n");
+		return -1;
+	}
+
+	__create_cq_cmd(&ctrl->cq[qid], &cmd);
 
 	return __admin(ctrl, &cmd);
 }
@@ -348,7 +506,6 @@ int nvme_delete_iocq(struct nvme_ctrl *ctrl, int qid)
 int nvme_create_iosq(struct nvme_ctrl *ctrl, int qid, int qsize, struct nvme_cq *cq,
 		     unsigned long flags)
 {
-	struct nvme_sq *sq = &ctrl->sq[qid];
 	union nvme_cmd cmd;
 
 	if (nvme_configure_sq(ctrl, qid, qsize, cq, flags)) {
@@ -356,14 +513,7 @@ int nvme_create_iosq(struct nvme_ctrl *ctrl, int qid, int qsize, struct nvme_cq
 		return -1;
 	}
 
-	cmd.create_sq = (struct nvme_cmd_create_sq) {
-		.opcode = NVME_ADMIN_CREATE_SQ,
-		.prp1   = cpu_to_le64(sq->mem.iova),
-		.qid    = cpu_to_le16((uint16_t)qid),
-		.qsize  = cpu_to_le16((uint16_t)(qsize - 1)),
-		.qflags = cpu_to_le16(NVME_Q_PC),
-		.cqid   = cpu_to_le16((uint16_t)cq->id),
-	};
+	__create_sq_cmd(&ctrl->sq[qid], &cmd);
 
 	return __admin(ctrl, &cmd);
 }
@@ -397,6 +547,161 @@ int nvme_create_ioqpair(struct nvme_ctrl *ctrl, int qid, int qsize, int vector,
 	return 0;
 }
 
+/*
+ * Submit the commands back-to-back (at most half an admin queue at a time, to
+ * leave room for Asynchronous Event Requests and other users of the admin
+ * queue) and reap them together.
+ */
+#define NVME_ADMIN_BATCH (NVME_AQ_QSIZE / 2)
+
+/*
+ * Submit @n admin commands, NVME_ADMIN_BATCH at a time, and wait for them. Stops
+ * after the first batch with a failed command and fails with the error of the
+ * first command (in @cmds order) that failed.
+ */
+static int __admin_batch(struct nvme_ctrl *ctrl, union nvme_cmd *cmds, int n)
+{
+	struct nvme_rq *rqs[NVME_ADMIN_BATCH];
+	struct nvme_cqe cqe;
+	int err = 0, submit_err = 0;
+
+	for (int i = 0; i < n; i += NVME_ADMIN_BATCH) {
+		int m = min_t(int, n - i, NVME_ADMIN_BATCH), submitted;
+
+		for (submitted = 0; submitted < m; submitted++) {
+			rqs[submitted] = nvme_admin_submit(ctrl, &cmds[i + submitted], NULL, 0,
+							   NULL, NULL);
+			if (!rqs[submitted]) {
+				submit_err = errno;
+				break;
+			}
+		}
+
+		/* always reap what was submitted to release the trackers */
+		for (int j = 0; j < submitted; j++) {
+			if (nvme_admin_wait(ctrl, rqs[j], &cqe, NULL) && !err) {
+				err = errno;
+
+				log_debug("admin command (opcode 0x%" PRIx8 ") failed\n",
+					  cmds[i + j].opcode);
+			}
+		}
+
+		/* the command that could not be submitted follows those reaped */
+		if (!err)
+			err = submit_err;
+
+		if (err) {
+			errno = err;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int nvme_create_ioqpairs(struct nvme_ctrl *ctrl, int n, int qsize, unsigned long flags)
+{
+	size_t pagesize = __mps_to_pagesize(ctrl->config.mps);
+	size_t cqlen, sqlen, pageslen, stride;
+	union nvme_cmd *cmds;
+	int qid;
+
+	if (n < 1 || n > ctrl->config.ncqa + 1 || n > ctrl->config.nsqa + 1 || qsize < 2) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ctrl->ioqmem.len) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* queues created by other means must be deleted first */
+	for (qid = 1; qid <= n; qid++) {
+		if (ctrl->cq[qid].mem.vaddr || ctrl->sq[qid].mem.vaddr) {
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	/* lay out the queue memory as [cq ring | sq ring | rq pages] per qid */
+	cqlen = ALIGN_UP((size_t)qsize << NVME_CQES, pagesize);
+	sqlen = ALIGN_UP((size_t)qsize << NVME_SQES, pagesize);
+	pageslen = __abort_on_overflow(qsize, pagesize);
+	stride = cqlen + sqlen + pageslen;
+
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &ctrl->ioqmem, __abort_on_overflow(n, stride),
+			     __dmabuf_flags(ctrl)))
+		return -1;
+
+	cmds = znew_t(union nvme_cmd, n);
+
+	for (qid = 1; qid <= n; qid++) {
+		size_t off = (size_t)(qid - 1) * stride;
+		struct iommu_dmabuf cqmem, sqmem, pages;
+
+		cqmem = ctrl->ioqmem;
+		cqmem.vaddr = ctrl->ioqmem.vaddr + off;
+		cqmem.iova = ctrl->ioqmem.iova + off;
+		cqmem.len = (ssize_t)cqlen;
+
+		sqmem = cqmem;
+		sqmem.vaddr += cqlen;
+		sqmem.iova += cqlen;
+		sqmem.len = (ssize_t)sqlen;
+
+		pages = sqmem;
+		pages.vaddr += sqlen;
+		pages.iova += sqlen;
+		pages.len = (ssize_t)pageslen;
+
+		if (__configure_cq(ctrl, qid, qsize, -1, &cqmem))
+			goto discard;
+
+		if (__configure_sq(ctrl, qid, qsize, &ctrl->cq[qid], flags, &sqmem, &pages)) {
+			nvme_discard_cq(ctrl, &ctrl->cq[qid]);
+			goto discard;
+		}
+	}
+
+	for (qid = 1; qid <= n; qid++)
+		__create_cq_cmd(&ctrl->cq[qid], &cmds[qid - 1]);
+
+	if (__admin_batch(ctrl, cmds, n)) {
+		log_debug("could not create io completion queues\n");
+		goto discard;
+	}
+
+	for (qid = 1; qid <= n; qid++)
+		__create_sq_cmd(&ctrl->sq[qid], &cmds[qid - 1]);
+
+	if (__admin_batch(ctrl, cmds, n)) {
+		log_debug("could not create io submission queues\n");
+		goto discard;
+	}
+
+	free(cmds);
+
+	return 0;
+
+discard:
+	free(cmds);
+
+	/*
+	 * Queues that were created on the controller are left behind, just as
+	 * with nvme_create_ioqpair(); they are deleted by a controller reset.
+	 */
+	for (int i = 1; i < qid && i <= n; i++) {
+		nvme_discard_sq(ctrl, &ctrl->sq[i]);
+		nvme_discard_cq(ctrl, &ctrl->cq[i]);
+	}
+
+	__put_ioqmem(ctrl);
+
+	return -1;
+}
+
 int nvme_delete_ioqpair(struct nvme_ctrl *ctrl, int qid)
 {
 	if (nvme_delete_iosq(ctrl, qid)) {
@@ -412,43 +717,92 @@ int nvme_delete_ioqpair(struct nvme_ctrl *ctrl, int qid)
 	return 0;
 }
 
-static int nvme_wait_rdy(struct nvme_ctrl *ctrl, unsigned short rdy)
+/* status register polling backoff (in microseconds) */
+#define NVME_CSTS_POLL_MIN_US	10
+#define NVME_CSTS_POLL_MAX_US	1000
+
+/* time allowed for each admin command issued during initialization */
+#define NVME_INIT_ADMIN_TIMEOUT_US	(60 * 1000000ULL)
+
+static inline uint64_t __usecs_to_ticks(uint64_t usecs)
 {
-	uint64_t cap;
-	uint32_t csts;
-	unsigned long timeout_ms;
-	struct timeabs deadline;
+	return usecs * (__vfn_ticks_freq / 1000000ULL);
+}
 
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
-	timeout_ms = 500 * (NVME_FIELD_GET(cap, CAP_TO) + 1);
-	deadline = timeabs_add(time_now(), time_from_msec(timeout_ms));
+static inline uint64_t __ticks_to_usecs(uint64_t ticks)
+{
+	return ticks / (__vfn_ticks_freq / 1000000ULL);
+}
 
-	do {
-		if (time_after(time_now(), deadline)) {
+static uint64_t __rdy_deadline(struct nvme_ctrl *ctrl)
+{
+	uint64_t cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+
+	return get_ticks() + __usecs_to_ticks(500000ULL * (NVME_FIELD_GET(cap, CAP_TO) + 1));
+}
+
+/*
+ * Check if the controller has reached the requested ready state. Returns 1 if
+ * so, 0 if not and -1 (and sets errno) if the controller is in a fatal state.
+ */
+static int __check_rdy(struct nvme_ctrl *ctrl, unsigned short rdy)
+{
+	uint32_t csts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CSTS));
+
+	if (rdy && NVME_FIELD_GET(csts, CSTS_CFS)) {
+		log_debug("controller fatal status\n");
+
+		errno = EIO;
+		return -1;
+	}
+
+	return NVME_FIELD_GET(csts, CSTS_RDY) == rdy;
+}
+
+static int nvme_wait_rdy(struct nvme_ctrl *ctrl, unsigned short rdy)
+{
+	uint64_t deadline = __rdy_deadline(ctrl);
+	unsigned int backoff = NVME_CSTS_POLL_MIN_US;
+	int ret;
+
+	while (!(ret = __check_rdy(ctrl, rdy))) {
+		if (get_ticks() > deadline) {
 			log_debug("timed out\n");
 
 			errno = ETIMEDOUT;
 			return -1;
 		}
 
-		csts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CSTS));
-	} while (NVME_FIELD_GET(csts, CSTS_RDY) != rdy);
+		usleep(backoff);
 
-	return 0;
+		backoff = min_t(unsigned int, backoff * 2, NVME_CSTS_POLL_MAX_US);
+	}
+
+	return ret < 0 ? -1 : 0;
 }
 
-int nvme_enable(struct nvme_ctrl *ctrl)
+static void __enable(struct nvme_ctrl *ctrl)
 {
-	uint8_t css;
+	uint8_t css, ams = NVME_CC_AMS_RR;
 	uint32_t cc;
 	uint64_t cap;
 
 	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
 	css = NVME_FIELD_GET(cap, CAP_CSS);
 
+	ctrl->flags &= ~NVME_CTRL_F_WRR;
+
+	if (ctrl->opts.flags & NVME_CTRL_OPTS_F_WRR) {
+		if (NVME_FIELD_GET(cap, CAP_AMS) & NVME_CAP_AMS_WRR) {
+			ams = NVME_CC_AMS_WRR;
+			ctrl->flags |= NVME_CTRL_F_WRR;
+		} else
+			log_debug("weighted round robin arbitration not supported\n");
+	}
+
 	cc =
 		NVME_FIELD_SET(ctrl->config.mps, CC_MPS) |
-		NVME_FIELD_SET(NVME_CC_AMS_RR,	 CC_AMS) |
+		NVME_FIELD_SET(ams,		 CC_AMS) |
 		NVME_FIELD_SET(NVME_CC_SHN_NONE, CC_SHN) |
 		NVME_FIELD_SET(NVME_SQES,        CC_IOSQES) |
 		NVME_FIELD_SET(NVME_CQES,        CC_IOCQES) |
@@ -462,65 +816,34 @@ int nvme_enable(struct nvme_ctrl *ctrl)
 		cc |= NVME_FIELD_SET(NVME_CC_CSS_NVM, CC_CSS);
 
 	mmio_write32(ctrl->regs + NVME_REG_CC, cpu_to_le32(cc));
-
-	return nvme_wait_rdy(ctrl, 1);
 }
 
-int nvme_reset(struct nvme_ctrl *ctrl)
+static void __disable(struct nvme_ctrl *ctrl)
 {
 	uint32_t cc;
 
 	cc = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CC));
 	mmio_write32(ctrl->regs + NVME_REG_CC, cpu_to_le32(cc & 0xfe));
-
-	return nvme_wait_rdy(ctrl, 0);
 }
 
-static int nvme_init_dbconfig(struct nvme_ctrl *ctrl)
+int nvme_enable(struct nvme_ctrl *ctrl)
 {
-	union nvme_cmd cmd;
-
-	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &ctrl->dbbuf.doorbells, __VFN_PAGESIZE, 0x0))
-		return -1;
-
-	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &ctrl->dbbuf.eventidxs, __VFN_PAGESIZE, 0x0))
-		goto put_doorbells;
-
-	cmd = (union nvme_cmd) {
-		.opcode = NVME_ADMIN_DBCONFIG,
-		.dptr.prp1 = cpu_to_le64(ctrl->dbbuf.doorbells.iova),
-		.dptr.prp2 = cpu_to_le64(ctrl->dbbuf.eventidxs.iova),
-	};
-
-	if (__admin(ctrl, &cmd))
-		goto put_eventidxs;
+	__enable(ctrl);
 
-	if (!(ctrl->opts.quirks & NVME_QUIRK_BROKEN_DBBUF)) {
-		uint64_t cap;
-		uint8_t dstrd;
+	return nvme_wait_rdy(ctrl, 1);
+}
 
-		cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
-		dstrd = NVME_FIELD_GET(cap, CAP_DSTRD);
+int nvme_reset(struct nvme_ctrl *ctrl)
+{
+	__disable(ctrl);
 
-		ctrl->adminq.cq->dbbuf.doorbell =
-			cqhdbl(ctrl->dbbuf.doorbells.vaddr, NVME_AQ, dstrd);
-		ctrl->adminq.cq->dbbuf.eventidx =
-			cqhdbl(ctrl->dbbuf.eventidxs.vaddr, NVME_AQ, dstrd);
+	if (nvme_wait_rdy(ctrl, 0))
+		return -1;
 
-		ctrl->adminq.sq->dbbuf.doorbell =
-			sqtdbl(ctrl->dbbuf.doorbells.vaddr, NVME_AQ, dstrd);
-		ctrl->adminq.sq->dbbuf.eventidx =
-			sqtdbl(ctrl->dbbuf.eventidxs.vaddr, NVME_AQ, dstrd);
-	}
+	/* the controller no longer uses the host memory buffer */
+	ctrl->hmb.enabled = false;
 
 	return 0;
-
-put_eventidxs:
-	iommu_put_dmabuf(&ctrl->dbbuf.eventidxs);
-put_doorbells:
-	iommu_put_dmabuf(&ctrl->dbbuf.doorbells);
-
-	return -1;
 }
 
 static int nvme_init_pci(struct nvme_ctrl *ctrl, const char *bdf)
@@ -577,6 +900,10 @@ int nvme_ctrl_init(struct nvme_ctrl *ctrl, const char *bdf,
 	if ((ctrl->pci.classcode & 0xff) == 0x03)
 		ctrl->flags = NVME_CTRL_F_ADMINISTRATIVE;
 
+	ctrl->numa_node = pci_device_get_numa_node(bdf);
+	if (ctrl->numa_node >= 0)
+		log_debug("device is on numa node %d\n", ctrl->numa_node);
+
 	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
 	mpsmin = NVME_FIELD_GET(cap, CAP_MPSMIN);
 	mpsmax = NVME_FIELD_GET(cap, CAP_MPSMAX);
@@ -594,6 +921,9 @@ int nvme_ctrl_init(struct nvme_ctrl *ctrl, const char *bdf,
 
 	ctrl->config.mqes = NVME_FIELD_GET(cap, CAP_MQES);
 
+	pthread_mutex_init(&ctrl->admin.lock, NULL);
+	pthread_mutex_init(&ctrl->ns.lock, NULL);
+
 	/* +2 because nsqr/ncqr are zero-based values and do not account for the admin queue */
 	ctrl->sq = znew_t(struct nvme_sq, ctrl->opts.nsqr + 2);
 	ctrl->cq = znew_t(struct nvme_cq, ctrl->opts.ncqr + 2);
@@ -601,42 +931,81 @@ int nvme_ctrl_init(struct nvme_ctrl *ctrl, const char *bdf,
 	return 0;
 }
 
-int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_opts *opts)
+static void __init_admin_cb(struct nvme_rq *rq, struct nvme_cqe *cqe)
 {
-	struct iommu_ctx *ctx;
+	struct nvme_init_op *op = rq->opaque;
 
-	uint16_t oacs;
-	uint32_t sgls;
+	memcpy(&op->cqe, cqe, sizeof(*cqe));
 
-	__autovar_s(iommu_dmabuf) buffer = {};
-
-	union nvme_cmd cmd = {};
-	struct nvme_cqe cqe;
+	op->busy = false;
+}
 
-	if (nvme_ctrl_init(ctrl, bdf, opts))
+static int __init_submit(struct nvme_init_op *op, union nvme_cmd *cmd, void *buf, size_t len)
+{
+	if (!nvme_admin_submit(op->ctrl, cmd, buf, len, __init_admin_cb, op))
 		return -1;
 
-	ctx = __iommu_ctx(ctrl);
+	op->busy = true;
+	op->deadline = get_ticks() + __usecs_to_ticks(NVME_INIT_ADMIN_TIMEOUT_US);
 
-	if (nvme_reset(ctrl)) {
-		log_debug("could not reset controller\n");
-		return -1;
-	}
+	return 0;
+}
 
-	if (nvme_configure_adminq(ctrl, 0x0)) {
-		log_debug("could not configure admin queue\n");
-		return -1;
+static void __init_enter_stage(struct nvme_init_op *op, int stage)
+{
+	op->stage = stage;
+	op->tstage = get_ticks();
+
+	if (stage == NVME_INIT_STAGE_RESET || stage == NVME_INIT_STAGE_ENABLE) {
+		op->deadline = __rdy_deadline(op->ctrl);
+		op->next_poll = op->tstage;
+		op->backoff = __usecs_to_ticks(NVME_CSTS_POLL_MIN_US);
 	}
+}
 
-	if (nvme_enable(ctrl)) {
-		log_debug("could not enable controller\n");
+static void __init_next_stage(struct nvme_init_op *op, int stage)
+{
+	op->usecs[op->stage] = __ticks_to_usecs(get_ticks() - op->tstage);
+
+	log_debug("%s: stage %d completed in %" PRIu64 " us\n", op->ctrl->pci.bdf, op->stage,
+		  op->usecs[op->stage]);
+
+	__init_enter_stage(op, stage);
+}
+
+/*
+ * Poll the controller ready state with exponential backoff. Returns 1 if the
+ * controller reached the requested state, 0 if not (yet) and -1 on error.
+ */
+static int __init_wait_rdy(struct nvme_init_op *op, unsigned short rdy)
+{
+	uint64_t now = get_ticks();
+	int ret;
+
+	if (now < op->next_poll)
+		return 0;
+
+	ret = __check_rdy(op->ctrl, rdy);
+	if (ret)
+		return ret;
+
+	if (now > op->deadline) {
+		log_debug("timed out\n");
+
+		errno = ETIMEDOUT;
 		return -1;
 	}
 
-	if (ctrl->flags & NVME_CTRL_F_ADMINISTRATIVE)
-		return 0;
+	op->next_poll = now + op->backoff;
+	op->backoff = min_t(uint64_t, op->backoff * 2, __usecs_to_ticks(NVME_CSTS_POLL_MAX_US));
 
-	cmd = (union nvme_cmd) {
+	return 0;
+}
+
+static int __init_set_features(struct nvme_init_op *op)
+{
+	struct nvme_ctrl *ctrl = op->ctrl;
+	union nvme_cmd cmd = {
 		.opcode = NVME_ADMIN_SET_FEATURES,
 	};
 
@@ -645,17 +1014,17 @@ int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_op
 		NVME_FIELD_SET(ctrl->opts.nsqr, FEAT_NRQS_NSQR) |
 		NVME_FIELD_SET(ctrl->opts.ncqr, FEAT_NRQS_NCQR));
 
-	if (nvme_admin(ctrl, &cmd, NULL, 0, &cqe)) {
-		log_debug("could not set number of queues\n");
-		return -1;
-	}
+	__init_next_stage(op, NVME_INIT_STAGE_SET_FEATURES);
+
+	return __init_submit(op, &cmd, NULL, 0);
+}
 
-	ctrl->config.nsqa = min_t(int, ctrl->opts.nsqr,
-				  NVME_FIELD_GET(le32_to_cpu(cqe.dw0), FEAT_NRQS_NSQR));
-	ctrl->config.ncqa = min_t(int, ctrl->opts.ncqr,
-				  NVME_FIELD_GET(le32_to_cpu(cqe.dw0), FEAT_NRQS_NCQR));
+static int __init_identify(struct nvme_init_op *op)
+{
+	union nvme_cmd cmd;
 
-	if (iommu_get_dmabuf(ctx, &buffer, NVME_IDENTIFY_DATA_SIZE, IOMMU_MAP_EPHEMERAL))
+	if (iommu_get_dmabuf(__iommu_ctx(op->ctrl), &op->buf, NVME_IDENTIFY_DATA_SIZE,
+			     IOMMU_MAP_EPHEMERAL))
 		return -1;
 
 	cmd.identify = (struct nvme_cmd_identify) {
@@ -663,14 +1032,65 @@ int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_op
 		.cns = NVME_IDENTIFY_CNS_CTRL,
 	};
 
-	if (nvme_admin(ctrl, &cmd, buffer.vaddr, buffer.len, NULL))
-		return -1;
+	__init_next_stage(op, NVME_INIT_STAGE_IDENTIFY);
 
-	oacs = le16_to_cpu(*(leint16_t *)(buffer.vaddr + NVME_IDENTIFY_CTRL_OACS));
-	if (oacs & NVME_IDENTIFY_CTRL_OACS_DBCONFIG && nvme_init_dbconfig(ctrl))
+	return __init_submit(op, &cmd, op->buf.vaddr, op->buf.len);
+}
+
+static int __init_dbconfig(struct nvme_init_op *op)
+{
+	struct nvme_ctrl *ctrl = op->ctrl;
+	union nvme_cmd cmd;
+
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &ctrl->dbbuf.doorbells, __VFN_PAGESIZE,
+			     __dmabuf_flags(ctrl)))
 		return -1;
 
-	sgls = le32_to_cpu(*(leint32_t *)(buffer.vaddr + NVME_IDENTIFY_CTRL_SGLS));
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &ctrl->dbbuf.eventidxs, __VFN_PAGESIZE,
+			     __dmabuf_flags(ctrl)))
+		goto put_doorbells;
+
+	cmd = (union nvme_cmd) {
+		.opcode = NVME_ADMIN_DBCONFIG,
+		.dptr.prp1 = cpu_to_le64(ctrl->dbbuf.doorbells.iova),
+		.dptr.prp2 = cpu_to_le64(ctrl->dbbuf.eventidxs.iova),
+	};
+
+	/* the buffers are released by nvme_init_poll() if the command fails */
+	__init_next_stage(op, NVME_INIT_STAGE_DBCONFIG);
+
+	return __init_submit(op, &cmd, NULL, 0);
+
+put_doorbells:
+	iommu_put_dmabuf(&ctrl->dbbuf.doorbells);
+
+	return -1;
+}
+
+static void __dbconfig_enable(struct nvme_ctrl *ctrl)
+{
+	uint64_t cap;
+	uint8_t dstrd;
+
+	if (ctrl->opts.quirks & NVME_QUIRK_BROKEN_DBBUF)
+		return;
+
+	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	dstrd = NVME_FIELD_GET(cap, CAP_DSTRD);
+
+	ctrl->adminq.cq->dbbuf.doorbell = cqhdbl(ctrl->dbbuf.doorbells.vaddr, NVME_AQ, dstrd);
+	ctrl->adminq.cq->dbbuf.eventidx = cqhdbl(ctrl->dbbuf.eventidxs.vaddr, NVME_AQ, dstrd);
+
+	ctrl->adminq.sq->dbbuf.doorbell = sqtdbl(ctrl->dbbuf.doorbells.vaddr, NVME_AQ, dstrd);
+	ctrl->adminq.sq->dbbuf.eventidx = sqtdbl(ctrl->dbbuf.eventidxs.vaddr, NVME_AQ, dstrd);
+}
+
+static void __init_identified(struct nvme_init_op *op)
+{
+	struct nvme_ctrl *ctrl = op->ctrl;
+	uint32_t sgls;
+
+	sgls = le32_to_cpu(*(leint32_t *)(op->buf.vaddr + NVME_IDENTIFY_CTRL_SGLS));
 	if (sgls) {
 		uint32_t alignment = NVME_FIELD_GET(sgls, IDENTIFY_CTRL_SGLS_ALIGNMENT);
 
@@ -680,21 +1100,441 @@ int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_op
 			ctrl->flags |= NVME_CTRL_F_SGLS_DWORD_ALIGNMENT;
 	}
 
+	__nvme_hmb_identified(ctrl, op->buf.vaddr);
+}
+
+static int __init_hmb(struct nvme_init_op *op)
+{
+	struct nvme_ctrl *ctrl = op->ctrl;
+	union nvme_cmd cmd;
+
+	if (!(ctrl->opts.flags & NVME_CTRL_OPTS_F_HMB) || !ctrl->hmb.hmpre) {
+		__init_next_stage(op, NVME_INIT_STAGE_DONE);
+		return 1;
+	}
+
+	/* the host memory buffer is optional */
+	if (__nvme_hmb_alloc(ctrl, ctrl->opts.hmb_size)) {
+		log_info("%s: continuing without a host memory buffer\n", ctrl->pci.bdf);
+
+		__init_next_stage(op, NVME_INIT_STAGE_DONE);
+		return 1;
+	}
+
+	__nvme_hmb_cmd(ctrl, &cmd, NVME_FEAT_HMB_EHM);
+
+	__init_next_stage(op, NVME_INIT_STAGE_HMB);
+
+	return __init_submit(op, &cmd, NULL, 0);
+}
+
+int nvme_init_start(struct nvme_init_op *op, struct nvme_ctrl *ctrl, const char *bdf,
+		    const struct nvme_ctrl_opts *opts)
+{
+	memset(op, 0x0, sizeof(*op));
+
+	op->ctrl = ctrl;
+
+	if (nvme_ctrl_init(ctrl, bdf, opts)) {
+		op->err = errno;
+		return -1;
+	}
+
+	__disable(ctrl);
+	__init_enter_stage(op, NVME_INIT_STAGE_RESET);
+
+	return 0;
+}
+
+static int __init_step(struct nvme_init_op *op)
+{
+	struct nvme_ctrl *ctrl = op->ctrl;
+	uint16_t oacs;
+	int ret;
+
+	switch (op->stage) {
+	case NVME_INIT_STAGE_RESET:
+		ret = __init_wait_rdy(op, 0);
+		if (ret <= 0)
+			return ret;
+
+		if (nvme_configure_adminq(ctrl, 0x0)) {
+			log_debug("could not configure admin queue\n");
+			return -1;
+		}
+
+		__enable(ctrl);
+		__init_next_stage(op, NVME_INIT_STAGE_ENABLE);
+
+		return 0;
+
+	case NVME_INIT_STAGE_ENABLE:
+		ret = __init_wait_rdy(op, 1);
+		if (ret <= 0)
+			return ret;
+
+		if (ctrl->flags & NVME_CTRL_F_ADMINISTRATIVE) {
+			__init_next_stage(op, NVME_INIT_STAGE_DONE);
+			return 1;
+		}
+
+		return __init_set_features(op);
+
+	case NVME_INIT_STAGE_SET_FEATURES:
+		ctrl->config.nsqa = min_t(int, ctrl->opts.nsqr,
+					  NVME_FIELD_GET(le32_to_cpu(op->cqe.dw0), FEAT_NRQS_NSQR));
+		ctrl->config.ncqa = min_t(int, ctrl->opts.ncqr,
+					  NVME_FIELD_GET(le32_to_cpu(op->cqe.dw0), FEAT_NRQS_NCQR));
+
+		return __init_identify(op);
+
+	case NVME_INIT_STAGE_IDENTIFY:
+		__init_identified(op);
+
+		oacs = le16_to_cpu(*(leint16_t *)(op->buf.vaddr + NVME_IDENTIFY_CTRL_OACS));
+
+		iommu_put_dmabuf(&op->buf);
+
+		if (oacs & NVME_IDENTIFY_CTRL_OACS_DBCONFIG)
+			return __init_dbconfig(op);
+
+		return __init_hmb(op);
+
+	case NVME_INIT_STAGE_DBCONFIG:
+		__dbconfig_enable(ctrl);
+
+		return __init_hmb(op);
+
+	case NVME_INIT_STAGE_HMB:
+		ctrl->hmb.enabled = true;
+		__init_next_stage(op, NVME_INIT_STAGE_DONE);
+
+		return 1;
+
+	case NVME_INIT_STAGE_DONE:
+		return 1;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+int nvme_init_poll(struct nvme_init_op *op)
+{
+	struct nvme_ctrl *ctrl = op->ctrl;
+	int ret;
+
+	if (op->err) {
+		errno = op->err;
+		return -1;
+	}
+
+	if (op->busy) {
+		if (nvme_admin_poll(ctrl) < 0)
+			goto err;
+
+		if (op->busy) {
+			if (get_ticks() <= op->deadline)
+				return 0;
+
+			log_debug("%s: stage %d admin command timed out\n", ctrl->pci.bdf,
+				  op->stage);
+
+			/* disable the controller so the command is not completed later */
+			__disable(ctrl);
+
+			errno = ETIMEDOUT;
+			goto err;
+		}
+
+		if (!nvme_cqe_ok(&op->cqe)) {
+			if (op->stage == NVME_INIT_STAGE_HMB) {
+				log_info("%s: host memory buffer rejected; continuing without\n",
+					 ctrl->pci.bdf);
+
+				__nvme_hmb_free(ctrl);
+
+				__init_next_stage(op, NVME_INIT_STAGE_DONE);
+				return 1;
+			}
+
+			log_debug("stage %d admin command failed\n", op->stage);
+
+			nvme_set_errno_from_cqe(&op->cqe);
+			goto err;
+		}
+	}
+
+	ret = __init_step(op);
+	if (ret < 0)
+		goto err;
+
+	return ret;
+
+err:
+	op->err = errno ? errno : EIO;
+
+	iommu_put_dmabuf(&op->buf);
+
+	if (op->stage == NVME_INIT_STAGE_DBCONFIG) {
+		iommu_put_dmabuf(&ctrl->dbbuf.eventidxs);
+		iommu_put_dmabuf(&ctrl->dbbuf.doorbells);
+	}
+
+	if (op->stage == NVME_INIT_STAGE_HMB)
+		__nvme_hmb_free(ctrl);
+
+	errno = op->err;
+	return -1;
+}
+
+int nvme_init_wait(struct nvme_init_op *ops, int n)
+{
+	int failed = 0;
+
+	do {
+		uint64_t now, next = UINT64_MAX;
+		bool spin = false;
+		int pending = 0;
+
+		for (int i = 0; i < n; i++) {
+			struct nvme_init_op *op = &ops[i];
+
+			if (op->err || op->stage == NVME_INIT_STAGE_DONE)
+				continue;
+
+			if (nvme_init_poll(op))
+				continue;
+
+			pending++;
+
+			if (op->busy)
+				spin = true;
+			else
+				next = min_t(uint64_t, next, op->next_poll);
+		}
+
+		if (!pending)
+			break;
+
+		/* sleep if all controllers are waiting for a state change */
+		now = get_ticks();
+		if (!spin && next > now)
+			usleep((useconds_t)__ticks_to_usecs(next - now));
+	} while (true);
+
+	for (int i = 0; i < n; i++) {
+		if (ops[i].err)
+			failed++;
+	}
+
+	return failed;
+}
+
+int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_opts *opts)
+{
+	struct nvme_init_op op;
+
+	if (nvme_init_start(&op, ctrl, bdf, opts))
+		return -1;
+
+	if (nvme_init_wait(&op, 1)) {
+		errno = op.err;
+		return -1;
+	}
+
 	return 0;
 }
 
+/*
+ * Clear the completion queue ring. Completions already stashed are kept for
+ * their waiters, since the request trackers survive the reset.
+ */
+static void __reset_cq(struct nvme_cq *cq)
+{
+	memset(cq->mem.vaddr, 0x0, (size_t)cq->qsize << NVME_CQES);
+
+	cq->head = 0;
+	cq->phase = 0;
+
+	if (cq->dbbuf.doorbell) {
+		__STORE_PTR(uint32_t *, cq->dbbuf.doorbell, 0);
+		__STORE_PTR(uint32_t *, cq->dbbuf.eventidx, 0);
+	}
+}
+
+static void __reset_sq(struct nvme_sq *sq)
+{
+	memset(sq->mem.vaddr, 0x0, (size_t)sq->qsize << NVME_SQES);
+
+	sq->tail = sq->ptail = 0;
+
+	if (sq->dbbuf.doorbell) {
+		__STORE_PTR(uint32_t *, sq->dbbuf.doorbell, 0);
+		__STORE_PTR(uint32_t *, sq->dbbuf.eventidx, 0);
+	}
+}
+
+int nvme_ctrl_reset_fast(struct nvme_ctrl *ctrl)
+{
+	union nvme_cmd *cmds;
+	int n, ret = -1;
+
+	if (!ctrl->adminq.sq) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (nvme_reset(ctrl)) {
+		log_debug("could not reset controller\n");
+		return -1;
+	}
+
+	/* fail the dropped commands instead of leaving their waiters spinning */
+	__nvme_admin_reset(ctrl);
+
+	/* namespace change events may have been lost */
+	nvme_ns_invalidate(ctrl);
+
+	/* admin completions are reaped under the admin lock */
+	pthread_mutex_lock(&ctrl->admin.lock);
+	__reset_cq(ctrl->adminq.cq);
+	__reset_sq(ctrl->adminq.sq);
+	pthread_mutex_unlock(&ctrl->admin.lock);
+
+	for (int qid = 1; qid < ctrl->opts.ncqr + 2; qid++) {
+		struct nvme_cq *cq = &ctrl->cq[qid];
+
+		if (!cq->mem.vaddr)
+			continue;
+
+		pthread_spin_lock(&cq->lock);
+		__reset_cq(cq);
+		pthread_spin_unlock(&cq->lock);
+	}
+
+	for (int qid = 1; qid < ctrl->opts.nsqr + 2; qid++) {
+		struct nvme_sq *sq = &ctrl->sq[qid];
+
+		if (!sq->mem.vaddr)
+			continue;
+
+		__reset_sq(sq);
+
+		pthread_spin_lock(&sq->cq->lock);
+		__nvme_cq_stash_abort(sq->cq, sq,
+				      NVME_CQE_SFP_DNR | NVME_CQE_SFP_SC_ABORT_REQ);
+		pthread_spin_unlock(&sq->cq->lock);
+	}
+
+	__program_adminq(ctrl);
+
+	if (nvme_enable(ctrl)) {
+		log_debug("could not enable controller\n");
+		return -1;
+	}
+
+	if (ctrl->flags & NVME_CTRL_F_ADMINISTRATIVE)
+		return 0;
+
+	cmds = znew_t(union nvme_cmd, max_t(int, ctrl->opts.nsqr, ctrl->opts.ncqr) + 4);
+
+	/* feature values do not survive the reset */
+	cmds[0] = (union nvme_cmd) {
+		.opcode = NVME_ADMIN_SET_FEATURES,
+	};
+
+	cmds[0].features.fid = NVME_FEAT_FID_NUM_QUEUES;
+	cmds[0].features.cdw11 = cpu_to_le32(
+		NVME_FIELD_SET(ctrl->opts.nsqr, FEAT_NRQS_NSQR) |
+		NVME_FIELD_SET(ctrl->opts.ncqr, FEAT_NRQS_NCQR));
+
+	n = 1;
+
+	if (ctrl->dbbuf.doorbells.vaddr) {
+		cmds[n++] = (union nvme_cmd) {
+			.opcode = NVME_ADMIN_DBCONFIG,
+			.dptr.prp1 = cpu_to_le64(ctrl->dbbuf.doorbells.iova),
+			.dptr.prp2 = cpu_to_le64(ctrl->dbbuf.eventidxs.iova),
+		};
+	}
+
+	if (ctrl->arbitration_set) {
+		cmds[n] = (union nvme_cmd) {
+			.opcode = NVME_ADMIN_SET_FEATURES,
+		};
+
+		cmds[n].features.fid = NVME_FEAT_FID_ARBITRATION;
+		cmds[n++].features.cdw11 = cpu_to_le32(ctrl->arbitration);
+	}
+
+	/* return the host memory buffer (with its contents) to the controller */
+	if (ctrl->hmb.nchunks)
+		__nvme_hmb_cmd(ctrl, &cmds[n++], NVME_FEAT_HMB_EHM | NVME_FEAT_HMB_MR);
+
+	if (__admin_batch(ctrl, cmds, n)) {
+		log_debug("could not configure controller\n");
+		goto out;
+	}
+
+	ctrl->hmb.enabled = ctrl->hmb.nchunks > 0;
+
+	/* recreate the i/o queues as they were */
+	n = 0;
+	for (int qid = 1; qid < ctrl->opts.ncqr + 2; qid++) {
+		if (ctrl->cq[qid].mem.vaddr)
+			__create_cq_cmd(&ctrl->cq[qid], &cmds[n++]);
+	}
+
+	if (__admin_batch(ctrl, cmds, n)) {
+		log_debug("could not recreate io completion queues\n");
+		goto out;
+	}
+
+	n = 0;
+	for (int qid = 1; qid < ctrl->opts.nsqr + 2; qid++) {
+		if (ctrl->sq[qid].mem.vaddr)
+			__create_sq_cmd(&ctrl->sq[qid], &cmds[n++]);
+	}
+
+	if (__admin_batch(ctrl, cmds, n)) {
+		log_debug("could not recreate io submission queues\n");
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	free(cmds);
+
+	return ret;
+}
+
 void nvme_close(struct nvme_ctrl *ctrl)
 {
+	/* make sure the controller stops using the host memory buffer */
+	if (nvme_discard_hmb(ctrl)) {
+		if (nvme_reset(ctrl))
+			log_error("could not reset controller; leaking host memory buffer\n");
+		else
+			__nvme_hmb_free(ctrl);
+	}
+
+	/* the queue memory is released with the last queue carved from it */
 	for (int i = 0; i < ctrl->opts.nsqr + 2; i++)
 		nvme_discard_sq(ctrl, &ctrl->sq[i]);
 
-	free(ctrl->sq);
-
 	for (int i = 0; i < ctrl->opts.ncqr + 2; i++)
 		nvme_discard_cq(ctrl, &ctrl->cq[i]);
 
+	free(ctrl->sq);
 	free(ctrl->cq);
 
+	free(ctrl->admin.slots);
+	pthread_mutex_destroy(&ctrl->admin.lock);
+
+	__nvme_ns_free(ctrl);
+
 	nvme_discard_cmb(ctrl);
 
 	if (ctrl->dbbuf.doorbells.vaddr) {
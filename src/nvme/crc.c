@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/crc: " fmt
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vfn/support.h>
+#include <vfn/nvme.h>
+
+#include "ccan/array_size/array_size.h"
+
+#include "crc.h"
+
+#include "crc16table.h"
+#include "crc64table.h"
+
+/* length of the buffer used to check an implementation when it is selected */
+#define NVME_CRC_SELFTEST_LEN 1031
+
+const uint64_t (*const __nvme_crc64_fold)[2] = crc64_nvme_fold;
+const uint64_t (*const __nvme_crc16_fold)[2] = crc16_t10dif_fold;
+
+static const struct nvme_crc_impl *nvme_crc_impls[] = {
+#if defined(__x86_64__)
+	&__nvme_crc_vpclmul,
+	&__nvme_crc_pclmul,
+#elif defined(__aarch64__)
+	&__nvme_crc_pmull,
+#endif
+	&__nvme_crc_slice8,
+};
+
+static const struct nvme_crc_impl *nvme_crc = &__nvme_crc_slice8;
+
+static bool __supported(void)
+{
+	return true;
+}
+
+static uint64_t __crc64_table(uint64_t crc, const unsigned char *buffer, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		crc = (crc >> 8) ^ crc64_nvme_table[0][(crc & 0xff) ^ buffer[i]];
+
+	return crc;
+}
+
+static uint16_t __crc16_table(uint16_t crc, const unsigned char *buffer, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		crc = (uint16_t)(crc << 8) ^ crc16_t10dif_table[0][(crc >> 8) ^ buffer[i]];
+
+	return crc;
+}
+
+const struct nvme_crc_impl __nvme_crc_table = {
+	.name = "table",
+	.supported = __supported,
+	.crc64 = __crc64_table,
+	.crc16 = __crc16_table,
+};
+
+static inline uint64_t __load_le64(const unsigned char *p)
+{
+	uint64_t v = 0;
+
+	for (int i = 0; i < 8; i++)
+		v |= (uint64_t)p[i] << (8 * i);
+
+	return v;
+}
+
+uint64_t __nvme_crc64_slice8(uint64_t crc, const unsigned char *buffer, size_t len)
+{
+	const uint64_t (*t)[256] = crc64_nvme_table;
+
+	for (; len >= 8; len -= 8, buffer += 8) {
+		uint64_t v = crc ^ __load_le64(buffer);
+
+		crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^
+			t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff] ^
+			t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^
+			t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+	}
+
+	return __crc64_table(crc, buffer, len);
+}
+
+uint16_t __nvme_crc16_slice8(uint16_t crc, const unsigned char *buffer, size_t len)
+{
+	const uint16_t (*t)[256] = crc16_t10dif_table;
+
+	for (; len >= 8; len -= 8, buffer += 8) {
+		crc = t[7][buffer[0] ^ (crc >> 8)] ^ t[6][buffer[1] ^ (crc & 0xff)] ^
+			t[5][buffer[2]] ^ t[4][buffer[3]] ^
+			t[3][buffer[4]] ^ t[2][buffer[5]] ^
+			t[1][buffer[6]] ^ t[0][buffer[7]];
+	}
+
+	return __crc16_table(crc, buffer, len);
+}
+
+const struct nvme_crc_impl __nvme_crc_slice8 = {
+	.name = "slice8",
+	.supported = __supported,
+	.crc64 = __nvme_crc64_slice8,
+	.crc16 = __nvme_crc16_slice8,
+};
+
+/* check an implementation against the byte-wise tables */
+static bool __selftest(const struct nvme_crc_impl *impl)
+{
+	unsigned char buf[NVME_CRC_SELFTEST_LEN];
+	uint32_t x = 0x12345678;
+
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		/* xorshift */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+
+		buf[i] = (unsigned char)x;
+	}
+
+	for (size_t off = 0; off < 16; off += 5) {
+		size_t len = sizeof(buf) - off;
+
+		if (impl->crc64(~0ULL, buf + off, len) != __crc64_table(~0ULL, buf + off, len) ||
+		    impl->crc16(0x0, buf + off, len) != __crc16_table(0x0, buf + off, len))
+			return false;
+	}
+
+	return true;
+}
+
+static void __attribute__((constructor)) init_crc(void)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(nvme_crc_impls); i++) {
+		const struct nvme_crc_impl *impl = nvme_crc_impls[i];
+
+		if (!impl->supported())
+			continue;
+
+		if (!__selftest(impl)) {
+			log_error("%s crc implementation is broken; skipping\n", impl->name);
+			continue;
+		}
+
+		nvme_crc = impl;
+		break;
+	}
+
+	log_debug("using %s crc implementation\n", nvme_crc->name);
+}
+
+uint64_t nvme_crc64(uint64_t crc, const unsigned char *buffer, size_t len)
+{
+	return nvme_crc->crc64(crc, buffer, len) ^ (uint64_t)~0;
+}
+
+uint16_t nvme_crc16(uint16_t crc, const unsigned char *buffer, size_t len)
+{
+	return nvme_crc->crc16(crc, buffer, len);
+}
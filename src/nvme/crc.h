@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * CRC implementations update the raw CRC state; the final inversion of the
+ * CRC64 is done by nvme_crc64().
+ */
+struct nvme_crc_impl {
+	const char *name;
+
+	bool (*supported)(void);
+
+	uint64_t (*crc64)(uint64_t crc, const unsigned char *buffer, size_t len);
+	uint16_t (*crc16)(uint16_t crc, const unsigned char *buffer, size_t len);
+};
+
+/* portable implementations */
+extern const struct nvme_crc_impl __nvme_crc_table;
+extern const struct nvme_crc_impl __nvme_crc_slice8;
+
+/* architecture specific implementations */
+#if defined(__x86_64__)
+extern const struct nvme_crc_impl __nvme_crc_pclmul;
+extern const struct nvme_crc_impl __nvme_crc_vpclmul;
+#elif defined(__aarch64__)
+extern const struct nvme_crc_impl __nvme_crc_pmull;
+#endif
+
+/*
+ * Folding implementations reduce the data (at least 256 bytes) to a 128 bit block and finish the
+ * reduction (and any trailing bytes) with slicing-by-8.
+ */
+uint64_t __nvme_crc64_slice8(uint64_t crc, const unsigned char *buffer, size_t len);
+uint16_t __nvme_crc16_slice8(uint16_t crc, const unsigned char *buffer, size_t len);
+
+/*
+ * Folding constants (see lib/gentable-crc{16,64}.c); entry i folds a block
+ * over 128 * (i + 1) bits.
+ */
+extern const uint64_t (*const __nvme_crc64_fold)[2];
+extern const uint64_t (*const __nvme_crc16_fold)[2];
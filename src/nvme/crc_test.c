@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "crc.c"
+
+#define BUF_LEN 0x2000
+
+static unsigned char buf[BUF_LEN + 16];
+
+/* compare against the byte-wise tables at all alignments and many lengths */
+static bool check(const struct nvme_crc_impl *impl, bool crc16)
+{
+	for (size_t off = 0; off < 16; off++) {
+		for (size_t len = 0; len <= BUF_LEN; len += len < 1100 ? 1 : 509) {
+			const unsigned char *p = buf + off;
+
+			if (crc16) {
+				uint16_t seed = (uint16_t)(off * 0x1021);
+
+				if (impl->crc16(seed, p, len) != __crc16_table(seed, p, len))
+					return false;
+			} else {
+				uint64_t seed = ~0ULL - off;
+
+				if (impl->crc64(seed, p, len) != __crc64_table(seed, p, len))
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+int main(void)
+{
+	const unsigned char *check_str = (const unsigned char *)"123456789";
+	uint32_t x = 0xdeadbeef;
+
+	plan_tests(4 + 2 * ARRAY_SIZE(nvme_crc_impls));
+
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+
+		buf[i] = (unsigned char)x;
+	}
+
+	diag("using %s", nvme_crc->name);
+
+	/* check values of the crc catalogue */
+	ok1(nvme_crc64(~0ULL, check_str, 9) == 0xae8b14860a799888ULL);
+	ok1(nvme_crc16(0x0, check_str, 9) == 0xd0db);
+
+	for (size_t i = 0; i < ARRAY_SIZE(nvme_crc_impls); i++) {
+		const struct nvme_crc_impl *impl = nvme_crc_impls[i];
+
+		if (!impl->supported()) {
+			skip(2, "%s not supported", impl->name);
+			continue;
+		}
+
+		ok(check(impl, false), "%s crc64", impl->name);
+		ok(check(impl, true), "%s crc16", impl->name);
+	}
+
+	/* calculations may be continued */
+	ok1(nvme_crc64(nvme_crc64(~0ULL, buf, 1000) ^ ~0ULL, buf + 1000, 3000) ==
+	    nvme_crc64(~0ULL, buf, 4000));
+	ok1(nvme_crc16(nvme_crc16(0x0, buf, 1000), buf + 1000, 3000) ==
+	    nvme_crc16(0x0, buf, 4000));
+
+	return exit_status();
+}
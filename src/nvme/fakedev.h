@@ -0,0 +1,214 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * Fake NVMe device for the unit tests; include it after the source file under
+ * test. A fake device serves one queue pair backed by plain memory. Commands
+ * are completed explicitly with fakedev_complete(), or processed (from the
+ * test thread or a device thread) as the submission queue doorbell is written.
+ *
+ * Unless FAKEDEV_NO_IOMMU is defined, iova mapped memory is identity mapped
+ * by stubs of the iommu functions.
+ */
+
+#include <pthread.h>
+
+struct fakedev {
+	struct nvme_sq *sq;
+	struct nvme_cq *cq;
+
+	uint32_t sqdb, cqdb;
+
+	/* submission queue head, completion queue tail and phase */
+	uint16_t head, tail, phase;
+
+	/* execute a command, optionally setting dword 0 of the cqe; returns the status */
+	uint16_t (*exec)(struct fakedev *dev, union nvme_cmd *sqe, uint32_t *dw0);
+	void *opaque;
+
+	pthread_t thread;
+	bool stop;
+};
+
+#ifndef FAKEDEV_NO_IOMMU
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+int iommu_get_dmabuf(struct iommu_ctx *ctx UNUSED, struct iommu_dmabuf *buffer, size_t len,
+		     unsigned long flags UNUSED)
+{
+	ssize_t ret = pgmap(&buffer->vaddr, len);
+
+	if (ret < 0)
+		return -1;
+
+	buffer->len = (size_t)ret;
+	buffer->iova = (uint64_t)buffer->vaddr;
+
+	return 0;
+}
+
+void iommu_put_dmabuf(struct iommu_dmabuf *buffer)
+{
+	if (buffer->len)
+		pgunmap(buffer->vaddr, buffer->len);
+}
+#endif
+
+/* link the request trackers of @sq into its free list like the library does */
+static inline void fakedev_init_rqs(struct nvme_sq *sq, struct nvme_rq *rqs)
+{
+	sq->rqs = rqs;
+	sq->rq_top = NULL;
+
+	for (int i = 0; i < sq->qsize - 1; i++) {
+		rqs[i].sq = sq;
+		rqs[i].cid = (uint16_t)i;
+		rqs[i].rq_next = sq->rq_top;
+
+		sq->rq_top = &rqs[i];
+	}
+}
+
+/*
+ * Set up @sq and @cq as queue pair @qid, with @rqs (sqsize - 1 entries) as
+ * request trackers, each with a prp list page of its own.
+ */
+static inline void fakedev_init(struct fakedev *dev, int qid, struct nvme_sq *sq, int sqsize,
+				struct nvme_cq *cq, int cqsize, struct nvme_rq *rqs)
+{
+	memset(dev, 0x0, sizeof(*dev));
+
+	dev->sq = sq;
+	dev->cq = cq;
+	dev->phase = 1;
+
+	assert(pgmap(&sq->mem.vaddr, (size_t)sqsize << NVME_SQES) > 0);
+	assert(pgmap(&cq->mem.vaddr, (size_t)cqsize << NVME_CQES) > 0);
+
+	cq->id = qid;
+	cq->qsize = cqsize;
+	cq->doorbell = &dev->cqdb;
+	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+
+	__nvme_cq_grow_stash(cq, (uint16_t)qid, sqsize - 1);
+
+	sq->id = qid;
+	sq->qsize = sqsize;
+	sq->doorbell = &dev->sqdb;
+	sq->cq = cq;
+	pthread_spin_init(&sq->lock, PTHREAD_PROCESS_PRIVATE);
+
+	fakedev_init_rqs(sq, rqs);
+
+	for (int i = 0; i < sqsize - 1; i++) {
+		assert(pgmap(&rqs[i].page.vaddr, __VFN_PAGESIZE) > 0);
+		rqs[i].page.iova = (uint64_t)rqs[i].page.vaddr;
+	}
+}
+
+/*
+ * Post a completion queue entry for command @cid of submission queue @sqid,
+ * which may be another submission queue associated with the completion queue.
+ */
+static inline void fakedev_complete_sq(struct fakedev *dev, uint16_t sqid, uint16_t cid,
+				       uint16_t status, uint32_t dw0)
+{
+	struct nvme_cqe *cqe = dev->cq->mem.vaddr + (dev->tail << NVME_CQES);
+
+	cqe->cid = cid;
+	cqe->sqid = cpu_to_le16(sqid);
+	cqe->dw0 = cpu_to_le32(dw0);
+
+	atomic_store_release(&cqe->sfp, cpu_to_le16((uint16_t)(status << 1 | dev->phase)));
+
+	if (++dev->tail == dev->cq->qsize) {
+		dev->tail = 0;
+		dev->phase ^= 0x1;
+	}
+}
+
+/* post a completion queue entry for command @cid */
+static inline void fakedev_complete(struct fakedev *dev, uint16_t cid, uint16_t status,
+				    uint32_t dw0)
+{
+	fakedev_complete_sq(dev, (uint16_t)dev->sq->id, cid, status, dw0);
+}
+
+/* execute and complete all commands submitted so far; returns the number */
+static inline int fakedev_process(struct fakedev *dev)
+{
+	uint16_t tail = (uint16_t)le32_to_cpu(atomic_load_acquire(&dev->sqdb));
+	int n = 0;
+
+	while (dev->head != tail) {
+		union nvme_cmd *sqe = dev->sq->mem.vaddr + (dev->head << NVME_SQES);
+		uint16_t status = 0x0;
+		uint32_t dw0 = 0x0;
+
+		if (dev->exec)
+			status = dev->exec(dev, sqe, &dw0);
+
+		dev->head = (uint16_t)((dev->head + 1) % dev->sq->qsize);
+
+		fakedev_complete(dev, sqe->cid, status, dw0);
+
+		n++;
+	}
+
+	return n;
+}
+
+static void *__fakedev_run(void *opaque)
+{
+	struct fakedev *dev = opaque;
+
+	while (!atomic_load_acquire(&dev->stop))
+		fakedev_process(dev);
+
+	return NULL;
+}
+
+/* process commands from a device thread until fakedev_stop() */
+static inline void fakedev_start(struct fakedev *dev)
+{
+	dev->stop = false;
+
+	assert(pthread_create(&dev->thread, NULL, __fakedev_run, dev) == 0);
+}
+
+static inline void fakedev_stop(struct fakedev *dev)
+{
+	atomic_store_release(&dev->stop, true);
+	pthread_join(dev->thread, NULL);
+}
@@ -0,0 +1,884 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/handover: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+#include "admin.h"
+
+#define NVME_HANDOVER_MAGIC 0x686e7666 /* "fvnh" */
+#define NVME_HANDOVER_VERSION 1
+
+/* SCM_MAX_FD */
+#define NVME_HANDOVER_MAX_FDS 253
+
+/* device fd, iommu context fds and one memfd per region */
+#define NVME_HANDOVER_FIXED_FDS (1 + IOMMU_CTX_STATE_MAX_FDS)
+
+enum nvme_handover_region_kind {
+	/* memory owned by a single buffer (a ring, request pages, ...) */
+	NVME_HANDOVER_REGION_BUF,
+
+	/* queue memory carved up by nvme_create_ioqpairs() */
+	NVME_HANDOVER_REGION_IOQMEM,
+};
+
+struct nvme_handover_region {
+	uint64_t iova;
+	uint64_t len;
+	uint32_t kind;
+	uint32_t rsvd;
+};
+
+struct nvme_handover_cq {
+	int32_t id;
+	int32_t qsize;
+	int32_t vector;
+	int32_t phase;
+	uint16_t head;
+	uint16_t rsvd[3];
+	uint64_t iova;
+};
+
+struct nvme_handover_sq {
+	int32_t id;
+	int32_t qsize;
+	int32_t cqid;
+	uint16_t tail, ptail;
+	uint64_t iova;
+	uint64_t pages;
+};
+
+struct nvme_handover_hdr {
+	uint32_t magic;
+	uint32_t version;
+
+	char bdf[32];
+
+	struct iommu_ctx_state iommu;
+
+	/* struct nvme_ctrl_opts */
+	int32_t nsqr, ncqr;
+	uint32_t quirks;
+	uint64_t opts_flags;
+
+	/* cached configuration */
+	int32_t nsqa, ncqa;
+	int32_t mqes, mps;
+	uint64_t flags;
+	int32_t numa_node;
+
+	struct {
+		int32_t bar;
+		uint64_t offset;
+		uint64_t iova;
+		uint64_t size;
+	} cmb;
+
+	struct {
+		uint64_t doorbells;
+		uint64_t eventidxs;
+	} dbbuf;
+
+	uint32_t nregions, ncqs, nsqs, naers;
+	uint32_t nfds;
+
+	/* length of the payload following the header */
+	uint32_t len;
+};
+
+struct nvme_handover_map {
+	struct nvme_handover_region *region;
+
+	void *vaddr;
+	int fd;
+};
+
+struct nvme_handover_out {
+	struct nvme_handover_region regions[NVME_HANDOVER_MAX_FDS];
+	int fds[NVME_HANDOVER_MAX_FDS];
+	int nregions;
+};
+
+static int __add_region(struct nvme_handover_out *out, struct iommu_dmabuf *buf, uint32_t kind)
+{
+	if (buf->memfd < 0) {
+		log_debug("queue memory is not shareable (see NVME_CTRL_OPTS_F_HANDOVER)\n");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (NVME_HANDOVER_FIXED_FDS + out->nregions == NVME_HANDOVER_MAX_FDS) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	out->regions[out->nregions] = (struct nvme_handover_region) {
+		.iova = buf->iova,
+		.len = (uint64_t)buf->len,
+		.kind = kind,
+	};
+
+	out->fds[out->nregions++] = buf->memfd;
+
+	return 0;
+}
+
+static int __sq_nfree(struct nvme_sq *sq)
+{
+	int n = 0;
+
+	for (struct nvme_rq *rq = sq->rq_top; rq; rq = rq->rq_next)
+		n++;
+
+	return n;
+}
+
+static int __send(int sock, void *buf, size_t len, int *fds, int nfds)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * NVME_HANDOVER_MAX_FDS)] = {};
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = CMSG_SPACE(sizeof(int) * nfds),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+	while (iov.iov_len) {
+		ssize_t ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		iov.iov_base += ret;
+		iov.iov_len -= ret;
+
+		/* the file descriptors go with the first byte */
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+	}
+
+	return 0;
+}
+
+static void __close_fds(int *fds, int nfds)
+{
+	for (int i = 0; i < nfds; i++) {
+		if (fds[i] < 0)
+			continue;
+
+		log_fatal_if(close(fds[i]), "close\n");
+	}
+}
+
+/*
+ * Receive exactly @len bytes. If @fds is not NULL, collect the file descriptors
+ * passed along and return their number in @nfds.
+ */
+static int __recv(int sock, void *buf, size_t len, int *fds, int *nfds)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * NVME_HANDOVER_MAX_FDS)];
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	if (nfds)
+		*nfds = 0;
+
+	while (iov.iov_len) {
+		struct cmsghdr *cmsg;
+		ssize_t ret;
+
+		msg.msg_control = fds ? cbuf : NULL;
+		msg.msg_controllen = fds ? sizeof(cbuf) : 0;
+
+		ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			goto err;
+		}
+
+		if (!ret) {
+			errno = ECONNRESET;
+			goto err;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			int n;
+
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+
+			n = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+			n = min_t(int, n, NVME_HANDOVER_MAX_FDS - *nfds);
+
+			memcpy(&fds[*nfds], CMSG_DATA(cmsg), sizeof(int) * n);
+			*nfds += n;
+		}
+
+		if (msg.msg_flags & MSG_CTRUNC) {
+			errno = EMSGSIZE;
+			goto err;
+		}
+
+		iov.iov_base += ret;
+		iov.iov_len -= ret;
+	}
+
+	return 0;
+
+err:
+	if (fds)
+		__close_fds(fds, *nfds);
+
+	return -1;
+}
+
+int nvme_handover_send(struct nvme_ctrl *ctrl, int sock)
+{
+	struct nvme_handover_out *out;
+	struct nvme_handover_hdr *hdr;
+	struct nvme_handover_cq *cqs;
+	struct nvme_handover_sq *sqs;
+	uint16_t *aers;
+	int fds[NVME_HANDOVER_MAX_FDS];
+	int ncqs = 0, nsqs = 0, naers, ret = -1;
+	size_t len;
+	void *buf;
+
+	if (!ctrl->adminq.sq) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	out = znew_t(struct nvme_handover_out, 1);
+
+	cqs = znew_t(struct nvme_handover_cq, ctrl->opts.ncqr + 2);
+	sqs = znew_t(struct nvme_handover_sq, ctrl->opts.nsqr + 2);
+	aers = znew_t(uint16_t, ctrl->adminq.sq->qsize);
+
+	naers = __nvme_admin_export_aers(ctrl, aers);
+	if (naers < 0) {
+		log_debug("admin commands outstanding\n");
+		goto out;
+	}
+
+	if (ctrl->dbbuf.doorbells.vaddr) {
+		if (__add_region(out, &ctrl->dbbuf.doorbells, NVME_HANDOVER_REGION_BUF) ||
+		    __add_region(out, &ctrl->dbbuf.eventidxs, NVME_HANDOVER_REGION_BUF))
+			goto out;
+	}
+
+	if (ctrl->ioqmem.len && __add_region(out, &ctrl->ioqmem, NVME_HANDOVER_REGION_IOQMEM))
+		goto out;
+
+	for (int qid = 0; qid < ctrl->opts.ncqr + 2; qid++) {
+		struct nvme_cq *cq = &ctrl->cq[qid];
+
+		if (!cq->mem.vaddr)
+			continue;
+
+		if (!cq->shared && __add_region(out, &cq->mem, NVME_HANDOVER_REGION_BUF))
+			goto out;
+
+		cqs[ncqs++] = (struct nvme_handover_cq) {
+			.id = cq->id,
+			.qsize = cq->qsize,
+			.vector = cq->vector,
+			.phase = cq->phase,
+			.head = cq->head,
+			.iova = cq->mem.iova,
+		};
+	}
+
+	for (int qid = 0; qid < ctrl->opts.nsqr + 2; qid++) {
+		struct nvme_sq *sq = &ctrl->sq[qid];
+
+		if (!sq->mem.vaddr)
+			continue;
+
+		if (__sq_nfree(sq) != sq->qsize - 1 - (qid == NVME_AQ ? naers : 0)) {
+			log_debug("sq %d is not idle\n", qid);
+
+			errno = EBUSY;
+			goto out;
+		}
+
+		if (!sq->shared) {
+			if (__add_region(out, &sq->mem, NVME_HANDOVER_REGION_BUF) ||
+			    __add_region(out, &sq->pages, NVME_HANDOVER_REGION_BUF))
+				goto out;
+		}
+
+		sqs[nsqs++] = (struct nvme_handover_sq) {
+			.id = sq->id,
+			.qsize = sq->qsize,
+			.cqid = sq->cq->id,
+			.tail = sq->tail,
+			.ptail = sq->ptail,
+			.iova = sq->mem.iova,
+			.pages = sq->pages.iova,
+		};
+	}
+
+	len = sizeof(*hdr) + out->nregions * sizeof(struct nvme_handover_region) +
+		ncqs * sizeof(*cqs) + nsqs * sizeof(*sqs) + naers * sizeof(*aers);
+
+	buf = zmallocn(1, len);
+	hdr = buf;
+
+	*hdr = (struct nvme_handover_hdr) {
+		.magic = NVME_HANDOVER_MAGIC,
+		.version = NVME_HANDOVER_VERSION,
+
+		.nsqr = ctrl->opts.nsqr,
+		.ncqr = ctrl->opts.ncqr,
+		.quirks = ctrl->opts.quirks,
+		.opts_flags = ctrl->opts.flags,
+
+		.nsqa = ctrl->config.nsqa,
+		.ncqa = ctrl->config.ncqa,
+		.mqes = ctrl->config.mqes,
+		.mps = ctrl->config.mps,
+		.flags = ctrl->flags,
+		.numa_node = ctrl->numa_node,
+
+		.nregions = (uint32_t)out->nregions,
+		.ncqs = (uint32_t)ncqs,
+		.nsqs = (uint32_t)nsqs,
+		.naers = (uint32_t)naers,
+
+		.len = (uint32_t)(len - sizeof(*hdr)),
+	};
+
+	strncpy(hdr->bdf, ctrl->pci.bdf, sizeof(hdr->bdf) - 1);
+
+	if (ctrl->cmb.vaddr) {
+		uint32_t cmbloc = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CMBLOC));
+
+		hdr->cmb.bar = ctrl->cmb.bar;
+		hdr->cmb.offset = NVME_FIELD_GET(cmbloc, CMBLOC_OFST);
+		hdr->cmb.iova = ctrl->cmb.iova;
+		hdr->cmb.size = ctrl->cmb.size;
+	}
+
+	if (ctrl->dbbuf.doorbells.vaddr) {
+		hdr->dbbuf.doorbells = ctrl->dbbuf.doorbells.iova;
+		hdr->dbbuf.eventidxs = ctrl->dbbuf.eventidxs.iova;
+	}
+
+	if (iommu_export_context(__iommu_ctx(ctrl), ctrl->pci.bdf, &hdr->iommu, &fds[1]))
+		goto free_buf;
+
+	fds[0] = ctrl->pci.dev.fd;
+
+	memmove(&fds[1 + hdr->iommu.nfds], out->fds, out->nregions * sizeof(int));
+
+	hdr->nfds = 1 + hdr->iommu.nfds + out->nregions;
+
+	len = sizeof(*hdr);
+
+	memcpy(buf + len, out->regions, out->nregions * sizeof(struct nvme_handover_region));
+	len += out->nregions * sizeof(struct nvme_handover_region);
+
+	memcpy(buf + len, cqs, ncqs * sizeof(*cqs));
+	len += ncqs * sizeof(*cqs);
+
+	memcpy(buf + len, sqs, nsqs * sizeof(*sqs));
+	len += nsqs * sizeof(*sqs);
+
+	memcpy(buf + len, aers, naers * sizeof(*aers));
+	len += naers * sizeof(*aers);
+
+	ret = __send(sock, buf, len, fds, (int)hdr->nfds);
+
+free_buf:
+	free(buf);
+out:
+	free(aers);
+	free(sqs);
+	free(cqs);
+	free(out);
+
+	return ret;
+}
+
+/*
+ * Find the buffer at @iova in the received regions. Buffers that own a region
+ * take over the memory file descriptor; buffers carved from the I/O queue
+ * memory are marked as shared.
+ */
+static int __lookup(struct nvme_ctrl *ctrl, struct nvme_handover_map *maps, int nmaps,
+		    uint64_t iova, size_t len, struct iommu_dmabuf *buf, bool *shared)
+{
+	for (int i = 0; i < nmaps; i++) {
+		struct nvme_handover_region *r = maps[i].region;
+		uint64_t off = iova - r->iova;
+
+		if (iova < r->iova || off + len > r->len)
+			continue;
+
+		*buf = (struct iommu_dmabuf) {
+			.ctx = __iommu_ctx(ctrl),
+			.vaddr = maps[i].vaddr + off,
+			.iova = iova,
+			.len = (ssize_t)len,
+			.memfd = -1,
+		};
+
+		if (r->kind == NVME_HANDOVER_REGION_IOQMEM) {
+			if (shared)
+				*shared = true;
+
+			return 0;
+		}
+
+		if (off) {
+			log_debug("iova 0x%" PRIx64 " does not start a region\n", iova);
+			break;
+		}
+
+		buf->len = (ssize_t)r->len;
+		buf->memfd = maps[i].fd;
+
+		return 0;
+	}
+
+	log_debug("no region for iova 0x%" PRIx64 "\n", iova);
+
+	errno = EINVAL;
+	return -1;
+}
+
+static int __restore_cq(struct nvme_ctrl *ctrl, struct nvme_handover_cq *rec,
+			struct nvme_handover_map *maps, int nmaps, uint8_t dstrd)
+{
+	struct nvme_cq *cq;
+
+	if (rec->id < 0 || rec->id > ctrl->opts.ncqr + 1 || rec->qsize < 2) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cq = &ctrl->cq[rec->id];
+
+	*cq = (struct nvme_cq) {
+		.id = rec->id,
+		.qsize = rec->qsize,
+		.head = rec->head,
+		.phase = rec->phase,
+		.vector = rec->vector,
+		.doorbell = cqhdbl(ctrl->doorbells, rec->id, dstrd),
+	};
+
+	if (__lookup(ctrl, maps, nmaps, rec->iova, (size_t)rec->qsize << NVME_CQES, &cq->mem,
+		     &cq->shared))
+		return -1;
+
+	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+
+	if (ctrl->dbbuf.doorbells.vaddr) {
+		cq->dbbuf.doorbell = cqhdbl(ctrl->dbbuf.doorbells.vaddr, rec->id, dstrd);
+		cq->dbbuf.eventidx = cqhdbl(ctrl->dbbuf.eventidxs.vaddr, rec->id, dstrd);
+	}
+
+	return 0;
+}
+
+static int __restore_sq(struct nvme_ctrl *ctrl, struct nvme_handover_sq *rec,
+			struct nvme_handover_map *maps, int nmaps, uint8_t dstrd,
+			uint16_t *aers, int naers)
+{
+	int pageshift = __mps_to_pageshift(ctrl->config.mps);
+	struct nvme_rq *top = NULL;
+	struct nvme_sq *sq;
+	struct nvme_cq *cq;
+
+	if (rec->id < 0 || rec->id > ctrl->opts.nsqr + 1 || rec->qsize < 2 ||
+	    rec->cqid < 0 || rec->cqid > ctrl->opts.ncqr + 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cq = &ctrl->cq[rec->cqid];
+	if (!cq->mem.vaddr) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sq = &ctrl->sq[rec->id];
+
+	*sq = (struct nvme_sq) {
+		.id = rec->id,
+		.qsize = rec->qsize,
+		.tail = rec->tail,
+		.ptail = rec->ptail,
+		.cq = cq,
+		.doorbell = sqtdbl(ctrl->doorbells, rec->id, dstrd),
+	};
+
+	if (__lookup(ctrl, maps, nmaps, rec->iova, (size_t)rec->qsize << NVME_SQES, &sq->mem,
+		     &sq->shared))
+		return -1;
+
+	if (__lookup(ctrl, maps, nmaps, rec->pages, (size_t)(rec->qsize - 1) << pageshift,
+		     &sq->pages, NULL))
+		return -1;
+
+	pthread_spin_init(&sq->lock, PTHREAD_PROCESS_PRIVATE);
+
+	if (ctrl->dbbuf.doorbells.vaddr) {
+		sq->dbbuf.doorbell = sqtdbl(ctrl->dbbuf.doorbells.vaddr, rec->id, dstrd);
+		sq->dbbuf.eventidx = sqtdbl(ctrl->dbbuf.eventidxs.vaddr, rec->id, dstrd);
+	}
+
+	sq->rqs = znew_t(struct nvme_rq, rec->qsize - 1);
+
+	for (int i = 0; i < rec->qsize - 1; i++) {
+		struct nvme_rq *rq = &sq->rqs[i];
+		bool busy = false;
+
+		rq->sq = sq;
+		rq->cid = (uint16_t)i;
+
+		rq->page.vaddr = sq->pages.vaddr + ((size_t)i << pageshift);
+		rq->page.iova = sq->pages.iova + ((uint64_t)i << pageshift);
+
+		/* outstanding asynchronous event requests are not free */
+		for (int j = 0; j < naers && rec->id == NVME_AQ; j++)
+			busy |= aers[j] == i;
+
+		if (busy)
+			continue;
+
+		rq->rq_next = top;
+		top = rq;
+	}
+
+	sq->rq_top = top;
+
+	__nvme_cq_grow_stash(cq, (uint16_t)sq->id, rec->qsize - 1);
+
+	return 0;
+}
+
+static void __abort(struct nvme_ctrl *ctrl, struct nvme_handover_hdr *hdr,
+		    struct nvme_handover_map *maps, int *fds, int nfds)
+{
+	int nmaps = (int)hdr->nregions;
+
+	for (int i = 0; i < ctrl->opts.nsqr + 2 && ctrl->sq; i++)
+		free(ctrl->sq[i].rqs);
+
+	for (int i = 0; i < ctrl->opts.ncqr + 2 && ctrl->cq; i++) {
+		free(ctrl->cq[i].stash.cqes);
+		free(ctrl->cq[i].stash.ready);
+		free(ctrl->cq[i].stash.ranges);
+	}
+
+	free(ctrl->sq);
+	free(ctrl->cq);
+	free(ctrl->admin.slots);
+
+	for (int i = 0; i < nmaps; i++) {
+		if (maps[i].vaddr)
+			pgunmap(maps[i].vaddr, maps[i].region->len);
+	}
+
+	if (ctrl->cmb.vaddr)
+		vfio_pci_unmap_bar(&ctrl->pci, ctrl->cmb.bar, ctrl->cmb.vaddr, ctrl->cmb.size, 0);
+
+	if (ctrl->doorbells)
+		vfio_pci_unmap_bar(&ctrl->pci, 0, ctrl->doorbells, 0x1000, 0x1000);
+
+	if (ctrl->regs)
+		vfio_pci_unmap_bar(&ctrl->pci, 0, ctrl->regs, 0x1000, 0);
+
+	/*
+	 * Only close the file descriptors; closing the device would release
+	 * the imported iommu context state. The imported context owns (and
+	 * closes) the file descriptors backing it.
+	 */
+	if (ctrl->pci.dev.ctx) {
+		iommu_release_context(ctrl->pci.dev.ctx);
+
+		for (int i = 1; i < 1 + (int)hdr->iommu.nfds; i++)
+			fds[i] = -1;
+	}
+
+	__close_fds(fds, nfds);
+
+	free(ctrl->pci.bdf);
+
+	pthread_mutex_destroy(&ctrl->admin.lock);
+	pthread_mutex_destroy(&ctrl->ns.lock);
+
+	memset(ctrl, 0x0, sizeof(*ctrl));
+}
+
+static int __attach(struct nvme_ctrl *ctrl, struct nvme_handover_hdr *hdr, void *payload,
+		    int *fds, struct nvme_handover_map *maps)
+{
+	struct nvme_handover_region *regions = payload;
+	struct nvme_handover_cq *cqs = (void *)&regions[hdr->nregions];
+	struct nvme_handover_sq *sqs = (void *)&cqs[hdr->ncqs];
+	uint16_t *aers = (void *)&sqs[hdr->nsqs];
+	int *memfds = &fds[1 + hdr->iommu.nfds];
+	struct iommu_ctx *ctx;
+	uint8_t dstrd;
+	uint64_t cap;
+
+	ctx = iommu_import_context(&hdr->iommu, hdr->bdf, &fds[1]);
+	if (!ctx) {
+		log_debug("could not import iommu context\n");
+		return -1;
+	}
+
+	ctrl->pci.dev.ctx = ctx;
+
+	if (vfio_pci_adopt(&ctrl->pci, hdr->bdf, fds[0])) {
+		log_debug("could not adopt device\n");
+		return -1;
+	}
+
+	ctrl->regs = vfio_pci_map_bar(&ctrl->pci, 0, 0x1000, 0, PROT_READ | PROT_WRITE);
+	if (!ctrl->regs) {
+		log_debug("could not map controller registers\n");
+		return -1;
+	}
+
+	ctrl->doorbells = vfio_pci_map_bar(&ctrl->pci, 0, 0x1000, 0x1000, PROT_WRITE);
+	if (!ctrl->doorbells) {
+		log_debug("could not map doorbells\n");
+		return -1;
+	}
+
+	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	dstrd = NVME_FIELD_GET(cap, CAP_DSTRD);
+
+	for (unsigned int i = 0; i < hdr->nregions; i++) {
+		struct nvme_handover_map *m = &maps[i];
+		uint64_t iova = regions[i].iova;
+
+		m->region = &regions[i];
+		m->fd = memfds[i];
+
+		m->vaddr = mmap(NULL, regions[i].len, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+		if (m->vaddr == MAP_FAILED) {
+			m->vaddr = NULL;
+			return -1;
+		}
+
+		if (iommu_map_vaddr(ctx, m->vaddr, regions[i].len, &iova,
+				    IOMMU_MAP_FIXED_IOVA | IOMMU_MAP_ADOPT))
+			return -1;
+	}
+
+	if (hdr->dbbuf.doorbells) {
+		if (__lookup(ctrl, maps, (int)hdr->nregions, hdr->dbbuf.doorbells, 0,
+			     &ctrl->dbbuf.doorbells, NULL) ||
+		    __lookup(ctrl, maps, (int)hdr->nregions, hdr->dbbuf.eventidxs, 0,
+			     &ctrl->dbbuf.eventidxs, NULL))
+			return -1;
+	}
+
+	for (unsigned int i = 0; i < hdr->nregions; i++) {
+		if (regions[i].kind != NVME_HANDOVER_REGION_IOQMEM)
+			continue;
+
+		ctrl->ioqmem = (struct iommu_dmabuf) {
+			.ctx = ctx,
+			.vaddr = maps[i].vaddr,
+			.iova = regions[i].iova,
+			.len = (ssize_t)regions[i].len,
+			.memfd = maps[i].fd,
+		};
+	}
+
+	for (unsigned int i = 0; i < hdr->ncqs; i++) {
+		if (__restore_cq(ctrl, &cqs[i], maps, (int)hdr->nregions, dstrd))
+			return -1;
+	}
+
+	for (unsigned int i = 0; i < hdr->nsqs; i++) {
+		if (__restore_sq(ctrl, &sqs[i], maps, (int)hdr->nregions, dstrd, aers,
+				 (int)hdr->naers))
+			return -1;
+	}
+
+	if (!ctrl->sq[NVME_AQ].mem.vaddr || !ctrl->cq[NVME_AQ].mem.vaddr) {
+		log_debug("no admin queue\n");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	ctrl->adminq.sq = &ctrl->sq[NVME_AQ];
+	ctrl->adminq.cq = &ctrl->cq[NVME_AQ];
+
+	if (__nvme_admin_import_aers(ctrl, aers, (int)hdr->naers))
+		return -1;
+
+	if (hdr->cmb.size) {
+		uint64_t iova = hdr->cmb.iova;
+
+		ctrl->cmb.bar = hdr->cmb.bar;
+		ctrl->cmb.size = hdr->cmb.size;
+		ctrl->cmb.vaddr = vfio_pci_map_bar(&ctrl->pci, hdr->cmb.bar, hdr->cmb.size,
+						   hdr->cmb.offset, PROT_READ | PROT_WRITE);
+		if (!ctrl->cmb.vaddr) {
+			log_debug("could not map bar %d\n", hdr->cmb.bar);
+			return -1;
+		}
+
+		if (iommu_map_vaddr(ctx, ctrl->cmb.vaddr, ctrl->cmb.size, &iova,
+				    IOMMU_MAP_FIXED_IOVA | IOMMU_MAP_ADOPT))
+			return -1;
+
+		ctrl->cmb.iova = iova;
+	}
+
+	return 0;
+}
+
+int nvme_handover_recv(struct nvme_ctrl *ctrl, int sock)
+{
+	struct nvme_handover_hdr hdr;
+	struct nvme_handover_map *maps = NULL;
+	int fds[NVME_HANDOVER_MAX_FDS];
+	void *payload = NULL;
+	int nfds, ret = -1;
+
+	memset(ctrl, 0x0, sizeof(*ctrl));
+
+	if (__recv(sock, &hdr, sizeof(hdr), fds, &nfds))
+		return -1;
+
+	if (hdr.magic != NVME_HANDOVER_MAGIC || hdr.version != NVME_HANDOVER_VERSION) {
+		log_debug("invalid handover header\n");
+
+		errno = EPROTO;
+		goto close_fds;
+	}
+
+	if (hdr.nfds != (uint32_t)nfds || hdr.iommu.nfds > IOMMU_CTX_STATE_MAX_FDS ||
+	    hdr.nfds != 1 + hdr.iommu.nfds + hdr.nregions) {
+		log_debug("unexpected number of file descriptors\n");
+
+		errno = EPROTO;
+		goto close_fds;
+	}
+
+	if (hdr.len != hdr.nregions * sizeof(struct nvme_handover_region) +
+	    hdr.ncqs * sizeof(struct nvme_handover_cq) +
+	    hdr.nsqs * sizeof(struct nvme_handover_sq) + hdr.naers * sizeof(uint16_t)) {
+		errno = EPROTO;
+		goto close_fds;
+	}
+
+	hdr.bdf[sizeof(hdr.bdf) - 1] = '\0';
+
+	payload = zmallocn(1, hdr.len);
+
+	if (__recv(sock, payload, hdr.len, NULL, NULL))
+		goto close_fds;
+
+	ctrl->opts = (struct nvme_ctrl_opts) {
+		.nsqr = hdr.nsqr,
+		.ncqr = hdr.ncqr,
+		.quirks = hdr.quirks,
+		.flags = (unsigned long)hdr.opts_flags,
+	};
+
+	ctrl->config.nsqa = hdr.nsqa;
+	ctrl->config.ncqa = hdr.ncqa;
+	ctrl->config.mqes = hdr.mqes;
+	ctrl->config.mps = hdr.mps;
+	ctrl->flags = (unsigned long)hdr.flags;
+	ctrl->numa_node = hdr.numa_node;
+
+	if (ctrl->opts.nsqr < 0 || ctrl->opts.ncqr < 0) {
+		errno = EPROTO;
+		goto close_fds;
+	}
+
+	pthread_mutex_init(&ctrl->admin.lock, NULL);
+	pthread_mutex_init(&ctrl->ns.lock, NULL);
+
+	ctrl->sq = znew_t(struct nvme_sq, ctrl->opts.nsqr + 2);
+	ctrl->cq = znew_t(struct nvme_cq, ctrl->opts.ncqr + 2);
+
+	maps = znew_t(struct nvme_handover_map, hdr.nregions + 1);
+
+	if (__attach(ctrl, &hdr, payload, fds, maps)) {
+		int err = errno;
+
+		__abort(ctrl, &hdr, maps, fds, nfds);
+
+		errno = err;
+		goto out;
+	}
+
+	log_debug("attached to %s\n", ctrl->pci.bdf);
+
+	ret = 0;
+	goto out;
+
+close_fds:
+	__close_fds(fds, nfds);
+out:
+	free(maps);
+	free(payload);
+
+	return ret;
+}
@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <fcntl.h>
+
+#include "ccan/tap/tap.h"
+
+#include "handover.c"
+
+/* the iommu is faked below to check what gets adopted */
+#define FAKEDEV_NO_IOMMU
+#include "fakedev.h"
+
+#define AQSIZE 8
+#define IOQSIZE 2
+#define PAGESIZE 0x1000
+
+static struct iommu_ctx *fake_ctx = (struct iommu_ctx *)0xc0ffee;
+static uint8_t bar0[0x2000] __attribute__((aligned(0x1000)));
+static int nadopted;
+
+static bool adopt_fails;
+static int imported_fd = -1, released_fd = -1;
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags)
+{
+	assert(ctx == fake_ctx);
+	assert(flags == (IOMMU_MAP_FIXED_IOVA | IOMMU_MAP_ADOPT));
+
+	nadopted++;
+
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+int iommu_get_dmabuf(struct iommu_ctx *ctx UNUSED, struct iommu_dmabuf *buffer UNUSED,
+		     size_t len UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+void iommu_put_dmabuf(struct iommu_dmabuf *buffer UNUSED)
+{
+	;
+}
+
+int iommu_export_context(struct iommu_ctx *ctx UNUSED, const char *bdf UNUSED,
+			 struct iommu_ctx_state *state, int *fds)
+{
+	*state = (struct iommu_ctx_state) {
+		.backend = IOMMU_CTX_BACKEND_IOMMUFD,
+		.nfds = 1,
+		.id = 42,
+	};
+
+	fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	return 0;
+}
+
+struct iommu_ctx *iommu_import_context(const struct iommu_ctx_state *state,
+				       const char *bdf UNUSED, int *fds)
+{
+	if (state->backend != IOMMU_CTX_BACKEND_IOMMUFD || state->id != 42)
+		return NULL;
+
+	imported_fd = fds[0];
+
+	return fake_ctx;
+}
+
+void iommu_release_context(struct iommu_ctx *ctx)
+{
+	assert(ctx == fake_ctx);
+
+	released_fd = imported_fd;
+	close(imported_fd);
+}
+
+int vfio_pci_adopt(struct vfio_pci_device *pci, const char *bdf, int fd)
+{
+	if (adopt_fails) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	pci->bdf = strdup(bdf);
+	pci->dev.fd = fd;
+
+	return 0;
+}
+
+void *vfio_pci_map_bar(struct vfio_pci_device *pci UNUSED, int idx UNUSED, size_t len UNUSED,
+		       uint64_t offset, int prot UNUSED)
+{
+	return bar0 + offset;
+}
+
+void vfio_pci_unmap_bar(struct vfio_pci_device *pci UNUSED, int idx UNUSED, void *mem UNUSED,
+			size_t len UNUSED, uint64_t offset UNUSED)
+{
+	;
+}
+
+static void shared_buf(struct iommu_dmabuf *buf, size_t len, uint64_t iova)
+{
+	buf->len = pgmap_shared(&buf->vaddr, len, -1, &buf->memfd);
+	assert(buf->len > 0);
+
+	buf->iova = iova;
+}
+
+static void fake_ctrl(struct nvme_ctrl *ctrl)
+{
+	struct nvme_sq *sq;
+	struct nvme_cq *cq;
+	struct nvme_rq *rq;
+	uint16_t cid;
+
+	memset(ctrl, 0x0, sizeof(*ctrl));
+
+	ctrl->pci.bdf = "0000:01:00.0";
+	ctrl->pci.dev.ctx = fake_ctx;
+	ctrl->pci.dev.fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	ctrl->opts = (struct nvme_ctrl_opts) {
+		.nsqr = 1, .ncqr = 1, .flags = NVME_CTRL_OPTS_F_HANDOVER,
+	};
+
+	ctrl->config.mqes = 1023;
+	ctrl->numa_node = -1;
+
+	pthread_mutex_init(&ctrl->admin.lock, NULL);
+
+	ctrl->sq = znew_t(struct nvme_sq, 3);
+	ctrl->cq = znew_t(struct nvme_cq, 3);
+
+	/* admin queue pair with buffers of its own */
+	cq = &ctrl->cq[0];
+	cq->qsize = AQSIZE;
+	cq->head = 3;
+	cq->phase = 1;
+	shared_buf(&cq->mem, AQSIZE << NVME_CQES, 0x100000);
+
+	sq = &ctrl->sq[0];
+	sq->qsize = AQSIZE;
+	sq->tail = sq->ptail = 4;
+	sq->cq = cq;
+	shared_buf(&sq->mem, AQSIZE << NVME_SQES, 0x200000);
+	shared_buf(&sq->pages, (AQSIZE - 1) * PAGESIZE, 0x300000);
+	fakedev_init_rqs(sq, znew_t(struct nvme_rq, sq->qsize - 1));
+
+	ctrl->adminq.sq = sq;
+	ctrl->adminq.cq = cq;
+
+	/* an outstanding asynchronous event request */
+	rq = nvme_rq_acquire(sq);
+	cid = rq->cid;
+	assert(__nvme_admin_import_aers(ctrl, &cid, 1) == 0);
+
+	/* i/o queue pair carved from the i/o queue memory */
+	shared_buf(&ctrl->ioqmem, 3 * PAGESIZE, 0x400000);
+
+	cq = &ctrl->cq[1];
+	cq->id = 1;
+	cq->qsize = IOQSIZE;
+	cq->vector = -1;
+	cq->shared = true;
+	cq->mem = (struct iommu_dmabuf) {
+		.vaddr = ctrl->ioqmem.vaddr, .iova = 0x400000, .len = PAGESIZE, .memfd = -1,
+	};
+
+	sq = &ctrl->sq[1];
+	sq->id = 1;
+	sq->qsize = IOQSIZE;
+	sq->tail = 1;
+	sq->cq = cq;
+	sq->shared = true;
+	sq->mem = (struct iommu_dmabuf) {
+		.vaddr = ctrl->ioqmem.vaddr + PAGESIZE, .iova = 0x401000, .len = PAGESIZE,
+		.memfd = -1,
+	};
+	sq->pages = (struct iommu_dmabuf) {
+		.vaddr = ctrl->ioqmem.vaddr + 2 * PAGESIZE, .iova = 0x402000, .len = PAGESIZE,
+		.memfd = -1,
+	};
+	fakedev_init_rqs(sq, znew_t(struct nvme_rq, sq->qsize - 1));
+}
+
+static int nfree(struct nvme_sq *sq)
+{
+	return __sq_nfree(sq);
+}
+
+int main(void)
+{
+	struct nvme_ctrl a, b, c;
+	struct nvme_rq *rq;
+	uint16_t cids[AQSIZE];
+	uint32_t magic = 0;
+	int sv[2], fd;
+
+	plan_tests(19);
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	fake_ctrl(&a);
+
+	/* write something the new process should see */
+	memset(a.sq[1].mem.vaddr, 0xab, 64);
+
+	ok1(nvme_handover_send(&a, sv[0]) == 0);
+	ok1(nvme_handover_recv(&b, sv[1]) == 0);
+
+	ok1(b.pci.dev.ctx == fake_ctx && b.pci.dev.fd >= 0);
+	ok1(strcmp(b.pci.bdf, "0000:01:00.0") == 0);
+
+	/* admin sq, cq and request pages, plus the i/o queue memory */
+	ok1(nadopted == 4);
+
+	ok1(b.adminq.sq == &b.sq[0] && b.adminq.cq == &b.cq[0]);
+	ok1(b.cq[0].head == 3 && b.cq[0].phase == 1 && b.sq[0].tail == 4);
+	ok1(b.sq[0].mem.iova == 0x200000 && b.sq[0].mem.memfd >= 0);
+	ok1(b.sq[0].rqs[2].page.iova == 0x300000 + 2 * PAGESIZE);
+
+	/* the outstanding aer is carried over and not on the free stack */
+	ok1(nfree(&b.sq[0]) == AQSIZE - 2);
+	ok1(__nvme_admin_export_aers(&b, cids) == 1 && cids[0] == AQSIZE - 2);
+
+	/* i/o queues are slices of the i/o queue memory */
+	ok1(b.sq[1].shared && b.cq[1].shared && b.sq[1].cq == &b.cq[1]);
+	ok1(b.sq[1].mem.vaddr == b.ioqmem.vaddr + PAGESIZE && b.ioqmem.iova == 0x400000);
+	ok1(b.sq[1].mem.vaddr != a.sq[1].mem.vaddr &&
+	    ((uint8_t *)b.sq[1].mem.vaddr)[63] == 0xab);
+	ok1(b.sq[1].doorbell == (void *)(bar0 + 0x1000 + (2 * 1) * 4));
+
+	/* a failed attach releases the imported iommu context */
+	adopt_fails = true;
+	ok1(nvme_handover_send(&a, sv[0]) == 0 && nvme_handover_recv(&c, sv[1]) == -1 &&
+	    errno == ENODEV && released_fd >= 0 && fcntl(released_fd, F_GETFD) == -1 &&
+	    !c.pci.dev.ctx);
+	adopt_fails = false;
+
+	/* busy i/o queue */
+	rq = nvme_rq_acquire(&a.sq[1]);
+	ok1(nvme_handover_send(&a, sv[0]) == -1 && errno == EBUSY);
+	nvme_rq_release(rq);
+
+	/* memory not shareable */
+	fd = a.sq[0].pages.memfd;
+	a.sq[0].pages.memfd = -1;
+	ok1(nvme_handover_send(&a, sv[0]) == -1 && errno == EINVAL);
+	a.sq[0].pages.memfd = fd;
+
+	/* garbage on the socket */
+	assert(write(sv[0], &magic, sizeof(magic)) == sizeof(magic));
+	assert(shutdown(sv[0], SHUT_WR) == 0);
+	ok1(nvme_handover_recv(&b, sv[1]) == -1);
+
+	return exit_status();
+}
@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/hmb: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+/* the size limits reported in identify controller are in 4 KiB units */
+#define NVME_HMB_UNIT 4096
+
+/* preferred size of a buffer chunk (one huge page) */
+#define NVME_HMB_CHUNK_SIZE __VFN_HUGEPAGESIZE
+
+void __nvme_hmb_identified(struct nvme_ctrl *ctrl, void *id)
+{
+	ctrl->hmb.hmpre = le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_CTRL_HMPRE));
+	ctrl->hmb.hmmin = le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_CTRL_HMMIN));
+	ctrl->hmb.hmminds = le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_CTRL_HMMINDS));
+	ctrl->hmb.hmmaxd = le16_to_cpu(*(leint16_t *)(id + NVME_IDENTIFY_CTRL_HMMAXD));
+}
+
+void __nvme_hmb_free(struct nvme_ctrl *ctrl)
+{
+	for (int i = 0; i < ctrl->hmb.nchunks; i++)
+		iommu_put_dmabuf(&ctrl->hmb.chunks[i]);
+
+	free(ctrl->hmb.chunks);
+
+	iommu_put_dmabuf(&ctrl->hmb.descs);
+
+	ctrl->hmb.chunks = NULL;
+	ctrl->hmb.nchunks = 0;
+	ctrl->hmb.size = 0;
+	ctrl->hmb.enabled = false;
+}
+
+int __nvme_hmb_alloc(struct nvme_ctrl *ctrl, size_t size)
+{
+	size_t pagesize = __mps_to_pagesize(ctrl->config.mps);
+	size_t hmpre = (size_t)ctrl->hmb.hmpre * NVME_HMB_UNIT;
+	size_t hmmin = (size_t)ctrl->hmb.hmmin * NVME_HMB_UNIT;
+	size_t minds = (size_t)ctrl->hmb.hmminds * NVME_HMB_UNIT;
+	size_t chunksize = NVME_HMB_CHUNK_SIZE, off = 0;
+	struct nvme_hmb_desc *descs;
+	int nchunks;
+
+	if (!hmpre) {
+		log_debug("controller does not request a host memory buffer\n");
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (ctrl->opts.flags & NVME_CTRL_OPTS_F_HANDOVER) {
+		log_debug("host memory buffer cannot be handed over\n");
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (!size)
+		size = hmpre;
+
+	size = ALIGN_UP(clamp(size, hmmin, hmpre), pagesize);
+
+	/* fewer, larger chunks if the controller limits the number of descriptors */
+	if (ctrl->hmb.hmmaxd && (size + chunksize - 1) / chunksize > ctrl->hmb.hmmaxd)
+		chunksize = ALIGN_UP((size + ctrl->hmb.hmmaxd - 1) / ctrl->hmb.hmmaxd,
+				     NVME_HMB_CHUNK_SIZE);
+
+	chunksize = ALIGN_UP(max(chunksize, minds), pagesize);
+	nchunks = (int)((size + chunksize - 1) / chunksize);
+
+	if (iommu_get_dmabuf(__iommu_ctx(ctrl), &ctrl->hmb.descs,
+			     nchunks * sizeof(struct nvme_hmb_desc),
+			     IOMMU_DMABUF_NODE(ctrl->numa_node)))
+		return -1;
+
+	descs = ctrl->hmb.descs.vaddr;
+
+	ctrl->hmb.chunks = znew_t(struct iommu_dmabuf, nchunks);
+
+	for (int i = 0; i < nchunks; i++) {
+		struct iommu_dmabuf *chunk = &ctrl->hmb.chunks[i];
+		size_t len = max(min(chunksize, size - off), minds);
+		unsigned long flags = IOMMU_DMABUF_NODE(ctrl->numa_node);
+
+		if (ALIGNED(len, __VFN_HUGEPAGESIZE))
+			flags |= IOMMU_DMABUF_HUGEPAGE;
+
+		if (iommu_get_dmabuf(__iommu_ctx(ctrl), chunk, len, flags)) {
+			log_debug("could not allocate host memory buffer chunk\n");
+
+			__nvme_hmb_free(ctrl);
+			return -1;
+		}
+
+		ctrl->hmb.nchunks++;
+
+		descs[i] = (struct nvme_hmb_desc) {
+			.badd = cpu_to_le64(chunk->iova),
+			.bsize = cpu_to_le32((uint32_t)(len / pagesize)),
+		};
+
+		off += len;
+	}
+
+	ctrl->hmb.size = off;
+
+	log_debug("allocated %zu bytes in %d chunks\n", off, nchunks);
+
+	return 0;
+}
+
+void __nvme_hmb_cmd(struct nvme_ctrl *ctrl, union nvme_cmd *cmd, uint32_t flags)
+{
+	size_t pagesize = __mps_to_pagesize(ctrl->config.mps);
+	uint64_t iova = ctrl->hmb.descs.iova;
+
+	*cmd = (union nvme_cmd) {
+		.opcode = NVME_ADMIN_SET_FEATURES,
+	};
+
+	cmd->features.fid = NVME_FEAT_FID_HOST_MEM_BUF;
+	cmd->features.cdw11 = cpu_to_le32(flags);
+
+	if (!(flags & NVME_FEAT_HMB_EHM))
+		return;
+
+	cmd->features.cdw12 = cpu_to_le32((uint32_t)(ctrl->hmb.size / pagesize));
+	cmd->features.cdw13 = cpu_to_le32((uint32_t)iova);
+	cmd->features.cdw14 = cpu_to_le32((uint32_t)(iova >> 32));
+	cmd->features.cdw15 = cpu_to_le32((uint32_t)ctrl->hmb.nchunks);
+}
+
+int nvme_configure_hmb(struct nvme_ctrl *ctrl, size_t size)
+{
+	union nvme_cmd cmd;
+
+	if (ctrl->hmb.nchunks) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (__nvme_hmb_alloc(ctrl, size))
+		return -1;
+
+	__nvme_hmb_cmd(ctrl, &cmd, NVME_FEAT_HMB_EHM);
+
+	if (nvme_admin(ctrl, &cmd, NULL, 0, NULL)) {
+		log_debug("could not enable host memory buffer\n");
+
+		__nvme_hmb_free(ctrl);
+		return -1;
+	}
+
+	ctrl->hmb.enabled = true;
+
+	return 0;
+}
+
+int nvme_discard_hmb(struct nvme_ctrl *ctrl)
+{
+	union nvme_cmd cmd;
+
+	if (ctrl->hmb.enabled) {
+		__nvme_hmb_cmd(ctrl, &cmd, 0x0);
+
+		/* the controller may still be using the buffer */
+		if (nvme_admin(ctrl, &cmd, NULL, 0, NULL)) {
+			log_debug("could not disable host memory buffer\n");
+			return -1;
+		}
+	}
+
+	__nvme_hmb_free(ctrl);
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "hmb.c"
+
+#define MiB (1UL << 20)
+
+static int nbufs, nhuge;
+static bool fail;
+static union nvme_cmd last;
+
+int iommu_get_dmabuf(struct iommu_ctx *ctx UNUSED, struct iommu_dmabuf *buffer, size_t len,
+		     unsigned long flags)
+{
+	buffer->len = pgmap(&buffer->vaddr, len);
+	assert(buffer->len > 0);
+
+	buffer->iova = (uint64_t)buffer->vaddr;
+
+	nbufs++;
+
+	if (flags & IOMMU_DMABUF_HUGEPAGE)
+		nhuge++;
+
+	return 0;
+}
+
+void iommu_put_dmabuf(struct iommu_dmabuf *buffer)
+{
+	if (!buffer->len)
+		return;
+
+	pgunmap(buffer->vaddr, buffer->len);
+
+	memset(buffer, 0x0, sizeof(*buffer));
+
+	nbufs--;
+}
+
+int nvme_admin(struct nvme_ctrl *ctrl UNUSED, union nvme_cmd *sqe, void *buf UNUSED,
+	       size_t len UNUSED, struct nvme_cqe *cqe_copy UNUSED)
+{
+	memcpy(&last, sqe, sizeof(last));
+
+	if (fail) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool check_descs(struct nvme_ctrl *ctrl, size_t chunksize, size_t last_chunksize)
+{
+	struct nvme_hmb_desc *descs = ctrl->hmb.descs.vaddr;
+
+	for (int i = 0; i < ctrl->hmb.nchunks; i++) {
+		size_t len = i == ctrl->hmb.nchunks - 1 ? last_chunksize : chunksize;
+
+		if (le64_to_cpu(descs[i].badd) != ctrl->hmb.chunks[i].iova ||
+		    le32_to_cpu(descs[i].bsize) != len / 4096)
+			return false;
+	}
+
+	return true;
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = { .numa_node = -1 };
+	uint8_t id[NVME_IDENTIFY_DATA_SIZE] = {};
+
+	plan_tests(21);
+
+	/* no host memory buffer requested */
+	ok1(nvme_configure_hmb(&ctrl, 0) == -1 && errno == ENOTSUP);
+
+	/* 8 MiB preferred, 2 MiB minimum */
+	*(leint32_t *)(id + NVME_IDENTIFY_CTRL_HMPRE) = cpu_to_le32(2048);
+	*(leint32_t *)(id + NVME_IDENTIFY_CTRL_HMMIN) = cpu_to_le32(512);
+
+	__nvme_hmb_identified(&ctrl, id);
+
+	ok1(nvme_configure_hmb(&ctrl, 0) == 0 && ctrl.hmb.enabled);
+	ok1(ctrl.hmb.size == 8 * MiB && ctrl.hmb.nchunks == 4 && nhuge == 4);
+	ok1(check_descs(&ctrl, 2 * MiB, 2 * MiB));
+
+	ok1(last.features.opcode == NVME_ADMIN_SET_FEATURES &&
+	    last.features.fid == NVME_FEAT_FID_HOST_MEM_BUF &&
+	    le32_to_cpu(last.features.cdw11) == NVME_FEAT_HMB_EHM &&
+	    le32_to_cpu(last.features.cdw12) == 2048 &&
+	    le32_to_cpu(last.features.cdw13) == (uint32_t)ctrl.hmb.descs.iova &&
+	    le32_to_cpu(last.features.cdw14) == (uint32_t)(ctrl.hmb.descs.iova >> 32) &&
+	    le32_to_cpu(last.features.cdw15) == 4);
+
+	ok1(nvme_configure_hmb(&ctrl, 0) == -1 && errno == EBUSY);
+
+	/* disabled before it is released */
+	ok1(nvme_discard_hmb(&ctrl) == 0 && le32_to_cpu(last.features.cdw11) == 0x0);
+	ok1(ctrl.hmb.nchunks == 0 && !ctrl.hmb.enabled && nbufs == 0);
+
+	/* limited to the minimum size */
+	nhuge = 0;
+	ok1(nvme_configure_hmb(&ctrl, MiB) == 0 && ctrl.hmb.size == 2 * MiB && nhuge == 1);
+	ok1(nvme_discard_hmb(&ctrl) == 0);
+
+	/* rounded up to the page size; the last chunk is smaller */
+	nhuge = 0;
+	ok1(nvme_configure_hmb(&ctrl, 3 * MiB + 1) == 0);
+	ok1(ctrl.hmb.size == 3 * MiB + 4096 && ctrl.hmb.nchunks == 2 && nhuge == 1);
+	ok1(check_descs(&ctrl, 2 * MiB, MiB + 4096));
+	ok1(nvme_discard_hmb(&ctrl) == 0);
+
+	/* larger chunks if the number of descriptors is limited */
+	*(leint16_t *)(id + NVME_IDENTIFY_CTRL_HMMAXD) = cpu_to_le16(3);
+
+	__nvme_hmb_identified(&ctrl, id);
+
+	ok1(nvme_configure_hmb(&ctrl, 0) == 0 && ctrl.hmb.nchunks == 2 &&
+	    check_descs(&ctrl, 4 * MiB, 4 * MiB));
+	ok1(nvme_discard_hmb(&ctrl) == 0);
+
+	/* minimum descriptor size */
+	*(leint32_t *)(id + NVME_IDENTIFY_CTRL_HMMINDS) = cpu_to_le32(768);
+	*(leint16_t *)(id + NVME_IDENTIFY_CTRL_HMMAXD) = cpu_to_le16(0);
+
+	__nvme_hmb_identified(&ctrl, id);
+
+	ok1(nvme_configure_hmb(&ctrl, 0) == 0 && ctrl.hmb.nchunks == 3 &&
+	    ctrl.hmb.size == 9 * MiB && check_descs(&ctrl, 3 * MiB, 3 * MiB));
+	ok1(nvme_discard_hmb(&ctrl) == 0);
+
+	/* the buffer is released if it cannot be enabled */
+	fail = true;
+	ok1(nvme_configure_hmb(&ctrl, 0) == -1 && ctrl.hmb.nchunks == 0 && nbufs == 0);
+	fail = false;
+
+	/* the buffer is kept if it cannot be disabled */
+	ok1(nvme_configure_hmb(&ctrl, 0) == 0);
+
+	fail = true;
+	ok1(nvme_discard_hmb(&ctrl) == -1 && ctrl.hmb.nchunks == 3 && ctrl.hmb.enabled);
+	fail = false;
+
+	nvme_discard_hmb(&ctrl);
+
+	return exit_status();
+}
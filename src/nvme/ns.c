@@ -0,0 +1,385 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/ns: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/iommu.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+/* number of entries in an active namespace id list */
+#define NVME_NS_LIST_MAX (NVME_IDENTIFY_DATA_SIZE / sizeof(leint32_t))
+
+/* the number of logical blocks field is a 16 bit zeroes based value */
+#define NVME_NS_NLB_MAX 0x10000
+
+static int __identify_csi(struct nvme_ctrl *ctrl, struct iommu_dmabuf *buf, uint8_t cns,
+			  uint8_t csi, uint32_t nsid)
+{
+	union nvme_cmd cmd;
+
+	cmd.identify = (struct nvme_cmd_identify) {
+		.opcode = NVME_ADMIN_IDENTIFY,
+		.nsid = cpu_to_le32(nsid),
+		.cns = cns,
+		.csi = csi,
+	};
+
+	memset(buf->vaddr, 0x0, NVME_IDENTIFY_DATA_SIZE);
+
+	return nvme_admin(ctrl, &cmd, buf->vaddr, NVME_IDENTIFY_DATA_SIZE, NULL);
+}
+
+static inline int __identify(struct nvme_ctrl *ctrl, struct iommu_dmabuf *buf, uint8_t cns,
+			     uint32_t nsid)
+{
+	return __identify_csi(ctrl, buf, cns, 0x0, nsid);
+}
+
+static int __find_idx(struct nvme_ctrl *ctrl, uint32_t nsid)
+{
+	int lo = 0, hi = ctrl->ns.n;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (ctrl->ns.tbl[mid]->nsid < nsid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static struct nvme_ns_info *__find(struct nvme_ctrl *ctrl, uint32_t nsid)
+{
+	int idx = __find_idx(ctrl, nsid);
+
+	if (idx < ctrl->ns.n && ctrl->ns.tbl[idx]->nsid == nsid)
+		return ctrl->ns.tbl[idx];
+
+	return NULL;
+}
+
+static struct nvme_ns_info *__insert(struct nvme_ctrl *ctrl, uint32_t nsid)
+{
+	struct nvme_ns_info *info;
+	int idx = __find_idx(ctrl, nsid);
+
+	if (idx < ctrl->ns.n && ctrl->ns.tbl[idx]->nsid == nsid)
+		return ctrl->ns.tbl[idx];
+
+	info = znew_t(struct nvme_ns_info, 1);
+	info->nsid = nsid;
+
+	ctrl->ns.tbl = reallocn(ctrl->ns.tbl, (unsigned int)ctrl->ns.n + 1,
+				sizeof(*ctrl->ns.tbl));
+
+	memmove(&ctrl->ns.tbl[idx + 1], &ctrl->ns.tbl[idx],
+		(ctrl->ns.n - idx) * sizeof(*ctrl->ns.tbl));
+
+	ctrl->ns.tbl[idx] = info;
+	ctrl->ns.n++;
+
+	return info;
+}
+
+static int __refresh(struct nvme_ctrl *ctrl, struct iommu_dmabuf *buf)
+{
+	__autofree uint32_t *nsids = NULL;
+	uint32_t nsid = 0;
+	unsigned int n = 0;
+
+	if (!ctrl->ns.loaded) {
+		unsigned int shift;
+		uint64_t cap;
+		uint8_t mdts;
+
+		if (__identify(ctrl, buf, NVME_IDENTIFY_CNS_CTRL, 0))
+			return -1;
+
+		cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+		mdts = *(uint8_t *)(buf->vaddr + NVME_IDENTIFY_CTRL_MDTS);
+
+		ctrl->ns.ctratt = le32_to_cpu(*(leint32_t *)(buf->vaddr + NVME_IDENTIFY_CTRL_CTRATT));
+		ctrl->ns.oncs = le16_to_cpu(*(leint16_t *)(buf->vaddr + NVME_IDENTIFY_CTRL_ONCS));
+
+		/*
+		 * In units of the minimum memory page size; zero means no limit,
+		 * and so does a limit too large to be represented.
+		 */
+		shift = mdts + 12 + (unsigned int)NVME_FIELD_GET(cap, CAP_MPSMIN);
+
+		ctrl->ns.mdts = 0;
+
+		if (mdts && shift < sizeof(size_t) * 8)
+			ctrl->ns.mdts = (size_t)1 << shift;
+	}
+
+	/* read the entire list before touching the table */
+	do {
+		leint32_t *list = buf->vaddr;
+		unsigned int i;
+
+		if (__identify(ctrl, buf, NVME_IDENTIFY_CNS_ACTIVE_NS_LIST, nsid))
+			return -1;
+
+		nsids = reallocn(nsids, n + (unsigned int)NVME_NS_LIST_MAX, sizeof(*nsids));
+
+		for (i = 0; i < NVME_NS_LIST_MAX && list[i]; i++) {
+			nsid = le32_to_cpu(list[i]);
+			nsids[n++] = nsid;
+		}
+
+		/* a full list may be continued from the last namespace */
+		if (i < NVME_NS_LIST_MAX)
+			break;
+	} while (nsid < NVME_NSID_ALL - 1);
+
+	for (int i = 0; i < ctrl->ns.n; i++) {
+		ctrl->ns.tbl[i]->active = false;
+		ctrl->ns.tbl[i]->identified = false;
+	}
+
+	for (unsigned int i = 0; i < n; i++)
+		__insert(ctrl, nsids[i])->active = true;
+
+	ctrl->ns.loaded = true;
+
+	return 0;
+}
+
+static uint8_t __get_csi(struct nvme_ctrl *ctrl, struct iommu_dmabuf *buf, uint32_t nsid)
+{
+	size_t off = 0;
+
+	/* optional before NVMe 1.3; assume the NVM command set */
+	if (__identify(ctrl, buf, NVME_IDENTIFY_CNS_NS_DESC_LIST, nsid))
+		return 0x0;
+
+	while (off + sizeof(struct nvme_ns_desc) < NVME_IDENTIFY_DATA_SIZE) {
+		struct nvme_ns_desc *desc = buf->vaddr + off;
+
+		if (!desc->nidl)
+			break;
+
+		if (desc->nidt == NVME_NS_DESC_CSI)
+			return desc->nid[0];
+
+		off += sizeof(*desc) + desc->nidl;
+	}
+
+	return 0x0;
+}
+
+/*
+ * Replace the table entry @entry with a copy of @ns. Entries that have been
+ * identified before may have been handed out, so they are kept (unchanged)
+ * until the namespace table is freed.
+ */
+static struct nvme_ns_info *__publish(struct nvme_ctrl *ctrl, struct nvme_ns_info *entry,
+				      struct nvme_ns_info *ns)
+{
+	struct nvme_ns_info *info;
+
+	/* identify rejects a zero lba data size; the entry was never returned */
+	if (!entry->lbads) {
+		*entry = *ns;
+		return entry;
+	}
+
+	info = znew_t(struct nvme_ns_info, 1);
+	*info = *ns;
+
+	ctrl->ns.tbl[__find_idx(ctrl, info->nsid)] = info;
+
+	ctrl->ns.retired = reallocn(ctrl->ns.retired, (unsigned int)ctrl->ns.nretired + 1,
+				    sizeof(*ctrl->ns.retired));
+	ctrl->ns.retired[ctrl->ns.nretired++] = entry;
+
+	return info;
+}
+
+/*
+ * Identify the namespace of @entry. The namespace information is gathered
+ * separately and only published (in one go) if all of it could be read, so a
+ * failed identify does not leave a partially updated entry.
+ *
+ * Return: The published entry or ``NULL``.
+ */
+static struct nvme_ns_info *__identify_ns(struct nvme_ctrl *ctrl, struct iommu_dmabuf *buf,
+					  struct nvme_ns_info *entry)
+{
+	struct nvme_ns_info ns = { .nsid = entry->nsid, .active = entry->active };
+	struct nvme_ns_info *info = &ns;
+	struct nvme_lbaf *lbaf;
+	void *id = buf->vaddr;
+	uint8_t nsfeat, flbas, dps;
+	unsigned int fmt;
+
+	info->csi = __get_csi(ctrl, buf, info->nsid);
+
+	if (__identify(ctrl, buf, NVME_IDENTIFY_CNS_NS, info->nsid))
+		return NULL;
+
+	info->nsze = le64_to_cpu(*(leint64_t *)(id + NVME_IDENTIFY_NS_NSZE));
+	info->ncap = le64_to_cpu(*(leint64_t *)(id + NVME_IDENTIFY_NS_NCAP));
+
+	nsfeat = *(uint8_t *)(id + NVME_IDENTIFY_NS_NSFEAT);
+	flbas = *(uint8_t *)(id + NVME_IDENTIFY_NS_FLBAS);
+	dps = *(uint8_t *)(id + NVME_IDENTIFY_NS_DPS);
+
+	fmt = NVME_FIELD_GET(flbas, IDENTIFY_NS_FLBAS_HI) << 4 |
+		NVME_FIELD_GET(flbas, IDENTIFY_NS_FLBAS_LO);
+
+	lbaf = (struct nvme_lbaf *)(id + NVME_IDENTIFY_NS_LBAF) + fmt;
+
+	info->lbaf = (uint8_t)fmt;
+	info->lbads = lbaf->ds;
+	info->ms = le16_to_cpu(lbaf->ms);
+	info->extended = !!(flbas & NVME_IDENTIFY_NS_FLBAS_EXTENDED);
+
+	info->pi = NVME_FIELD_GET(dps, IDENTIFY_NS_DPS_PIT);
+	info->pi_first = !!(dps & NVME_IDENTIFY_NS_DPS_FIRST);
+
+	if (info->lbads < 9 || info->lbads > 31) {
+		log_debug("nsid %" PRIu32 " has unsupported lba data size\n", info->nsid);
+
+		errno = EINVAL;
+		return NULL;
+	}
+
+	info->noiob = le16_to_cpu(*(leint16_t *)(id + NVME_IDENTIFY_NS_NOIOB));
+
+	info->npwg = info->npwa = info->npdg = info->npda = info->nows = 1;
+
+	if (nsfeat & NVME_IDENTIFY_NS_NSFEAT_OPTPERF) {
+		/* zeroes based values */
+		info->npwg += le16_to_cpu(*(leint16_t *)(id + NVME_IDENTIFY_NS_NPWG));
+		info->npwa += le16_to_cpu(*(leint16_t *)(id + NVME_IDENTIFY_NS_NPWA));
+		info->npdg += le16_to_cpu(*(leint16_t *)(id + NVME_IDENTIFY_NS_NPDG));
+		info->npda += le16_to_cpu(*(leint16_t *)(id + NVME_IDENTIFY_NS_NPDA));
+		info->nows += le16_to_cpu(*(leint16_t *)(id + NVME_IDENTIFY_NS_NOWS));
+	}
+
+	info->mssrl = info->msrc = 0;
+	info->mcl = 0;
+
+	if (ctrl->ns.oncs & NVME_IDENTIFY_CTRL_ONCS_COPY) {
+		info->mssrl = le16_to_cpu(*(leint16_t *)(id + NVME_IDENTIFY_NS_MSSRL));
+		info->mcl = le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_NS_MCL));
+
+		/* zeroes based */
+		if (info->mssrl && info->mcl)
+			info->msrc = (uint16_t)(*(uint8_t *)(id + NVME_IDENTIFY_NS_MSRC) + 1);
+	}
+
+	info->max_nlb = NVME_NS_NLB_MAX;
+
+	if (ctrl->ns.mdts)
+		info->max_nlb = (uint32_t)clamp_t(size_t, ctrl->ns.mdts / nvme_ns_lba_size(info),
+						  1, NVME_NS_NLB_MAX);
+
+	info->pif = NVME_NS_PIF_16B;
+	info->sts = 0;
+
+	/* the protection information format is in the nvm command set namespace data */
+	if (info->pi && (ctrl->ns.ctratt & NVME_IDENTIFY_CTRL_CTRATT_ELBAS)) {
+		uint32_t elbaf;
+
+		if (__identify_csi(ctrl, buf, NVME_IDENTIFY_CNS_CSI_NS, NVME_CSI_NVM, info->nsid))
+			return NULL;
+
+		elbaf = le32_to_cpu(*((leint32_t *)(id + NVME_IDENTIFY_NVM_NS_ELBAF) + fmt));
+
+		info->pif = (uint8_t)NVME_FIELD_GET(elbaf, IDENTIFY_NVM_ELBAF_PIF);
+		info->sts = (uint8_t)NVME_FIELD_GET(elbaf, IDENTIFY_NVM_ELBAF_STS);
+	}
+
+	info->identified = true;
+
+	return __publish(ctrl, entry, info);
+}
+
+const struct nvme_ns_info *nvme_ns_get_info(struct nvme_ctrl *ctrl, uint32_t nsid)
+{
+	__autovar_s(iommu_dmabuf) buf = {};
+	struct nvme_ns_info *info;
+
+	__autolock(&ctrl->ns.lock);
+
+	if (!ctrl->ns.loaded || __atomic_exchange_n(&ctrl->ns.stale, false, __ATOMIC_ACQ_REL)) {
+		if (iommu_get_dmabuf(__iommu_ctx(ctrl), &buf, NVME_IDENTIFY_DATA_SIZE,
+				     IOMMU_MAP_EPHEMERAL))
+			goto stale;
+
+		if (__refresh(ctrl, &buf))
+			goto stale;
+	}
+
+	info = __find(ctrl, nsid);
+	if (!info || !info->active) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	if (info->identified)
+		return info;
+
+	if (!buf.vaddr && iommu_get_dmabuf(__iommu_ctx(ctrl), &buf, NVME_IDENTIFY_DATA_SIZE,
+					   IOMMU_MAP_EPHEMERAL))
+		return NULL;
+
+	return __identify_ns(ctrl, &buf, info);
+
+stale:
+	/* retry on the next lookup */
+	if (ctrl->ns.loaded)
+		nvme_ns_invalidate(ctrl);
+
+	return NULL;
+}
+
+void __nvme_ns_free(struct nvme_ctrl *ctrl)
+{
+	for (int i = 0; i < ctrl->ns.n; i++)
+		free(ctrl->ns.tbl[i]);
+
+	free(ctrl->ns.tbl);
+
+	for (int i = 0; i < ctrl->ns.nretired; i++)
+		free(ctrl->ns.retired[i]);
+
+	free(ctrl->ns.retired);
+
+	pthread_mutex_destroy(&ctrl->ns.lock);
+}
@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "ns.c"
+
+static int ncmds;
+static bool fail, fail_ns, ns3_active = true;
+static uint8_t mdts = 5;
+
+int iommu_get_dmabuf(struct iommu_ctx *ctx UNUSED, struct iommu_dmabuf *buffer, size_t len,
+		     unsigned long flags UNUSED)
+{
+	buffer->len = pgmap(&buffer->vaddr, len);
+	assert(buffer->len > 0);
+
+	return 0;
+}
+
+void iommu_put_dmabuf(struct iommu_dmabuf *buffer)
+{
+	if (buffer->len)
+		pgunmap(buffer->vaddr, buffer->len);
+}
+
+static void fake_identify_ns(uint32_t nsid, void *id)
+{
+	struct nvme_lbaf *lbaf = id + NVME_IDENTIFY_NS_LBAF;
+
+	*(leint64_t *)(id + NVME_IDENTIFY_NS_NSZE) = cpu_to_le64(1000 * nsid);
+	*(leint64_t *)(id + NVME_IDENTIFY_NS_NCAP) = cpu_to_le64(900 * nsid);
+
+	lbaf[0] = (struct nvme_lbaf) { .ds = 9 };
+	lbaf[1] = (struct nvme_lbaf) { .ds = 12, .ms = cpu_to_le16(8) };
+
+	if (nsid != 1)
+		return;
+
+	/* format 1 with extended metadata and type 1 pi in the first bytes */
+	*(uint8_t *)(id + NVME_IDENTIFY_NS_FLBAS) = 0x1 | NVME_IDENTIFY_NS_FLBAS_EXTENDED;
+	*(uint8_t *)(id + NVME_IDENTIFY_NS_DPS) = 0x1 | NVME_IDENTIFY_NS_DPS_FIRST;
+
+	*(leint16_t *)(id + NVME_IDENTIFY_NS_NOIOB) = cpu_to_le16(64);
+
+	*(uint8_t *)(id + NVME_IDENTIFY_NS_NSFEAT) = NVME_IDENTIFY_NS_NSFEAT_OPTPERF;
+	*(leint16_t *)(id + NVME_IDENTIFY_NS_NPWG) = cpu_to_le16(7);
+	*(leint16_t *)(id + NVME_IDENTIFY_NS_NOWS) = cpu_to_le16(15);
+
+	*(leint16_t *)(id + NVME_IDENTIFY_NS_MSSRL) = cpu_to_le16(128);
+	*(leint32_t *)(id + NVME_IDENTIFY_NS_MCL) = cpu_to_le32(1024);
+	*(uint8_t *)(id + NVME_IDENTIFY_NS_MSRC) = 15;
+}
+
+int nvme_admin(struct nvme_ctrl *ctrl UNUSED, union nvme_cmd *sqe, void *buf,
+	       size_t len UNUSED, struct nvme_cqe *cqe_copy UNUSED)
+{
+	uint32_t nsid = le32_to_cpu(sqe->identify.nsid);
+	leint32_t *list = buf;
+
+	ncmds++;
+
+	if (fail) {
+		errno = EIO;
+		return -1;
+	}
+
+	switch (sqe->identify.cns) {
+	case NVME_IDENTIFY_CNS_CTRL:
+		*(uint8_t *)(buf + NVME_IDENTIFY_CTRL_MDTS) = mdts;
+		*(leint32_t *)(buf + NVME_IDENTIFY_CTRL_CTRATT) =
+			cpu_to_le32(NVME_IDENTIFY_CTRL_CTRATT_ELBAS);
+		*(leint16_t *)(buf + NVME_IDENTIFY_CTRL_ONCS) = cpu_to_le16(NVME_IDENTIFY_CTRL_ONCS_COPY);
+		break;
+
+	case NVME_IDENTIFY_CNS_ACTIVE_NS_LIST:
+		assert(nsid == 0);
+
+		list[0] = cpu_to_le32(1);
+
+		if (ns3_active)
+			list[1] = cpu_to_le32(3);
+
+		break;
+
+	case NVME_IDENTIFY_CNS_NS_DESC_LIST:
+		/* not supported for nsid 1 */
+		if (nsid == 1) {
+			errno = EIO;
+			return -1;
+		}
+
+		*(struct nvme_ns_desc *)buf = (struct nvme_ns_desc) {
+			.nidt = NVME_NS_DESC_CSI, .nidl = 1,
+		};
+		*(uint8_t *)(buf + sizeof(struct nvme_ns_desc)) = 0x2;
+
+		break;
+
+	case NVME_IDENTIFY_CNS_NS:
+		if (fail_ns) {
+			errno = EIO;
+			return -1;
+		}
+
+		fake_identify_ns(nsid, buf);
+		break;
+
+	case NVME_IDENTIFY_CNS_CSI_NS:
+		/* only namespaces with protection information */
+		assert(nsid == 1 && sqe->identify.csi == NVME_CSI_NVM);
+
+		/* 64b guard for format 1 */
+		list = buf + NVME_IDENTIFY_NVM_NS_ELBAF;
+		list[0] = cpu_to_le32(0x7f);
+		list[1] = cpu_to_le32(NVME_NS_PIF_64B << NVME_IDENTIFY_NVM_ELBAF_PIF_SHIFT);
+
+		break;
+
+	default:
+		assert(false);
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	const struct nvme_ns_info *ns1, *ns3, *ns;
+	struct nvme_ctrl ctrl = {};
+
+	plan_tests(24);
+
+	ctrl.regs = zmallocn(1, 0x1000);
+	pthread_mutex_init(&ctrl.ns.lock, NULL);
+
+	/*
+	 * identify controller, active namespace list, descriptors, namespace and
+	 * nvm command set namespace
+	 */
+	ns1 = nvme_ns_get_info(&ctrl, 1);
+	ok1(ns1 && ncmds == 5);
+
+	ok1(ns1->nsid == 1 && ns1->csi == 0x0 && ns1->nsze == 1000 && ns1->ncap == 900);
+	ok1(ns1->lbads == 12 && ns1->ms == 8 && ns1->extended);
+	ok1(ns1->pi == 1 && ns1->pi_first);
+	ok1(ns1->pif == NVME_NS_PIF_64B && ns1->sts == 0);
+	ok1(ns1->noiob == 64 && ns1->npwg == 8 && ns1->nows == 16 && ns1->npda == 1);
+	ok1(nvme_ns_lba_size(ns1) == 4104);
+	ok1(ns1->mssrl == 128 && ns1->mcl == 1024 && ns1->msrc == 16);
+
+	/* mdts is 128 KiB */
+	ok1(ns1->max_nlb == 0x20000 / 4104);
+
+	/* cached */
+	ok1(nvme_ns_get_info(&ctrl, 1) == ns1 && ncmds == 5);
+
+	ok1(nvme_ns_get_info(&ctrl, 2) == NULL && errno == ENOENT && ncmds == 5);
+
+	ns3 = nvme_ns_get_info(&ctrl, 3);
+	ok1(ns3 && ns3->csi == 0x2 && ns3->lbads == 9 && ns3->max_nlb == 256);
+	ok1(ns3->noiob == 0 && ns3->npwg == 1 && ns3->msrc == 0);
+
+	/* limited by the optimal i/o boundary */
+	ok1(nvme_ns_max_nlb(ns1, 60) == 4 && nvme_ns_max_nlb(ns1, 64) == ns1->max_nlb);
+	ok1(nvme_ns_max_nlb(ns3, 60) == 256);
+
+	/* namespace 3 is detached */
+	ns3_active = false;
+	nvme_ns_invalidate(&ctrl);
+
+	ok1(nvme_ns_get_info(&ctrl, 3) == NULL && errno == ENOENT);
+
+	/* namespaces are identified again into a new entry; the old one remains valid */
+	ncmds = 0;
+	ns = nvme_ns_get_info(&ctrl, 1);
+	ok1(ns && ns != ns1 && ncmds == 3);
+	ok1(ns->lbads == 12 && ns1->lbads == 12 && ns1->nsze == 1000);
+
+	ns1 = ns;
+
+	/* failed refreshes are retried */
+	nvme_ns_invalidate(&ctrl);
+	fail = true;
+	ok1(nvme_ns_get_info(&ctrl, 1) == NULL && ns1->active);
+
+	fail = false;
+	ncmds = 0;
+	ns1 = nvme_ns_get_info(&ctrl, 1);
+	ok1(ns1 && ns1->identified && ncmds == 4);
+
+	/* a failed identify leaves the entry untouched */
+	nvme_ns_invalidate(&ctrl);
+	fail_ns = true;
+	ok1(nvme_ns_get_info(&ctrl, 1) == NULL && !ns1->identified);
+	ok1(ns1->lbads == 12 && ns1->nsze == 1000 && ns1->pif == NVME_NS_PIF_64B &&
+	    ns1->max_nlb == 0x20000 / 4104);
+
+	fail_ns = false;
+	ns = nvme_ns_get_info(&ctrl, 1);
+	ok1(ns && ns->identified && ctrl.ns.nretired == 3);
+
+	__nvme_ns_free(&ctrl);
+
+	/* a transfer size limit too large to represent is no limit */
+	ctrl = (struct nvme_ctrl) { .regs = ctrl.regs };
+	pthread_mutex_init(&ctrl.ns.lock, NULL);
+
+	mdts = 60;
+	ns1 = nvme_ns_get_info(&ctrl, 1);
+	ok1(ns1 && ctrl.ns.mdts == 0 && ns1->max_nlb == NVME_NS_NLB_MAX);
+
+	__nvme_ns_free(&ctrl);
+	free(ctrl.regs);
+
+	return exit_status();
+}
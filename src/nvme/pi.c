@@ -0,0 +1,424 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/pi: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/nvme.h>
+
+#include "types.h"
+
+/* application tag that disables checking of a logical block */
+#define NVME_PI_APPTAG_ESCAPE 0xffff
+
+int nvme_pi_init(struct nvme_pi *pi, const struct nvme_ns_info *info,
+		 const struct nvme_pi_opts *opts)
+{
+	*pi = (struct nvme_pi) {
+		.info = info,
+		.opts = opts ? *opts : nvme_pi_opts_default,
+		.bs = (size_t)1 << info->lbads,
+	};
+
+	if (!info->pi || info->sts) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	switch (info->pif) {
+	case NVME_NS_PIF_16B:
+		pi->tuple = sizeof(struct nvme_crc16_pi_tuple);
+		break;
+
+	case NVME_NS_PIF_64B:
+		pi->tuple = sizeof(struct nvme_crc64_pi_tuple);
+		break;
+
+	default:
+		log_debug("nsid %" PRIu32 " has unsupported protection information format\n",
+			  info->nsid);
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (info->ms < pi->tuple) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/*
+	 * with only protection information in the metadata, the controller does
+	 * not transfer the metadata of extended logical blocks if it inserts and
+	 * strips the protection information
+	 */
+	if ((pi->opts.flags & NVME_PI_F_PRACT) && info->extended && info->ms == pi->tuple) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* the reference tag of type 3 protection information is opaque */
+	if (info->pi == 3)
+		pi->opts.flags &= ~NVME_PI_F_CHECK_REFTAG;
+
+	if (!info->pi_first)
+		pi->pioff = info->ms - pi->tuple;
+
+	pthread_mutex_init(&pi->lock, NULL);
+
+	return 0;
+}
+
+void nvme_pi_fini(struct nvme_pi *pi)
+{
+	pthread_mutex_destroy(&pi->lock);
+
+	memset(pi, 0x0, sizeof(*pi));
+}
+
+/*
+ * The guard covers the logical block data and, if the protection information
+ * is in the last bytes of the metadata, the metadata preceding it.
+ */
+static uint64_t __guard(struct nvme_pi *pi, unsigned char *data, unsigned char *md)
+{
+	size_t len = pi->bs;
+
+	/* contiguous for extended logical blocks */
+	if (md == data + len) {
+		len += pi->pioff;
+		md = NULL;
+	}
+
+	if (pi->info->pif == NVME_NS_PIF_16B) {
+		uint16_t crc = nvme_crc16(0x0, data, len);
+
+		if (md && pi->pioff)
+			crc = nvme_crc16(crc, md, pi->pioff);
+
+		return crc;
+	} else {
+		uint64_t crc = nvme_crc64(~0ULL, data, len);
+
+		if (md && pi->pioff)
+			crc = nvme_crc64(~crc, md, pi->pioff);
+
+		return crc;
+	}
+}
+
+static inline uint64_t __reftag(struct nvme_pi *pi, uint64_t lba)
+{
+	if (pi->info->pi == 3)
+		return 0x0;
+
+	if (pi->info->pif == NVME_NS_PIF_16B)
+		return (uint32_t)lba;
+
+	return lba & ((1ULL << 48) - 1);
+}
+
+static void __put_tuple(struct nvme_pi *pi, unsigned char *md, uint64_t guard, uint64_t reftag)
+{
+	if (pi->info->pif == NVME_NS_PIF_16B) {
+		struct nvme_crc16_pi_tuple *t = (struct nvme_crc16_pi_tuple *)md;
+
+		t->guard = cpu_to_be16((uint16_t)guard);
+		t->apptag = cpu_to_be16(pi->opts.apptag);
+		t->reftag = cpu_to_be32((uint32_t)reftag);
+	} else {
+		struct nvme_crc64_pi_tuple *t = (struct nvme_crc64_pi_tuple *)md;
+
+		t->guard = cpu_to_be64(guard);
+		t->apptag = cpu_to_be16(pi->opts.apptag);
+
+		put_unaligned_be48(reftag, t->sr);
+	}
+}
+
+static void __get_tuple(struct nvme_pi *pi, unsigned char *md, uint64_t *guard,
+			uint16_t *apptag, uint64_t *reftag)
+{
+	if (pi->info->pif == NVME_NS_PIF_16B) {
+		struct nvme_crc16_pi_tuple *t = (struct nvme_crc16_pi_tuple *)md;
+
+		*guard = be16_to_cpu(t->guard);
+		*apptag = be16_to_cpu(t->apptag);
+		*reftag = be32_to_cpu(t->reftag);
+	} else {
+		struct nvme_crc64_pi_tuple *t = (struct nvme_crc64_pi_tuple *)md;
+
+		*guard = be64_to_cpu(t->guard);
+		*apptag = be16_to_cpu(t->apptag);
+		*reftag = get_unaligned_be48(t->sr);
+	}
+}
+
+/* get the data and metadata of logical block @i */
+static inline void __block(struct nvme_pi *pi, void *data, void *mbuf, uint64_t i,
+			   unsigned char **d, unsigned char **md)
+{
+	const struct nvme_ns_info *info = pi->info;
+
+	if (info->extended) {
+		*d = data + i * (pi->bs + info->ms);
+		*md = *d + pi->bs;
+	} else {
+		*d = data + i * pi->bs;
+		*md = mbuf + i * info->ms;
+	}
+}
+
+void nvme_pi_generate(struct nvme_pi *pi, void *data, void *mbuf, uint64_t slba, uint64_t nlb)
+{
+	for (uint64_t i = 0; i < nlb; i++) {
+		unsigned char *d, *md;
+
+		__block(pi, data, mbuf, i, &d, &md);
+
+		__put_tuple(pi, md + pi->pioff, __guard(pi, d, md), __reftag(pi, slba + i));
+	}
+}
+
+static inline bool __escaped(struct nvme_pi *pi, uint16_t apptag, uint64_t reftag)
+{
+	if (apptag != NVME_PI_APPTAG_ESCAPE)
+		return false;
+
+	if (pi->info->pi != 3)
+		return true;
+
+	/* type 3 also requires the reference tag escape */
+	if (pi->info->pif == NVME_NS_PIF_16B)
+		return reftag == UINT32_MAX;
+
+	return reftag == (1ULL << 48) - 1;
+}
+
+int nvme_pi_verify(struct nvme_pi *pi, void *data, void *mbuf, uint64_t slba, uint64_t nlb,
+		   uint64_t *lba)
+{
+	unsigned int flags = pi->opts.flags;
+
+	for (uint64_t i = 0; i < nlb; i++) {
+		unsigned char *d, *md;
+		uint64_t guard, reftag;
+		uint16_t apptag;
+
+		__block(pi, data, mbuf, i, &d, &md);
+		__get_tuple(pi, md + pi->pioff, &guard, &apptag, &reftag);
+
+		if (__escaped(pi, apptag, reftag))
+			continue;
+
+		if ((flags & NVME_PI_F_CHECK_GUARD) && guard != __guard(pi, d, md))
+			goto mismatch;
+
+		if ((flags & NVME_PI_F_CHECK_APPTAG) &&
+		    (apptag ^ pi->opts.apptag) & pi->opts.appmask)
+			goto mismatch;
+
+		if ((flags & NVME_PI_F_CHECK_REFTAG) && reftag != __reftag(pi, slba + i))
+			goto mismatch;
+
+		continue;
+
+mismatch:
+		log_debug("protection information mismatch at lba %" PRIu64 "\n", slba + i);
+
+		if (lba)
+			*lba = slba + i;
+
+		errno = EILSEQ;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* verify or generate the protection information of the entire request */
+static int __bio_pi(struct nvme_pi *pi, struct nvme_bio *bio, bool verify)
+{
+	size_t lbsize = nvme_ns_lba_size(pi->info);
+	uint64_t lba = bio->pi_slba;
+
+	for (int i = 0; i < bio->niov; i++) {
+		uint64_t nlb = bio->iov[i].iov_len / lbsize;
+		void *mbuf = NULL;
+
+		if (bio->mbuf)
+			mbuf = bio->mbuf + (lba - bio->pi_slba) * pi->info->ms;
+
+		if (!verify)
+			nvme_pi_generate(pi, bio->iov[i].iov_base, mbuf, lba, nlb);
+		else if (nvme_pi_verify(pi, bio->iov[i].iov_base, mbuf, lba, nlb, NULL))
+			return -1;
+
+		lba += nlb;
+	}
+
+	return 0;
+}
+
+/* called as the completion callback of a deferred request */
+static void __pi_queue(struct nvme_bio *bio)
+{
+	struct nvme_pi *pi = bio->end_io_data;
+
+	bio->pi_next = NULL;
+
+	pthread_mutex_lock(&pi->lock);
+
+	if (pi->pending_tail)
+		pi->pending_tail->pi_next = bio;
+	else
+		pi->pending = bio;
+
+	pi->pending_tail = bio;
+
+	pthread_mutex_unlock(&pi->lock);
+}
+
+static void __pi_end_io(struct nvme_bio *bio)
+{
+	struct nvme_pi *pi = bio->end_io_data;
+
+	if (bio->err)
+		return;
+
+	/*
+	 * The completion callback is called last on the completion path, so the
+	 * request is only handed over to nvme_pi_verify_pending() from there.
+	 */
+	if ((pi->opts.flags & NVME_PI_F_DEFER) && bio->cb) {
+		bio->pi_cb = bio->cb;
+		bio->cb = __pi_queue;
+
+		return;
+	}
+
+	if (__bio_pi(pi, bio, true))
+		bio->err = EILSEQ;
+}
+
+int nvme_pi_attach(struct nvme_pi *pi, struct nvme_bio *bio, void *mbuf)
+{
+	const struct nvme_ns_info *info = pi->info;
+	unsigned int flags = pi->opts.flags;
+	size_t lbsize = nvme_ns_lba_size(info);
+	uint16_t control = 0x0;
+
+	if (bio->info != info ||
+	    (bio->cmd.opcode != NVME_CMD_READ && bio->cmd.opcode != NVME_CMD_WRITE)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int i = 0; i < bio->niov; i++) {
+		if (bio->iov[i].iov_len % lbsize) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	/* metadata is not transferred if it holds only inserted and stripped pi */
+	if (info->extended || ((flags & NVME_PI_F_PRACT) && info->ms == pi->tuple))
+		mbuf = NULL;
+	else if (!mbuf) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (flags & NVME_PI_F_CHECK_GUARD)
+		control |= NVME_RW_CONTROL_PRCHK_GUARD;
+
+	if (flags & NVME_PI_F_CHECK_APPTAG)
+		control |= NVME_RW_CONTROL_PRCHK_APPTAG;
+
+	if (flags & NVME_PI_F_CHECK_REFTAG)
+		control |= NVME_RW_CONTROL_PRCHK_REFTAG;
+
+	if (flags & NVME_PI_F_PRACT)
+		control |= NVME_RW_CONTROL_PRACT;
+
+	bio->cmd.rw.control = cpu_to_le16(le16_to_cpu(bio->cmd.rw.control) | control);
+	bio->cmd.rw.apptag = cpu_to_le16(pi->opts.apptag);
+	bio->cmd.rw.appmask = cpu_to_le16(pi->opts.appmask);
+
+	bio->pi = true;
+	bio->mbuf = mbuf;
+	bio->pi_slba = bio->slba;
+
+	if (flags & NVME_PI_F_PRACT)
+		return 0;
+
+	if (bio->cmd.opcode == NVME_CMD_WRITE)
+		return __bio_pi(pi, bio, false);
+
+	if (flags & NVME_PI_F_VERIFY) {
+		bio->end_io = __pi_end_io;
+		bio->end_io_data = pi;
+	}
+
+	return 0;
+}
+
+int nvme_pi_verify_pending(struct nvme_pi *pi, int budget)
+{
+	int n = 0;
+
+	while (!budget || n < budget) {
+		struct nvme_bio *bio;
+
+		pthread_mutex_lock(&pi->lock);
+
+		bio = pi->pending;
+		if (bio) {
+			pi->pending = bio->pi_next;
+
+			if (!pi->pending)
+				pi->pending_tail = NULL;
+		}
+
+		pthread_mutex_unlock(&pi->lock);
+
+		if (!bio)
+			break;
+
+		if (__bio_pi(pi, bio, true))
+			bio->err = EILSEQ;
+
+		bio->cb = bio->pi_cb;
+		bio->cb(bio);
+
+		n++;
+	}
+
+	return n;
+}
@@ -0,0 +1,227 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "pi.c"
+
+#define NLB 8
+
+static unsigned char data[NLB * (4096 + 24)];
+static unsigned char mbuf[NLB * 24];
+
+static int ncb;
+
+static void bio_cb(struct nvme_bio *bio UNUSED)
+{
+	ncb++;
+}
+
+static void fill(void)
+{
+	uint32_t x = 0xdeadbeef;
+
+	for (size_t i = 0; i < sizeof(data); i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+
+		data[i] = (unsigned char)x;
+	}
+}
+
+/* complete a request like the block i/o layer */
+static void complete(struct nvme_bio *bio, int err)
+{
+	bio->err = err;
+
+	if (bio->end_io)
+		bio->end_io(bio);
+
+	if (bio->cb)
+		bio->cb(bio);
+}
+
+static void bio_setup(struct nvme_bio *bio, const struct nvme_ns_info *info, uint8_t opcode,
+		      uint64_t slba, struct iovec *iov, int niov)
+{
+	memset(bio, 0x0, sizeof(*bio));
+
+	bio->cmd.opcode = opcode;
+	bio->info = info;
+	bio->slba = slba;
+	bio->iov = iov;
+	bio->niov = niov;
+}
+
+int main(void)
+{
+	struct nvme_ns_info info = { .nsid = 1, .lbads = 9, .ms = 8, .extended = true, .pi = 1,
+		.pi_first = true };
+	struct nvme_pi_opts opts = nvme_pi_opts_default;
+	struct nvme_crc16_pi_tuple *t16;
+	struct nvme_crc64_pi_tuple *t64;
+	struct nvme_pi pi;
+	struct nvme_bio bio;
+	struct iovec iov[2];
+	uint64_t lba;
+	bool ok;
+
+	plan_tests(28);
+
+	fill();
+
+	/* unsupported formats */
+	info.pi = 0;
+	ok1(nvme_pi_init(&pi, &info, NULL) == -1 && errno == ENOTSUP);
+	info.pi = 1;
+
+	info.pif = NVME_NS_PIF_32B;
+	ok1(nvme_pi_init(&pi, &info, NULL) == -1 && errno == ENOTSUP);
+	info.pif = NVME_NS_PIF_64B;
+	ok1(nvme_pi_init(&pi, &info, NULL) == -1 && errno == ENOTSUP);
+	info.pif = NVME_NS_PIF_16B;
+
+	opts.flags |= NVME_PI_F_PRACT;
+	ok1(nvme_pi_init(&pi, &info, &opts) == -1 && errno == ENOTSUP);
+	opts = nvme_pi_opts_default;
+
+	/* 16b guard, extended logical blocks */
+	ok1(nvme_pi_init(&pi, &info, NULL) == 0);
+
+	nvme_pi_generate(&pi, data, NULL, 0x100000010, NLB);
+
+	ok = true;
+	for (int i = 0; i < NLB; i++) {
+		t16 = (struct nvme_crc16_pi_tuple *)(data + i * 520 + 512);
+
+		if (be16_to_cpu(t16->guard) != nvme_crc16(0x0, data + i * 520, 512) ||
+		    be16_to_cpu(t16->apptag) != 0x0 || be32_to_cpu(t16->reftag) != 0x10 + (uint32_t)i)
+			ok = false;
+	}
+	ok1(ok);
+
+	ok1(nvme_pi_verify(&pi, data, NULL, 0x100000010, NLB, NULL) == 0);
+
+	/* reference tag mismatch */
+	ok1(nvme_pi_verify(&pi, data, NULL, 0x11, NLB, &lba) == -1 && errno == EILSEQ &&
+	    lba == 0x11);
+
+	/* guard mismatch */
+	data[3 * 520 + 7] ^= 0x1;
+	ok1(nvme_pi_verify(&pi, data, NULL, 0x10, NLB, &lba) == -1 && errno == EILSEQ &&
+	    lba == 0x13);
+
+	/* escaped blocks are not checked */
+	t16 = (struct nvme_crc16_pi_tuple *)(data + 3 * 520 + 512);
+	t16->apptag = cpu_to_be16(0xffff);
+	ok1(nvme_pi_verify(&pi, data, NULL, 0x10, NLB, NULL) == 0);
+
+	nvme_pi_fini(&pi);
+
+	/* application tag checked under the mask */
+	opts = (struct nvme_pi_opts) {
+		.flags = NVME_PI_F_CHECK_APPTAG, .apptag = 0x1234, .appmask = 0xff00,
+	};
+	ok1(nvme_pi_init(&pi, &info, &opts) == 0);
+
+	nvme_pi_generate(&pi, data, NULL, 0x0, NLB);
+	pi.opts.apptag = 0x12ff;
+	ok1(nvme_pi_verify(&pi, data, NULL, 0x0, NLB, NULL) == 0);
+	pi.opts.apptag = 0x1334;
+	ok1(nvme_pi_verify(&pi, data, NULL, 0x0, NLB, NULL) == -1 && errno == EILSEQ);
+
+	nvme_pi_fini(&pi);
+
+	/* type 3; the reference tag is not checked */
+	info.pi = 3;
+	ok1(nvme_pi_init(&pi, &info, NULL) == 0 && !(pi.opts.flags & NVME_PI_F_CHECK_REFTAG));
+
+	nvme_pi_generate(&pi, data, NULL, 0x0, NLB);
+	ok1(nvme_pi_verify(&pi, data, NULL, 0x1000, NLB, NULL) == 0);
+
+	nvme_pi_fini(&pi);
+
+	/* 64b guard, last in separate metadata; the guard covers the preceding metadata */
+	info = (struct nvme_ns_info) { .nsid = 1, .lbads = 12, .ms = 24, .pi = 1,
+		.pif = NVME_NS_PIF_64B };
+	ok1(nvme_pi_init(&pi, &info, NULL) == 0 && pi.pioff == 8);
+
+	nvme_pi_generate(&pi, data, mbuf, 0x123456789abc, NLB);
+
+	t64 = (struct nvme_crc64_pi_tuple *)(mbuf + 24 + 8);
+	ok1(be64_to_cpu(t64->guard) ==
+	    nvme_crc64(~nvme_crc64(~0ULL, data + 4096, 4096), mbuf + 24, 8) &&
+	    get_unaligned_be48(t64->sr) == 0x123456789abd);
+
+	ok1(nvme_pi_verify(&pi, data, mbuf, 0x123456789abc, NLB, NULL) == 0);
+
+	mbuf[5 * 24 + 2] ^= 0x1;
+	ok1(nvme_pi_verify(&pi, data, mbuf, 0x123456789abc, NLB, &lba) == -1 &&
+	    lba == 0x123456789abc + 5);
+
+	/* separate metadata requires a buffer */
+	iov[0] = (struct iovec) { .iov_base = data, .iov_len = 4 << 12 };
+	iov[1] = (struct iovec) { .iov_base = data + (4 << 12), .iov_len = 4 << 12 };
+
+	bio_setup(&bio, &info, NVME_CMD_WRITE, 0x40, iov, 2);
+	ok1(nvme_pi_attach(&pi, &bio, NULL) == -1 && errno == EINVAL);
+
+	bio_setup(&bio, &info, NVME_CMD_FLUSH, 0x40, iov, 2);
+	ok1(nvme_pi_attach(&pi, &bio, mbuf) == -1 && errno == EINVAL);
+
+	/* writes are generated on attach */
+	memset(mbuf, 0x0, sizeof(mbuf));
+
+	bio_setup(&bio, &info, NVME_CMD_WRITE, 0x40, iov, 2);
+	ok1(nvme_pi_attach(&pi, &bio, mbuf) == 0 && bio.pi && bio.mbuf == mbuf &&
+	    le16_to_cpu(bio.cmd.rw.control) ==
+	    (NVME_RW_CONTROL_PRCHK_GUARD | NVME_RW_CONTROL_PRCHK_REFTAG));
+	ok1(nvme_pi_verify(&pi, data, mbuf, 0x40, NLB, NULL) == 0);
+
+	/* without deferral, reads are verified on completion */
+	pi.opts.flags &= ~NVME_PI_F_DEFER;
+
+	bio_setup(&bio, &info, NVME_CMD_READ, 0x40, iov, 2);
+	bio.cb = bio_cb;
+	ok1(nvme_pi_attach(&pi, &bio, mbuf) == 0 && bio.end_io);
+
+	mbuf[6 * 24] ^= 0x1;
+	complete(&bio, 0);
+	ok1(bio.err == EILSEQ && ncb == 1);
+
+	nvme_pi_fini(&pi);
+
+	/* deferred verification (the default) */
+	ok1(nvme_pi_init(&pi, &info, NULL) == 0 && (pi.opts.flags & NVME_PI_F_DEFER));
+
+	ncb = 0;
+	bio_setup(&bio, &info, NVME_CMD_READ, 0x40, iov, 2);
+	bio.cb = bio_cb;
+	nvme_pi_attach(&pi, &bio, mbuf);
+
+	complete(&bio, 0);
+	ok1(bio.err == 0 && ncb == 0 && pi.pending == &bio);
+
+	ok1(nvme_pi_verify_pending(&pi, 1) == 1 && bio.err == EILSEQ && ncb == 1 &&
+	    bio.cb == bio_cb && !pi.pending && nvme_pi_verify_pending(&pi, 0) == 0);
+
+	nvme_pi_fini(&pi);
+
+	return exit_status();
+}
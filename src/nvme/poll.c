@@ -0,0 +1,271 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/poll: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#define NVME_POLL_REAP_MAX 32
+
+int nvme_poll_group_init(struct nvme_poll_group *pg, const struct nvme_poll_group_opts *opts)
+{
+	*pg = (struct nvme_poll_group) {
+		.opts = opts ? *opts : nvme_poll_group_opts_default,
+	};
+
+	if (pg->opts.batch < 1 || pg->opts.budget < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pg->deferred_tail = &pg->deferred;
+
+	return 0;
+}
+
+void nvme_poll_group_fini(struct nvme_poll_group *pg)
+{
+	for (int i = 0; i < pg->nentries; i++)
+		free(pg->entries[i].sqs);
+
+	free(pg->entries);
+
+	memset(pg, 0x0, sizeof(*pg));
+}
+
+static void __find_sqs(struct nvme_poll_group_entry *e)
+{
+	struct nvme_ctrl *ctrl = e->ctrl;
+	int nsqs = ctrl->opts.nsqr + 2;
+
+	if (!ctrl->sq)
+		return;
+
+	for (int i = 0; i < nsqs; i++) {
+		if (ctrl->sq[i].cq != e->cq)
+			continue;
+
+		e->sqs = reallocn(e->sqs, (unsigned int)e->nsqs + 1, sizeof(*e->sqs));
+		e->sqs[e->nsqs++] = &ctrl->sq[i];
+	}
+}
+
+int nvme_poll_group_add(struct nvme_poll_group *pg, struct nvme_ctrl *ctrl, struct nvme_cq *cq)
+{
+	for (int i = 0; i < pg->nentries; i++) {
+		if (pg->entries[i].cq == cq) {
+			errno = EEXIST;
+			return -1;
+		}
+	}
+
+	if (pg->nentries == pg->nalloc) {
+		pg->nalloc = pg->nalloc ? pg->nalloc * 2 : 8;
+		pg->entries = reallocn(pg->entries, (unsigned int)pg->nalloc,
+				       sizeof(*pg->entries));
+	}
+
+	pg->entries[pg->nentries] = (struct nvme_poll_group_entry) {
+		.ctrl = ctrl,
+		.cq = cq,
+	};
+
+	__find_sqs(&pg->entries[pg->nentries++]);
+
+	return 0;
+}
+
+int nvme_poll_group_del(struct nvme_poll_group *pg, struct nvme_cq *cq)
+{
+	for (int i = 0; i < pg->nentries; i++) {
+		if (pg->entries[i].cq != cq)
+			continue;
+
+		free(pg->entries[i].sqs);
+
+		memmove(&pg->entries[i], &pg->entries[i + 1],
+			(pg->nentries - i - 1) * sizeof(*pg->entries));
+
+		if (--pg->nentries == 0 || pg->next >= pg->nentries)
+			pg->next = 0;
+
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+void nvme_poll_group_defer(struct nvme_poll_group *pg, struct nvme_rq *rq,
+			   void (*fn)(struct nvme_rq *rq))
+{
+	rq->deferred = fn;
+	rq->rq_next = NULL;
+
+	*pg->deferred_tail = rq;
+	pg->deferred_tail = &rq->rq_next;
+}
+
+static inline void __update_tail(struct nvme_sq *sq)
+{
+	pthread_spin_lock(&sq->lock);
+	nvme_sq_update_tail(sq);
+	pthread_spin_unlock(&sq->lock);
+}
+
+/*
+ * Reap up to @max completions of commands with a completion callback, the
+ * same way nvme_bio_wait() does; completions for synchronous waiters (see
+ * nvme_rq_wait()) are stashed for them. Returns the number of callbacks run.
+ */
+static int __poll_cq(struct nvme_poll_group_entry *e, int max)
+{
+	struct nvme_cq *cq = e->cq;
+	int total = 0;
+
+	while (total < max) {
+		struct nvme_cqe cqes[NVME_POLL_REAP_MAX], *cqe;
+		struct nvme_rq *rqs[NVME_POLL_REAP_MAX];
+		int want = min_t(int, max - total, NVME_POLL_REAP_MAX);
+		struct nvme_sq *sq = NULL;
+		bool reaped = false;
+		int n = 0;
+
+		/* someone else is reaping; come back on the next poll */
+		if (pthread_spin_trylock(&cq->lock))
+			break;
+
+		/* completions reaped and stashed by synchronous waiters */
+		for (int i = 0; i < e->nsqs && n < want; i++)
+			n += __nvme_cq_stash_take_cb(cq, e->sqs[i], &rqs[n], &cqes[n], want - n);
+
+		while (n < want && (cqe = nvme_cq_get_cqe(cq))) {
+			struct nvme_rq *rq;
+
+			reaped = true;
+
+			rq = nvme_rq_from_cqe(e->ctrl, cqe);
+			if (!rq) {
+				log_error("SPURIOUS CQE (cq %d cid %" PRIu16 ")\n", cq->id, cqe->cid);
+				continue;
+			}
+
+			/* completions for waiters */
+			if (!rq->cb) {
+				__nvme_cq_stash_put(cq, cqe);
+				continue;
+			}
+
+			rqs[n] = rq;
+			memcpy(&cqes[n++], cqe, sizeof(*cqe));
+		}
+
+		if (reaped)
+			nvme_cq_update_head(cq);
+
+		pthread_spin_unlock(&cq->lock);
+
+		for (int i = 0; i < n; i++) {
+			/* submit whatever was posted to the previous queue */
+			if (sq && sq != rqs[i]->sq)
+				__update_tail(sq);
+
+			sq = rqs[i]->sq;
+
+			nvme_rq_disarm(rqs[i]);
+			rqs[i]->cb(rqs[i], &cqes[i]);
+		}
+
+		if (sq)
+			__update_tail(sq);
+
+		total += n;
+
+		if (n < want)
+			break;
+	}
+
+	for (int i = 0; i < e->nsqs; i++)
+		nvme_sq_check_timeouts(e->sqs[i]);
+
+	return total;
+}
+
+static void __run_deferred(struct nvme_poll_group *pg)
+{
+	struct nvme_rq *rq = pg->deferred, *next;
+	struct nvme_sq *sq = NULL;
+
+	/* hooks deferred by hooks run on the next call */
+	pg->deferred = NULL;
+	pg->deferred_tail = &pg->deferred;
+
+	for (; rq; rq = next) {
+		next = rq->rq_next;
+
+		if (sq && sq != rq->sq)
+			__update_tail(sq);
+
+		sq = rq->sq;
+
+		rq->deferred(rq);
+	}
+
+	if (sq)
+		__update_tail(sq);
+}
+
+int nvme_poll_group_poll(struct nvme_poll_group *pg)
+{
+	int budget = pg->opts.budget;
+	int i = pg->next;
+
+	for (int visited = 0; visited < pg->nentries && budget > 0; visited++) {
+		int max = min_t(int, pg->opts.batch, budget);
+		int n = __poll_cq(&pg->entries[i], max);
+
+		budget -= n;
+
+		/* resume a queue that was cut short by the budget */
+		if (budget > 0 || n < max)
+			i = (i + 1) % pg->nentries;
+	}
+
+	/* rotate the starting queue */
+	if (pg->nentries && i == pg->next)
+		i = (i + 1) % pg->nentries;
+
+	pg->next = i;
+
+	if (pg->deferred)
+		__run_deferred(pg);
+
+	return pg->opts.budget - budget;
+}
@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "poll.c"
+#include "fakedev.h"
+
+#define QSIZE 16
+
+struct fake {
+	struct nvme_ctrl ctrl;
+	struct nvme_sq sq[2];
+	struct nvme_cq cq;
+	struct nvme_rq rqs[QSIZE - 1];
+
+	struct fakedev dev;
+
+	int completed;
+};
+
+static void fake_init(struct fake *f)
+{
+	fakedev_init(&f->dev, 1, &f->sq[1], QSIZE, &f->cq, QSIZE, f->rqs);
+
+	f->ctrl.sq = f->sq;
+
+	for (int i = 0; i < QSIZE - 1; i++)
+		f->rqs[i].opaque = f;
+}
+
+static void count(struct nvme_rq *rq, struct nvme_cqe *cqe UNUSED)
+{
+	struct fake *f = rq->opaque;
+
+	f->completed++;
+}
+
+static void resubmit(struct nvme_rq *rq, struct nvme_cqe *cqe UNUSED)
+{
+	union nvme_cmd cmd = {};
+
+	count(rq, cqe);
+
+	nvme_rq_post(rq, &cmd);
+}
+
+static struct nvme_poll_group pg;
+static uint32_t cqdb_at_hook;
+static int hooks;
+
+static void hook(struct nvme_rq *rq)
+{
+	struct fake *f = rq->opaque;
+	union nvme_cmd cmd = {};
+
+	cqdb_at_hook = f->dev.cqdb;
+	hooks++;
+
+	nvme_rq_post(rq, &cmd);
+}
+
+static void defer(struct nvme_rq *rq, struct nvme_cqe *cqe UNUSED)
+{
+	count(rq, cqe);
+
+	nvme_poll_group_defer(&pg, rq, hook);
+}
+
+int main(void)
+{
+	struct nvme_poll_group_opts opts = { .batch = 4, .budget = 6 };
+	struct fake a = {}, b = {};
+	int completed;
+
+	plan_tests(30);
+
+	fake_init(&a);
+	fake_init(&b);
+
+	opts.batch = 0;
+	ok1(nvme_poll_group_init(&pg, &opts) == -1 && errno == EINVAL);
+	opts.batch = 4;
+
+	ok1(nvme_poll_group_init(&pg, &opts) == 0);
+	ok1(nvme_poll_group_add(&pg, &a.ctrl, &a.cq) == 0);
+	ok1(nvme_poll_group_add(&pg, &b.ctrl, &b.cq) == 0);
+	ok1(nvme_poll_group_add(&pg, &a.ctrl, &a.cq) == -1 && errno == EEXIST);
+
+	/* empty polls still rotate the starting queue */
+	ok1(nvme_poll_group_poll(&pg) == 0);
+
+	/* batch and budget limits with round-robin fairness */
+	for (uint16_t i = 0; i < 10; i++) {
+		a.rqs[i].cb = count;
+		b.rqs[i].cb = count;
+
+		fakedev_complete(&a.dev, i, 0, 0);
+		fakedev_complete(&b.dev, i, 0, 0);
+	}
+
+	ok1(nvme_poll_group_poll(&pg) == 6);
+	ok1(a.completed == 2 && b.completed == 4);
+	ok1(a.dev.cqdb == 2 && b.dev.cqdb == 4);
+
+	ok1(nvme_poll_group_poll(&pg) == 6);
+	ok1(a.completed == 6 && b.completed == 6);
+
+	ok1(nvme_poll_group_poll(&pg) == 6);
+	ok1(a.completed == 8 && b.completed == 10);
+
+	ok1(nvme_poll_group_poll(&pg) == 2);
+	ok1(a.completed == 10 && b.completed == 10);
+	ok1(a.dev.cqdb == 10 && b.dev.cqdb == 10);
+
+	/* commands posted from callbacks are submitted after the batch */
+	a.rqs[0].cb = resubmit;
+	a.rqs[1].cb = resubmit;
+
+	fakedev_complete(&a.dev, 0, 0, 0);
+	fakedev_complete(&a.dev, 1, 0, 0);
+
+	ok1(nvme_poll_group_poll(&pg) == 2);
+	ok1(a.dev.sqdb == 2);
+
+	/* deferred hooks run after the completion queue head is updated */
+	a.rqs[2].cb = defer;
+
+	fakedev_complete(&a.dev, 2, 0, 0);
+
+	ok1(nvme_poll_group_poll(&pg) == 1);
+	ok1(hooks == 1 && cqdb_at_hook == 13);
+	ok1(a.dev.sqdb == 3);
+
+	/* completions for synchronous waiters are stashed for them */
+	completed = a.completed;
+
+	fakedev_complete(&a.dev, 10, 0, 0);
+	fakedev_complete(&a.dev, 4, 0, 0);
+
+	ok1(nvme_poll_group_poll(&pg) == 1 && a.completed == completed + 1);
+	ok1(nvme_rq_wait(&a.rqs[10], NULL, NULL) == 0);
+
+	/* and callbacks run for completions stashed by waiters */
+	fakedev_complete(&a.dev, 4, 0, 0);
+	fakedev_complete(&a.dev, 11, 0, 0);
+
+	ok1(nvme_rq_wait(&a.rqs[11], NULL, NULL) == 0 && a.completed == completed + 1);
+	ok1(nvme_poll_group_poll(&pg) == 1 && a.completed == completed + 2);
+
+	/* spurious completions */
+	fakedev_complete(&b.dev, QSIZE, 0, 0);
+	fakedev_complete(&b.dev, 11, 0, 0);
+
+	ok1(nvme_poll_group_poll(&pg) == 0);
+	ok1(b.completed == 10 && b.dev.cqdb == 12);
+
+	ok1(nvme_poll_group_del(&pg, &b.cq) == 0);
+	ok1(nvme_poll_group_del(&pg, &b.cq) == -1 && errno == ENOENT);
+
+	fakedev_complete(&b.dev, 0, 0, 0);
+	ok1(nvme_poll_group_poll(&pg) == 0);
+
+	nvme_poll_group_fini(&pg);
+
+	return exit_status();
+}
@@ -32,6 +32,8 @@
 
 #include "ccan/time/time.h"
 
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+
 void nvme_cq_get_cqes(struct nvme_cq *cq, struct nvme_cqe *cqes, int n)
 {
 	struct nvme_cqe *cqe;
@@ -81,3 +83,71 @@ int nvme_cq_wait_cqes(struct nvme_cq *cq, struct nvme_cqe *cqes, int n, struct t
 
 	return n - m;
 }
+
+/*
+ * The completion stash has a range of slots, indexed by command identifier,
+ * for each submission queue associated with the completion queue. Grow the
+ * range of @sqid to hold @nslots entries, relocating any entries stashed for
+ * other waiters.
+ */
+void __nvme_cq_grow_stash(struct nvme_cq *cq, uint16_t sqid, int nslots)
+{
+	struct nvme_cq_stash_range *ranges;
+	struct nvme_cqe *cqes;
+	unsigned long *ready;
+	int i, nranges, total = 0;
+
+	pthread_spin_lock(&cq->lock);
+
+	for (i = 0; i < cq->stash.nranges; i++) {
+		if (cq->stash.ranges[i].sqid == sqid)
+			break;
+	}
+
+	if (i < cq->stash.nranges && cq->stash.ranges[i].nslots >= nslots)
+		goto out;
+
+	nranges = cq->stash.nranges + (i == cq->stash.nranges);
+
+	ranges = znew_t(struct nvme_cq_stash_range, (unsigned int)nranges);
+	if (cq->stash.nranges)
+		memcpy(ranges, cq->stash.ranges, cq->stash.nranges * sizeof(*ranges));
+
+	ranges[i].sqid = sqid;
+	ranges[i].nslots = nslots;
+
+	for (int r = 0; r < nranges; r++) {
+		ranges[r].base = total;
+		total += ranges[r].nslots;
+	}
+
+	cqes = znew_t(struct nvme_cqe, (unsigned int)total);
+	ready = znew_t(unsigned long, (unsigned int)ROUND_UP(total, BITS_PER_LONG) / BITS_PER_LONG);
+
+	for (int r = 0; r < cq->stash.nranges; r++) {
+		struct nvme_cq_stash_range *range = &cq->stash.ranges[r];
+
+		for (int cid = 0; cid < range->nslots; cid++) {
+			int from = range->base + cid, to = ranges[r].base + cid;
+
+			if (!(cq->stash.ready[from / BITS_PER_LONG] & (1UL << (from % BITS_PER_LONG))))
+				continue;
+
+			memcpy(&cqes[to], &cq->stash.cqes[from], sizeof(*cqes));
+			ready[to / BITS_PER_LONG] |= 1UL << (to % BITS_PER_LONG);
+		}
+	}
+
+	free(cq->stash.cqes);
+	free(cq->stash.ready);
+	free(cq->stash.ranges);
+
+	cq->stash.cqes = cqes;
+	cq->stash.ready = ready;
+	cq->stash.nslots = total;
+	cq->stash.ranges = ranges;
+	cq->stash.nranges = nranges;
+
+out:
+	pthread_spin_unlock(&cq->lock);
+}
@@ -35,9 +35,13 @@
 #include <vfn/vfio.h>
 #include <vfn/nvme.h>
 
+#include "ccan/time/time.h"
+
 #include "iommu/context.h"
 #include "types.h"
 
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+
 int nvme_rq_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
 		    uint64_t iova, size_t len)
 {
@@ -67,24 +71,226 @@ int nvme_rq_mapv(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd
 	return nvme_rq_mapv_sgl(ctrl, rq, cmd, iov, niov);
 }
 
+int nvme_cmd_tmpl_init(struct nvme_ctrl *ctrl, struct nvme_cmd_tmpl *tmpl, uint8_t opcode,
+		       uint32_t nsid, unsigned int lbads)
+{
+	if (lbads < 9 || lbads > 31) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(tmpl, 0x0, sizeof(*tmpl));
+
+	tmpl->cmd.opcode = opcode;
+	tmpl->cmd.nsid = cpu_to_le32(nsid);
+
+	tmpl->lbads = (int)lbads;
+	tmpl->pageshift = __mps_to_pageshift(ctrl->config.mps);
+
+	return 0;
+}
+
+int nvme_rq_rw(struct nvme_rq *rq, const struct nvme_cmd_tmpl *tmpl, uint64_t slba,
+	       uint32_t nlb, uint64_t iova)
+{
+	union nvme_dptr dptr;
+	union nvme_cmd *sqe;
+
+	if (!nlb || nlb > 0x10000) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the iova of the request tracker page is known; no need to translate it */
+	if (__nvme_map_prp(&dptr, rq->page.vaddr, rq->page.iova, iova,
+			   (size_t)nlb << tmpl->lbads, tmpl->pageshift))
+		return -1;
+
+	sqe = nvme_rq_reserve(rq);
+
+	memcpy(sqe, &tmpl->cmd, sizeof(*sqe));
+
+	sqe->rw.dptr = dptr;
+	sqe->rw.slba = cpu_to_le64(slba);
+	sqe->rw.nlb = cpu_to_le16((uint16_t)(nlb - 1));
+
+	nvme_rq_commit(rq, sqe);
+
+	return 0;
+}
+
+/* stash slot of the completion of command @cid on submission queue @sqid */
+static inline int __stash_slot(struct nvme_cq *cq, uint16_t sqid, uint16_t cid)
+{
+	for (int i = 0; i < cq->stash.nranges; i++) {
+		struct nvme_cq_stash_range *range = &cq->stash.ranges[i];
+
+		if (range->sqid == sqid)
+			return cid < range->nslots ? range->base + cid : -1;
+	}
+
+	return -1;
+}
+
+static inline bool __stash_take(struct nvme_cq *cq, uint16_t sqid, uint16_t cid,
+				struct nvme_cqe *cqe)
+{
+	int slot = __stash_slot(cq, sqid, cid);
+	unsigned long bit, *ready;
+
+	if (slot < 0)
+		return false;
+
+	bit = 1UL << (slot % BITS_PER_LONG);
+	ready = &cq->stash.ready[slot / BITS_PER_LONG];
+
+	if (!(*ready & bit))
+		return false;
+
+	memcpy(cqe, &cq->stash.cqes[slot], sizeof(*cqe));
+
+	*ready &= ~bit;
+
+	return true;
+}
+
+void __nvme_cq_stash_put(struct nvme_cq *cq, struct nvme_cqe *cqe)
+{
+	int slot = __stash_slot(cq, cqe->sqid, cqe->cid);
+
+	if (slot < 0) {
+		log_error("SPURIOUS CQE (cq %d sq %" PRIu16 " cid %" PRIu16 ")\n", cq->id,
+			  cqe->sqid, cqe->cid);
+		return;
+	}
+
+	memcpy(&cq->stash.cqes[slot], cqe, sizeof(*cqe));
+
+	cq->stash.ready[slot / BITS_PER_LONG] |= 1UL << (slot % BITS_PER_LONG);
+}
+
+int __nvme_cq_stash_take_cb(struct nvme_cq *cq, struct nvme_sq *sq, struct nvme_rq **rqs,
+			    struct nvme_cqe *cqes, int max)
+{
+	int slot = __stash_slot(cq, (uint16_t)sq->id, 0), n = 0;
+
+	if (slot < 0)
+		return 0;
+
+	for (uint16_t cid = 0; cid < sq->qsize - 1 && n < max; cid++, slot++) {
+		unsigned long bit = 1UL << (slot % BITS_PER_LONG);
+		unsigned long *ready = &cq->stash.ready[slot / BITS_PER_LONG];
+
+		if (!(*ready & bit) || !sq->rqs[cid].cb)
+			continue;
+
+		rqs[n] = &sq->rqs[cid];
+		memcpy(&cqes[n++], &cq->stash.cqes[slot], sizeof(*cqes));
+
+		*ready &= ~bit;
+	}
+
+	return n;
+}
+
+void __nvme_cq_stash_abort(struct nvme_cq *cq, struct nvme_sq *sq, uint16_t sfp)
+{
+	int slot = __stash_slot(cq, (uint16_t)sq->id, 0);
+	bool *idle;
+
+	if (slot < 0)
+		return;
+
+	idle = znew_t(bool, sq->qsize - 1);
+
+	for (struct nvme_rq *rq = sq->rq_top; rq; rq = rq->rq_next)
+		idle[rq->cid] = true;
+
+	for (uint16_t cid = 0; cid < sq->qsize - 1; cid++, slot++) {
+		unsigned long bit = 1UL << (slot % BITS_PER_LONG);
+		unsigned long *ready = &cq->stash.ready[slot / BITS_PER_LONG];
+
+		if (idle[cid] || (*ready & bit))
+			continue;
+
+		nvme_rq_disarm(&sq->rqs[cid]);
+
+		cq->stash.cqes[slot] = (struct nvme_cqe) {
+			.sqid = cpu_to_le16((uint16_t)sq->id),
+			.cid = cid,
+			.sfp = cpu_to_le16(sfp),
+		};
+
+		*ready |= bit;
+	}
+
+	free(idle);
+}
+
+/*
+ * Take the completion queue entry for command @cid on submission queue @sqid
+ * from the stash or reap available entries, stashing the others for their
+ * waiters. Only one thread accesses the stash and reaps at a time; if another
+ * thread holds the completion queue lock, return immediately.
+ */
+static bool __reap(struct nvme_cq *cq, uint16_t sqid, uint16_t cid, struct nvme_cqe *cqe)
+{
+	struct nvme_cqe *entry;
+	bool found;
+	int n = 0;
+
+	if (pthread_spin_trylock(&cq->lock))
+		return false;
+
+	found = __stash_take(cq, sqid, cid, cqe);
+
+	while (n < cq->qsize && (entry = nvme_cq_get_cqe(cq))) {
+		n++;
+
+		if (!found && entry->cid == cid && entry->sqid == sqid) {
+			memcpy(cqe, entry, sizeof(*cqe));
+			found = true;
+
+			continue;
+		}
+
+		__nvme_cq_stash_put(cq, entry);
+	}
+
+	if (n)
+		nvme_cq_update_head(cq);
+
+	pthread_spin_unlock(&cq->lock);
+
+	return found;
+}
+
 int nvme_rq_wait(struct nvme_rq *rq, struct nvme_cqe *cqe_copy, struct timespec *ts)
 {
 	struct nvme_cq *cq = rq->sq->cq;
 	struct nvme_cqe cqe;
+	uint64_t timeout = 0;
 
-	if (nvme_cq_wait_cqes(cq, &cqe, 1, ts) != 1)
-		return -1;
+	if (ts) {
+		struct timerel rel = { .ts = *ts };
 
-	nvme_cq_update_head(cq);
+		timeout = get_ticks() + time_to_usec(rel) * (__vfn_ticks_freq / 1000000ULL);
+	}
 
-	if (cqe_copy)
-		memcpy(cqe_copy, &cqe, sizeof(*cqe_copy));
+	while (!__reap(cq, (uint16_t)rq->sq->id, rq->cid, &cqe)) {
+		nvme_sq_check_timeouts(rq->sq);
 
-	if (cqe.cid != rq->cid) {
-		errno = EAGAIN;
-		return -1;
+		if (ts && get_ticks() >= timeout) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
 	}
 
+	nvme_rq_disarm(rq);
+
+	if (cqe_copy)
+		memcpy(cqe_copy, &cqe, sizeof(*cqe_copy));
+
 	if (!nvme_cqe_ok(&cqe)) {
 		if (logv(LOG_DEBUG)) {
 			uint16_t status = le16_to_cpu(cqe.sfp) >> 1;
@@ -19,36 +19,194 @@
 #include "ccan/tap/tap.h"
 
 #include "rq.c"
+#include "fakedev.h"
 
 #define __max_prps 513
 
-bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
-{
-	*iova = (uint64_t)vaddr;
+#define QSIZE 8
+#define NTHREADS 4
 
-	return true;
-}
+static struct nvme_sq sq;
+static struct nvme_cq cq;
+static struct nvme_rq rqs[QSIZE - 1];
+static struct nvme_sq sq2;
+static struct nvme_rq rqs2[QSIZE - 1];
+static struct fakedev dev;
 
-int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
-		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+static void *waiter(void *opaque)
 {
-	return 0;
+	struct nvme_rq *rq = opaque;
+	struct nvme_cqe cqe;
+
+	if (nvme_rq_spin(rq, &cqe) || le32_to_cpu(cqe.dw0) != rq->cid)
+		return (void *)1;
+
+	return NULL;
 }
 
-int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+static void test_wait(void)
 {
-	return 0;
+	struct timespec ts = { .tv_nsec = 1000000 };
+	pthread_t threads[NTHREADS];
+	struct nvme_rq *a, *b;
+	struct nvme_cqe cqe;
+	int failed = 0;
+
+	fakedev_init(&dev, 0, &sq, QSIZE, &cq, QSIZE, rqs);
+
+	/* out of order completions are stashed */
+	fakedev_complete(&dev, 2, 0, 2);
+	fakedev_complete(&dev, 1, 0, 1);
+	fakedev_complete(&dev, 0, 0, 0);
+
+	ok1(nvme_rq_wait(&rqs[0], &cqe, &ts) == 0 && cqe.cid == 0);
+	ok1(dev.cqdb == 3);
+	ok1(cq.stash.ready[0] == 0x6);
+
+	ok1(nvme_rq_wait(&rqs[2], &cqe, &ts) == 0 && le32_to_cpu(cqe.dw0) == 2);
+	ok1(nvme_rq_wait(&rqs[1], &cqe, &ts) == 0 && le32_to_cpu(cqe.dw0) == 1);
+	ok1(cq.stash.ready[0] == 0x0);
+
+	ok1(nvme_rq_wait(&rqs[0], &cqe, &ts) == -1 && errno == ETIMEDOUT);
+
+	/* error status */
+	fakedev_complete(&dev, 3, 0x2, 0);
+	ok1(nvme_rq_wait(&rqs[3], &cqe, &ts) == -1 && errno == EIO && cqe.cid == 3);
+
+	/* unknown command identifiers are dropped */
+	fakedev_complete(&dev, QSIZE, 0, 0);
+	fakedev_complete(&dev, 4, 0, 4);
+	ok1(nvme_rq_wait(&rqs[4], &cqe, &ts) == 0 && cqe.cid == 4);
+
+	/* concurrent waiters on the same queue */
+	for (int i = 0; i < NTHREADS; i++)
+		pthread_create(&threads[i], NULL, waiter, &rqs[i]);
+
+	for (int i = NTHREADS - 1; i >= 0; i--)
+		fakedev_complete(&dev, (uint16_t)i, 0, (uint32_t)i);
+
+	for (int i = 0; i < NTHREADS; i++) {
+		void *ret;
+
+		pthread_join(threads[i], &ret);
+
+		if (ret)
+			failed++;
+	}
+
+	ok1(failed == 0);
+	ok1(cq.stash.ready[0] == 0x0);
+
+	/* stashed entries are kept when another submission queue is associated */
+	fakedev_complete(&dev, 1, 0, 1);
+	fakedev_complete(&dev, 0, 0, 0);
+	ok1(nvme_rq_wait(&rqs[0], &cqe, &ts) == 0 && cq.stash.ready[0] == 0x2);
+
+	sq2.id = 1;
+	sq2.cq = &cq;
+
+	for (int i = 0; i < QSIZE - 1; i++) {
+		rqs2[i].sq = &sq2;
+		rqs2[i].cid = (uint16_t)i;
+	}
+
+	__nvme_cq_grow_stash(&cq, 1, QSIZE - 1);
+	ok1(cq.stash.nranges == 2 && cq.stash.nslots == 2 * (QSIZE - 1));
+
+	/* completions are matched on submission queue and command identifier */
+	fakedev_complete_sq(&dev, 1, 1, 0, 0x101);
+	fakedev_complete_sq(&dev, 1, 0, 0, 0x100);
+	ok1(nvme_rq_wait(&rqs2[0], &cqe, &ts) == 0 && le32_to_cpu(cqe.dw0) == 0x100);
+	ok1(nvme_rq_wait(&rqs[1], &cqe, &ts) == 0 && le32_to_cpu(cqe.dw0) == 1);
+	ok1(nvme_rq_wait(&rqs2[1], &cqe, &ts) == 0 && le32_to_cpu(cqe.dw0) == 0x101);
+	ok1(cq.stash.ready[0] == 0x0);
+
+	/* outstanding commands are aborted, but stashed completions are kept */
+	a = nvme_rq_acquire(&sq);
+	b = nvme_rq_acquire(&sq);
+
+	fakedev_complete(&dev, a->cid, 0, 0xa);
+	ok1(nvme_rq_wait(b, &cqe, &ts) == -1 && errno == ETIMEDOUT);
+
+	__nvme_cq_stash_abort(&cq, &sq, NVME_CQE_SFP_DNR | NVME_CQE_SFP_SC_ABORT_REQ);
+	ok1(cq.stash.ready[0] == (1UL << a->cid | 1UL << b->cid));
+
+	ok1(nvme_rq_wait(b, &cqe, &ts) == -1 && errno == EIO);
+	ok1(le16_to_cpu(cqe.sfp) == (NVME_CQE_SFP_DNR | NVME_CQE_SFP_SC_ABORT_REQ));
+	ok1(nvme_rq_wait(a, &cqe, &ts) == 0 && le32_to_cpu(cqe.dw0) == 0xa);
+
+	nvme_rq_release(b);
+	nvme_rq_release(a);
 }
 
-int iommu_get_dmabuf(struct iommu_ctx *ctx UNUSED, struct iommu_dmabuf *buffer UNUSED,
-		     size_t len UNUSED, unsigned long flags UNUSED)
+static void test_tmpl(struct nvme_ctrl *ctrl, struct nvme_rq *rq)
 {
-	return 0;
+	struct nvme_sq tsq = { .qsize = 2 };
+	struct nvme_cmd_tmpl tmpl;
+	union nvme_cmd *sqe;
+	leint64_t *prplist = rq->page.vaddr;
+
+	assert(pgmap(&tsq.mem.vaddr, 2 << NVME_SQES) > 0);
+
+	rq->sq = &tsq;
+	rq->cid = 3;
+
+	ok1(nvme_cmd_tmpl_init(ctrl, &tmpl, 0x2, 1, 8) == -1 && errno == EINVAL);
+	ok1(nvme_cmd_tmpl_init(ctrl, &tmpl, 0x2, 1, 9) == 0);
+
+	/* written directly into the submission queue entry */
+	sqe = tsq.mem.vaddr;
+	ok1(nvme_rq_rw(rq, &tmpl, 0x10, 8, 0x1000000) == 0);
+	ok1(tsq.tail == 1);
+	ok1(sqe->opcode == 0x2 && sqe->cid == 3 && le32_to_cpu(sqe->nsid) == 1);
+	ok1(le64_to_cpu(sqe->rw.slba) == 0x10 && le16_to_cpu(sqe->rw.nlb) == 7);
+	ok1(le64_to_cpu(sqe->dptr.prp1) == 0x1000000 && le64_to_cpu(sqe->dptr.prp2) == 0x0);
+
+	/* two pages and wrap */
+	sqe = tsq.mem.vaddr + (1 << NVME_SQES);
+	ok1(nvme_rq_rw(rq, &tmpl, 0x20, 9, 0x1000e00) == 0);
+	ok1(tsq.tail == 0);
+	ok1(le64_to_cpu(sqe->dptr.prp1) == 0x1000e00 && le64_to_cpu(sqe->dptr.prp2) == 0x1001000);
+
+	/* prp list */
+	sqe = tsq.mem.vaddr;
+	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
+	ok1(nvme_rq_rw(rq, &tmpl, 0x0, 24, 0x1000000) == 0);
+	ok1(le64_to_cpu(sqe->dptr.prp2) == rq->page.iova);
+	ok1(le64_to_cpu(prplist[0]) == 0x1001000 && le64_to_cpu(prplist[1]) == 0x1002000);
+
+	ok1(nvme_rq_rw(rq, &tmpl, 0x0, 0, 0x1000000) == -1 && errno == EINVAL);
+	ok1(nvme_rq_rw(rq, &tmpl, 0x0, 0x10000, 0x1000000) == -1 && errno == EINVAL);
+	ok1(tsq.tail == 1);
 }
 
-void iommu_put_dmabuf(struct iommu_dmabuf *buffer UNUSED)
+static void test_reserve(void)
 {
-	;
+	struct nvme_sq tsq = { .qsize = 4 };
+	struct nvme_rq trq = { .sq = &tsq, .cid = 2 };
+	union nvme_cmd *sqes[3], *sqe;
+
+	assert(pgmap(&tsq.mem.vaddr, 4 << NVME_SQES) > 0);
+
+	/* built in place */
+	sqe = nvme_sq_reserve(&tsq);
+	ok1(sqe == tsq.mem.vaddr);
+	ok1(tsq.tail == 0);
+
+	sqe->opcode = 0x2;
+	nvme_rq_commit(&trq, sqe);
+	ok1(tsq.tail == 1 && sqe->cid == 2);
+
+	tsq.tail = 3;
+
+	/* batch across the wrap */
+	nvme_sq_reserve_batch(&tsq, 3, sqes);
+	ok1(sqes[0] == tsq.mem.vaddr + (3 << NVME_SQES));
+	ok1(sqes[1] == tsq.mem.vaddr && sqes[2] == tsq.mem.vaddr + (1 << NVME_SQES));
+	ok1(tsq.tail == 3);
+
+	nvme_sq_commit_batch(&tsq, 3);
+	ok1(tsq.tail == 2);
 }
 
 int main(void)
@@ -63,7 +221,7 @@ int main(void)
 	struct nvme_sgld *sglds;
 	struct iovec iov[8];
 
-	plan_tests(126);
+	plan_tests(171);
 
 	assert(pgmap((void **)&rq.page.vaddr, __VFN_PAGESIZE) > 0);
 
@@ -363,5 +521,23 @@ int main(void)
 	ok1(le64_to_cpu(sglds[0].addr) == 0x1000000);
 	ok1(le64_to_cpu(sglds[1].addr) == 0x1002000);
 
+	/*
+	 * Command templates
+	 */
+
+	test_tmpl(&ctrl, &rq);
+
+	/*
+	 * In place command construction
+	 */
+
+	test_reserve();
+
+	/*
+	 * Completion stash
+	 */
+
+	test_wait();
+
 	return exit_status();
 }
@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/task: " fmt
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/nvme.h>
+
+void nvme_task_init(struct nvme_task *task, nvme_task_fn fn, void *opaque)
+{
+	*task = (struct nvme_task) {
+		.fn = fn,
+		.opaque = opaque,
+	};
+}
+
+int nvme_task_run(struct nvme_task *task)
+{
+	task->state = task->fn(task);
+
+	if (task->state == NVME_TASK_DONE && task->on_done)
+		task->on_done(task);
+
+	return task->state;
+}
+
+static void __nvme_task_complete(struct nvme_rq *rq, struct nvme_cqe *cqe)
+{
+	struct nvme_task *task = rq->opaque;
+
+	memcpy(&task->cqe, cqe, sizeof(*cqe));
+
+	if (!nvme_cqe_ok(cqe))
+		task->nerr++;
+
+	if (--task->pending)
+		return;
+
+	nvme_task_run(task);
+}
+
+void nvme_task_await_rq(struct nvme_task *task, struct nvme_rq *rq)
+{
+	rq->opaque = task;
+	rq->cb = __nvme_task_complete;
+
+	task->pending++;
+}
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+#include "ccan/container_of/container_of.h"
+
+#include "task.c"
+#include "fakedev.h"
+
+#define QSIZE 32
+#define NTASKS 8
+
+enum {
+	OP_FLUSH	= 0x00,
+	OP_WRITE	= 0x01,
+	OP_READ		= 0x02,
+};
+
+static struct nvme_ctrl ctrl;
+static struct nvme_sq sqs[2];
+static struct nvme_cq cq;
+static struct nvme_rq rqs[QSIZE - 1];
+static struct fakedev dev;
+
+/* fail flushes; complete everything else with the opcode in dword 0 */
+static uint16_t dev_exec(struct fakedev *dev UNUSED, union nvme_cmd *sqe, uint32_t *dw0)
+{
+	*dw0 = sqe->opcode;
+
+	return sqe->opcode == OP_FLUSH ? 0x2 : 0x0;
+}
+
+struct rmw {
+	struct nvme_task task;
+	struct nvme_rq *rq;
+	union nvme_cmd cmd;
+
+	uint8_t seen[2];
+};
+
+static int rmw(struct nvme_task *task)
+{
+	struct rmw *ctx = container_of(task, struct rmw, task);
+
+	NVME_TASK_BEGIN(task);
+
+	ctx->rq = nvme_rq_acquire(&sqs[1]);
+
+	ctx->cmd = (union nvme_cmd) { .opcode = OP_READ };
+	nvme_rq_post(ctx->rq, &ctx->cmd);
+
+	NVME_TASK_AWAIT(task, ctx->rq);
+
+	ctx->seen[0] = (uint8_t)le32_to_cpu(task->cqe.dw0);
+
+	ctx->cmd = (union nvme_cmd) { .opcode = OP_WRITE };
+	nvme_rq_post(ctx->rq, &ctx->cmd);
+
+	NVME_TASK_AWAIT(task, ctx->rq);
+
+	ctx->seen[1] = (uint8_t)le32_to_cpu(task->cqe.dw0);
+
+	nvme_rq_release(ctx->rq);
+
+	NVME_TASK_END(task);
+}
+
+struct fanout {
+	struct nvme_task task;
+	struct nvme_rq *rq[3];
+};
+
+static int fanout(struct nvme_task *task)
+{
+	struct fanout *ctx = container_of(task, struct fanout, task);
+	union nvme_cmd cmd = {};
+
+	NVME_TASK_BEGIN(task);
+
+	for (int i = 0; i < 3; i++) {
+		ctx->rq[i] = nvme_rq_acquire(&sqs[1]);
+
+		cmd.opcode = i == 1 ? OP_FLUSH : OP_READ;
+		nvme_rq_post(ctx->rq[i], &cmd);
+
+		nvme_task_await_rq(task, ctx->rq[i]);
+	}
+
+	NVME_TASK_WAIT(task);
+
+	for (int i = 0; i < 3; i++)
+		nvme_rq_release(ctx->rq[i]);
+
+	NVME_TASK_END(task);
+}
+
+static int ndone;
+
+static void on_done(struct nvme_task *task UNUSED)
+{
+	ndone++;
+}
+
+int main(void)
+{
+	struct nvme_poll_group pg;
+	struct rmw tasks[NTASKS];
+	struct fanout f;
+	bool ok = true;
+
+	plan_tests(12);
+
+	fakedev_init(&dev, 1, &sqs[1], QSIZE, &cq, QSIZE, rqs);
+	dev.exec = dev_exec;
+
+	ctrl.sq = sqs;
+
+	assert(nvme_poll_group_init(&pg, NULL) == 0);
+	assert(nvme_poll_group_add(&pg, &ctrl, &cq) == 0);
+
+	/* single task, two steps */
+	nvme_task_init(&tasks[0].task, rmw, NULL);
+	tasks[0].task.on_done = on_done;
+
+	ok1(nvme_task_run(&tasks[0].task) == NVME_TASK_WAITING);
+	ok1(!nvme_task_done(&tasks[0].task));
+
+	/* nothing is submitted until the task yields and the tail is updated */
+	nvme_sq_update_tail(&sqs[1]);
+
+	ok1(fakedev_process(&dev) == 1 && nvme_poll_group_poll(&pg) == 1);
+	ok1(tasks[0].seen[0] == OP_READ && !nvme_task_done(&tasks[0].task));
+
+	ok1(fakedev_process(&dev) == 1 && nvme_poll_group_poll(&pg) == 1);
+	ok1(tasks[0].seen[1] == OP_WRITE && nvme_task_done(&tasks[0].task));
+	ok1(ndone == 1);
+
+	/* fan out and join, counting errors */
+	nvme_task_init(&f.task, fanout, NULL);
+	nvme_task_run(&f.task);
+	nvme_sq_update_tail(&sqs[1]);
+
+	ok1(fakedev_process(&dev) == 3 && nvme_poll_group_poll(&pg) == 3);
+	ok1(nvme_task_done(&f.task) && f.task.nerr == 1);
+
+	/* interleaved tasks */
+	ndone = 0;
+
+	for (int i = 0; i < NTASKS; i++) {
+		nvme_task_init(&tasks[i].task, rmw, NULL);
+		tasks[i].task.on_done = on_done;
+
+		nvme_task_run(&tasks[i].task);
+	}
+
+	nvme_sq_update_tail(&sqs[1]);
+
+	while (fakedev_process(&dev))
+		nvme_poll_group_poll(&pg);
+
+	ok1(ndone == NTASKS);
+
+	for (int i = 0; i < NTASKS; i++)
+		ok &= tasks[i].seen[0] == OP_READ && tasks[i].seen[1] == OP_WRITE;
+
+	ok1(ok);
+
+	/* all request trackers were released */
+	ok1(sqs[1].rq_top && nvme_rq_acquire(&sqs[1]));
+
+	nvme_poll_group_fini(&pg);
+
+	return exit_status();
+}
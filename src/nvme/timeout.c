@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/timeout: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/nvme.h>
+
+#include "ccan/container_of/container_of.h"
+
+/* the timer wheel of a submission queue counts milliseconds */
+static inline uint64_t __now_ms(void)
+{
+	return get_ticks() / (__vfn_ticks_freq / 1000);
+}
+
+void __nvme_rq_arm(struct nvme_rq *rq)
+{
+	struct nvme_sq *sq = rq->sq;
+
+	pthread_spin_lock(&sq->timeouts.lock);
+
+	timer_wheel_del(&rq->timer);
+	timer_wheel_add(sq->timeouts.wheel, &rq->timer, __now_ms() + sq->timeouts.timeout);
+
+	pthread_spin_unlock(&sq->timeouts.lock);
+}
+
+void __nvme_rq_disarm(struct nvme_rq *rq)
+{
+	struct nvme_sq *sq = rq->sq;
+
+	pthread_spin_lock(&sq->timeouts.lock);
+	timer_wheel_del(&rq->timer);
+	pthread_spin_unlock(&sq->timeouts.lock);
+}
+
+int nvme_sq_enable_timeouts(struct nvme_sq *sq, unsigned int timeout_ms,
+			    nvme_rq_timeout_fn fn, void *opaque)
+{
+	if (!timeout_ms || !fn) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!sq->timeouts.wheel) {
+		pthread_spin_init(&sq->timeouts.lock, PTHREAD_PROCESS_PRIVATE);
+
+		sq->timeouts.wheel = znew_t(struct timer_wheel, 1);
+		timer_wheel_init(sq->timeouts.wheel, __now_ms());
+	}
+
+	sq->timeouts.timeout = timeout_ms;
+	sq->timeouts.fn = fn;
+	sq->timeouts.opaque = opaque;
+
+	return 0;
+}
+
+void nvme_sq_disable_timeouts(struct nvme_sq *sq)
+{
+	if (!sq->timeouts.wheel)
+		return;
+
+	for (int i = 0; i < sq->qsize - 1; i++)
+		nvme_rq_disarm(&sq->rqs[i]);
+
+	free(sq->timeouts.wheel);
+
+	pthread_spin_destroy(&sq->timeouts.lock);
+
+	memset(&sq->timeouts, 0x0, sizeof(sq->timeouts));
+}
+
+/* collect expired requests; the handlers are called without the wheel lock */
+static void __expire(struct timer_wheel_entry *t, void *opaque)
+{
+	struct nvme_rq ***tail = opaque;
+	struct nvme_rq *rq = container_of(t, struct nvme_rq, timer);
+
+	rq->expired_next = NULL;
+
+	**tail = rq;
+	*tail = &rq->expired_next;
+}
+
+int nvme_sq_check_timeouts(struct nvme_sq *sq)
+{
+	struct nvme_rq *expired = NULL, **tail = &expired, *rq;
+	int n;
+
+	if (!sq->timeouts.wheel)
+		return 0;
+
+	/* another thread is checking */
+	if (pthread_spin_trylock(&sq->timeouts.lock))
+		return 0;
+
+	n = timer_wheel_advance(sq->timeouts.wheel, __now_ms(), __expire, &tail);
+
+	pthread_spin_unlock(&sq->timeouts.lock);
+
+	while ((rq = expired)) {
+		expired = rq->expired_next;
+
+		rq->ntimeouts++;
+
+		log_debug("sqid %d cid %" PRIu16 " timed out (%d)\n", sq->id, rq->cid,
+			  rq->ntimeouts);
+
+		if (sq->timeouts.fn(rq, rq->ntimeouts, sq->timeouts.opaque) != NVME_RQ_TIMEOUT_REARM)
+			continue;
+
+		pthread_spin_lock(&sq->timeouts.lock);
+
+		/* the handler may have released the tracker or rearmed it on its own */
+		if (!timer_wheel_pending(&rq->timer))
+			timer_wheel_add(sq->timeouts.wheel, &rq->timer,
+					__now_ms() + sq->timeouts.timeout);
+
+		pthread_spin_unlock(&sq->timeouts.lock);
+	}
+
+	return n;
+}
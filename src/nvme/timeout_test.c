@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "timeout.c"
+
+#define QSIZE 8
+
+static struct nvme_sq sq;
+static struct nvme_rq rqs[QSIZE - 1];
+
+static struct nvme_rq *expired;
+static int count, action;
+static bool repost;
+
+static void post(struct nvme_rq *rq);
+
+static int handler(struct nvme_rq *rq, int cnt, void *opaque)
+{
+	assert(opaque == &sq);
+
+	expired = rq;
+	count = cnt;
+
+	/* posting arms the command under the wheel lock */
+	if (repost)
+		post(&rqs[4]);
+
+	return action;
+}
+
+static void post(struct nvme_rq *rq)
+{
+	union nvme_cmd cmd = {};
+
+	nvme_rq_post(rq, &cmd);
+}
+
+int main(void)
+{
+	plan_tests(18);
+
+	assert(pgmap(&sq.mem.vaddr, QSIZE << NVME_SQES) > 0);
+
+	sq.qsize = QSIZE;
+	sq.rqs = rqs;
+
+	for (int i = 0; i < QSIZE - 1; i++) {
+		rqs[i].sq = &sq;
+		rqs[i].cid = (uint16_t)i;
+	}
+
+	ok1(nvme_sq_enable_timeouts(&sq, 0, handler, &sq) == -1 && errno == EINVAL);
+	ok1(nvme_sq_enable_timeouts(&sq, 10, handler, &sq) == 0);
+
+	/* armed on post */
+	post(&rqs[0]);
+	post(&rqs[1]);
+	ok1(timer_wheel_pending(&rqs[0].timer) && timer_wheel_pending(&rqs[1].timer));
+	ok1(nvme_sq_check_timeouts(&sq) == 0);
+
+	/* rqs[1] completes in time */
+	nvme_rq_disarm(&rqs[1]);
+	ok1(!timer_wheel_pending(&rqs[1].timer));
+
+	action = NVME_RQ_TIMEOUT_REARM;
+	usleep(30000);
+
+	ok1(nvme_sq_check_timeouts(&sq) == 1);
+	ok1(expired == &rqs[0] && count == 1);
+	ok1(timer_wheel_pending(&rqs[0].timer));
+
+	/* times out again (e.g., abort did not go through); give up */
+	action = NVME_RQ_TIMEOUT_DONE;
+	usleep(30000);
+
+	ok1(nvme_sq_check_timeouts(&sq) == 1);
+	ok1(expired == &rqs[0] && count == 2);
+	ok1(!timer_wheel_pending(&rqs[0].timer));
+
+	/* handlers are called without the wheel lock held */
+	repost = true;
+	post(&rqs[5]);
+	usleep(30000);
+
+	ok1(nvme_sq_check_timeouts(&sq) == 1 && expired == &rqs[5] &&
+	    timer_wheel_pending(&rqs[4].timer));
+
+	repost = false;
+	nvme_rq_disarm(&rqs[4]);
+
+	/* releasing the tracker disarms it and resets the count */
+	post(&rqs[0]);
+	nvme_rq_release(&rqs[0]);
+	ok1(!timer_wheel_pending(&rqs[0].timer) && rqs[0].ntimeouts == 0);
+
+	usleep(30000);
+	ok1(nvme_sq_check_timeouts(&sq) == 0);
+
+	/* disabling timeouts stops tracking outstanding commands */
+	post(&rqs[2]);
+	nvme_sq_disable_timeouts(&sq);
+	ok1(!timer_wheel_pending(&rqs[2].timer));
+	ok1(sq.timeouts.wheel == NULL);
+	ok1(nvme_sq_check_timeouts(&sq) == 0);
+
+	/* not armed while disabled */
+	post(&rqs[3]);
+	ok1(!timer_wheel_pending(&rqs[3].timer));
+
+	return exit_status();
+}
@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/trim: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+int nvme_trim_init(struct nvme_trim *trim, struct nvme_ns *ns, const struct nvme_trim_opts *opts)
+{
+	*trim = (struct nvme_trim) {
+		.ns = ns,
+		.opts = opts ? *opts : nvme_trim_opts_default,
+	};
+
+	if (trim->opts.batch < 1 || trim->opts.batch > NVME_DSM_MAX_RANGES ||
+	    trim->opts.capacity < trim->opts.batch || trim->opts.max_inflight < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	trim->pending = znew_t(struct nvme_lba_range, trim->opts.capacity);
+	trim->batches = znew_t(struct nvme_trim_batch, trim->opts.max_inflight);
+	trim->idle = znew_t(struct nvme_trim_batch *, trim->opts.max_inflight);
+
+	for (int i = 0; i < trim->opts.max_inflight; i++) {
+		struct nvme_trim_batch *batch = &trim->batches[i];
+
+		batch->trim = trim;
+		batch->ranges = znew_t(struct nvme_lba_range, NVME_DSM_MAX_RANGES);
+
+		trim->idle[trim->nidle++] = batch;
+	}
+
+	pthread_mutex_init(&trim->lock, NULL);
+
+	return 0;
+}
+
+void nvme_trim_fini(struct nvme_trim *trim)
+{
+	for (int i = 0; i < trim->opts.max_inflight; i++)
+		free(trim->batches[i].ranges);
+
+	free(trim->batches);
+	free(trim->idle);
+	free(trim->pending);
+
+	pthread_mutex_destroy(&trim->lock);
+
+	memset(trim, 0x0, sizeof(*trim));
+}
+
+static int __cmp_range(const void *a, const void *b)
+{
+	const struct nvme_lba_range *x = a, *y = b;
+
+	if (x->slba == y->slba)
+		return 0;
+
+	return x->slba < y->slba ? -1 : 1;
+}
+
+/* sort the pending ranges and merge adjacent or overlapping ranges */
+static void __merge(struct nvme_trim *trim)
+{
+	struct nvme_lba_range *pending = trim->pending;
+	int n = 0;
+
+	if (trim->npending < 2)
+		return;
+
+	qsort(pending, trim->npending, sizeof(*pending), __cmp_range);
+
+	for (int i = 1; i < trim->npending; i++) {
+		struct nvme_lba_range *last = &pending[n];
+		uint64_t end = last->slba + last->nlb;
+
+		if (pending[i].slba <= end) {
+			last->nlb = max_t(uint64_t, end, pending[i].slba + pending[i].nlb) - last->slba;
+			continue;
+		}
+
+		pending[++n] = pending[i];
+	}
+
+	atomic_store_release(&trim->npending, n + 1);
+}
+
+/* merge a range into an overlapping or adjacent pending range, if any */
+static bool __absorb(struct nvme_trim *trim, uint64_t slba, uint64_t nlb)
+{
+	for (int i = 0; i < trim->npending; i++) {
+		struct nvme_lba_range *r = &trim->pending[i];
+		uint64_t end = max_t(uint64_t, r->slba + r->nlb, slba + nlb);
+
+		if (r->slba > slba + nlb || slba > r->slba + r->nlb)
+			continue;
+
+		r->slba = min_t(uint64_t, r->slba, slba);
+		r->nlb = end - r->slba;
+
+		/* the range may now reach its neighbours */
+		__merge(trim);
+
+		return true;
+	}
+
+	return false;
+}
+
+static void __batch_cb(struct nvme_bio *bio);
+
+/*
+ * Issue a batch of (at most 256) pending ranges, lowest addresses first.
+ * Returns 1 if a batch was issued and 0 if there is nothing to issue or no
+ * batch is available.
+ */
+static int __issue(struct nvme_trim *trim)
+{
+	struct nvme_ns *ns = trim->ns;
+	struct nvme_trim_batch *batch;
+	int n;
+
+	if (!trim->npending || !trim->nidle)
+		return 0;
+
+	__merge(trim);
+
+	n = min_t(int, trim->npending, NVME_DSM_MAX_RANGES);
+	batch = trim->idle[trim->nidle - 1];
+
+	memcpy(batch->ranges, trim->pending, n * sizeof(*trim->pending));
+
+	if (nvme_bio_init_trimv(&batch->bio, ns->ctrl, ns->nsid, batch->ranges, n))
+		return -1;
+
+	batch->bio.cb = __batch_cb;
+	batch->bio.opaque = batch;
+
+	if (nvme_bio_submit(&batch->bio, nvme_ns_get_sq(ns)))
+		return -1;
+
+	batch->busy = true;
+	trim->nidle--;
+
+	memmove(trim->pending, trim->pending + n, (trim->npending - n) * sizeof(*trim->pending));
+	atomic_store_release(&trim->npending, trim->npending - n);
+
+	return 1;
+}
+
+static inline bool __should_issue(struct nvme_trim *trim)
+{
+	return !(trim->opts.flags & NVME_TRIM_F_DEFER) && trim->npending >= trim->opts.batch;
+}
+
+static void __batch_cb(struct nvme_bio *bio)
+{
+	struct nvme_trim_batch *batch = bio->opaque;
+	struct nvme_trim *trim = batch->trim;
+
+	pthread_mutex_lock(&trim->lock);
+
+	if (bio->err && !trim->err)
+		trim->err = bio->err;
+
+	batch->busy = false;
+	trim->idle[trim->nidle++] = batch;
+
+	/* keep going while enough ranges are pending; errors leave them pending */
+	if (__should_issue(trim))
+		__issue(trim);
+
+	pthread_mutex_unlock(&trim->lock);
+}
+
+int nvme_trim_add(struct nvme_trim *trim, uint64_t slba, uint64_t nlb)
+{
+	uint64_t nsze = trim->ns->info->nsze;
+	struct nvme_lba_range *last;
+	int ret = 0;
+
+	if (!nlb || slba >= nsze || nlb > nsze - slba) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&trim->lock);
+
+	/* sequential deallocations extend the last range */
+	last = trim->npending ? &trim->pending[trim->npending - 1] : NULL;
+	if (last && last->slba + last->nlb == slba) {
+		last->nlb += nlb;
+		goto out;
+	}
+
+	if (trim->npending == trim->opts.capacity) {
+		__merge(trim);
+
+		if (__absorb(trim, slba, nlb))
+			goto out;
+
+		if (trim->npending == trim->opts.capacity &&
+		    ((trim->opts.flags & NVME_TRIM_F_DEFER) || __issue(trim) != 1)) {
+			errno = EAGAIN;
+			ret = -1;
+			goto out;
+		}
+	}
+
+	trim->pending[trim->npending] = (struct nvme_lba_range) {
+		.slba = slba,
+		.nlb = nlb,
+	};
+
+	atomic_store_release(&trim->npending, trim->npending + 1);
+
+	if (__should_issue(trim))
+		__issue(trim);
+
+out:
+	pthread_mutex_unlock(&trim->lock);
+
+	return ret;
+}
+
+int nvme_trim_kick(struct nvme_trim *trim)
+{
+	int ret, n = 0;
+
+	pthread_mutex_lock(&trim->lock);
+
+	while ((ret = __issue(trim)) > 0)
+		n++;
+
+	pthread_mutex_unlock(&trim->lock);
+
+	if (ret < 0 && !n)
+		return -1;
+
+	return n;
+}
+
+int nvme_trim_flush(struct nvme_trim *trim)
+{
+	int err;
+
+	while (true) {
+		struct nvme_trim_batch *batch = NULL;
+		int ret;
+
+		pthread_mutex_lock(&trim->lock);
+
+		while ((ret = __issue(trim)) > 0)
+			;
+
+		err = errno;
+
+		for (int i = 0; i < trim->opts.max_inflight; i++) {
+			if (trim->batches[i].busy) {
+				batch = &trim->batches[i];
+				break;
+			}
+		}
+
+		pthread_mutex_unlock(&trim->lock);
+
+		if (!batch) {
+			/* the remaining ranges could not be issued */
+			if (ret < 0) {
+				errno = err;
+				return -1;
+			}
+
+			break;
+		}
+
+		/* errors are recorded by the batch callback */
+		nvme_bio_wait(&batch->bio);
+	}
+
+	pthread_mutex_lock(&trim->lock);
+
+	err = trim->err;
+	trim->err = 0;
+
+	pthread_mutex_unlock(&trim->lock);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
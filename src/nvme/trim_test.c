@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "trim.c"
+
+#define MAX_SUBMITTED 8
+
+static struct nvme_ns_info info = {
+	.nsid = 1,
+	.nsze = 0x10000,
+	.lbads = 9,
+};
+
+/* submitted (and not yet completed) requests */
+static struct nvme_bio *submitted[MAX_SUBMITTED];
+static int nsubmitted, ntotal;
+static bool fail_submit, fail_complete;
+
+struct nvme_sq *nvme_ns_get_sq(struct nvme_ns *ns UNUSED)
+{
+	return NULL;
+}
+
+int nvme_bio_init_trimv(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint32_t nsid UNUSED,
+			const struct nvme_lba_range *ranges, int nranges)
+{
+	memset(bio, 0x0, sizeof(*bio));
+
+	bio->cmd.opcode = NVME_CMD_DSM;
+	bio->ctrl = ctrl;
+	bio->ranges = ranges;
+	bio->nranges = nranges;
+
+	return 0;
+}
+
+int nvme_bio_submit(struct nvme_bio *bio, struct nvme_sq *sq UNUSED)
+{
+	if (fail_submit) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	assert(nsubmitted < MAX_SUBMITTED);
+
+	bio->inflight = 1;
+	submitted[nsubmitted++] = bio;
+	ntotal++;
+
+	return 0;
+}
+
+/* complete all submitted requests (in order) */
+int nvme_bio_wait(struct nvme_bio *bio UNUSED)
+{
+	while (nsubmitted) {
+		struct nvme_bio *b = submitted[0];
+
+		memmove(submitted, submitted + 1, --nsubmitted * sizeof(*submitted));
+
+		b->inflight = 0;
+		b->err = fail_complete ? EIO : 0;
+
+		/* may submit another batch */
+		b->cb(b);
+	}
+
+	return 0;
+}
+
+static bool check_ranges(struct nvme_bio *bio, const struct nvme_lba_range *ranges, int n)
+{
+	if (bio->nranges != n)
+		return false;
+
+	for (int i = 0; i < n; i++) {
+		if (bio->ranges[i].slba != ranges[i].slba || bio->ranges[i].nlb != ranges[i].nlb)
+			return false;
+	}
+
+	return true;
+}
+
+int main(void)
+{
+	struct nvme_ns ns = { .nsid = 1, .info = &info };
+	struct nvme_trim_opts opts = nvme_trim_opts_default;
+	struct nvme_trim trim;
+
+	plan_tests(25);
+
+	opts.batch = NVME_DSM_MAX_RANGES + 1;
+	ok1(nvme_trim_init(&trim, &ns, &opts) == -1 && errno == EINVAL);
+
+	opts = (struct nvme_trim_opts) { .capacity = 16, .batch = 4, .max_inflight = 1 };
+	ok1(nvme_trim_init(&trim, &ns, &opts) == 0);
+
+	ok1(nvme_trim_add(&trim, 0x10000, 1) == -1 && errno == EINVAL);
+	ok1(nvme_trim_add(&trim, 0xffff, 2) == -1 && errno == EINVAL);
+	ok1(nvme_trim_add(&trim, 0x0, 0) == -1 && errno == EINVAL);
+
+	/* nothing is issued below the batch threshold */
+	ok1(nvme_trim_add(&trim, 100, 4) == 0 && nvme_trim_add(&trim, 10, 2) == 0 &&
+	    nvme_trim_add(&trim, 50, 1) == 0);
+	ok1(nvme_trim_pending(&trim) == 3 && ntotal == 0);
+
+	/* sorted and merged before issue */
+	ok1(nvme_trim_add(&trim, 11, 3) == 0 && ntotal == 1 && nvme_trim_pending(&trim) == 0);
+	ok1(check_ranges(submitted[0], (struct nvme_lba_range[]) {
+		{ 10, 4 }, { 50, 1 }, { 100, 4 },
+	}, 3));
+
+	/* sequential deallocations extend the last range */
+	ok1(nvme_trim_add(&trim, 200, 8) == 0 && nvme_trim_add(&trim, 208, 8) == 0 &&
+	    nvme_trim_pending(&trim) == 1);
+
+	/* no more than max_inflight batches in flight */
+	ok1(nvme_trim_add(&trim, 300, 1) == 0 && nvme_trim_add(&trim, 400, 1) == 0 &&
+	    nvme_trim_add(&trim, 500, 1) == 0);
+	ok1(nvme_trim_pending(&trim) == 4 && ntotal == 1);
+
+	/* the next batch is issued when the previous one completes */
+	nvme_bio_wait(NULL);
+	ok1(ntotal == 2 && nvme_trim_pending(&trim) == 0 && trim.nidle == 1);
+
+	/* flush issues the remaining ranges and waits */
+	ok1(nvme_trim_add(&trim, 600, 1) == 0 && nvme_trim_flush(&trim) == 0);
+	ok1(ntotal == 3 && nvme_trim_pending(&trim) == 0 && nsubmitted == 0);
+
+	/* errors are reported by flush */
+	fail_complete = true;
+	ok1(nvme_trim_add(&trim, 700, 1) == 0 && nvme_trim_flush(&trim) == -1 && errno == EIO);
+	fail_complete = false;
+
+	ok1(nvme_trim_flush(&trim) == 0);
+
+	/* ranges that cannot be issued are kept */
+	fail_submit = true;
+	ok1(nvme_trim_add(&trim, 800, 1) == 0 && nvme_trim_kick(&trim) == -1 && errno == EBUSY);
+	ok1(nvme_trim_flush(&trim) == -1 && errno == EBUSY && nvme_trim_pending(&trim) == 1);
+	fail_submit = false;
+
+	ok1(nvme_trim_flush(&trim) == 0 && nvme_trim_pending(&trim) == 0);
+
+	nvme_trim_fini(&trim);
+
+	/* deferred issue; up to 256 ranges per batch */
+	ntotal = 0;
+	opts = (struct nvme_trim_opts) {
+		.capacity = 300, .batch = 4, .max_inflight = 2, .flags = NVME_TRIM_F_DEFER,
+	};
+	ok1(nvme_trim_init(&trim, &ns, &opts) == 0);
+
+	for (int i = 0; i < 300; i++)
+		nvme_trim_add(&trim, (uint64_t)i * 4, 1);
+
+	ok1(nvme_trim_pending(&trim) == 300 && ntotal == 0);
+
+	/* a range that overlaps a pending range is merged into it if the list is full */
+	ok1(nvme_trim_add(&trim, 2, 1) == -1 && errno == EAGAIN);
+	ok1(nvme_trim_add(&trim, 0, 2) == 0 && nvme_trim_pending(&trim) == 300);
+
+	ok1(nvme_trim_kick(&trim) == 2 && submitted[0]->nranges == 256 &&
+	    submitted[1]->nranges == 44 && submitted[0]->ranges[0].nlb == 2);
+
+	nvme_bio_wait(NULL);
+	nvme_trim_fini(&trim);
+
+	return exit_status();
+}
@@ -16,8 +16,15 @@
 #define NVME_FIELD_SET(value, name) \
 	(((value) & NVME_##name##_MASK) << NVME_##name##_SHIFT)
 
+#define cqhdbl(doorbells, qid, dstrd) \
+	(doorbells + (2 * qid + 1) * (4 << dstrd))
+
+#define sqtdbl(doorbells, qid, dstrd) \
+	(doorbells + (2 * qid) * (4 << dstrd))
+
 enum nvme_constants {
 	NVME_IDENTIFY_DATA_SIZE		= 4096,
+	NVME_NSID_ALL			= 0xffffffff,
 };
 
 enum nvme_reg {
@@ -45,11 +52,14 @@ enum nvme_cap {
 	NVME_CAP_MPSMIN_MASK		= 0xf,
 	NVME_CAP_MPSMAX_SHIFT		= 52,
 	NVME_CAP_MPSMAX_MASK		= 0xf,
+	NVME_CAP_AMS_SHIFT		= 17,
+	NVME_CAP_AMS_MASK		= 0x3,
 	NVME_CAP_CMBS_SHIFT		= 57,
 	NVME_CAP_CMBS_MASK		= 0x1,
 
 	NVME_CAP_CSS_CSI		= 1 << 6,
 	NVME_CAP_CSS_ADMIN		= 1 << 7,
+	NVME_CAP_AMS_WRR		= 1 << 0,
 };
 
 enum nvme_cc {
@@ -70,6 +80,7 @@ enum nvme_cc {
 
 	NVME_CC_SHN_NONE		= 0,
 	NVME_CC_AMS_RR			= 0,
+	NVME_CC_AMS_WRR			= 1,
 	NVME_CC_CSS_CSI			= 6,
 	NVME_CC_CSS_ADMIN		= 7,
 	NVME_CC_CSS_NVM			= 0,
@@ -78,6 +89,8 @@ enum nvme_cc {
 enum nvme_csts {
 	NVME_CSTS_RDY_SHIFT		= 0,
 	NVME_CSTS_RDY_MASK		= 0x1,
+	NVME_CSTS_CFS_SHIFT		= 1,
+	NVME_CSTS_CFS_MASK		= 0x1,
 };
 
 enum nvme_cmbloc {
@@ -121,10 +134,29 @@ enum nvme_feat {
 	NVME_FEAT_NRQS_NSQR_MASK	= 0xffff,
 	NVME_FEAT_NRQS_NCQR_SHIFT	= 16,
 	NVME_FEAT_NRQS_NCQR_MASK	= 0xffff,
+	NVME_FEAT_ARB_AB_SHIFT		= 0,
+	NVME_FEAT_ARB_AB_MASK		= 0x7,
+	NVME_FEAT_ARB_LPW_SHIFT		= 8,
+	NVME_FEAT_ARB_LPW_MASK		= 0xff,
+	NVME_FEAT_ARB_MPW_SHIFT		= 16,
+	NVME_FEAT_ARB_MPW_MASK		= 0xff,
+	NVME_FEAT_ARB_HPW_SHIFT		= 24,
+	NVME_FEAT_ARB_HPW_MASK		= 0xff,
+	NVME_FEAT_HMB_EHM		= 1 << 0,
+	NVME_FEAT_HMB_MR		= 1 << 1,
 };
 
 enum nvme_fid {
+	NVME_FEAT_FID_ARBITRATION	= 0x01,
 	NVME_FEAT_FID_NUM_QUEUES	= 0x07,
+	NVME_FEAT_FID_HOST_MEM_BUF	= 0x0d,
+};
+
+/* host memory buffer descriptor list entry */
+struct nvme_hmb_desc {
+	leint64_t badd;
+	leint32_t bsize;
+	uint32_t  rsvd12;
 };
 
 enum nvme_admin_opcode {
@@ -133,27 +165,150 @@ enum nvme_admin_opcode {
 	NVME_ADMIN_DELETE_CQ		= 0x04,
 	NVME_ADMIN_CREATE_CQ            = 0x05,
 	NVME_ADMIN_IDENTIFY		= 0x06,
+	NVME_ADMIN_ABORT		= 0x08,
 	NVME_ADMIN_SET_FEATURES         = 0x09,
 	NVME_ADMIN_ASYNC_EVENT          = 0x0c,
 	NVME_ADMIN_VIRT_MGMT		= 0x1c,
 	NVME_ADMIN_DBCONFIG		= 0x7c,
 };
 
+enum nvme_io_opcode {
+	NVME_CMD_FLUSH			= 0x00,
+	NVME_CMD_WRITE			= 0x01,
+	NVME_CMD_READ			= 0x02,
+	NVME_CMD_DSM			= 0x09,
+	NVME_CMD_COPY			= 0x19,
+	NVME_CMD_ZONE_MGMT_SEND		= 0x79,
+	NVME_CMD_ZONE_MGMT_RECV		= 0x7a,
+	NVME_CMD_ZONE_APPEND		= 0x7d,
+};
+
+enum nvme_csi {
+	NVME_CSI_NVM			= 0x0,
+	NVME_CSI_ZNS			= 0x2,
+};
+
+enum nvme_zone_mgmt_fields {
+	/* zone management send (cdw13) */
+	NVME_ZONE_MGMT_SEND_ZSA_SHIFT	= 0,
+	NVME_ZONE_MGMT_SEND_ZSA_MASK	= 0xff,
+	NVME_ZONE_MGMT_SEND_SELECT_ALL	= 1 << 8,
+
+	/* zone management receive (cdw13) */
+	NVME_ZONE_MGMT_RECV_ZRA_SHIFT	= 0,
+	NVME_ZONE_MGMT_RECV_ZRA_MASK	= 0xff,
+	NVME_ZONE_MGMT_RECV_ZRASF_SHIFT	= 8,
+	NVME_ZONE_MGMT_RECV_ZRASF_MASK	= 0xff,
+	NVME_ZONE_MGMT_RECV_PARTIAL	= 1 << 16,
+
+	NVME_ZONE_MGMT_RECV_ZRA_REPORT	= 0x0,
+};
+
+/* zone descriptor (see zone management receive) */
+struct nvme_zone_desc {
+	uint8_t   zt;
+	uint8_t   zs;
+	uint8_t   za;
+	uint8_t   zai;
+	uint8_t   rsvd4[4];
+	leint64_t zcap;
+	leint64_t zslba;
+	leint64_t wp;
+	uint8_t   rsvd32[32];
+};
+
+struct nvme_zone_report {
+	leint64_t nr_zones;
+	uint8_t   rsvd8[56];
+	struct nvme_zone_desc descs[];
+};
+
+enum nvme_zone_desc_fields {
+	NVME_ZONE_DESC_ZT_SHIFT		= 0,
+	NVME_ZONE_DESC_ZT_MASK		= 0xf,
+	NVME_ZONE_DESC_ZS_SHIFT		= 4,
+	NVME_ZONE_DESC_ZS_MASK		= 0xf,
+};
+
+enum nvme_dsm_fields {
+	NVME_DSM_MAX_RANGES		= 256,
+	NVME_DSM_ATTR_AD		= 1 << 2,
+};
+
+struct nvme_dsm_range {
+	leint32_t cattr;
+	leint32_t nlb;
+	leint64_t slba;
+};
+
+/* protection information (upper 16 bits of cdw12 of read and write commands) */
+enum nvme_rw_control {
+	NVME_RW_CONTROL_PRCHK_REFTAG	= 1 << 10,
+	NVME_RW_CONTROL_PRCHK_APPTAG	= 1 << 11,
+	NVME_RW_CONTROL_PRCHK_GUARD	= 1 << 12,
+	NVME_RW_CONTROL_PRACT		= 1 << 13,
+};
+
+enum nvme_copy_fields {
+	/* number of ranges (cdw12); zeroes based */
+	NVME_COPY_NR_SHIFT		= 0,
+	NVME_COPY_NR_MASK		= 0xff,
+};
+
+/* source range entry, descriptor format 0h */
+struct nvme_copy_range {
+	uint8_t   rsvd0[8];
+	leint64_t slba;
+	leint16_t nlb;
+	uint8_t   rsvd18[6];
+	leint32_t eilbrt;
+	leint16_t elbat;
+	leint16_t elbatm;
+};
+
+enum nvme_cqe_fields {
+	/* do not retry (in the phase tagged status field) */
+	NVME_CQE_SFP_DNR		= 1 << 15,
+
+	/* generic command status Command Abort Requested */
+	NVME_CQE_SFP_SC_ABORT_REQ	= 0x07 << 1,
+};
+
 enum nvme_identify_cns {
+	NVME_IDENTIFY_CNS_NS			= 0x00,
 	NVME_IDENTIFY_CNS_CTRL			= 0x01,
+	NVME_IDENTIFY_CNS_ACTIVE_NS_LIST	= 0x02,
+	NVME_IDENTIFY_CNS_NS_DESC_LIST		= 0x03,
+	NVME_IDENTIFY_CNS_CSI_NS		= 0x05,
+	NVME_IDENTIFY_CNS_CSI_CTRL		= 0x06,
 	NVME_IDENTIFY_CNS_PRIMARY_CTRL_CAP	= 0x14,
 	NVME_IDENTIFY_CNS_SECONDARY_CTRL_LIST	= 0x15,
 };
 
 enum nvme_identify_ctrl_offset {
+	NVME_IDENTIFY_CTRL_MDTS		= 77,
+	NVME_IDENTIFY_CTRL_CTRATT	= 96,
 	NVME_IDENTIFY_CTRL_OACS		= 256,
+	NVME_IDENTIFY_CTRL_HMPRE	= 272,
+	NVME_IDENTIFY_CTRL_HMMIN	= 276,
+	NVME_IDENTIFY_CTRL_HMMINDS	= 332,
+	NVME_IDENTIFY_CTRL_HMMAXD	= 336,
+	NVME_IDENTIFY_CTRL_ONCS		= 520,
 	NVME_IDENTIFY_CTRL_SGLS		= 536,
 };
 
+enum nvme_identify_ctrl_ctratt {
+	NVME_IDENTIFY_CTRL_CTRATT_ELBAS	= 1 << 15,
+};
+
 enum nvme_identify_ctrl_oacs {
 	NVME_IDENTIFY_CTRL_OACS_DBCONFIG = 1 << 8,
 };
 
+enum nvme_identify_ctrl_oncs {
+	NVME_IDENTIFY_CTRL_ONCS_COPY	= 1 << 8,
+};
+
 enum nvme_identify_ctrl_sgls {
 	NVME_IDENTIFY_CTRL_SGLS_ALIGNMENT_SHIFT	= 0,
 	NVME_IDENTIFY_CTRL_SGLS_ALIGNMENT_MASK	= 0x3,
@@ -162,6 +317,92 @@ enum nvme_identify_ctrl_sgls {
 	NVME_IDENTIFY_CTRL_SGLS_ALIGNMENT_DWORD	= 0x2,
 };
 
+enum nvme_identify_ns_offset {
+	NVME_IDENTIFY_NS_NSZE		= 0,
+	NVME_IDENTIFY_NS_NCAP		= 8,
+	NVME_IDENTIFY_NS_NSFEAT		= 24,
+	NVME_IDENTIFY_NS_NLBAF		= 25,
+	NVME_IDENTIFY_NS_FLBAS		= 26,
+	NVME_IDENTIFY_NS_DPS		= 29,
+	NVME_IDENTIFY_NS_NOIOB		= 46,
+	NVME_IDENTIFY_NS_NPWG		= 64,
+	NVME_IDENTIFY_NS_NPWA		= 66,
+	NVME_IDENTIFY_NS_NPDG		= 68,
+	NVME_IDENTIFY_NS_NPDA		= 70,
+	NVME_IDENTIFY_NS_NOWS		= 72,
+	NVME_IDENTIFY_NS_MSSRL		= 74,
+	NVME_IDENTIFY_NS_MCL		= 76,
+	NVME_IDENTIFY_NS_MSRC		= 80,
+	NVME_IDENTIFY_NS_LBAF		= 128,
+};
+
+enum nvme_identify_ns_fields {
+	NVME_IDENTIFY_NS_NSFEAT_OPTPERF		= 1 << 4,
+
+	NVME_IDENTIFY_NS_FLBAS_LO_SHIFT		= 0,
+	NVME_IDENTIFY_NS_FLBAS_LO_MASK		= 0xf,
+	NVME_IDENTIFY_NS_FLBAS_HI_SHIFT		= 5,
+	NVME_IDENTIFY_NS_FLBAS_HI_MASK		= 0x3,
+	NVME_IDENTIFY_NS_FLBAS_EXTENDED		= 1 << 4,
+
+	NVME_IDENTIFY_NS_DPS_PIT_SHIFT		= 0,
+	NVME_IDENTIFY_NS_DPS_PIT_MASK		= 0x7,
+	NVME_IDENTIFY_NS_DPS_FIRST		= 1 << 3,
+};
+
+/* identify namespace, nvm command set */
+enum nvme_identify_nvm_offset {
+	NVME_IDENTIFY_NVM_NS_ELBAF	= 12,
+};
+
+/* extended lba format */
+enum nvme_identify_nvm_elbaf {
+	NVME_IDENTIFY_NVM_ELBAF_STS_SHIFT	= 0,
+	NVME_IDENTIFY_NVM_ELBAF_STS_MASK	= 0x7f,
+	NVME_IDENTIFY_NVM_ELBAF_PIF_SHIFT	= 7,
+	NVME_IDENTIFY_NVM_ELBAF_PIF_MASK	= 0x3,
+};
+
+/* identify namespace and controller, zoned namespace command set */
+enum nvme_identify_zns_offset {
+	NVME_IDENTIFY_ZNS_CTRL_ZASL	= 0,
+	NVME_IDENTIFY_ZNS_NS_LBAFE	= 2816,
+};
+
+/* lba format extension */
+struct nvme_lbafe {
+	leint64_t zsze;
+	uint8_t   zdes;
+	uint8_t   rsvd9[7];
+};
+
+struct nvme_lbaf {
+	leint16_t ms;
+	uint8_t   ds;
+	uint8_t   rp;
+};
+
+enum nvme_ns_desc_type {
+	NVME_NS_DESC_CSI			= 0x04,
+};
+
+struct nvme_ns_desc {
+	uint8_t   nidt;
+	uint8_t   nidl;
+	uint8_t   rsvd2[2];
+	uint8_t   nid[];
+};
+
+enum nvme_aen_fields {
+	NVME_AEN_TYPE_SHIFT			= 0,
+	NVME_AEN_TYPE_MASK			= 0x7,
+	NVME_AEN_INFO_SHIFT			= 8,
+	NVME_AEN_INFO_MASK			= 0xff,
+
+	NVME_AEN_TYPE_NOTICE			= 0x2,
+	NVME_AEN_NOTICE_NS_CHANGED		= 0x0,
+};
+
 struct nvme_primary_ctrl_cap {
 	leint16_t cntlid;
 	leint16_t portid;
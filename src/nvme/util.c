@@ -36,18 +36,6 @@
 #include "ccan/minmax/minmax.h"
 #include "types.h"
 
-#include "crc64table.h"
-
-uint64_t nvme_crc64(uint64_t crc, const unsigned char *buffer, size_t len)
-{
-	size_t i;
-
-	for (i = 0; i < len; i++)
-		crc = (crc >> 8) ^ crc64_nvme_table[(crc & 0xff) ^ buffer[i]];
-
-	return crc ^ (uint64_t)~0;
-}
-
 int nvme_set_errno_from_cqe(struct nvme_cqe *cqe)
 {
 	errno = le16_to_cpu(cqe->sfp) >> 1 ? EIO : 0;
@@ -55,26 +43,6 @@ int nvme_set_errno_from_cqe(struct nvme_cqe *cqe)
 	return errno ? -1 : 0;
 }
 
-int nvme_aer(struct nvme_ctrl *ctrl, void *opaque)
-{
-	struct nvme_rq *rq;
-	union nvme_cmd cmd = { .opcode = NVME_ADMIN_ASYNC_EVENT };
-
-	rq = nvme_rq_acquire_atomic(ctrl->adminq.sq);
-	if (!rq) {
-		errno = EBUSY;
-		return -1;
-	}
-
-	cmd.cid = rq->cid | NVME_CID_AER;
-	rq->opaque = opaque;
-
-	/* rq_exec overwrites the command identifier, so use sq_exec */
-	nvme_sq_exec(ctrl->adminq.sq, &cmd);
-
-	return 0;
-}
-
 int nvme_sync(struct nvme_ctrl *ctrl, struct nvme_sq *sq, union nvme_cmd *sqe, void *buf,
 	      size_t len, struct nvme_cqe *cqe_copy)
 {
@@ -108,21 +76,13 @@ int nvme_sync(struct nvme_ctrl *ctrl, struct nvme_sq *sq, union nvme_cmd *sqe, v
 		}
 	}
 
+	pthread_spin_lock(&sq->lock);
 	nvme_rq_exec(rq, sqe);
+	pthread_spin_unlock(&sq->lock);
 
-	while (nvme_rq_spin(rq, &cqe) < 0) {
-		if (errno == EAGAIN) {
-			log_error("SPURIOUS CQE (cq %" PRIu16 " cid %" PRIu16 ")\n",
-				  rq->sq->cq->id, cqe.cid);
-
-			continue;
-		}
-
+	if (nvme_rq_spin(rq, &cqe))
 		ret = -1;
 
-		break;
-	}
-
 	if (cqe_copy)
 		memcpy(cqe_copy, &cqe, 1 << NVME_CQES);
 
@@ -136,12 +96,6 @@ release_rq:
 	return ret;
 }
 
-int nvme_admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
-	       struct nvme_cqe *cqe_copy)
-{
-	return nvme_sync(ctrl, ctrl->adminq.sq, sqe, buf, len, cqe_copy);
-}
-
 static inline int __map_prp_first(leint64_t *prp1, leint64_t *prplist, uint64_t iova, size_t len,
 				  int pageshift)
 {
@@ -186,8 +140,8 @@ static inline int __map_prp_first(leint64_t *prp1, leint64_t *prplist, uint64_t
 static inline int __map_prp_append(leint64_t *prplist, uint64_t iova, size_t len, int max_prps,
 				   int pageshift)
 {
-	int prpcount = max_t(int, 1, (int)len >> pageshift);
 	size_t pagesize = 1 << pageshift;
+	int prpcount = max_t(int, 1, (int)(ALIGN_UP(len, pagesize) >> pageshift));
 
 	if (prpcount > max_prps) {
 		log_error("too many prps required\n");
@@ -219,11 +173,26 @@ static inline void __set_prp2(leint64_t *prp2, leint64_t prplist, leint64_t prpl
 		*prp2 = 0x0;
 }
 
+int __nvme_map_prp(union nvme_dptr *dptr, leint64_t *prplist, uint64_t prplist_iova,
+		   uint64_t iova, size_t len, int pageshift)
+{
+	int prpcount;
+
+	prpcount = __map_prp_first(&dptr->prp1, prplist, iova, len, pageshift);
+	if (prpcount < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	__set_prp2(&dptr->prp2, cpu_to_le64(prplist_iova), prplist[0], prpcount);
+
+	return 0;
+}
+
 int nvme_map_prp(struct nvme_ctrl *ctrl, leint64_t *prplist, union nvme_cmd *cmd,
 		 uint64_t iova, size_t len)
 {
 	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
-	int prpcount;
 	int pageshift = __mps_to_pageshift(ctrl->config.mps);
 	uint64_t prplist_iova;
 
@@ -232,15 +201,7 @@ int nvme_map_prp(struct nvme_ctrl *ctrl, leint64_t *prplist, union nvme_cmd *cmd
 		return -1;
 	}
 
-	prpcount = __map_prp_first(&cmd->dptr.prp1, prplist, iova, len, pageshift);
-	if (prpcount < 0) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	__set_prp2(&cmd->dptr.prp2, cpu_to_le64(prplist_iova), prplist[0], prpcount);
-
-	return 0;
+	return __nvme_map_prp(&cmd->dptr, prplist, prplist_iova, iova, len, pageshift);
 }
 
 static int nvme_virt_mgmt(struct nvme_ctrl *ctrl, uint16_t cntlid, enum nvme_virt_mgmt_rt rt,
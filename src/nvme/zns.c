@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/zns: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+/* size of the buffer used to refresh the zone table */
+#define NVME_ZNS_REPORT_SIZE 0x4000
+
+int nvme_zns_mgmt_send(struct nvme_ns *ns, uint64_t slba, uint8_t zsa, bool all)
+{
+	union nvme_cmd cmd = {
+		.opcode = NVME_CMD_ZONE_MGMT_SEND,
+		.nsid = cpu_to_le32(ns->nsid),
+	};
+
+	cmd.rw.slba = cpu_to_le64(slba);
+	cmd.cdw13 = cpu_to_le32(NVME_FIELD_SET(zsa, ZONE_MGMT_SEND_ZSA) |
+				(all ? NVME_ZONE_MGMT_SEND_SELECT_ALL : 0));
+
+	return nvme_sync(ns->ctrl, nvme_ns_get_sq(ns), &cmd, NULL, 0, NULL);
+}
+
+int nvme_zns_mgmt_recv(struct nvme_ns *ns, uint64_t slba, uint8_t zrasf, bool partial,
+		       void *buf, size_t len)
+{
+	union nvme_cmd cmd = {
+		.opcode = NVME_CMD_ZONE_MGMT_RECV,
+		.nsid = cpu_to_le32(ns->nsid),
+	};
+
+	if (!len || len % 4) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cmd.rw.slba = cpu_to_le64(slba);
+	cmd.cdw12 = cpu_to_le32((uint32_t)(len / 4 - 1));
+	cmd.cdw13 = cpu_to_le32(NVME_FIELD_SET(NVME_ZONE_MGMT_RECV_ZRA_REPORT, ZONE_MGMT_RECV_ZRA) |
+				NVME_FIELD_SET(zrasf, ZONE_MGMT_RECV_ZRASF) |
+				(partial ? NVME_ZONE_MGMT_RECV_PARTIAL : 0));
+
+	return nvme_sync(ns->ctrl, nvme_ns_get_sq(ns), &cmd, buf, len, NULL);
+}
+
+static void __raise(uint64_t *val, uint64_t to)
+{
+	uint64_t cur = atomic_load_acquire(val);
+
+	while (cur < to && !atomic_cmpxchg(val, cur, to))
+		;
+}
+
+/*
+ * Update the cached descriptor of @zone. Unless the zone was reset, the write
+ * pointer is only moved forward, since zone append requests may have
+ * completed (and advanced the cached write pointer) after the report was
+ * generated, and the blocks reserved by inflight requests are kept.
+ */
+static void __zone_update(struct nvme_zone *zone, struct nvme_zone_desc *desc, bool reset)
+{
+	uint8_t zs = NVME_FIELD_GET(desc->zs, ZONE_DESC_ZS);
+	uint64_t zslba = le64_to_cpu(desc->zslba);
+	uint64_t wp = le64_to_cpu(desc->wp);
+	uint64_t zcap = le64_to_cpu(desc->zcap);
+	uint64_t used;
+
+	switch (zs) {
+	case NVME_ZONE_STATE_FULL:
+	case NVME_ZONE_STATE_READ_ONLY:
+	case NVME_ZONE_STATE_OFFLINE:
+		/* the write pointer is not valid; no more data can be appended */
+		used = zcap;
+		wp = zslba + zcap;
+
+		break;
+
+	default:
+		used = wp - zslba;
+
+		break;
+	}
+
+	zone->zslba = zslba;
+	zone->zcap = zcap;
+	zone->zt = NVME_FIELD_GET(desc->zt, ZONE_DESC_ZT);
+	zone->za = desc->za;
+
+	atomic_store_release(&zone->zs, zs);
+
+	if (reset) {
+		atomic_store_release(&zone->wp, wp);
+		atomic_store_release(&zone->reserved, used);
+
+		return;
+	}
+
+	__raise(&zone->wp, wp);
+	__raise(&zone->reserved, used);
+}
+
+static int __refresh(struct nvme_zns *zns, uint32_t zone, uint32_t n, bool reset)
+{
+	struct nvme_zone_report *report = zns->report.vaddr;
+	size_t max = (zns->report.len - sizeof(*report)) / sizeof(struct nvme_zone_desc);
+	int ret = 0;
+
+	if (zone >= zns->nr_zones || n > zns->nr_zones - zone) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&zns->lock);
+
+	while (n) {
+		uint64_t nr = min_t(uint64_t, max, n);
+
+		/* size the report so only the requested zones are transferred */
+		if (nvme_zns_mgmt_recv(zns->ns, zone * zns->zsze, NVME_ZONE_REPORT_ALL, true,
+				       report, sizeof(*report) + nr * sizeof(struct nvme_zone_desc))) {
+			ret = -1;
+			break;
+		}
+
+		nr = min_t(uint64_t, le64_to_cpu(report->nr_zones), nr);
+		if (!nr) {
+			log_debug("empty zone report\n");
+
+			errno = EIO;
+			ret = -1;
+			break;
+		}
+
+		for (uint64_t i = 0; i < nr; i++)
+			__zone_update(&zns->zones[zone + i], &report->descs[i], reset);
+
+		zone += (uint32_t)nr;
+		n -= (uint32_t)nr;
+	}
+
+	pthread_mutex_unlock(&zns->lock);
+
+	return ret;
+}
+
+int nvme_zns_refresh(struct nvme_zns *zns, uint32_t zone, uint32_t n)
+{
+	return __refresh(zns, zone, n, false);
+}
+
+int nvme_zns_zone_action(struct nvme_zns *zns, uint32_t zone, uint8_t zsa)
+{
+	if (zone >= zns->nr_zones) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (nvme_zns_mgmt_send(zns->ns, zns->zones[zone].zslba, zsa, false))
+		return -1;
+
+	return __refresh(zns, zone, 1,
+			 zsa == NVME_ZONE_ACTION_RESET || zsa == NVME_ZONE_ACTION_OFFLINE);
+}
+
+static int __identify_zns(struct nvme_zns *zns)
+{
+	struct nvme_ctrl *ctrl = zns->ns->ctrl;
+	const struct nvme_ns_info *info = zns->ns->info;
+	void *id = zns->report.vaddr;
+	struct nvme_lbafe *lbafe;
+	union nvme_cmd cmd;
+	uint8_t zasl;
+
+	cmd.identify = (struct nvme_cmd_identify) {
+		.opcode = NVME_ADMIN_IDENTIFY,
+		.nsid = cpu_to_le32(info->nsid),
+		.cns = NVME_IDENTIFY_CNS_CSI_NS,
+		.csi = NVME_CSI_ZNS,
+	};
+
+	if (nvme_admin(ctrl, &cmd, id, NVME_IDENTIFY_DATA_SIZE, NULL))
+		return -1;
+
+	lbafe = (struct nvme_lbafe *)(id + NVME_IDENTIFY_ZNS_NS_LBAFE) + info->lbaf;
+
+	zns->zsze = le64_to_cpu(lbafe->zsze);
+	if (!zns->zsze) {
+		log_debug("nsid %" PRIu32 " reports no zone size\n", info->nsid);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	cmd.identify = (struct nvme_cmd_identify) {
+		.opcode = NVME_ADMIN_IDENTIFY,
+		.cns = NVME_IDENTIFY_CNS_CSI_CTRL,
+		.csi = NVME_CSI_ZNS,
+	};
+
+	if (nvme_admin(ctrl, &cmd, id, NVME_IDENTIFY_DATA_SIZE, NULL))
+		return -1;
+
+	zasl = *(uint8_t *)(id + NVME_IDENTIFY_ZNS_CTRL_ZASL);
+
+	zns->max_append = info->max_nlb;
+
+	/* in units of the minimum memory page size; zero means mdts */
+	if (zasl) {
+		uint64_t cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+		uint64_t bytes = (uint64_t)__mps_to_pagesize(NVME_FIELD_GET(cap, CAP_MPSMIN)) << zasl;
+
+		zns->max_append = (uint32_t)min_t(uint64_t, zns->max_append,
+						  bytes / nvme_ns_lba_size(info));
+	}
+
+	zns->nr_zones = (uint32_t)(info->nsze / zns->zsze);
+
+	return 0;
+}
+
+int nvme_zns_open(struct nvme_zns *zns, struct nvme_ns *ns)
+{
+	if (ns->info->csi != NVME_CSI_ZNS) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	*zns = (struct nvme_zns) {
+		.ns = ns,
+	};
+
+	if (iommu_get_dmabuf(__iommu_ctx(ns->ctrl), &zns->report, NVME_ZNS_REPORT_SIZE, 0x0))
+		return -1;
+
+	if (__identify_zns(zns))
+		goto err;
+
+	pthread_mutex_init(&zns->lock, NULL);
+
+	zns->zones = znew_t(struct nvme_zone, zns->nr_zones);
+
+	if (__refresh(zns, 0, zns->nr_zones, true)) {
+		nvme_zns_close(zns);
+		return -1;
+	}
+
+	return 0;
+
+err:
+	iommu_put_dmabuf(&zns->report);
+
+	return -1;
+}
+
+void nvme_zns_close(struct nvme_zns *zns)
+{
+	free(zns->zones);
+
+	iommu_put_dmabuf(&zns->report);
+	pthread_mutex_destroy(&zns->lock);
+
+	memset(zns, 0x0, sizeof(*zns));
+}
+
+static int __reserve(struct nvme_zone *zone, uint64_t nlb)
+{
+	uint64_t reserved = atomic_load_acquire(&zone->reserved);
+
+	do {
+		if (reserved + nlb > zone->zcap) {
+			errno = ENOSPC;
+			return -1;
+		}
+	} while (!atomic_cmpxchg(&zone->reserved, reserved, reserved + nlb));
+
+	return 0;
+}
+
+/* the number of logical blocks is kept in the command prototype */
+static inline uint64_t __append_nlb(struct nvme_bio *bio)
+{
+	return (uint64_t)le16_to_cpu(bio->cmd.rw.nlb) + 1;
+}
+
+static void __append_end_io(struct nvme_bio *bio)
+{
+	struct nvme_zone *zone = bio->end_io_data;
+	uint64_t nlb = __append_nlb(bio), wp;
+	uint8_t zs;
+
+	if (bio->err) {
+		/* release the reservation */
+		__atomic_fetch_sub(&zone->reserved, nlb, __ATOMIC_SEQ_CST);
+
+		return;
+	}
+
+	wp = nvme_zns_append_lba(bio) + nlb;
+
+	__raise(&zone->wp, wp);
+
+	if (wp == zone->zslba + zone->zcap) {
+		atomic_store_release(&zone->zs, (uint8_t)NVME_ZONE_STATE_FULL);
+
+		return;
+	}
+
+	zs = atomic_load_acquire(&zone->zs);
+
+	if (zs == NVME_ZONE_STATE_EMPTY || zs == NVME_ZONE_STATE_CLOSED)
+		atomic_cmpxchg(&zone->zs, zs, (uint8_t)NVME_ZONE_STATE_IMPLICITLY_OPEN);
+}
+
+static int __append_init(struct nvme_zns *zns, struct nvme_bio *bio, uint32_t zone,
+			 struct iovec *iov, int niov)
+{
+	struct nvme_ns *ns = zns->ns;
+	struct nvme_zone *z;
+	uint64_t nlb;
+
+	if (zone >= zns->nr_zones) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	z = &zns->zones[zone];
+
+	if (nvme_bio_init(bio, ns->ctrl, NVME_CMD_ZONE_APPEND, ns->nsid,
+			  z->zslba * nvme_ns_lba_size(ns->info), iov, niov))
+		return -1;
+
+	nlb = bio->nlb;
+
+	if (nlb > zns->max_append) {
+		log_debug("zone append of %" PRIu64 " blocks exceeds the limit\n", nlb);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (__reserve(z, nlb))
+		return -1;
+
+	bio->cmd.rw.slba = cpu_to_le64(z->zslba);
+	bio->cmd.rw.nlb = cpu_to_le16((uint16_t)(nlb - 1));
+
+	bio->end_io = __append_end_io;
+	bio->end_io_data = z;
+
+	return 0;
+}
+
+int nvme_zns_append(struct nvme_zns *zns, uint32_t zone, struct iovec *iov, int niov,
+		    uint64_t *alba)
+{
+	struct nvme_bio bio;
+
+	if (__append_init(zns, &bio, zone, iov, niov))
+		return -1;
+
+	if (__nvme_ns_sync(zns->ns, &bio))
+		return -1;
+
+	if (alba)
+		*alba = nvme_zns_append_lba(&bio);
+
+	return 0;
+}
+
+int nvme_zns_append_async(struct nvme_zns *zns, struct nvme_bio *bio, uint32_t zone,
+			  struct iovec *iov, int niov, nvme_bio_cb cb, void *opaque)
+{
+	if (__append_init(zns, bio, zone, iov, niov))
+		return -1;
+
+	bio->cb = cb;
+	bio->opaque = opaque;
+
+	if (nvme_bio_submit(bio, nvme_ns_get_sq(zns->ns))) {
+		int err = errno;
+
+		__atomic_fetch_sub(&zns->zones[zone].reserved, __append_nlb(bio), __ATOMIC_SEQ_CST);
+
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
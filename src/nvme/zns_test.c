@@ -0,0 +1,418 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <pthread.h>
+
+#include "ccan/tap/tap.h"
+
+#include "zns.c"
+
+/* more zones than fit in a single report */
+#define NZONES 300
+#define ZSZE 256
+#define ZCAP 192
+
+#define NTHREADS 4
+#define APPEND_NLB 4
+
+static struct nvme_ns_info info = {
+	.nsid = 1,
+	.csi = NVME_CSI_ZNS,
+	.nsze = NZONES * ZSZE,
+	.lbaf = 1,
+	.lbads = 9,
+	.max_nlb = 32,
+};
+
+static uint64_t regs[8];
+
+/* fake zoned namespace */
+static struct {
+	uint8_t zs[NZONES];
+	uint64_t wp[NZONES];
+
+	uint8_t zasl;
+
+	int nreports, nzones_reported;
+	uint32_t last_send;
+
+	bool fail;
+} dev;
+
+static int ncb;
+
+int iommu_get_dmabuf(struct iommu_ctx *ctx UNUSED, struct iommu_dmabuf *buffer, size_t len,
+		     unsigned long flags UNUSED)
+{
+	buffer->len = pgmap(&buffer->vaddr, len);
+	assert(buffer->len > 0);
+
+	buffer->iova = (uint64_t)buffer->vaddr;
+
+	return 0;
+}
+
+void iommu_put_dmabuf(struct iommu_dmabuf *buffer)
+{
+	if (!buffer->len)
+		return;
+
+	pgunmap(buffer->vaddr, buffer->len);
+
+	memset(buffer, 0x0, sizeof(*buffer));
+}
+
+int nvme_admin(struct nvme_ctrl *ctrl UNUSED, union nvme_cmd *sqe, void *buf,
+	       size_t len, struct nvme_cqe *cqe_copy UNUSED)
+{
+	struct nvme_lbafe *lbafe = buf + NVME_IDENTIFY_ZNS_NS_LBAFE;
+
+	assert(sqe->identify.csi == NVME_CSI_ZNS);
+
+	memset(buf, 0x0, len);
+
+	switch (sqe->identify.cns) {
+	case NVME_IDENTIFY_CNS_CSI_NS:
+		lbafe[info.lbaf].zsze = cpu_to_le64(ZSZE);
+		break;
+
+	case NVME_IDENTIFY_CNS_CSI_CTRL:
+		*(uint8_t *)buf = dev.zasl;
+		break;
+	}
+
+	return 0;
+}
+
+static void dev_zone_action(uint32_t zone, uint8_t zsa)
+{
+	switch (zsa) {
+	case NVME_ZONE_ACTION_FINISH:
+		dev.zs[zone] = NVME_ZONE_STATE_FULL;
+		break;
+
+	case NVME_ZONE_ACTION_RESET:
+		dev.zs[zone] = NVME_ZONE_STATE_EMPTY;
+		dev.wp[zone] = 0;
+		break;
+
+	case NVME_ZONE_ACTION_CLOSE:
+		dev.zs[zone] = NVME_ZONE_STATE_CLOSED;
+		break;
+	}
+}
+
+int nvme_sync(struct nvme_ctrl *ctrl UNUSED, struct nvme_sq *sq UNUSED, union nvme_cmd *sqe,
+	      void *buf, size_t len, struct nvme_cqe *cqe_copy UNUSED)
+{
+	uint32_t zone = (uint32_t)(le64_to_cpu(sqe->rw.slba) / ZSZE);
+	uint32_t cdw13 = le32_to_cpu(sqe->cdw13);
+	struct nvme_zone_report *report = buf;
+	uint32_t nr;
+
+	if (dev.fail) {
+		errno = EIO;
+		return -1;
+	}
+
+	switch (sqe->opcode) {
+	case NVME_CMD_ZONE_MGMT_SEND:
+		dev.last_send = cdw13;
+
+		if (cdw13 & NVME_ZONE_MGMT_SEND_SELECT_ALL) {
+			for (uint32_t i = 0; i < NZONES; i++)
+				dev_zone_action(i, (uint8_t)cdw13);
+
+			break;
+		}
+
+		dev_zone_action(zone, (uint8_t)cdw13);
+
+		break;
+
+	case NVME_CMD_ZONE_MGMT_RECV:
+		assert(len == (le32_to_cpu(sqe->cdw12) + 1) * 4);
+		assert(cdw13 & NVME_ZONE_MGMT_RECV_PARTIAL);
+
+		nr = min_t(uint32_t, NZONES - zone, (uint32_t)((len - 64) / 64));
+
+		memset(report, 0x0, len);
+		report->nr_zones = cpu_to_le64(nr);
+
+		for (uint32_t i = 0; i < nr; i++) {
+			struct nvme_zone_desc *desc = &report->descs[i];
+			uint64_t zslba = (uint64_t)(zone + i) * ZSZE;
+
+			desc->zt = 0x2;
+			desc->zs = (uint8_t)(dev.zs[zone + i] << 4);
+			desc->zcap = cpu_to_le64(ZCAP);
+			desc->zslba = cpu_to_le64(zslba);
+			desc->wp = cpu_to_le64(zslba + dev.wp[zone + i]);
+		}
+
+		dev.nreports++;
+		dev.nzones_reported += (int)nr;
+
+		break;
+
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+struct nvme_sq *nvme_ns_get_sq(struct nvme_ns *ns UNUSED)
+{
+	return NULL;
+}
+
+int nvme_bio_init(struct nvme_bio *bio, struct nvme_ctrl *ctrl, uint8_t opcode, uint32_t nsid,
+		  uint64_t offset, struct iovec *iov, int niov)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+
+	*bio = (struct nvme_bio) {
+		.cmd.opcode = opcode,
+		.cmd.nsid = cpu_to_le32(nsid),
+		.ctrl = ctrl,
+		.info = &info,
+		.slba = offset >> info.lbads,
+		.nlb = len >> info.lbads,
+		.iov = iov,
+		.niov = niov,
+	};
+
+	return 0;
+}
+
+/* execute a zone append on the fake device */
+static void dev_append(struct nvme_bio *bio)
+{
+	uint32_t zone = (uint32_t)(le64_to_cpu(bio->cmd.rw.slba) / ZSZE);
+	uint64_t nlb = (uint64_t)le16_to_cpu(bio->cmd.rw.nlb) + 1;
+	uint64_t wp;
+
+	assert(bio->cmd.opcode == NVME_CMD_ZONE_APPEND);
+
+	if (dev.fail) {
+		bio->err = EIO;
+		goto out;
+	}
+
+	wp = __atomic_fetch_add(&dev.wp[zone], nlb, __ATOMIC_SEQ_CST);
+
+	/* zone boundary error; the tracker should never let this happen */
+	assert(wp + nlb <= ZCAP);
+
+	bio->cqe.qw0 = cpu_to_le64((uint64_t)zone * ZSZE + wp);
+
+out:
+	if (bio->end_io)
+		bio->end_io(bio);
+}
+
+int __nvme_ns_sync(struct nvme_ns *ns UNUSED, struct nvme_bio *bio)
+{
+	dev_append(bio);
+
+	if (bio->err) {
+		errno = bio->err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nvme_bio_submit(struct nvme_bio *bio, struct nvme_sq *sq UNUSED)
+{
+	dev_append(bio);
+
+	if (bio->cb)
+		bio->cb(bio);
+
+	return 0;
+}
+
+static void append_cb(struct nvme_bio *bio)
+{
+	uint64_t *alba = bio->opaque;
+
+	*alba = nvme_zns_append_lba(bio);
+
+	ncb++;
+}
+
+struct appender {
+	pthread_t thread;
+	struct nvme_zns *zns;
+
+	int n;
+	uint64_t albas[ZCAP / APPEND_NLB];
+};
+
+static void *append_run(void *opaque)
+{
+	struct appender *a = opaque;
+	uint8_t buf[APPEND_NLB * 512];
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+	while (!nvme_zns_append(a->zns, 1, &iov, 1, &a->albas[a->n]))
+		a->n++;
+
+	return (errno == ENOSPC) ? NULL : (void *)0x1;
+}
+
+static bool check_shared(struct appender *appenders)
+{
+	bool written[ZCAP / APPEND_NLB] = {};
+	int n = 0;
+
+	for (int i = 0; i < NTHREADS; i++) {
+		for (int j = 0; j < appenders[i].n; j++) {
+			uint64_t off = appenders[i].albas[j] - ZSZE;
+
+			if (off % APPEND_NLB || off >= ZCAP || written[off / APPEND_NLB])
+				return false;
+
+			written[off / APPEND_NLB] = true;
+			n++;
+		}
+	}
+
+	return n == ZCAP / APPEND_NLB;
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = { .regs = regs };
+	struct nvme_ns ns = { .ctrl = &ctrl, .nsid = 1, .info = &info };
+	struct appender appenders[NTHREADS] = {};
+	struct nvme_zns zns;
+	struct nvme_bio bio;
+	uint8_t buf[32 * 512];
+	struct iovec iov = { .iov_base = buf, .iov_len = 8 * 512 };
+	uint64_t alba;
+	bool joined = true;
+
+	plan_tests(28);
+
+	for (int i = 0; i < NZONES; i++)
+		dev.zs[i] = NVME_ZONE_STATE_EMPTY;
+
+	/* zone 2 is partially written, zone 3 is full */
+	dev.zs[2] = NVME_ZONE_STATE_CLOSED;
+	dev.wp[2] = 16;
+	dev.zs[3] = NVME_ZONE_STATE_FULL;
+
+	/* only zoned namespaces */
+	info.csi = NVME_CSI_NVM;
+	ok1(nvme_zns_open(&zns, &ns) == -1 && errno == ENOTSUP);
+	info.csi = NVME_CSI_ZNS;
+
+	/* 8 KiB zone append size limit */
+	dev.zasl = 1;
+
+	ok1(nvme_zns_open(&zns, &ns) == 0);
+	ok1(zns.zsze == ZSZE && zns.nr_zones == NZONES && zns.max_append == 16);
+
+	/* the table is populated in as many reports as needed */
+	ok1(dev.nreports == 2 && dev.nzones_reported == NZONES);
+
+	ok1(zns.zones[2].zslba == 2 * ZSZE && zns.zones[2].zcap == ZCAP &&
+	    zns.zones[2].wp == 2 * ZSZE + 16 && zns.zones[2].zs == NVME_ZONE_STATE_CLOSED);
+	ok1(nvme_zns_zone_avail(&zns.zones[2]) == ZCAP - 16);
+	ok1(nvme_zns_zone_avail(&zns.zones[3]) == 0);
+
+	/* append */
+	ok1(nvme_zns_append(&zns, 2, &iov, 1, &alba) == 0 && alba == 2 * ZSZE + 16);
+	ok1(zns.zones[2].wp == 2 * ZSZE + 24 && zns.zones[2].zs == NVME_ZONE_STATE_IMPLICITLY_OPEN);
+	ok1(nvme_zns_zone_avail(&zns.zones[2]) == ZCAP - 24);
+
+	ok1(nvme_zns_append(&zns, 0, &iov, 1, &alba) == 0 && alba == 0);
+	ok1(zns.zones[0].wp == 8 && zns.zones[0].zs == NVME_ZONE_STATE_IMPLICITLY_OPEN);
+
+	/* larger than the zone append size limit */
+	iov.iov_len = 32 * 512;
+	ok1(nvme_zns_append(&zns, 0, &iov, 1, NULL) == -1 && errno == EINVAL);
+	iov.iov_len = 8 * 512;
+
+	/* no room left */
+	ok1(nvme_zns_append(&zns, 3, &iov, 1, NULL) == -1 && errno == ENOSPC);
+	ok1(nvme_zns_append(&zns, NZONES, &iov, 1, NULL) == -1 && errno == EINVAL);
+
+	/* failed requests release their reservation */
+	dev.fail = true;
+	ok1(nvme_zns_append(&zns, 0, &iov, 1, NULL) == -1 && errno == EIO);
+	dev.fail = false;
+
+	ok1(zns.zones[0].wp == 8 && nvme_zns_zone_avail(&zns.zones[0]) == ZCAP - 8);
+
+	/* asynchronous append; the location is returned in the completion */
+	ok1(nvme_zns_append_async(&zns, &bio, 0, &iov, 1, append_cb, &alba) == 0);
+	ok1(ncb == 1 && alba == 8 && zns.zones[0].wp == 16);
+
+	/* incremental refresh only reports the requested zones */
+	dev.nreports = dev.nzones_reported = 0;
+	dev.wp[5] = 32;
+
+	ok1(nvme_zns_refresh(&zns, 4, 2) == 0 && dev.nreports == 1 && dev.nzones_reported == 2);
+	ok1(zns.zones[5].wp == 5 * ZSZE + 32 && nvme_zns_zone_avail(&zns.zones[5]) == ZCAP - 32);
+
+	/* a stale report does not move the write pointer backwards */
+	dev.wp[0] = 8;
+	ok1(nvme_zns_refresh(&zns, 0, 1) == 0 && zns.zones[0].wp == 16);
+	dev.wp[0] = 16;
+
+	/* zone actions */
+	ok1(nvme_zns_zone_action(&zns, 0, NVME_ZONE_ACTION_FINISH) == 0 &&
+	    dev.last_send == NVME_ZONE_ACTION_FINISH);
+	ok1(zns.zones[0].zs == NVME_ZONE_STATE_FULL && nvme_zns_zone_avail(&zns.zones[0]) == 0);
+
+	ok1(nvme_zns_zone_action(&zns, 0, NVME_ZONE_ACTION_RESET) == 0);
+	ok1(zns.zones[0].zs == NVME_ZONE_STATE_EMPTY && zns.zones[0].wp == 0 &&
+	    nvme_zns_zone_avail(&zns.zones[0]) == ZCAP);
+
+	ok1(nvme_zns_mgmt_send(&ns, 0, NVME_ZONE_ACTION_CLOSE, true) == 0 &&
+	    dev.last_send == (NVME_ZONE_MGMT_SEND_SELECT_ALL | NVME_ZONE_ACTION_CLOSE));
+
+	/* many appenders sharing a zone */
+	for (int i = 0; i < NTHREADS; i++) {
+		appenders[i].zns = &zns;
+		pthread_create(&appenders[i].thread, NULL, append_run, &appenders[i]);
+	}
+
+	for (int i = 0; i < NTHREADS; i++) {
+		void *ret;
+
+		pthread_join(appenders[i].thread, &ret);
+
+		if (ret)
+			joined = false;
+	}
+
+	ok1(joined && check_shared(appenders) && zns.zones[1].zs == NVME_ZONE_STATE_FULL);
+
+	nvme_zns_close(&zns);
+
+	return exit_status();
+}
@@ -13,6 +13,7 @@
 #include <byteswap.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -150,6 +151,36 @@ out:
 	return errno ? -1 : 0;
 }
 
+int pci_device_get_numa_node(const char *bdf)
+{
+	char buf[32], *endptr, *path = NULL;
+	long node = -1;
+	ssize_t ret;
+
+	if (asprintf(&path, "/sys/bus/pci/devices/%s/numa_node", bdf) < 0) {
+		log_debug("asprintf failed\n");
+		return -1;
+	}
+
+	ret = readmax(path, buf, sizeof(buf) - 1);
+	if (ret < 0)
+		goto out;
+
+	buf[ret] = '\0';
+
+	errno = 0;
+	node = strtol(buf, &endptr, 10);
+	if (endptr == buf || node < -1 || node > INT_MAX) {
+		errno = EINVAL;
+		node = -1;
+	}
+
+out:
+	free(path);
+
+	return (int)node;
+}
+
 char *pci_get_driver(const char *bdf)
 {
 	char *p, *link = NULL, *driver = NULL, *name = NULL;
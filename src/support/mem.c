@@ -26,6 +26,10 @@
 #include <unistd.h>
 
 #include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/memfd.h>
+#include <linux/mempolicy.h>
 
 #include <vfn/support/align.h>
 #include <vfn/support/atomic.h>
@@ -77,6 +81,88 @@ ssize_t pgmap(void **mem, size_t sz)
 	return len;
 }
 
+#define NUMA_MAX_NODES 1024
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+
+static void __mbind(void *mem, ssize_t len, int node)
+{
+	unsigned long nodemask[NUMA_MAX_NODES / BITS_PER_LONG] = {};
+
+	if (node >= NUMA_MAX_NODES) {
+		log_debug("invalid numa node %d\n", node);
+		return;
+	}
+
+	nodemask[node / BITS_PER_LONG] = 1UL << (node % BITS_PER_LONG);
+
+	/*
+	 * The memory has not been touched yet, so pages will be faulted in on
+	 * the preferred node. This is best effort; fall back to the default
+	 * policy on failure (e.g. on kernels without NUMA support).
+	 */
+	if (syscall(SYS_mbind, mem, len, MPOL_PREFERRED, nodemask, node + 2, 0))
+		log_debug("could not bind memory to numa node %d\n", node);
+}
+
+ssize_t pgmap_node(void **mem, size_t sz, int node)
+{
+	ssize_t len;
+
+	len = pgmap(mem, sz);
+	if (len < 0 || node < 0)
+		return len;
+
+	__mbind(*mem, len, node);
+
+	return len;
+}
+
+ssize_t pgmap_shared(void **mem, size_t sz, int node, int *fd)
+{
+	ssize_t len = ALIGN_UP(sz, __VFN_PAGESIZE);
+
+	*fd = (int)syscall(SYS_memfd_create, "vfn", MFD_CLOEXEC);
+	if (*fd < 0)
+		return -1;
+
+	if (ftruncate(*fd, len))
+		goto close_fd;
+
+	*mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (*mem == MAP_FAILED)
+		goto close_fd;
+
+	if (node >= 0)
+		__mbind(*mem, len, node);
+
+	return len;
+
+close_fd:
+	log_fatal_if(close(*fd), "close\n");
+	*fd = -1;
+
+	return -1;
+}
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+ssize_t pgmap_hugepage(void **mem, size_t sz, int node)
+{
+	ssize_t len = ALIGN_UP(sz, __VFN_HUGEPAGESIZE);
+
+	*mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, 0, 0);
+	if (*mem == MAP_FAILED)
+		return -1;
+
+	if (node >= 0)
+		__mbind(*mem, len, node);
+
+	return len;
+}
+
 ssize_t pgmapn(void **mem, unsigned int n, size_t sz)
 {
 	if (would_overflow(n, sz)) {
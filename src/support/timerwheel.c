@@ -0,0 +1,134 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vfn/support/timerwheel.h>
+
+#define __level_shift(level) ((level) * TIMER_WHEEL_BITS)
+
+/* largest delta representable by the wheel */
+#define __max_delta ((1ULL << __level_shift(TIMER_WHEEL_LEVELS)) - 1)
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now)
+{
+	memset(tw, 0x0, sizeof(*tw));
+
+	tw->next = now;
+}
+
+static void __insert(struct timer_wheel_entry **slot, struct timer_wheel_entry *t)
+{
+	t->next = *slot;
+	if (t->next)
+		t->next->pprev = &t->next;
+
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void __place(struct timer_wheel *tw, struct timer_wheel_entry *t)
+{
+	uint64_t delta = t->expires - tw->next;
+	int level;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < 1ULL << __level_shift(level + 1))
+			break;
+	}
+
+	__insert(&tw->slots[level][(t->expires >> __level_shift(level)) & TIMER_WHEEL_MASK], t);
+}
+
+void timer_wheel_add(struct timer_wheel *tw, struct timer_wheel_entry *t, uint64_t expires)
+{
+	if (expires < tw->next)
+		expires = tw->next;
+	else if (expires - tw->next > __max_delta)
+		expires = tw->next + __max_delta;
+
+	t->expires = expires;
+
+	__place(tw, t);
+}
+
+/* re-place the timers of a slot in the lower levels */
+static void __cascade(struct timer_wheel *tw, int level, int idx)
+{
+	struct timer_wheel_entry *t = tw->slots[level][idx], *next;
+
+	tw->slots[level][idx] = NULL;
+
+	for (; t; t = next) {
+		next = t->next;
+
+		__place(tw, t);
+	}
+}
+
+int timer_wheel_advance(struct timer_wheel *tw, uint64_t now,
+			void (*fn)(struct timer_wheel_entry *t, void *opaque), void *opaque)
+{
+	int n = 0;
+
+	while (tw->next <= now) {
+		uint64_t j = tw->next, end;
+		struct timer_wheel_entry *t, *list;
+		int idx = (int)(j & TIMER_WHEEL_MASK);
+
+		/* cascade when the lower level wraps */
+		for (int level = 1; level < TIMER_WHEEL_LEVELS && !idx; level++) {
+			idx = (int)((j >> __level_shift(level)) & TIMER_WHEEL_MASK);
+
+			__cascade(tw, level, idx);
+		}
+
+		idx = (int)(j & TIMER_WHEEL_MASK);
+
+		/* skip to the next occupied slot, stopping where the lower level wraps */
+		if (!tw->slots[0][idx]) {
+			end = j | TIMER_WHEEL_MASK;
+			if (end > now)
+				end = now;
+
+			while (j < end && !tw->slots[0][(j + 1) & TIMER_WHEEL_MASK])
+				j++;
+
+			tw->next = j + 1;
+
+			continue;
+		}
+
+		tw->next++;
+
+		/*
+		 * Detach the slot such that timers added back to it by @fn fire on
+		 * the next rotation instead of in this call.
+		 */
+		list = tw->slots[0][idx];
+		tw->slots[0][idx] = NULL;
+		list->pprev = &list;
+
+		while ((t = list)) {
+			timer_wheel_del(t);
+
+			n++;
+
+			fn(t, opaque);
+		}
+	}
+
+	return n;
+}
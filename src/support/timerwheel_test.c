@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2024 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "vfn/support/compiler.h"
+#include "vfn/support/timerwheel.h"
+
+#include "ccan/array_size/array_size.h"
+#include "ccan/container_of/container_of.h"
+#include "ccan/tap/tap.h"
+
+#define NTIMERS 4096
+
+struct timer {
+	struct timer_wheel_entry t;
+	uint64_t fired;
+	int nfired;
+};
+
+static uint64_t now;
+
+static void expire(struct timer_wheel_entry *t, void *opaque)
+{
+	struct timer *timer = container_of(t, struct timer, t);
+	int *count = opaque;
+
+	timer->fired = now;
+	timer->nfired++;
+
+	(*count)++;
+}
+
+static void rearm(struct timer_wheel_entry *t, void *opaque)
+{
+	struct timer_wheel *tw = opaque;
+	struct timer *timer = container_of(t, struct timer, t);
+
+	timer->nfired++;
+
+	if (timer->nfired < 3)
+		timer_wheel_add(tw, t, now + 100);
+}
+
+/* re-add the timer to the same slot */
+static void rearm_slot(struct timer_wheel_entry *t, void *opaque)
+{
+	struct timer_wheel *tw = opaque;
+	struct timer *timer = container_of(t, struct timer, t);
+
+	timer->nfired++;
+	timer->fired = now;
+
+	timer_wheel_add(tw, t, now + TIMER_WHEEL_SIZE);
+}
+
+static struct timer timers[NTIMERS];
+
+int main(void)
+{
+	struct timer_wheel tw;
+	struct timer a = {}, b = {};
+	bool ok = true;
+	int count = 0;
+
+	plan_tests(16);
+
+	/* basic */
+	now = 1000;
+	timer_wheel_init(&tw, now);
+
+	timer_wheel_add(&tw, &a.t, 1010);
+	timer_wheel_add(&tw, &b.t, 900);
+	ok1(timer_wheel_pending(&a.t) && b.t.expires == 1000);
+
+	ok1(timer_wheel_advance(&tw, now, expire, &count) == 1 && b.nfired == 1);
+	ok1(!timer_wheel_pending(&b.t));
+
+	now = 1009;
+	ok1(timer_wheel_advance(&tw, now, expire, &count) == 0);
+
+	now = 1020;
+	ok1(timer_wheel_advance(&tw, now, expire, &count) == 1 && a.fired == 1020);
+
+	/* deletion */
+	timer_wheel_add(&tw, &a.t, 5000);
+	timer_wheel_del(&a.t);
+	ok1(!timer_wheel_pending(&a.t));
+
+	now = 6000;
+	ok1(timer_wheel_advance(&tw, now, expire, &count) == 0);
+
+	/* clamping */
+	timer_wheel_add(&tw, &a.t, UINT64_MAX);
+	ok1(a.t.expires == now + (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)));
+
+	now = a.t.expires;
+	ok1(timer_wheel_advance(&tw, now, expire, &count) == 1 && a.fired == now);
+
+	/* re-adding from the callback */
+	a.nfired = 0;
+	timer_wheel_add(&tw, &a.t, now + 100);
+
+	for (int i = 0; i < 10; i++) {
+		now += 100;
+		timer_wheel_advance(&tw, now, rearm, &tw);
+	}
+
+	ok1(a.nfired == 3 && !timer_wheel_pending(&a.t));
+
+	/* a timer re-added to its own slot fires once per rotation */
+	a.nfired = 0;
+	timer_wheel_add(&tw, &a.t, ++now);
+
+	ok1(timer_wheel_advance(&tw, now, rearm_slot, &tw) == 1 && a.nfired == 1);
+
+	now += TIMER_WHEEL_SIZE;
+	ok1(timer_wheel_advance(&tw, now, rearm_slot, &tw) == 1 && a.nfired == 2 &&
+	    a.fired == now);
+
+	timer_wheel_del(&a.t);
+
+	/* randomized; every timer fires exactly once and on time (steps of 1) */
+	srand(1);
+
+	count = 0;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(timers); i++) {
+		uint64_t delta = (uint64_t)rand() % (1 << 20);
+
+		timers[i] = (struct timer) {};
+		timer_wheel_add(&tw, &timers[i].t, now + delta);
+	}
+
+	for (uint64_t end = now + (1 << 20); now < end; now++)
+		timer_wheel_advance(&tw, now, expire, &count);
+
+	ok1(count == NTIMERS);
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(timers); i++)
+		ok &= timers[i].nfired == 1 && timers[i].fired == timers[i].t.expires;
+
+	ok1(ok);
+
+	/* randomized; coarse steps never fire early */
+	count = 0;
+	ok = true;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(timers); i++) {
+		uint64_t delta = (uint64_t)rand() % (1 << 22);
+
+		timers[i] = (struct timer) {};
+		timer_wheel_add(&tw, &timers[i].t, now + delta);
+	}
+
+	for (uint64_t end = now + (1 << 22) + 1000; now < end; now += (uint64_t)rand() % 1000)
+		timer_wheel_advance(&tw, now, expire, &count);
+
+	timer_wheel_advance(&tw, now, expire, &count);
+
+	ok1(count == NTIMERS);
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(timers); i++)
+		ok &= timers[i].nfired == 1 && timers[i].fired >= timers[i].t.expires &&
+			timers[i].fired - timers[i].t.expires < 1000;
+
+	ok1(ok);
+
+	return exit_status();
+}
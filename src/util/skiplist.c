@@ -18,6 +18,9 @@ void skiplist_init(struct skiplist *list)
 {
 	list->height = 0;
 
+	/* any non-zero seed will do; mix in the address to vary between lists */
+	list->rnd = 0x9e3779b97f4a7c15ULL ^ (uintptr_t)list;
+
 	for (int k = 0; k < SKIPLIST_LEVELS; k++) {
 		list_head_init(&list->heads[k]);
 		skiplist_add(list, &list->sentinel, k);
@@ -77,22 +80,31 @@ struct skiplist_node *skiplist_find(struct skiplist *list, const void *key,
 	return NULL;
 }
 
-static inline int __skiplist_random_level(void)
+/*
+ * Pick a level with probability 1/2^(k+1) using a per-list xorshift64
+ * generator (callers serialize modifications to the list anyway).
+ */
+static inline int __skiplist_random_level(struct skiplist *list)
 {
-	int k = 0;
+	uint64_t x = list->rnd;
+	int k;
 
-	while (k < SKIPLIST_LEVELS - 1 && (rand() > (RAND_MAX / 2)))
-		k++;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
 
-	return k;
-}
+	list->rnd = x;
+
+	/* number of trailing one bits */
+	k = __builtin_ctzll(~x);
 
-#define SKIPLIST_RANDOM_LEVEL __skiplist_random_level()
+	return k < SKIPLIST_LEVELS - 1 ? k : SKIPLIST_LEVELS - 1;
+}
 
 void skiplist_link(struct skiplist *list, struct skiplist_node *n,
 		   struct skiplist_node *update[SKIPLIST_LEVELS])
 {
-	int k = SKIPLIST_RANDOM_LEVEL;
+	int k = __skiplist_random_level(list);
 
 	if (k > list->height) {
 		/* increase the height of the skiplist */
@@ -10,6 +10,8 @@
  * COPYING and LICENSE files for more information.
  */
 
+#include <stdint.h>
+
 #include "ccan/list/list.h"
 
 #ifndef SKIPLIST_LEVELS
@@ -42,6 +44,10 @@ struct skiplist_node {
 
 struct skiplist {
 	int height;
+
+	/* xorshift state for picking node levels */
+	uint64_t rnd;
+
 	struct skiplist_node sentinel;
 	struct list_head heads[SKIPLIST_LEVELS];
 };
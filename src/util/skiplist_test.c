@@ -16,6 +16,8 @@
  * more details.
  */
 
+#include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -28,6 +30,7 @@
 
 #include "vfn/support/compiler.h"
 #include "vfn/support/mem.h"
+#include "vfn/support/ticks.h"
 
 #include "skiplist.c"
 
@@ -93,12 +96,104 @@ static void __clear(void *opaque UNUSED, struct skiplist_node *n)
 	free(skiplist_entry(n, struct entry, list));
 }
 
+#define BENCH_THREADS 4
+#define BENCH_KEYS 4096
+#define BENCH_ROUNDS 16
+
+/*
+ * Each thread inserts into and erases from a list of its own, so the only
+ * state shared between threads would be that of the level generator.
+ */
+struct bench_thread {
+	pthread_t thread;
+
+	struct skiplist list;
+	struct entry *entries;
+
+	bool ok;
+};
+
+static void *bench_fn(void *opaque)
+{
+	struct bench_thread *t = opaque;
+	struct skiplist_node *n, *update[SKIPLIST_LEVELS];
+
+	t->ok = true;
+
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		for (unsigned int i = 0; i < BENCH_KEYS; i++) {
+			struct entry *e = &t->entries[i];
+
+			e->v = i;
+
+			if (skiplist_find(&t->list, &e->v, __cmp, update))
+				t->ok = false;
+			else
+				skiplist_link(&t->list, &e->list, update);
+		}
+
+		for (unsigned int i = 0; i < BENCH_KEYS; i++) {
+			n = skiplist_find(&t->list, &i, __cmp, update);
+			if (n)
+				skiplist_erase(&t->list, n, update);
+			else
+				t->ok = false;
+		}
+	}
+
+	t->ok &= t->list.height == 0;
+
+	return NULL;
+}
+
+/* returns the number of ticks per insert/erase op of each thread */
+static double bench(int nthreads, bool *all_ok)
+{
+	struct bench_thread threads[BENCH_THREADS];
+	uint64_t start, ticks;
+
+	start = get_ticks();
+
+	for (int i = 0; i < nthreads; i++) {
+		skiplist_init(&threads[i].list);
+		threads[i].entries = znew_t(struct entry, BENCH_KEYS);
+
+		assert(pthread_create(&threads[i].thread, NULL, bench_fn, &threads[i]) == 0);
+	}
+
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+
+		*all_ok &= threads[i].ok;
+
+		free(threads[i].entries);
+	}
+
+	ticks = get_ticks() - start;
+
+	return (double)ticks / (2 * BENCH_KEYS * BENCH_ROUNDS);
+}
+
+static void bench_scaling(void)
+{
+	bool all_ok = true;
+	double one, all;
+
+	one = bench(1, &all_ok);
+	all = bench(BENCH_THREADS, &all_ok);
+
+	ok(all_ok, "concurrent insert/erase on per-thread lists");
+
+	/* with a core per thread, this stays flat unless the threads contend */
+	diag("1 thread: %.1f ticks/op, %d threads: %.1f ticks/op", one, BENCH_THREADS, all);
+}
+
 int main(int argc UNUSED, char *argv[] UNUSED)
 {
 	struct skiplist_node *n, *update[SKIPLIST_LEVELS];
 	unsigned int v;
 
-	plan_tests(21);
+	plan_tests(22);
 
 	skiplist_init(&list);
 
@@ -152,5 +247,9 @@ int main(int argc UNUSED, char *argv[] UNUSED)
 
 	ok(skiplist_find(&list, &v, __cmp, NULL) == NULL, "find 0 not ok");
 
+	skiplist_clear_with(&list, __clear, NULL);
+
+	bench_scaling();
+
 	return exit_status();
 }
@@ -152,29 +152,8 @@ void vfio_pci_unmap_bar(struct vfio_pci_device *pci, int idx, void *mem, size_t
 		log_debug("failed to unmap bar region\n");
 }
 
-int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf)
+static int vfio_pci_setup(struct vfio_pci_device *pci, const char *bdf)
 {
-	if (pci->bdf) {
-		errno = EALREADY;
-		return -1;
-	}
-
-	if (pci_device_info_get_ull(bdf, "class", &pci->classcode)) {
-		log_debug("could not get device class code\n");
-		return -1;
-	}
-
-	log_info("pci class code is 0x%06llx\n", pci->classcode);
-
-	if (!pci->dev.ctx)
-		pci->dev.ctx = iommu_get_default_context();
-
-	pci->dev.fd = pci->dev.ctx->ops.get_device_fd(pci->dev.ctx, bdf);
-	if (pci->dev.fd < 0) {
-		log_debug("failed to get device fd\n");
-		return -1;
-	}
-
 	pci->dev.device_info.argsz = sizeof(struct vfio_device_info);
 
 	if (ioctl(pci->dev.fd, VFIO_DEVICE_GET_INFO, &pci->dev.device_info)) {
@@ -214,6 +193,54 @@ int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf)
 	return 0;
 }
 
+int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf)
+{
+	if (pci->bdf) {
+		errno = EALREADY;
+		return -1;
+	}
+
+	if (pci_device_info_get_ull(bdf, "class", &pci->classcode)) {
+		log_debug("could not get device class code\n");
+		return -1;
+	}
+
+	log_info("pci class code is 0x%06llx\n", pci->classcode);
+
+	if (!pci->dev.ctx)
+		pci->dev.ctx = iommu_get_default_context();
+
+	pci->dev.fd = pci->dev.ctx->ops.get_device_fd(pci->dev.ctx, bdf);
+	if (pci->dev.fd < 0) {
+		log_debug("failed to get device fd\n");
+		return -1;
+	}
+
+	return vfio_pci_setup(pci, bdf);
+}
+
+int vfio_pci_adopt(struct vfio_pci_device *pci, const char *bdf, int fd)
+{
+	if (pci->bdf) {
+		errno = EALREADY;
+		return -1;
+	}
+
+	if (!pci->dev.ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pci_device_info_get_ull(bdf, "class", &pci->classcode)) {
+		log_debug("could not get device class code\n");
+		return -1;
+	}
+
+	pci->dev.fd = fd;
+
+	return vfio_pci_setup(pci, bdf);
+}
+
 int vfio_pci_close(struct vfio_pci_device *pci)
 {
 	struct iommu_ctx *ctx = pci->dev.ctx;